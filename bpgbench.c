@@ -0,0 +1,667 @@
+/*
+ * BPG decoder benchmark
+ */
+
+/* The synthetic corpus is generated with the bpgenc executable, then
+   each image is decoded into every output format. libbpg should be
+   compiled with USE_STATS to get the per stage times. */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+
+#include <png.h>
+#include <jpeglib.h>
+
+#include "libbpg.h"
+
+/* allocation counting. It relies on the glibc internal allocator
+   entry points. */
+#if defined(__GLIBC__)
+#define USE_ALLOC_COUNT
+#endif
+
+#ifdef USE_ALLOC_COUNT
+#include <malloc.h>
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t n, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void *__libc_memalign(size_t align, size_t size);
+extern void __libc_free(void *ptr);
+
+static int64_t alloc_count;
+static int64_t alloc_bytes;
+
+void *malloc(size_t size)
+{
+    alloc_count++;
+    alloc_bytes += size;
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t n, size_t size)
+{
+    alloc_count++;
+    alloc_bytes += n * size;
+    return __libc_calloc(n, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+    alloc_count++;
+    alloc_bytes += size;
+    return __libc_realloc(ptr, size);
+}
+
+void *memalign(size_t align, size_t size)
+{
+    alloc_count++;
+    alloc_bytes += size;
+    return __libc_memalign(align, size);
+}
+
+void *aligned_alloc(size_t align, size_t size)
+{
+    return memalign(align, size);
+}
+
+int posix_memalign(void **pptr, size_t align, size_t size)
+{
+    void *ptr;
+    ptr = memalign(align, size);
+    if (!ptr)
+        return 12; /* ENOMEM */
+    *pptr = ptr;
+    return 0;
+}
+
+void free(void *ptr)
+{
+    __libc_free(ptr);
+}
+#endif /* USE_ALLOC_COUNT */
+
+typedef enum {
+    SRC_GRAY,
+    SRC_RGB,
+    SRC_RGB48,
+    SRC_RGBA,
+    SRC_RGBA64,
+    SRC_CMYK,
+    SRC_ANIM,
+} BenchSourceEnum;
+
+typedef struct {
+    const char *name;
+    BenchSourceEnum src;
+    const char *options; /* bpgenc options */
+} BenchImage;
+
+static const BenchImage bench_images[] = {
+    { "gray_8", SRC_GRAY, "" },
+    { "420_8", SRC_RGB, "-f 420" },
+    { "420_video_8", SRC_RGB, "-f 420_video" },
+    { "422_8", SRC_RGB, "-f 422" },
+    { "444_8", SRC_RGB, "-f 444" },
+    { "rgb_8", SRC_RGB, "-c rgb" },
+    { "ycgco_444_8", SRC_RGB, "-c ycgco -f 444" },
+    { "420_10", SRC_RGB48, "-f 420 -b 10" },
+    { "444_10", SRC_RGB48, "-f 444 -b 10" },
+    { "420_8_alpha", SRC_RGBA, "-f 420" },
+    { "420_8_premul", SRC_RGBA, "-f 420 -premul" },
+    { "444_10_alpha", SRC_RGBA64, "-f 444 -b 10" },
+    { "420_8_cmyk", SRC_CMYK, "-f 420" },
+    { "420_8_anim", SRC_ANIM, "-a -fps 10" },
+};
+
+#define BENCH_IMAGE_COUNT (sizeof(bench_images) / sizeof(bench_images[0]))
+
+#define ANIM_FRAME_COUNT 8
+
+static const char *out_fmt_name[] = {
+    "rgb24",
+    "rgba32",
+    "rgb48",
+    "rgba64",
+    "cmyk32",
+    "cmyk64",
+};
+
+#define OUT_FMT_COUNT (sizeof(out_fmt_name) / sizeof(out_fmt_name[0]))
+
+static int64_t get_time_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* reset the peak RSS so that it can be measured per image (Linux only) */
+static void peak_rss_reset(void)
+{
+#ifdef __linux__
+    FILE *f;
+    f = fopen("/proc/self/clear_refs", "w");
+    if (f) {
+        fputs("5", f);
+        fclose(f);
+    }
+#endif
+}
+
+/* return the peak RSS in kB */
+static int64_t peak_rss_get(void)
+{
+    struct rusage ru;
+#ifdef __linux__
+    FILE *f;
+    char line[256];
+    int64_t v;
+
+    f = fopen("/proc/self/status", "r");
+    if (f) {
+        while (fgets(line, sizeof(line), f)) {
+            if (sscanf(line, "VmHWM: %" SCNd64, &v) == 1) {
+                fclose(f);
+                return v;
+            }
+        }
+        fclose(f);
+    }
+#endif
+    getrusage(RUSAGE_SELF, &ru);
+    return ru.ru_maxrss;
+}
+
+/* deterministic test pattern: gradients, a few rings and some noise
+   so that the encoder has real work to do. Return a value in [0,
+   65535]. */
+static int pattern(int x, int y, int c, int frame, int w, int h)
+{
+    int v, dx, dy, r;
+    uint32_t n;
+
+    x += frame * 7;
+    switch(c) {
+    case 0:
+        v = x * 65535 / w;
+        break;
+    case 1:
+        v = y * 65535 / h;
+        break;
+    case 2:
+        v = ((x + y) * 65535) / (w + h);
+        break;
+    default:
+        /* alpha or K: rings */
+        dx = x - w / 2;
+        dy = y - h / 2;
+        r = (int)sqrt(dx * dx + dy * dy);
+        v = ((r / 16) & 1) ? 65535 : (r * 65535 / (w + h));
+        break;
+    }
+    dx = x - w / 3;
+    dy = y - h / 3;
+    r = dx * dx + dy * dy;
+    if (r < (w * w) / 36)
+        v = 65535 - v;
+    n = (x * 0x9e3779b1) ^ (y * 0x85ebca6b) ^ (c * 0xc2b2ae35);
+    n ^= n >> 15;
+    v += (int)(n & 0x7ff) - 0x400;
+    if (v < 0)
+        v = 0;
+    else if (v > 65535)
+        v = 65535;
+    return v;
+}
+
+static int png_write_pattern(const char *filename, int w, int h,
+                             int color_type, int bit_depth, int frame)
+{
+    FILE *f;
+    png_structp png_ptr;
+    png_infop info_ptr;
+    uint8_t *row;
+    int x, y, c, c_count, v;
+
+    f = fopen(filename, "wb");
+    if (!f)
+        return -1;
+    png_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+    info_ptr = png_create_info_struct(png_ptr);
+    if (setjmp(png_jmpbuf(png_ptr)) != 0) {
+        fclose(f);
+        return -1;
+    }
+    png_init_io(png_ptr, f);
+    png_set_IHDR(png_ptr, info_ptr, w, h, bit_depth, color_type,
+                 PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT,
+                 PNG_FILTER_TYPE_DEFAULT);
+    png_set_compression_level(png_ptr, 1);
+    png_write_info(png_ptr, info_ptr);
+
+    switch(color_type) {
+    case PNG_COLOR_TYPE_GRAY:
+        c_count = 1;
+        break;
+    case PNG_COLOR_TYPE_RGB_ALPHA:
+        c_count = 4;
+        break;
+    default:
+        c_count = 3;
+        break;
+    }
+    row = malloc(w * c_count * 2);
+    for(y = 0; y < h; y++) {
+        for(x = 0; x < w; x++) {
+            for(c = 0; c < c_count; c++) {
+                v = pattern(x, y, c, frame, w, h);
+                if (bit_depth == 16) {
+                    row[(x * c_count + c) * 2] = v >> 8;
+                    row[(x * c_count + c) * 2 + 1] = v;
+                } else {
+                    row[x * c_count + c] = v >> 8;
+                }
+            }
+        }
+        png_write_row(png_ptr, row);
+    }
+    free(row);
+    png_write_end(png_ptr, NULL);
+    png_destroy_write_struct(&png_ptr, &info_ptr);
+    fclose(f);
+    return 0;
+}
+
+static int jpeg_write_cmyk_pattern(const char *filename, int w, int h)
+{
+    struct jpeg_compress_struct cinfo;
+    struct jpeg_error_mgr jerr;
+    JSAMPROW row_pointer[1];
+    FILE *f;
+    uint8_t *row;
+    int x, y, c;
+
+    f = fopen(filename, "wb");
+    if (!f)
+        return -1;
+    cinfo.err = jpeg_std_error(&jerr);
+    jpeg_create_compress(&cinfo);
+    jpeg_stdio_dest(&cinfo, f);
+    cinfo.image_width = w;
+    cinfo.image_height = h;
+    cinfo.input_components = 4;
+    cinfo.in_color_space = JCS_CMYK;
+    jpeg_set_defaults(&cinfo);
+    jpeg_set_quality(&cinfo, 95, TRUE);
+    jpeg_start_compress(&cinfo, TRUE);
+    row = malloc(w * 4);
+    for(y = 0; y < h; y++) {
+        for(x = 0; x < w; x++) {
+            for(c = 0; c < 4; c++)
+                row[x * 4 + c] = pattern(x, y, c, 0, w, h) >> 8;
+        }
+        row_pointer[0] = row;
+        jpeg_write_scanlines(&cinfo, row_pointer, 1);
+    }
+    free(row);
+    jpeg_finish_compress(&cinfo);
+    jpeg_destroy_compress(&cinfo);
+    fclose(f);
+    return 0;
+}
+
+/* generate the source image(s) and the BPG file */
+static int gen_image(const BenchImage *bi, const char *dir,
+                     const char *bpgenc_path, int w, int h, int qp,
+                     char *bpg_filename, int bpg_filename_size)
+{
+    char src_filename[1024], cmd[4096];
+    int ret, i;
+
+    switch(bi->src) {
+    case SRC_GRAY:
+        snprintf(src_filename, sizeof(src_filename), "%s/%s.png", dir, bi->name);
+        ret = png_write_pattern(src_filename, w, h, PNG_COLOR_TYPE_GRAY, 8, 0);
+        break;
+    case SRC_RGB:
+        snprintf(src_filename, sizeof(src_filename), "%s/%s.png", dir, bi->name);
+        ret = png_write_pattern(src_filename, w, h, PNG_COLOR_TYPE_RGB, 8, 0);
+        break;
+    case SRC_RGB48:
+        snprintf(src_filename, sizeof(src_filename), "%s/%s.png", dir, bi->name);
+        ret = png_write_pattern(src_filename, w, h, PNG_COLOR_TYPE_RGB, 16, 0);
+        break;
+    case SRC_RGBA:
+        snprintf(src_filename, sizeof(src_filename), "%s/%s.png", dir, bi->name);
+        ret = png_write_pattern(src_filename, w, h, PNG_COLOR_TYPE_RGB_ALPHA, 8, 0);
+        break;
+    case SRC_RGBA64:
+        snprintf(src_filename, sizeof(src_filename), "%s/%s.png", dir, bi->name);
+        ret = png_write_pattern(src_filename, w, h, PNG_COLOR_TYPE_RGB_ALPHA, 16, 0);
+        break;
+    case SRC_CMYK:
+        snprintf(src_filename, sizeof(src_filename), "%s/%s.jpg", dir, bi->name);
+        ret = jpeg_write_cmyk_pattern(src_filename, w, h);
+        break;
+    case SRC_ANIM:
+        ret = 0;
+        for(i = 0; i < ANIM_FRAME_COUNT && ret == 0; i++) {
+            snprintf(src_filename, sizeof(src_filename), "%s/%s-%03d.png",
+                     dir, bi->name, i + 1);
+            ret = png_write_pattern(src_filename, w, h, PNG_COLOR_TYPE_RGB, 8, i);
+        }
+        snprintf(src_filename, sizeof(src_filename), "%s/%s-%%03d.png",
+                 dir, bi->name);
+        break;
+    default:
+        abort();
+    }
+    if (ret < 0) {
+        fprintf(stderr, "Could not write '%s'\n", src_filename);
+        return -1;
+    }
+
+    snprintf(bpg_filename, bpg_filename_size, "%s/%s.bpg", dir, bi->name);
+    snprintf(cmd, sizeof(cmd), "\"%s\" -q %d %s -o \"%s\" \"%s\"",
+             bpgenc_path, qp, bi->options, bpg_filename, src_filename);
+    if (system(cmd) != 0) {
+        fprintf(stderr, "Command failed: %s\n", cmd);
+        return -1;
+    }
+    return 0;
+}
+
+static uint8_t *load_file(int *pbuf_len, const char *filename)
+{
+    FILE *f;
+    uint8_t *buf;
+    int buf_len;
+
+    f = fopen(filename, "rb");
+    if (!f)
+        return NULL;
+    fseek(f, 0, SEEK_END);
+    buf_len = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    buf = malloc(buf_len);
+    if (fread(buf, 1, buf_len, f) != buf_len) {
+        free(buf);
+        fclose(f);
+        return NULL;
+    }
+    fclose(f);
+    *pbuf_len = buf_len;
+    return buf;
+}
+
+typedef struct {
+    int width, height, bit_depth, frame_count;
+    int64_t total_time; /* ns */
+    int64_t pixel_count;
+    int64_t peak_rss; /* kB */
+    int64_t alloc_count, alloc_bytes;
+    int has_stats;
+    BPGDecoderStats stats; /* sum over the iterations */
+} BenchResult;
+
+static int bench_decode(BenchResult *r, const uint8_t *buf, int buf_len,
+                        BPGDecoderOutputFormat out_fmt, int n_iter)
+{
+    BPGDecoderContext *s;
+    BPGImageInfo info_s, *info = &info_s;
+    BPGDecoderStats st;
+    uint8_t *line;
+    int it, y, frame_count;
+    int64_t t0;
+
+    memset(r, 0, sizeof(*r));
+    if (bpg_decoder_get_info_from_buf(info, NULL, buf, buf_len) < 0)
+        return -1;
+    r->width = info->width;
+    r->height = info->height;
+    r->bit_depth = info->bit_depth;
+    r->has_stats = 1;
+    /* large enough for all the output formats */
+    line = malloc(info->width * 4 * 2);
+
+    peak_rss_reset();
+#ifdef USE_ALLOC_COUNT
+    alloc_count = 0;
+    alloc_bytes = 0;
+#endif
+    for(it = 0; it < n_iter; it++) {
+        t0 = get_time_ns();
+        s = bpg_decoder_open();
+        if (bpg_decoder_decode(s, buf, buf_len) < 0) {
+            bpg_decoder_close(s);
+            free(line);
+            return -1;
+        }
+        frame_count = 0;
+        while (bpg_decoder_start(s, out_fmt) == 0) {
+            for(y = 0; y < info->height; y++)
+                bpg_decoder_get_line(s, line);
+            frame_count++;
+        }
+        if (bpg_decoder_get_stats(s, &st) == 0) {
+            r->stats.header_time += st.header_time;
+            r->stats.init_time += st.init_time;
+            r->stats.demux_time += st.demux_time;
+            r->stats.decode_time += st.decode_time;
+            r->stats.interp_time += st.interp_time;
+            r->stats.convert_time += st.convert_time;
+            r->stats.hevc_bytes = st.hevc_bytes;
+            if (st.peak_demux_size > r->stats.peak_demux_size)
+                r->stats.peak_demux_size = st.peak_demux_size;
+            r->stats.output_buf_size = st.output_buf_size;
+            r->stats.nal_count = st.nal_count;
+        } else {
+            r->has_stats = 0;
+        }
+        bpg_decoder_close(s);
+        r->total_time += get_time_ns() - t0;
+        r->frame_count = frame_count;
+        r->pixel_count += (int64_t)info->width * info->height * frame_count;
+    }
+    r->peak_rss = peak_rss_get();
+#ifdef USE_ALLOC_COUNT
+    r->alloc_count = alloc_count / n_iter;
+    r->alloc_bytes = alloc_bytes / n_iter;
+#else
+    r->alloc_count = -1;
+    r->alloc_bytes = -1;
+#endif
+    free(line);
+    return 0;
+}
+
+/* average time per iteration in milliseconds */
+static double to_ms(int64_t t, int n_iter)
+{
+    return (double)t / (1e6 * n_iter);
+}
+
+static void print_result(const BenchImage *bi, const char *fmt_name,
+                         const BenchResult *r, int n_iter, int json,
+                         int is_first)
+{
+    double mpix_s, t_ms[6];
+    int i;
+
+    if (r->total_time > 0)
+        mpix_s = (double)r->pixel_count * 1e3 / r->total_time;
+    else
+        mpix_s = 0;
+    t_ms[0] = to_ms(r->stats.header_time, n_iter);
+    t_ms[1] = to_ms(r->stats.init_time, n_iter);
+    t_ms[2] = to_ms(r->stats.demux_time, n_iter);
+    t_ms[3] = to_ms(r->stats.decode_time, n_iter);
+    t_ms[4] = to_ms(r->stats.interp_time, n_iter);
+    t_ms[5] = to_ms(r->stats.convert_time, n_iter);
+    if (!r->has_stats) {
+        for(i = 0; i < 6; i++)
+            t_ms[i] = -1;
+    }
+    if (json) {
+        printf("%s  { \"image\": \"%s\", \"output_format\": \"%s\", "
+               "\"width\": %d, \"height\": %d, \"bit_depth\": %d, "
+               "\"frames\": %d, \"iterations\": %d, "
+               "\"mpixels_per_s\": %.3f, \"total_ms\": %.3f, "
+               "\"header_ms\": %.3f, \"init_ms\": %.3f, \"demux_ms\": %.3f, "
+               "\"decode_ms\": %.3f, \"interp_ms\": %.3f, \"convert_ms\": %.3f, "
+               "\"peak_rss_kb\": %" PRId64 ", \"allocs\": %" PRId64 ", "
+               "\"alloc_bytes\": %" PRId64 " }",
+               is_first ? "" : ",\n",
+               bi->name, fmt_name, r->width, r->height, r->bit_depth,
+               r->frame_count, n_iter, mpix_s, to_ms(r->total_time, n_iter),
+               t_ms[0], t_ms[1], t_ms[2], t_ms[3], t_ms[4], t_ms[5],
+               r->peak_rss, r->alloc_count, r->alloc_bytes);
+    } else {
+        if (is_first) {
+            printf("image,output_format,width,height,bit_depth,frames,"
+                   "iterations,mpixels_per_s,total_ms,header_ms,init_ms,"
+                   "demux_ms,decode_ms,interp_ms,convert_ms,peak_rss_kb,"
+                   "allocs,alloc_bytes\n");
+        }
+        printf("%s,%s,%d,%d,%d,%d,%d,%.3f,%.3f,%.3f,%.3f,%.3f,%.3f,%.3f,%.3f,"
+               "%" PRId64 ",%" PRId64 ",%" PRId64 "\n",
+               bi->name, fmt_name, r->width, r->height, r->bit_depth,
+               r->frame_count, n_iter, mpix_s, to_ms(r->total_time, n_iter),
+               t_ms[0], t_ms[1], t_ms[2], t_ms[3], t_ms[4], t_ms[5],
+               r->peak_rss, r->alloc_count, r->alloc_bytes);
+    }
+}
+
+static void help(void)
+{
+    printf("BPG decoder benchmark\n"
+           "usage: bpgbench [options]\n"
+           "Options:\n"
+           "-e bpgenc      path of the bpgenc executable (default = ./bpgenc)\n"
+           "-d dir         directory of the generated images (default = bpgbench.tmp)\n"
+           "-s WxH         size of the generated images (default = 512x512)\n"
+           "-n count       number of decodes per image and output format (default = 10)\n"
+           "-q qp          quantizer parameter given to bpgenc (default = 29)\n"
+           "-i name        only benchmark the image 'name' (can be repeated)\n"
+           "-j             JSON output (default = CSV)\n"
+           "-l             list the images of the corpus\n");
+    exit(1);
+}
+
+#define SELECT_MAX 32
+
+int main(int argc, char **argv)
+{
+    const char *bpgenc_path, *dir, *select_tab[SELECT_MAX];
+    char bpg_filename[1024];
+    int w, h, n_iter, qp, json, c, select_count, is_first, buf_len, ret;
+    unsigned int i, j;
+    int k;
+    const BenchImage *bi;
+    BenchResult r;
+    uint8_t *buf;
+
+    bpgenc_path = "./bpgenc";
+    dir = "bpgbench.tmp";
+    w = 512;
+    h = 512;
+    n_iter = 10;
+    qp = 29;
+    json = 0;
+    select_count = 0;
+    for(;;) {
+        c = getopt(argc, argv, "he:d:s:n:q:i:jl");
+        if (c == -1)
+            break;
+        switch(c) {
+        case 'h':
+            help();
+            break;
+        case 'e':
+            bpgenc_path = optarg;
+            break;
+        case 'd':
+            dir = optarg;
+            break;
+        case 's':
+            if (sscanf(optarg, "%dx%d", &w, &h) != 2 || w < 1 || h < 1) {
+                fprintf(stderr, "Invalid size\n");
+                exit(1);
+            }
+            break;
+        case 'n':
+            n_iter = atoi(optarg);
+            if (n_iter < 1)
+                n_iter = 1;
+            break;
+        case 'q':
+            qp = atoi(optarg);
+            break;
+        case 'i':
+            if (select_count >= SELECT_MAX) {
+                fprintf(stderr, "Too many images\n");
+                exit(1);
+            }
+            select_tab[select_count++] = optarg;
+            break;
+        case 'j':
+            json = 1;
+            break;
+        case 'l':
+            for(i = 0; i < BENCH_IMAGE_COUNT; i++)
+                printf("%-16s bpgenc %s\n", bench_images[i].name,
+                       bench_images[i].options);
+            exit(0);
+        default:
+            exit(1);
+        }
+    }
+
+    mkdir(dir, 0777);
+
+    is_first = 1;
+    if (json)
+        printf("[\n");
+    for(i = 0; i < BENCH_IMAGE_COUNT; i++) {
+        bi = &bench_images[i];
+        if (select_count > 0) {
+            for(k = 0; k < select_count; k++) {
+                if (!strcmp(select_tab[k], bi->name))
+                    break;
+            }
+            if (k == select_count)
+                continue;
+        }
+        if (gen_image(bi, dir, bpgenc_path, w, h, qp,
+                      bpg_filename, sizeof(bpg_filename)) < 0)
+            exit(1);
+        buf = load_file(&buf_len, bpg_filename);
+        if (!buf) {
+            fprintf(stderr, "Could not read '%s'\n", bpg_filename);
+            exit(1);
+        }
+        for(j = 0; j < OUT_FMT_COUNT; j++) {
+            ret = bench_decode(&r, buf, buf_len, j, n_iter);
+            if (ret < 0) {
+                fprintf(stderr, "%s: could not decode to %s\n",
+                        bi->name, out_fmt_name[j]);
+                continue;
+            }
+            print_result(bi, out_fmt_name[j], &r, n_iter, json, is_first);
+            is_first = 0;
+        }
+        free(buf);
+    }
+    if (json)
+        printf("\n]\n");
+    return 0;
+}
@@ -37,20 +37,31 @@
 
 #include "libbpg.h"
 
+typedef struct {
+    FILE *f;
+    size_t line_size;
+} PPMWriteState;
+
+static int ppm_write_line(void *opaque, int y, const void *buf)
+{
+    PPMWriteState *s = opaque;
+    if (fwrite(buf, 1, s->line_size, s->f) != s->line_size)
+        return -1;
+    return 0;
+}
+
 static void ppm_save(BPGDecoderContext *img, const char *filename)
 {
     BPGImageInfo img_info_s, *img_info = &img_info_s;
+    PPMWriteState ws;
     FILE *f;
-    int w, h, y;
-    uint8_t *rgb_line;
+    int w, h;
 
     bpg_decoder_get_info(img, img_info);
     
     w = img_info->width;
     h = img_info->height;
 
-    rgb_line = malloc(3 * w);
-
     f = fopen(filename,"wb");
     if (!f) {
         fprintf(stderr, "%s: I/O error\n", filename);
@@ -60,13 +71,13 @@ static void ppm_save(BPGDecoderContext *img, const char *filename)
     fprintf(f, "P6\n%d %d\n%d\n", w, h, 255);
     
     bpg_decoder_start(img, BPG_OUTPUT_FORMAT_RGB24);
-    for (y = 0; y < h; y++) {
-        bpg_decoder_get_line(img, rgb_line);
-        fwrite(rgb_line, 1, w * 3, f);
+    ws.f = f;
+    ws.line_size = (size_t)w * 3;
+    if (bpg_decoder_get_lines(img, ppm_write_line, &ws) < 0) {
+        fprintf(stderr, "%s: I/O error\n", filename);
+        exit(1);
     }
     fclose(f);
-
-    free(rgb_line);
 }
 
 #ifdef USE_PNG
@@ -82,14 +93,19 @@ static void png_write_data (png_structp png_ptr, png_bytep data,
 	png_error(png_ptr, "PNG Write Error");
 }
 
+static int png_write_line(void *opaque, int y, const void *buf)
+{
+    png_write_row(opaque, (png_const_bytep)buf);
+    return 0;
+}
+
 static void png_save(BPGDecoderContext *img, const char *filename, int bit_depth)
 {
     BPGImageInfo img_info_s, *img_info = &img_info_s;
     FILE *f;
     png_structp png_ptr;
     png_infop info_ptr;
-    png_bytep row_pointer;
-    int y, color_type, bpp;
+    int color_type;
     BPGDecoderOutputFormat out_fmt;
 
     if (bit_depth != 8 && bit_depth != 16) {
@@ -151,13 +167,7 @@ static void png_save(BPGDecoderContext *img, const char *filename, int bit_depth
     
     bpg_decoder_start(img, out_fmt);
 
-    bpp = (3 + img_info->has_alpha) * (bit_depth / 8);
-    row_pointer = (png_bytep)png_malloc(png_ptr, img_info->width * bpp);
-    for (y = 0; y < img_info->height; y++) {
-        bpg_decoder_get_line(img, row_pointer);
-        png_write_row(png_ptr, row_pointer);
-    }
-    png_free(png_ptr, row_pointer);
+    bpg_decoder_get_lines(img, png_write_line, png_ptr);
     
     png_write_end(png_ptr, NULL);
     
@@ -270,7 +280,9 @@ int main(int argc, char **argv)
     FILE *f;
     BPGDecoderContext *img;
     uint8_t *buf;
-    int buf_len, bit_depth, c, show_info;
+    long file_len;
+    size_t buf_len;
+    int bit_depth, c, show_info;
     const char *outfilename, *filename, *p;
     
     outfilename = "out.png";
@@ -316,11 +328,16 @@ int main(int argc, char **argv)
     }
 
     fseek(f, 0, SEEK_END);
-    buf_len = ftell(f);
+    file_len = ftell(f);
     fseek(f, 0, SEEK_SET);
+    if (file_len < 0) {
+        fprintf(stderr, "Error while reading file\n");
+        exit(1);
+    }
+    buf_len = file_len;
 
     buf = malloc(buf_len);
-    if (fread(buf, 1, buf_len, f) != buf_len) {
+    if (!buf || fread(buf, 1, buf_len, f) != buf_len) {
         fprintf(stderr, "Error while reading file\n");
         exit(1);
     }
@@ -21,6 +21,9 @@
  * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
  * THE SOFTWARE.
  */
+#ifndef _BPGENC_H
+#define _BPGENC_H
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -39,6 +42,8 @@ typedef struct {
     BPGColorSpaceEnum color_space;
     uint8_t bit_depth;
     uint8_t pixel_shift; /* (1 << pixel_shift) bytes per pixel */
+    uint8_t padded; /* true if the planes are already padded to a
+                       multiple of CB_SIZE */
     uint8_t *data[4];
     int linesize[4];
 } Image;
@@ -58,6 +63,11 @@ typedef struct {
     int verbose;
     int frame_rate;
     int limited_range;
+    int threads; /* 0 = encoder default */
+    int frame_threads; /* 0 = encoder default */
+    int wpp; /* -1 = encoder default, 0 = off, 1 = on */
+    int tile_cols, tile_rows; /* 0 = no tiles */
+    int session; /* 0-1: encode_picture() is used */
 } HEVCEncodeParams;
 
 typedef struct HEVCEncoderContext HEVCEncoderContext; 
@@ -66,6 +76,17 @@ typedef struct {
     HEVCEncoderContext *(*open)(const HEVCEncodeParams *params);
     int (*encode)(HEVCEncoderContext *s, Image *img);
     int (*close)(HEVCEncoderContext *s, uint8_t **pbuf);
+    /* optional (sessions): encode 'img' as an independent IDR picture
+       preceded by the parameter sets and return its bitstream in
+       *pbuf. The encoder stays open for the next picture. Return the
+       length or < 0 if error. */
+    int (*encode_picture)(HEVCEncoderContext *s, Image *img, uint8_t **pbuf);
+    /* true if the encoder has no tile support: the tile grid of still
+       images is then obtained by stitching separately encoded tiles */
+    int stitch_tiles;
+    /* true if the encoder outputs a VVC bitstream. The HEVC tile
+       stitching cannot be used. */
+    int vvc;
 } HEVCEncoder;
 
 extern HEVCEncoder jctvc_encoder;
@@ -79,7 +100,26 @@ int x265_encode_picture(uint8_t **pbuf, Image *img,
 void save_yuv1(Image *img, FILE *f);
 void save_yuv(Image *img, const char *filename);
 
+/* In-memory input and output for the encoders which read a YUV file
+   and write a bitstream file */
+typedef struct HEVCFileIO HEVCFileIO;
+
+HEVCFileIO *hevc_file_io_new(void);
+/* append the planes of 'img' to the YUV input (same layout as
+   save_yuv1()). Return < 0 if error. */
+int hevc_file_io_add_image(HEVCFileIO *s, Image *img);
+/* Return the names of the YUV input file and of the bitstream file
+   to give to the encoder. The transfers run until
+   hevc_file_io_close(). Return < 0 if error. */
+int hevc_file_io_start(HEVCFileIO *s, const char **pinfilename,
+                       const char **poutfilename);
+/* Must be called after the encoder has closed its files. Return the
+   bitstream in '*pbuf' and its length or < 0 if error. 's' is
+   freed. */
+int hevc_file_io_close(HEVCFileIO *s, uint8_t **pbuf);
+
 #ifdef __cplusplus
 }
 #endif
 
+#endif /* _BPGENC_H */
@@ -0,0 +1,878 @@
+/*
+ * BPG pixel kernel test bench
+ *
+ * The encoder and decoder kernels are static functions, so the two
+ * library source files are compiled in this translation unit. Build it
+ * with the same defines and objects as bpgenc and libbpg
+ * (USE_VAR_BIT_DEPTH is forced here so that both sides use 16 bit
+ * pixels).
+ */
+
+/* encoder side */
+#include "libbpgenc.c"
+
+/* decoder side: rename the symbols which are also defined in
+   libbpgenc.c */
+#define PIXEL dec_PIXEL
+#define clamp_pix dec_clamp_pix
+#define ColorConvertState DecColorConvertState
+#define convert_init dec_convert_init
+#define DynBuf DecDynBuf
+#define dyn_buf_init dec_dyn_buf_init
+#define dyn_buf_resize dec_dyn_buf_resize
+#define find_nal_end dec_find_nal_end
+#ifndef USE_VAR_BIT_DEPTH
+#define USE_VAR_BIT_DEPTH
+#endif
+#ifndef USE_PRED
+#define USE_PRED
+#endif
+#include "libbpg.c"
+#undef PIXEL
+#undef clamp_pix
+#undef ColorConvertState
+#undef convert_init
+
+#include <getopt.h>
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#define MAX_WIDTH 4096
+#define MAX_HEIGHT 64
+
+#if defined(__x86_64__) || defined(__i386__)
+#define TICKS_UNIT "cycles"
+
+static inline uint64_t get_ticks(void)
+{
+    return __rdtsc();
+}
+#else
+#define TICKS_UNIT "ns"
+
+static inline uint64_t get_ticks(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+#endif
+
+/* reproducible pseudo random generator (xorshift32) */
+static uint32_t rand_state = 1;
+
+static uint32_t rand32(void)
+{
+    uint32_t x = rand_state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    rand_state = x;
+    return x;
+}
+
+/* return a value between a and b inclusive */
+static int rand_range(int a, int b)
+{
+    return a + rand32() % (b - a + 1);
+}
+
+typedef struct {
+    int w;
+    int h; /* only used by the 2D kernels */
+    int bit_depth;
+    int phase; /* chroma phase */
+    int frac; /* vertical phase for interp2_vh */
+    int incr; /* output or input pixel increment */
+    int limited_range;
+    int arg; /* kernel specific */
+    uint32_t seed;
+} KernelParams;
+
+typedef struct {
+    const char *name;
+    void *func; /* the prototype depends on the kernel */
+    int (*supported)(void); /* NULL if always supported */
+} KernelImpl;
+
+typedef struct Kernel {
+    const char *name;
+    /* first entry is the C reference, terminated by a NULL name */
+    const KernelImpl *impls;
+    int is_2d;
+    int min_bit_depth, max_bit_depth;
+    int arg; /* copied to KernelParams.arg */
+    /* run the kernel 'count' times on the input generated from
+       'p'. The output of the last run is copied to 'out' and its size
+       is returned. '*pticks' receives the time spent in the kernel. */
+    size_t (*run)(const KernelImpl *impl, const KernelParams *p,
+                  uint8_t *out, int count, uint64_t *pticks);
+} Kernel;
+
+static void fill_pixels(PIXEL *buf, int n, int bit_depth)
+{
+    int i, pixel_max = (1 << bit_depth) - 1;
+    for(i = 0; i < n; i++)
+        buf[i] = rand32() & pixel_max;
+}
+
+static void fill_bytes(uint8_t *buf, int n)
+{
+    int i;
+    for(i = 0; i < n; i++)
+        buf[i] = rand32();
+}
+
+/* libbpg.c kernels */
+
+static size_t run_ycc_to_rgb24(const KernelImpl *impl, const KernelParams *p,
+                               uint8_t *out, int count, uint64_t *pticks)
+{
+    ColorConvertFunc *func = impl->func;
+    DecColorConvertState cvt;
+    PIXEL *y, *cb, *cr;
+    uint8_t *dst;
+    size_t dst_size;
+    uint64_t ti;
+    int i;
+
+    rand_state = p->seed;
+    dec_convert_init(&cvt, p->bit_depth, 8, BPG_CS_YCbCr, p->limited_range);
+    y = malloc(p->w * sizeof(PIXEL));
+    cb = malloc(p->w * sizeof(PIXEL));
+    cr = malloc(p->w * sizeof(PIXEL));
+    fill_pixels(y, p->w, p->bit_depth);
+    fill_pixels(cb, p->w, p->bit_depth);
+    fill_pixels(cr, p->w, p->bit_depth);
+    dst_size = p->w * p->incr;
+    dst = malloc(dst_size);
+    memset(dst, 0, dst_size);
+
+    ti = get_ticks();
+    for(i = 0; i < count; i++)
+        func(&cvt, dst, y, cb, cr, p->w, p->incr);
+    *pticks = get_ticks() - ti;
+
+    memcpy(out, dst, dst_size);
+    free(dst);
+    free(cr);
+    free(cb);
+    free(y);
+    return dst_size;
+}
+
+typedef void Interp2VHFunc(PIXEL *dst, PIXEL **src, int n, int y_pos,
+                           int16_t *tmp_buf, int bit_depth, int frac_pos,
+                           int c_h_phase);
+
+static size_t run_interp2_vh(const KernelImpl *impl, const KernelParams *p,
+                             uint8_t *out, int count, uint64_t *pticks)
+{
+    Interp2VHFunc *func = impl->func;
+    PIXEL *src[ITAPS], *dst;
+    int16_t *tmp_buf;
+    int i, w2, y_pos;
+    uint64_t ti;
+
+    rand_state = p->seed;
+    w2 = (p->w + 1) / 2;
+    for(i = 0; i < ITAPS; i++) {
+        src[i] = malloc(w2 * sizeof(PIXEL));
+        fill_pixels(src[i], w2, p->bit_depth);
+    }
+    y_pos = rand_range(0, ITAPS - 1);
+    tmp_buf = malloc((w2 + 2 * ITAPS2 - 1) * sizeof(int16_t));
+    dst = malloc(p->w * sizeof(PIXEL));
+
+    ti = get_ticks();
+    for(i = 0; i < count; i++) {
+        func(dst, src, p->w, y_pos, tmp_buf, p->bit_depth, p->frac,
+             p->phase);
+    }
+    *pticks = get_ticks() - ti;
+
+    memcpy(out, dst, p->w * sizeof(PIXEL));
+    free(dst);
+    free(tmp_buf);
+    for(i = 0; i < ITAPS; i++)
+        free(src[i]);
+    return p->w * sizeof(PIXEL);
+}
+
+typedef void InPlace8Func(uint8_t *dst, int n);
+
+static size_t run_alpha_divide8(const KernelImpl *impl, const KernelParams *p,
+                                uint8_t *out, int count, uint64_t *pticks)
+{
+    InPlace8Func *func = impl->func;
+    uint8_t *src, *dst;
+    size_t size;
+    uint64_t ti;
+    int i;
+
+    rand_state = p->seed;
+    size = p->w * 4;
+    src = malloc(size);
+    dst = malloc(size);
+    fill_bytes(src, size);
+    /* premultiplied input: the color components are <= alpha most of
+       the time */
+    for(i = 0; i < p->w; i++) {
+        if ((rand32() & 7) != 0) {
+            src[4 * i + 0] = src[4 * i + 0] * src[4 * i + 3] / 255;
+            src[4 * i + 1] = src[4 * i + 1] * src[4 * i + 3] / 255;
+            src[4 * i + 2] = src[4 * i + 2] * src[4 * i + 3] / 255;
+        }
+    }
+    /* the kernel works in place, so the input is restored before each
+       run */
+    *pticks = 0;
+    for(i = 0; i < count; i++) {
+        memcpy(dst, src, size);
+        ti = get_ticks();
+        func(dst, p->w);
+        *pticks += get_ticks() - ti;
+    }
+    memcpy(out, dst, size);
+    free(dst);
+    free(src);
+    return size;
+}
+
+typedef void GrayOneMinus8Func(uint8_t *dst, int n, int incr);
+
+static size_t run_gray_one_minus8(const KernelImpl *impl,
+                                  const KernelParams *p,
+                                  uint8_t *out, int count, uint64_t *pticks)
+{
+    GrayOneMinus8Func *func = impl->func;
+    uint8_t *dst;
+    size_t size;
+    uint64_t ti;
+    int i;
+
+    rand_state = p->seed;
+    size = p->w * p->incr;
+    dst = malloc(size);
+    fill_bytes(dst, size);
+    ti = get_ticks();
+    for(i = 0; i < count; i++)
+        func(dst, p->w, p->incr);
+    *pticks = get_ticks() - ti;
+    memcpy(out, dst, size);
+    free(dst);
+    return size;
+}
+
+/* libbpgenc.c kernels */
+
+/* arg = color space | (1 << 4) for 16 bit input */
+#define RGB48 (1 << 4)
+
+static size_t run_rgb_convert(const KernelImpl *impl, const KernelParams *p,
+                              uint8_t *out, int count, uint64_t *pticks)
+{
+    RGBConvertFunc *func = impl->func;
+    ColorConvertState cvt;
+    void *src;
+    PIXEL *dst;
+    uint64_t ti;
+    int i;
+
+    rand_state = p->seed;
+    if (p->arg & RGB48) {
+        convert_init(&cvt, 16, p->bit_depth, p->arg & 0xf, p->limited_range);
+        src = malloc(p->w * p->incr * sizeof(uint16_t));
+        fill_pixels(src, p->w * p->incr, 16);
+    } else {
+        convert_init(&cvt, 8, p->bit_depth, p->arg & 0xf, p->limited_range);
+        src = malloc(p->w * p->incr);
+        fill_bytes(src, p->w * p->incr);
+    }
+    dst = malloc(p->w * 3 * sizeof(PIXEL));
+
+    ti = get_ticks();
+    for(i = 0; i < count; i++)
+        func(&cvt, dst, dst + p->w, dst + 2 * p->w, src, p->w, p->incr);
+    *pticks = get_ticks() - ti;
+
+    memcpy(out, dst, p->w * 3 * sizeof(PIXEL));
+    free(dst);
+    free(src);
+    return p->w * 3 * sizeof(PIXEL);
+}
+
+static size_t run_gray_convert(const KernelImpl *impl, const KernelParams *p,
+                               uint8_t *out, int count, uint64_t *pticks)
+{
+    GrayConvertFunc *func = impl->func;
+    ColorConvertState cvt;
+    PIXEL *src, *dst;
+    uint64_t ti;
+    int i;
+
+    rand_state = p->seed;
+    convert_init(&cvt, 8, p->bit_depth, BPG_CS_YCbCr, 0);
+    src = malloc(p->w * sizeof(PIXEL));
+    dst = malloc(p->w * sizeof(PIXEL));
+    fill_pixels(src, p->w, p->bit_depth);
+    /* make sure that the special case of 0 is tested */
+    for(i = 0; i < p->w; i += 3)
+        src[i] = 0;
+    /* the kernel works in place */
+    *pticks = 0;
+    for(i = 0; i < count; i++) {
+        memcpy(dst, src, p->w * sizeof(PIXEL));
+        ti = get_ticks();
+        func(&cvt, dst, p->w);
+        *pticks += get_ticks() - ti;
+    }
+    memcpy(out, dst, p->w * sizeof(PIXEL));
+    free(dst);
+    free(src);
+    return p->w * sizeof(PIXEL);
+}
+
+/* arg = 1 for phase 1 | 2 for the 16 bit output */
+static size_t run_decimate2_h(const KernelImpl *impl, const KernelParams *p,
+                              uint8_t *out, int count, uint64_t *pticks)
+{
+    PIXEL *src;
+    int16_t *dst;
+    int i, d, w2;
+    uint64_t ti;
+
+    rand_state = p->seed;
+    if (p->arg & 1)
+        d = DP1TAPS2;
+    else
+        d = DP0TAPS2;
+    w2 = (p->w + 1) / 2;
+    /* the edge pixels are part of the input as in decimate2_h16() */
+    src = malloc((p->w + 2 * d) * sizeof(PIXEL));
+    fill_pixels(src, p->w + 2 * d, p->bit_depth);
+    dst = malloc(w2 * sizeof(int16_t));
+
+    ti = get_ticks();
+    if (p->arg & 2) {
+        Decimate2Func16 *func = impl->func;
+        for(i = 0; i < count; i++)
+            func(dst, src + d, p->w, p->bit_depth);
+    } else {
+        Decimate2Func *func = impl->func;
+        for(i = 0; i < count; i++)
+            func((PIXEL *)dst, src + d, p->w, p->bit_depth);
+    }
+    *pticks = get_ticks() - ti;
+
+    memcpy(out, dst, w2 * sizeof(int16_t));
+    free(dst);
+    free(src);
+    return w2 * sizeof(int16_t);
+}
+
+static size_t run_decimate2_v(const KernelImpl *impl, const KernelParams *p,
+                              uint8_t *out, int count, uint64_t *pticks)
+{
+    Decimate2VFunc *func = impl->func;
+    int16_t *src[DP1TAPS];
+    PIXEL *dst;
+    int i, j;
+    uint64_t ti;
+
+    rand_state = p->seed;
+    /* range of the decimate2px_simple16() output */
+    for(j = 0; j < DP1TAPS; j++) {
+        src[j] = malloc(p->w * sizeof(int16_t));
+        for(i = 0; i < p->w; i++)
+            src[j][i] = rand_range(-24 * 128, 152 * 128);
+    }
+    dst = malloc(p->w * sizeof(PIXEL));
+
+    ti = get_ticks();
+    for(i = 0; i < count; i++)
+        func(dst, src, p->w, p->bit_depth);
+    *pticks = get_ticks() - ti;
+
+    memcpy(out, dst, p->w * sizeof(PIXEL));
+    free(dst);
+    for(j = 0; j < DP1TAPS; j++)
+        free(src[j]);
+    return p->w * sizeof(PIXEL);
+}
+
+static size_t run_resample_h(const KernelImpl *impl, const KernelParams *p,
+                             uint8_t *out, int count, uint64_t *pticks)
+{
+    ResampleHFunc *func = impl->func;
+    PIXEL *src, *dst;
+    int16_t *coefs;
+    int *pos, src_n, n_taps, i;
+    uint64_t ti;
+
+    rand_state = p->seed;
+    /* random scale between 1/3 and 3 */
+    src_n = rand_range((p->w + 2) / 3, 3 * p->w);
+    coefs = resample_filter_init(&pos, &n_taps, src_n, p->w, 8);
+    /* edge extended input row as in resampler_put_row() */
+    for(i = 0; i < p->w; i++)
+        pos[i] += n_taps;
+    src = malloc((src_n + 2 * n_taps) * sizeof(PIXEL));
+    fill_pixels(src, src_n + 2 * n_taps, p->bit_depth);
+    dst = malloc(p->w * sizeof(PIXEL));
+
+    ti = get_ticks();
+    for(i = 0; i < count; i++)
+        func(dst, src, p->w, pos, coefs, n_taps, (1 << p->bit_depth) - 1);
+    *pticks = get_ticks() - ti;
+
+    memcpy(out, dst, p->w * sizeof(PIXEL));
+    free(dst);
+    free(src);
+    free(pos);
+    free(coefs);
+    return p->w * sizeof(PIXEL);
+}
+
+static size_t run_resample_v(const KernelImpl *impl, const KernelParams *p,
+                             uint8_t *out, int count, uint64_t *pticks)
+{
+    ResampleVFunc *func = impl->func;
+    PIXEL **src, *dst;
+    int16_t *coefs;
+    int *pos, src_n, n, n_taps, i, j;
+    uint64_t ti;
+
+    rand_state = p->seed;
+    /* filter of a random output row */
+    n = rand_range(1, 32);
+    src_n = rand_range((n + 2) / 3, 3 * n);
+    coefs = resample_filter_init(&pos, &n_taps, src_n, n, 2);
+    j = rand_range(0, n - 1);
+    src = malloc(n_taps * sizeof(src[0]));
+    for(i = 0; i < n_taps; i++) {
+        src[i] = malloc(p->w * sizeof(PIXEL));
+        fill_pixels(src[i], p->w, p->bit_depth);
+    }
+    dst = malloc(p->w * sizeof(PIXEL));
+
+    ti = get_ticks();
+    for(i = 0; i < count; i++) {
+        func(dst, (const PIXEL **)src, p->w, coefs + j * n_taps, n_taps,
+             (1 << p->bit_depth) - 1);
+    }
+    *pticks = get_ticks() - ti;
+
+    memcpy(out, dst, p->w * sizeof(PIXEL));
+    free(dst);
+    for(i = 0; i < n_taps; i++)
+        free(src[i]);
+    free(src);
+    free(pos);
+    free(coefs);
+    return p->w * sizeof(PIXEL);
+}
+
+typedef void Decimate2HVFunc(uint8_t *dst, int dst_linesize,
+                             uint8_t *src, int src_linesize,
+                             int w, int h, int bit_depth, int h_phase,
+                             int pixel_shift);
+
+static size_t run_decimate2_hv(const KernelImpl *impl, const KernelParams *p,
+                               uint8_t *out, int count, uint64_t *pticks)
+{
+    Decimate2HVFunc *func = impl->func;
+    PIXEL *src, *dst;
+    int i, w2, h2, src_linesize, dst_linesize;
+    uint64_t ti;
+
+    rand_state = p->seed;
+    w2 = (p->w + 1) / 2;
+    h2 = (p->h + 1) / 2;
+    src_linesize = p->w * sizeof(PIXEL);
+    dst_linesize = w2 * sizeof(PIXEL);
+    src = malloc(src_linesize * p->h);
+    fill_pixels(src, p->w * p->h, p->bit_depth);
+    dst = malloc(dst_linesize * h2);
+
+    ti = get_ticks();
+    for(i = 0; i < count; i++) {
+        func((uint8_t *)dst, dst_linesize, (uint8_t *)src, src_linesize,
+             p->w, p->h, p->bit_depth, p->phase, 1);
+    }
+    *pticks = get_ticks() - ti;
+
+    memcpy(out, dst, dst_linesize * h2);
+    free(dst);
+    free(src);
+    return dst_linesize * h2;
+}
+
+typedef void ImagePadFunc(Image *img, int cb_size);
+
+static size_t run_image_pad(const KernelImpl *impl, const KernelParams *p,
+                            uint8_t *out, int count, uint64_t *pticks)
+{
+    ImagePadFunc *func = impl->func;
+    Image *img;
+    uint8_t *q;
+    int i, c, y, w1, h1;
+    uint64_t ti;
+
+    img = NULL;
+    *pticks = 0;
+    for(i = 0; i < count; i++) {
+        rand_state = p->seed;
+        if (img)
+            image_free(img);
+        img = image_alloc(p->w, p->h, BPG_FORMAT_420, 1, BPG_CS_YCbCr,
+                          p->bit_depth);
+        for(c = 0; c < 4; c++) {
+            get_plane_res(img, &w1, &h1, c);
+            for(y = 0; y < h1; y++) {
+                if (img->pixel_shift) {
+                    fill_pixels((PIXEL *)(img->data[c] + y * img->linesize[c]),
+                                w1, p->bit_depth);
+                } else {
+                    fill_bytes(img->data[c] + y * img->linesize[c], w1);
+                }
+            }
+        }
+        ti = get_ticks();
+        func(img, 8);
+        *pticks += get_ticks() - ti;
+    }
+
+    /* only the padded area is compared */
+    q = out;
+    for(c = 0; c < 4; c++) {
+        get_plane_res(img, &w1, &h1, c);
+        for(y = 0; y < h1; y++) {
+            memcpy(q, img->data[c] + y * img->linesize[c],
+                   w1 << img->pixel_shift);
+            q += w1 << img->pixel_shift;
+        }
+    }
+    image_free(img);
+    return q - out;
+}
+
+static const KernelImpl ycc_to_rgb24_impls[] = {
+    { "c", ycc_to_rgb24 },
+    { NULL },
+};
+
+static const KernelImpl interp2_vh_impls[] = {
+    { "c", interp2_vh },
+    { NULL },
+};
+
+static const KernelImpl alpha_divide8_impls[] = {
+    { "c", alpha_divide8 },
+    { NULL },
+};
+
+static const KernelImpl gray_one_minus8_impls[] = {
+    { "c", gray_one_minus8 },
+    { NULL },
+};
+
+#if defined(HAVE_AVX2)
+#define SIMD_IMPLS(name)                  \
+static const KernelImpl name ## _impls[] = {     \
+    { "c", name },                               \
+    { "sse2", name ## _sse2 },                   \
+    { "avx2", name ## _avx2, cpu_has_avx2 },     \
+    { NULL },                                    \
+};
+#elif defined(HAVE_SSE2)
+#define SIMD_IMPLS(name)                  \
+static const KernelImpl name ## _impls[] = {     \
+    { "c", name },                               \
+    { "sse2", name ## _sse2 },                   \
+    { NULL },                                    \
+};
+#elif defined(HAVE_NEON)
+#define SIMD_IMPLS(name)                  \
+static const KernelImpl name ## _impls[] = {     \
+    { "c", name },                               \
+    { "neon", name ## _neon },                   \
+    { NULL },                                    \
+};
+#else
+#define SIMD_IMPLS(name)                  \
+static const KernelImpl name ## _impls[] = {     \
+    { "c", name },                               \
+    { NULL },                                    \
+};
+#endif
+
+SIMD_IMPLS(rgb24_to_ycc)
+SIMD_IMPLS(rgb48_to_ycc)
+SIMD_IMPLS(rgb24_to_ycgco)
+SIMD_IMPLS(rgb48_to_ycgco)
+SIMD_IMPLS(rgb24_to_rgb)
+SIMD_IMPLS(rgb48_to_rgb)
+SIMD_IMPLS(gray_one_minus)
+SIMD_IMPLS(gray_neg_c)
+SIMD_IMPLS(decimate2p0_simple)
+SIMD_IMPLS(decimate2p0_simple16)
+SIMD_IMPLS(decimate2p1_simple)
+SIMD_IMPLS(decimate2p1_simple16)
+SIMD_IMPLS(decimate2_v_simple)
+SIMD_IMPLS(resample_v)
+
+static const KernelImpl resample_h_impls[] = {
+    { "c", resample_h },
+#if defined(HAVE_SSE2)
+    { "sse2", resample_h_sse2 },
+#elif defined(HAVE_NEON)
+    { "neon", resample_h_neon },
+#endif
+    { NULL },
+};
+
+static const KernelImpl decimate2_hv_impls[] = {
+    { "c", decimate2_hv },
+    { NULL },
+};
+
+static const KernelImpl image_pad_impls[] = {
+    { "c", image_pad },
+    { NULL },
+};
+
+static const Kernel kernels[] = {
+    { "ycc_to_rgb24", ycc_to_rgb24_impls, 0, 8, 14, 0, run_ycc_to_rgb24 },
+    { "interp2_vh", interp2_vh_impls, 0, 8, 14, 0, run_interp2_vh },
+    { "alpha_divide8", alpha_divide8_impls, 0, 8, 8, 0, run_alpha_divide8 },
+    { "gray_one_minus8", gray_one_minus8_impls, 0, 8, 8, 0,
+      run_gray_one_minus8 },
+    { "rgb24_to_ycc", rgb24_to_ycc_impls, 0, 8, 14, BPG_CS_YCbCr,
+      run_rgb_convert },
+    { "rgb24_to_ycc_709", rgb24_to_ycc_impls, 0, 8, 14, BPG_CS_YCbCr_BT709,
+      run_rgb_convert },
+    { "rgb48_to_ycc", rgb48_to_ycc_impls, 0, 8, 14, BPG_CS_YCbCr | RGB48,
+      run_rgb_convert },
+    { "rgb24_to_ycgco", rgb24_to_ycgco_impls, 0, 8, 14, BPG_CS_YCgCo,
+      run_rgb_convert },
+    { "rgb48_to_ycgco", rgb48_to_ycgco_impls, 0, 8, 14, BPG_CS_YCgCo | RGB48,
+      run_rgb_convert },
+    { "rgb24_to_rgb", rgb24_to_rgb_impls, 0, 8, 14, BPG_CS_RGB,
+      run_rgb_convert },
+    { "rgb48_to_rgb", rgb48_to_rgb_impls, 0, 8, 14, BPG_CS_RGB | RGB48,
+      run_rgb_convert },
+    { "gray_one_minus", gray_one_minus_impls, 0, 8, 14, 0, run_gray_convert },
+    { "gray_neg_c", gray_neg_c_impls, 0, 8, 14, 0, run_gray_convert },
+    { "decimate2p0", decimate2p0_simple_impls, 0, 8, 14, 0,
+      run_decimate2_h },
+    { "decimate2p0_16", decimate2p0_simple16_impls, 0, 8, 14, 2,
+      run_decimate2_h },
+    { "decimate2p1", decimate2p1_simple_impls, 0, 8, 14, 1,
+      run_decimate2_h },
+    { "decimate2p1_16", decimate2p1_simple16_impls, 0, 8, 14, 3,
+      run_decimate2_h },
+    { "decimate2_v", decimate2_v_simple_impls, 0, 8, 14, 0,
+      run_decimate2_v },
+    { "decimate2_hv", decimate2_hv_impls, 1, 8, 14, 0, run_decimate2_hv },
+    { "resample_h", resample_h_impls, 0, 8, 14, 0, run_resample_h },
+    { "resample_v", resample_v_impls, 0, 8, 14, 0, run_resample_v },
+    { "image_pad", image_pad_impls, 1, 8, 14, 0, run_image_pad },
+};
+
+#define KERNEL_COUNT (sizeof(kernels) / sizeof(kernels[0]))
+
+static size_t max_out_size(void)
+{
+    /* 4 planes of 16 bit pixels covers all the kernels */
+    return (size_t)(MAX_WIDTH + 16) * (MAX_HEIGHT + 16) * 4 * sizeof(PIXEL);
+}
+
+static void rand_params(const Kernel *k, KernelParams *p, int test_idx)
+{
+    /* the small widths are always tested because they exercise the
+       tail handling of the vectorized loops */
+    if (test_idx < 64)
+        p->w = test_idx + 1;
+    else
+        p->w = rand_range(1, MAX_WIDTH);
+    if (k->is_2d)
+        p->h = rand_range(1, MAX_HEIGHT);
+    else
+        p->h = 1;
+    p->bit_depth = rand_range(k->min_bit_depth, k->max_bit_depth);
+    p->phase = rand32() & 1;
+    p->frac = rand32() & 1;
+    p->incr = (rand32() & 1) ? 4 : 3;
+    p->limited_range = rand32() & 1;
+    p->arg = k->arg;
+    p->seed = rand32() | 1;
+}
+
+/* return the number of failed tests */
+static int test_kernel(const Kernel *k, int n_tests)
+{
+    KernelParams p;
+    uint8_t *ref_out, *out;
+    size_t ref_size, size, pos;
+    uint64_t ticks;
+    int i, j, n_errors;
+
+    ref_out = malloc(max_out_size());
+    out = malloc(max_out_size());
+    n_errors = 0;
+    for(i = 0; i < n_tests; i++) {
+        rand_params(k, &p, i);
+        ref_size = k->run(&k->impls[0], &p, ref_out, 1, &ticks);
+        for(j = 1; k->impls[j].name != NULL; j++) {
+            if (k->impls[j].supported && !k->impls[j].supported())
+                continue;
+            size = k->run(&k->impls[j], &p, out, 1, &ticks);
+            if (size != ref_size || memcmp(out, ref_out, size) != 0) {
+                for(pos = 0; pos < size && out[pos] == ref_out[pos]; pos++)
+                    continue;
+                fprintf(stderr, "%s/%s: mismatch at byte %u: w=%d h=%d "
+                        "bit_depth=%d phase=%d frac=%d incr=%d "
+                        "limited_range=%d seed=0x%08x\n",
+                        k->name, k->impls[j].name, (unsigned)pos,
+                        p.w, p.h, p.bit_depth, p.phase, p.frac, p.incr,
+                        p.limited_range, p.seed);
+                n_errors++;
+            }
+        }
+    }
+    free(out);
+    free(ref_out);
+    return n_errors;
+}
+
+static void bench_kernel(const Kernel *k, int w, int h, int n_runs)
+{
+    KernelParams p;
+    uint8_t *out;
+    uint64_t ticks, best_ticks;
+    double ref_cpp, cpp;
+    int j, r;
+
+    out = malloc(max_out_size());
+    memset(&p, 0, sizeof(p));
+    p.w = w;
+    p.h = k->is_2d ? h : 1;
+    p.bit_depth = k->max_bit_depth >= 10 ? 10 : 8;
+    p.phase = 1;
+    p.frac = 0;
+    p.incr = 4;
+    p.limited_range = 0;
+    p.arg = k->arg;
+    p.seed = 0x12345678;
+    ref_cpp = 0;
+    for(j = 0; k->impls[j].name != NULL; j++) {
+        if (k->impls[j].supported && !k->impls[j].supported())
+            continue;
+        /* keep the best of several runs to reduce the noise */
+        best_ticks = UINT64_MAX;
+        for(r = 0; r < 5; r++) {
+            k->run(&k->impls[j], &p, out, n_runs, &ticks);
+            if (ticks < best_ticks)
+                best_ticks = ticks;
+        }
+        cpp = (double)best_ticks / ((double)n_runs * p.w * p.h);
+        if (j == 0)
+            ref_cpp = cpp;
+        printf("%-16s %-8s %8.3f %s/pixel  x%.2f\n",
+               k->name, k->impls[j].name, cpp, TICKS_UNIT, ref_cpp / cpp);
+    }
+    free(out);
+}
+
+static void kbench_help(void)
+{
+    printf("BPG pixel kernel test bench\n"
+           "usage: bpgkbench [options]\n"
+           "Options:\n"
+           "-k name      only test the kernel 'name'\n"
+           "-n count     number of randomized tests per kernel (default = 1000)\n"
+           "-s seed      random seed\n"
+           "-w width     benchmark width (default = 1920)\n"
+           "-r runs      benchmark runs (default = 100)\n"
+           "-t           only run the equivalence tests\n"
+           "-b           only run the benchmark\n");
+    exit(1);
+}
+
+int main(int argc, char **argv)
+{
+    const char *kernel_name;
+    int c, n_tests, n_runs, bench_w, test_only, bench_only, n_errors;
+    unsigned int i;
+    uint32_t seed;
+
+    kernel_name = NULL;
+    n_tests = 1000;
+    n_runs = 100;
+    bench_w = 1920;
+    test_only = 0;
+    bench_only = 0;
+    seed = 1;
+    for(;;) {
+        c = getopt(argc, argv, "hk:n:s:w:r:tb");
+        if (c == -1)
+            break;
+        switch(c) {
+        case 'h':
+            kbench_help();
+            break;
+        case 'k':
+            kernel_name = optarg;
+            break;
+        case 'n':
+            n_tests = atoi(optarg);
+            break;
+        case 's':
+            seed = strtoul(optarg, NULL, 0);
+            if (seed == 0)
+                seed = 1;
+            break;
+        case 'w':
+            bench_w = atoi(optarg);
+            if (bench_w < 1 || bench_w > MAX_WIDTH) {
+                fprintf(stderr, "width must be between 1 and %d\n",
+                        MAX_WIDTH);
+                exit(1);
+            }
+            break;
+        case 'r':
+            n_runs = atoi(optarg);
+            if (n_runs < 1)
+                n_runs = 1;
+            break;
+        case 't':
+            test_only = 1;
+            break;
+        case 'b':
+            bench_only = 1;
+            break;
+        default:
+            exit(1);
+        }
+    }
+
+    n_errors = 0;
+    for(i = 0; i < KERNEL_COUNT; i++) {
+        const Kernel *k = &kernels[i];
+        if (kernel_name && strcmp(kernel_name, k->name) != 0)
+            continue;
+        if (!bench_only) {
+            rand_state = seed;
+            c = test_kernel(k, n_tests);
+            printf("%-16s %d tests: %s\n", k->name, n_tests,
+                   c ? "FAILED" : "OK");
+            n_errors += c;
+        }
+        if (!test_only)
+            bench_kernel(k, bench_w, MAX_HEIGHT, n_runs);
+    }
+    return n_errors != 0;
+}
@@ -1,8 +1,5 @@
-#ifdef _WIN32
-#include <windows.h>
-#endif
-#include <unistd.h>
 #include <iostream>
+#include <mutex>
 #include "TAppEncTop.h"
 #include "Utilities/program_options_lite.h"
 
@@ -10,14 +7,19 @@
 
 struct HEVCEncoderContext {
     HEVCEncodeParams params;
-    char infilename[1024];
-    char outfilename[1024];
-    FILE *yuv_file;
+    HEVCFileIO *io; /* YUV input and bitstream output */
     int frame_count;
 };
 
 #define ARGV_MAX 256
 
+/* TEncTop::create() and destroy() build and free the global ROM
+   tables and the analysis statistics (m_gcAnalyze*) are globals, so
+   only one HM encode can run at a time. Concurrent HM encodes in one
+   process are not supported: the color and alpha layers, the ladder
+   renditions and the split tiles are encoded one after the other. */
+static std::mutex hm_mutex;
+
 static void add_opt(int *pargc, char **argv,
                     const char *str)
 {
@@ -32,38 +34,25 @@ static void add_opt(int *pargc, char **argv,
 static HEVCEncoderContext *jctvc_open(const HEVCEncodeParams *params)
 {
     HEVCEncoderContext *s;
-    char buf[1024];
-    static int tmp_idx = 1;
 
     s = (HEVCEncoderContext *)malloc(sizeof(HEVCEncoderContext));
     memset(s, 0, sizeof(*s));
 
     s->params = *params;
-#ifdef _WIN32
-    if (GetTempPath(sizeof(buf), buf) > sizeof(buf) - 1) {
-        fprintf(stderr, "Temporary path too long\n");
-        free(s);
-        return NULL;
-    }
-#else
-    strcpy(buf, "/tmp/");
-#endif
-    snprintf(s->infilename, sizeof(s->infilename), "%sout%d-%d.yuv", buf, getpid(), tmp_idx);
-    snprintf(s->outfilename, sizeof(s->outfilename), "%sout%d-%d.bin", buf, getpid(), tmp_idx);
-    tmp_idx++;
-
-    s->yuv_file = fopen(s->infilename, "wb");
-    if (!s->yuv_file) {
-        fprintf(stderr, "Could not open '%s'\n", s->infilename);
+    s->io = hevc_file_io_new();
+    if (!s->io) {
         free(s);
         return NULL;
     }
     return s;
 }
 
+/* the frames are kept in memory and given to the encoder by
+   jctvc_close() */
 static int jctvc_encode(HEVCEncoderContext *s, Image *img)
 {
-    save_yuv1(img, s->yuv_file);
+    if (hevc_file_io_add_image(s->io, img) < 0)
+        return -1;
     s->frame_count++;
     return 0;
 }
@@ -76,21 +65,14 @@ static int jctvc_close(HEVCEncoderContext *s, uint8_t **pbuf)
     int argc;
     char *argv[ARGV_MAX + 1];
     char buf[1024];
-    const char *str;
-    FILE *f;
-    uint8_t *out_buf;
+    const char *str, *infilename, *outfilename;
     int out_buf_len, i;
     
-    fclose(s->yuv_file);
-    s->yuv_file = NULL;
-
-    m_gcAnalyzeAll.clear();
-    m_gcAnalyzeI.clear();
-    m_gcAnalyzeP.clear();
-    m_gcAnalyzeB.clear();
-    m_gcAnalyzeAll_in.clear();
-    
-    cTAppEncTop.create();
+    if (hevc_file_io_start(s->io, &infilename, &outfilename) < 0) {
+        hevc_file_io_close(s->io, pbuf);
+        free(s);
+        return -1;
+    }
 
     argc = 0;
     add_opt(&argc, argv, "jctvc"); /* dummy executable name */
@@ -102,9 +84,9 @@ static int jctvc_close(HEVCEncoderContext *s, uint8_t **pbuf)
     fprintf( stdout, NVM_BITS );
     fprintf( stdout, "\n\n" );
 
-    snprintf(buf, sizeof(buf),"--InputFile=%s", s->infilename);
+    snprintf(buf, sizeof(buf),"--InputFile=%s", infilename);
     add_opt(&argc, argv, buf);
-    snprintf(buf, sizeof(buf),"--BitstreamFile=%s", s->outfilename);
+    snprintf(buf, sizeof(buf),"--BitstreamFile=%s", outfilename);
     add_opt(&argc, argv, buf);
 
     snprintf(buf, sizeof(buf),"--SourceWidth=%d", s->params.width);
@@ -242,6 +224,23 @@ static int jctvc_close(HEVCEncoderContext *s, uint8_t **pbuf)
         add_opt(&argc, argv, "--HadamardME=0");
     }
 
+    /* parallel tools. Note: HM is single threaded, so the thread
+       counts are ignored. The HEVC Main profiles do not allow WPP
+       together with tiles, so the tiles take priority. */
+    if (s->params.tile_cols > 1 || s->params.tile_rows > 1) {
+        if (s->params.wpp > 0)
+            fprintf(stderr, "WPP cannot be used with tiles, disabled.\n");
+        add_opt(&argc, argv, "--TileUniformSpacing=1");
+        snprintf(buf, sizeof(buf), "--NumTileColumnsMinus1=%d",
+                 s->params.tile_cols > 1 ? s->params.tile_cols - 1 : 0);
+        add_opt(&argc, argv, buf);
+        snprintf(buf, sizeof(buf), "--NumTileRowsMinus1=%d",
+                 s->params.tile_rows > 1 ? s->params.tile_rows - 1 : 0);
+        add_opt(&argc, argv, buf);
+    } else if (s->params.wpp > 0) {
+        add_opt(&argc, argv, "--WaveFrontSynchro=1");
+    }
+
 #if 0
     /* TEST with several slices */
     add_opt(&argc, argv, "--SliceMode=2");
@@ -260,40 +259,37 @@ static int jctvc_close(HEVCEncoderContext *s, uint8_t **pbuf)
         printf("\n");
     }
     
-    if(!cTAppEncTop.parseCfg( argc, argv )) {
-        fprintf(stderr, "Error while parsing options\n");
+    {
+        /* the option parsing also sets HM globals */
+        std::lock_guard<std::mutex> lock(hm_mutex);
+
+        cTAppEncTop.create();
+        if(!cTAppEncTop.parseCfg( argc, argv )) {
+            fprintf(stderr, "Error while parsing options\n");
+            out_buf_len = -1;
+        } else {
+            /* the bitstream file is closed at the end of encode() */
+            m_gcAnalyzeAll.clear();
+            m_gcAnalyzeI.clear();
+            m_gcAnalyzeP.clear();
+            m_gcAnalyzeB.clear();
+            m_gcAnalyzeAll_in.clear();
+            cTAppEncTop.encode();
+            out_buf_len = 0;
+        }
         cTAppEncTop.destroy();
-        return -1;
     }
     
-    cTAppEncTop.encode();
-    
-    cTAppEncTop.destroy();
-    
     for(i = 0; i < argc; i++)
         free(argv[i]);
-    unlink(s->infilename);
 
-    /* read output bitstream */
-    f = fopen(s->outfilename, "rb");
-    if (!f) {
-        fprintf(stderr, "Could not open '%s'\n", s->outfilename);
-        return -1;
-    }
-    
-    fseek(f, 0, SEEK_END);
-    out_buf_len = ftell(f);
-    fseek(f, 0, SEEK_SET);
-    out_buf = (uint8_t *)malloc(out_buf_len);
-    if (fread(out_buf, 1, out_buf_len, f) != out_buf_len) {
-        fprintf(stderr, "read error\n");
-        fclose(f);
-        free(out_buf);
-        return -1;
+    if (out_buf_len < 0) {
+        hevc_file_io_close(s->io, pbuf);
+        free(*pbuf);
+        *pbuf = NULL;
+    } else {
+        out_buf_len = hevc_file_io_close(s->io, pbuf);
     }
-    fclose(f);
-    unlink(s->outfilename);
-    *pbuf = out_buf;
     free(s);
     return out_buf_len;
 }
@@ -4,9 +4,9 @@
 
 #include <time.h>
 #include <iostream>
-#include <unistd.h>
 #include <chrono>
 #include <ctime>
+#include <mutex>
 
 #include "EncoderLib/EncLibCommon.h"
 #include "EncApp.h"
@@ -15,9 +15,6 @@
 extern "C" {
 #include "bpgenc.h"
 }
-#ifdef _WIN32
-#include <windows.h>
-#endif
 
 
 
@@ -56,9 +53,7 @@ static void printMacroSettings()
 
 struct HEVCEncoderContext {
     HEVCEncodeParams params;
-    char infilename[1024];
-    char outfilename[1024];
-    FILE *yuv_file;
+    HEVCFileIO *io; /* YUV input and bitstream output */
     int frame_count;
 };
 
@@ -78,42 +73,324 @@ static void add_opt(int *pargc, char **argv,
 static HEVCEncoderContext *jvetvvc_open(const HEVCEncodeParams *params)
 {
     HEVCEncoderContext *s;
-    char buf[1024];
-    static int tmp_idx = 1;
 
     s = (HEVCEncoderContext *)malloc(sizeof(HEVCEncoderContext));
     memset(s, 0, sizeof(*s));
 
     s->params = *params;
-#ifdef _WIN32
-    if (GetTempPath(sizeof(buf), buf) > sizeof(buf) - 1) {
-        fprintf(stderr, "Temporary path too long\n");
-        free(s);
-        return NULL;
-    }
-#else
-    strcpy(buf, "/tmp/");
-#endif
-    snprintf(s->infilename, sizeof(s->infilename), "%sout%d-%d.yuv", buf, getpid(), tmp_idx);
-    snprintf(s->outfilename, sizeof(s->outfilename), "%sout%d-%d.bin", buf, getpid(), tmp_idx);
-    tmp_idx++;
-
-    s->yuv_file = fopen(s->infilename, "wb");
-    if (!s->yuv_file) {
-        fprintf(stderr, "Could not open '%s'\n", s->infilename);
+    s->io = hevc_file_io_new();
+    if (!s->io) {
         free(s);
         return NULL;
     }
     return s;
 }
 
+/* the frames are kept in memory and given to the encoder by
+   jvetvvc_close() */
 static int jvetvvc_encode(HEVCEncoderContext *s, Image *img)
 {
-    save_yuv1(img, s->yuv_file);
+    if (hevc_file_io_add_image(s->io, img) < 0)
+        return -1;
     s->frame_count++;
     return 0;
 }
 
+/* The ROM tables only depend on constants, so they are built by the
+   first encode and kept until the process exits instead of being
+   rebuilt for each image. */
+static std::mutex rom_mutex;
+static int rom_refcount;
+static bool rom_initialized;
+
+static void jvetvvc_rom_free(void)
+{
+  std::lock_guard<std::mutex> lock( rom_mutex );
+  if( rom_initialized && rom_refcount == 0 )
+  {
+    destroyROM();
+    rom_initialized = false;
+  }
+}
+
+static void jvetvvc_rom_acquire(void)
+{
+  std::lock_guard<std::mutex> lock( rom_mutex );
+  if( !rom_initialized )
+  {
+    initROM();
+    TComHash::initBlockSizeToIndex();
+    rom_initialized = true;
+    atexit( jvetvvc_rom_free );
+  }
+  rom_refcount++;
+}
+
+static void jvetvvc_rom_release(void)
+{
+  std::lock_guard<std::mutex> lock( rom_mutex );
+  rom_refcount--;
+}
+
+/* the analysis statistics (m_gcAnalyze*) are globals updated by the
+   GOP encoder, so only one VTM encode can run at a time. Concurrent VTM
+   encodes in one process are not supported: the color and alpha
+   layers, the ladder renditions and the split tiles are encoded one
+   after the other. */
+static std::mutex analyze_mutex;
+
+/* destroy the encoder instances after an error. The first 'nb_libs'
+   ones were fully created. The input and bitstream files must be
+   closed so that the HEVCFileIO transfers can end. */
+static int jvetvvc_fail(std::vector<EncApp*> &pcEncApp, int nb_libs,
+                        std::fstream &bitstream)
+{
+  for( int i = 0; i < (int)pcEncApp.size(); i++ )
+  {
+    if( !pcEncApp[i] )
+      continue;
+    if( i < nb_libs )
+      pcEncApp[i]->destroyLib();
+    pcEncApp[i]->destroy();
+    delete pcEncApp[i];
+  }
+  pcEncApp.clear();
+  jvetvvc_rom_release();
+  bitstream.close();
+  return -1;
+}
+
+/* run the VTM encoder with the options in argv. Return < 0 if error */
+static int jvetvvc_run(int argc, char **argv)
+{
+  std::fstream bitstream;
+  EncLibCommon encLibCommon;
+
+  std::vector<EncApp*> pcEncApp(1);
+  bool resized = false;
+  int layerIdx = 0;
+
+  jvetvvc_rom_acquire();
+
+  char** layerArgv = new char*[argc];
+
+  do
+  {
+    pcEncApp[layerIdx] = new EncApp( bitstream, &encLibCommon );
+    // create application encoder class per layer
+    pcEncApp[layerIdx]->create();
+
+    // parse configuration per layer
+    try
+    {
+      int j = 0;
+      for( int i = 0; i < argc; i++ )
+      {
+        if( argv[i][0] == '-' && argv[i][1] == 'l' )
+        {
+          if (argc <= i + 1)
+          {
+            THROW("Command line parsing error: missing parameter after -lx\n");
+          }
+          int numParams = 1; // count how many parameters are consumed
+          // check for long parameters, which start with "--"
+          const std::string param = argv[i + 1];
+          if (param.rfind("--", 0) != 0)
+          {
+            // only short parameters have a second parameter for the value
+            if (argc <= i + 2)
+            {
+              THROW("Command line parsing error: missing parameter after -lx\n");
+            }
+            numParams++;
+          }
+          // check if correct layer index
+          if( argv[i][2] == std::to_string( layerIdx ).c_str()[0] )
+          {
+            layerArgv[j] = argv[i + 1];
+            if (numParams > 1)
+            {
+              layerArgv[j + 1] = argv[i + 2];
+            }
+            j+= numParams;
+          }
+          i += numParams;
+        }
+        else
+        {
+          layerArgv[j] = argv[i];
+          j++;
+        }
+      }
+
+      if( !pcEncApp[layerIdx]->parseCfg( j, layerArgv ) )
+      {
+        delete[] layerArgv;
+        return jvetvvc_fail( pcEncApp, layerIdx, bitstream );
+      }
+    }
+    catch( df::program_options_lite::ParseFailure &e )
+    {
+      std::cerr << "Error parsing option \"" << e.arg << "\" with argument \"" << e.val << "\"." << std::endl;
+      delete[] layerArgv;
+      return jvetvvc_fail( pcEncApp, layerIdx, bitstream );
+    }
+
+    pcEncApp[layerIdx]->createLib( layerIdx );
+
+    if( !resized )
+    {
+      pcEncApp.resize( pcEncApp[layerIdx]->getMaxLayers() );
+      resized = true;
+    }
+
+    layerIdx++;
+  } while( layerIdx < pcEncApp.size() );
+
+  delete[] layerArgv;
+
+  if (layerIdx > 1)
+  {
+    VPS* vps = pcEncApp[0]->getVPS();
+    //check chroma format and bit-depth for dependent layers
+    for (uint32_t i = 0; i < layerIdx; i++)
+    {
+      int curLayerChromaFormatIdc = pcEncApp[i]->getChromaFormatIDC();
+      int curLayerBitDepth = pcEncApp[i]->getBitDepth();
+      for (uint32_t j = 0; j < layerIdx; j++)
+      {
+        if (vps->getDirectRefLayerFlag(i, j))
+        {
+          int refLayerChromaFormatIdcInVPS = pcEncApp[j]->getChromaFormatIDC();
+          CHECK(curLayerChromaFormatIdc != refLayerChromaFormatIdcInVPS, "The chroma formats of the current layer and the reference layer are different");
+          int refLayerBitDepthInVPS = pcEncApp[j]->getBitDepth();
+          CHECK(curLayerBitDepth != refLayerBitDepthInVPS, "The bit-depth of the current layer and the reference layer are different");
+        }
+      }
+    }
+  }
+
+#if PRINT_MACRO_VALUES
+  printMacroSettings();
+#endif
+
+  // starting time
+  auto startTime  = std::chrono::steady_clock::now();
+  std::time_t startTime2 = std::chrono::system_clock::to_time_t(std::chrono::system_clock::now());
+  fprintf(stdout, " started @ %s", std::ctime(&startTime2) );
+  clock_t startClock = clock();
+
+  // call encoding function per layer
+  bool eos = false;
+
+  while( !eos )
+  {
+    // read GOP
+    bool keepLoop = true;
+    while( keepLoop )
+    {
+      for( auto & encApp : pcEncApp )
+      {
+#ifndef _DEBUG
+        try
+        {
+#endif
+          keepLoop = encApp->encodePrep( eos );
+#ifndef _DEBUG
+        }
+        catch( Exception &e )
+        {
+          std::cerr << e.what() << std::endl;
+          return jvetvvc_fail( pcEncApp, pcEncApp.size(), bitstream );
+        }
+        catch( const std::bad_alloc &e )
+        {
+          std::cout << "Memory allocation failed: " << e.what() << std::endl;
+          return jvetvvc_fail( pcEncApp, pcEncApp.size(), bitstream );
+        }
+#endif
+      }
+    }
+
+    // encode GOP
+    keepLoop = true;
+    while( keepLoop )
+    {
+      for( auto & encApp : pcEncApp )
+      {
+#ifndef _DEBUG
+        try
+        {
+#endif
+          keepLoop = encApp->encode();
+#ifndef _DEBUG
+        }
+        catch( Exception &e )
+        {
+          std::cerr << e.what() << std::endl;
+          return jvetvvc_fail( pcEncApp, pcEncApp.size(), bitstream );
+        }
+        catch( const std::bad_alloc &e )
+        {
+          std::cout << "Memory allocation failed: " << e.what() << std::endl;
+          return jvetvvc_fail( pcEncApp, pcEncApp.size(), bitstream );
+        }
+#endif
+      }
+    }
+  }
+  // ending time
+  clock_t endClock = clock();
+  auto endTime = std::chrono::steady_clock::now();
+  std::time_t endTime2 = std::chrono::system_clock::to_time_t(std::chrono::system_clock::now());
+#if JVET_O0756_CALCULATE_HDRMETRICS
+  auto metricTime = pcEncApp[0]->getMetricTime();
+
+  for( int layerIdx = 1; layerIdx < pcEncApp.size(); layerIdx++ )
+  {
+    metricTime += pcEncApp[layerIdx]->getMetricTime();
+  }
+  auto totalTime      = std::chrono::duration_cast<std::chrono::milliseconds>( endTime - startTime ).count();
+  auto encTime        = std::chrono::duration_cast<std::chrono::milliseconds>( endTime - startTime - metricTime ).count();
+  auto metricTimeuser = std::chrono::duration_cast<std::chrono::milliseconds>( metricTime ).count();
+#else
+  auto encTime = std::chrono::duration_cast<std::chrono::milliseconds>( endTime - startTime).count();
+#endif
+
+  for( auto & encApp : pcEncApp )
+  {
+    encApp->destroyLib();
+
+    // destroy application encoder class per layer
+    encApp->destroy();
+
+    delete encApp;
+  }
+
+  jvetvvc_rom_release();
+
+  pcEncApp.clear();
+
+  /* the reader of the bitstream pipe stops at end of file */
+  bitstream.close();
+
+  printf( "\n finished @ %s", std::ctime(&endTime2) );
+
+#if JVET_O0756_CALCULATE_HDRMETRICS
+  printf(" Encoding Time (Total Time): %12.3f ( %12.3f ) sec. [user] %12.3f ( %12.3f ) sec. [elapsed]\n",
+         ((endClock - startClock) * 1.0 / CLOCKS_PER_SEC) - (metricTimeuser/1000.0),
+         (endClock - startClock) * 1.0 / CLOCKS_PER_SEC,
+         encTime / 1000.0,
+         totalTime / 1000.0);
+#else
+  printf(" Total Time: %12.3f sec. [user] %12.3f sec. [elapsed]\n",
+         (endClock - startClock) * 1.0 / CLOCKS_PER_SEC,
+         encTime / 1000.0);
+#endif
+
+  return 0;
+}
+
 /* return the encoded data in *pbuf and the size. Return < 0 if error */
 static int jvetvvc_close(HEVCEncoderContext *s, uint8_t **pbuf)
 {
@@ -121,19 +398,14 @@ static int jvetvvc_close(HEVCEncoderContext *s, uint8_t **pbuf)
     int argc;
     char *argv[ARGV_MAX + 1];
     char buf[1024];
-    const char *str;
-    FILE *f;
-    uint8_t *out_buf;
+    const char *str, *infilename, *outfilename;
     int out_buf_len, i;
 
-    fclose(s->yuv_file);
-    s->yuv_file = NULL;
-
-    m_gcAnalyzeAll.clear();
-    m_gcAnalyzeI.clear();
-    m_gcAnalyzeP.clear();
-    m_gcAnalyzeB.clear();
-    m_gcAnalyzeAll_in.clear();
+    if (hevc_file_io_start(s->io, &infilename, &outfilename) < 0) {
+        hevc_file_io_close(s->io, pbuf);
+        free(s);
+        return -1;
+    }
 
     argc = 0;
     add_opt(&argc, argv, "jvetvvc"); /* dummy executable name */
@@ -193,7 +465,9 @@ static int jvetvvc_close(HEVCEncoderContext *s, uint8_t **pbuf)
 #endif
     fprintf( stdout, "\n" );
 
-    snprintf(buf, sizeof(buf),"--InputFile=%s", s->infilename);
+    snprintf(buf, sizeof(buf),"--InputFile=%s", infilename);
+    add_opt(&argc, argv, buf);
+    snprintf(buf, sizeof(buf),"--BitstreamFile=%s", outfilename);
     add_opt(&argc, argv, buf);
 
     /*int number_frames = gop_size - 1;
@@ -216,9 +490,6 @@ static int jvetvvc_close(HEVCEncoderContext *s, uint8_t **pbuf)
     add_opt(&argc, argv, buf);
     number_frames++;*/
 
-    //snprintf(buf, sizeof(buf),"--BitstreamFile=%s", s->outfilename);
-    //add_opt(&argc, argv, buf);
-
     snprintf(buf, sizeof(buf),"--SourceWidth=%d", s->params.width);
     add_opt(&argc, argv, buf);
     snprintf(buf, sizeof(buf),"--SourceHeight=%d", s->params.height);
@@ -560,7 +831,6 @@ static int jvetvvc_close(HEVCEncoderContext *s, uint8_t **pbuf)
     }
 
     if (s->params.intra_only) {
-        add_opt(&argc, argv, "--BitstreamFile=image.vvc");
         add_opt(&argc, argv, "--GOPSize=1");
         add_opt(&argc, argv, "--IntraPeriod=1");
         add_opt(&argc, argv, "--OnePictureOnlyConstraintFlag=1");
@@ -589,7 +859,6 @@ static int jvetvvc_close(HEVCEncoderContext *s, uint8_t **pbuf)
         add_opt(&argc, argv, "--MmvdDisNum=8");
         //add_opt(&argc, argv, "--TemporalSubsampleRatio              : 8
     } else {
-        add_opt(&argc, argv, "--BitstreamFile=animation.vvc");
         int gop_size = 1;
         snprintf(buf, sizeof(buf), "--GOPSize=%d", gop_size);
         add_opt(&argc, argv, buf);
@@ -663,7 +932,25 @@ static int jvetvvc_close(HEVCEncoderContext *s, uint8_t **pbuf)
         add_opt(&argc, argv, "--TransformSkipLog2MaxSize=5");
         add_opt(&argc, argv, "--SAOLcuBoundary=0");
 
-
+    /* parallel tools. Note: VTM is single threaded, so the thread
+       counts are ignored. */
+    if (s->params.wpp > 0)
+        add_opt(&argc, argv, "--WaveFrontSynchro=1");
+    if (s->params.tile_cols > 1 || s->params.tile_rows > 1) {
+        int n, ctb_count;
+        add_opt(&argc, argv, "--EnablePicPartitioning=1");
+        /* uniform tile sizes in CTUs (the last size is repeated) */
+        ctb_count = (s->params.width + 31) / 32;
+        n = s->params.tile_cols > 1 ? s->params.tile_cols : 1;
+        snprintf(buf, sizeof(buf), "--TileColumnWidthArray=%d",
+                 (ctb_count + n - 1) / n);
+        add_opt(&argc, argv, buf);
+        ctb_count = (s->params.height + 31) / 32;
+        n = s->params.tile_rows > 1 ? s->params.tile_rows : 1;
+        snprintf(buf, sizeof(buf), "--TileRowHeightArray=%d",
+                 (ctb_count + n - 1) / n);
+        add_opt(&argc, argv, buf);
+    }
 
 #if 0
     /* TEST with several slices */
@@ -683,253 +970,26 @@ static int jvetvvc_close(HEVCEncoderContext *s, uint8_t **pbuf)
         printf("\n");
     }
 
-  std::fstream bitstream;
-  EncLibCommon encLibCommon;
-
-  std::vector<EncApp*> pcEncApp(1);
-  bool resized = false;
-  int layerIdx = 0;
-
-  initROM();
-  TComHash::initBlockSizeToIndex();
-
-  char** layerArgv = new char*[argc];
-
-  do
-  {
-    pcEncApp[layerIdx] = new EncApp( bitstream, &encLibCommon );
-    // create application encoder class per layer
-    pcEncApp[layerIdx]->create();
-
-    // parse configuration per layer
-    try
-    {
-      int j = 0;
-      for( int i = 0; i < argc; i++ )
-      {
-        if( argv[i][0] == '-' && argv[i][1] == 'l' )
-        {
-          if (argc <= i + 1)
-          {
-            THROW("Command line parsing error: missing parameter after -lx\n");
-          }
-          int numParams = 1; // count how many parameters are consumed
-          // check for long parameters, which start with "--"
-          const std::string param = argv[i + 1];
-          if (param.rfind("--", 0) != 0)
-          {
-            // only short parameters have a second parameter for the value
-            if (argc <= i + 2)
-            {
-              THROW("Command line parsing error: missing parameter after -lx\n");
-            }
-            numParams++;
-          }
-          // check if correct layer index
-          if( argv[i][2] == std::to_string( layerIdx ).c_str()[0] )
-          {
-            layerArgv[j] = argv[i + 1];
-            if (numParams > 1)
-            {
-              layerArgv[j + 1] = argv[i + 2];
-            }
-            j+= numParams;
-          }
-          i += numParams;
-        }
-        else
-        {
-          layerArgv[j] = argv[i];
-          j++;
-        }
-      }
-
-      if( !pcEncApp[layerIdx]->parseCfg( j, layerArgv ) )
-      {
-        pcEncApp[layerIdx]->destroy();
-        return 1;
-      }
-    }
-    catch( df::program_options_lite::ParseFailure &e )
-    {
-      std::cerr << "Error parsing option \"" << e.arg << "\" with argument \"" << e.val << "\"." << std::endl;
-      return 1;
-    }
-
-    pcEncApp[layerIdx]->createLib( layerIdx );
-
-    if( !resized )
     {
-      pcEncApp.resize( pcEncApp[layerIdx]->getMaxLayers() );
-      resized = true;
+        std::lock_guard<std::mutex> lock(analyze_mutex);
+        m_gcAnalyzeAll.clear();
+        m_gcAnalyzeI.clear();
+        m_gcAnalyzeP.clear();
+        m_gcAnalyzeB.clear();
+        m_gcAnalyzeAll_in.clear();
+        out_buf_len = jvetvvc_run(argc, argv);
     }
 
-    layerIdx++;
-  } while( layerIdx < pcEncApp.size() );
-
-  delete[] layerArgv;
-
-  if (layerIdx > 1)
-  {
-    VPS* vps = pcEncApp[0]->getVPS();
-    //check chroma format and bit-depth for dependent layers
-    for (uint32_t i = 0; i < layerIdx; i++)
-    {
-      int curLayerChromaFormatIdc = pcEncApp[i]->getChromaFormatIDC();
-      int curLayerBitDepth = pcEncApp[i]->getBitDepth();
-      for (uint32_t j = 0; j < layerIdx; j++)
-      {
-        if (vps->getDirectRefLayerFlag(i, j))
-        {
-          int refLayerChromaFormatIdcInVPS = pcEncApp[j]->getChromaFormatIDC();
-          CHECK(curLayerChromaFormatIdc != refLayerChromaFormatIdcInVPS, "The chroma formats of the current layer and the reference layer are different");
-          int refLayerBitDepthInVPS = pcEncApp[j]->getBitDepth();
-          CHECK(curLayerBitDepth != refLayerBitDepthInVPS, "The bit-depth of the current layer and the reference layer are different");
-        }
-      }
-    }
-  }
-
-#if PRINT_MACRO_VALUES
-  printMacroSettings();
-#endif
-
-  // starting time
-  auto startTime  = std::chrono::steady_clock::now();
-  std::time_t startTime2 = std::chrono::system_clock::to_time_t(std::chrono::system_clock::now());
-  fprintf(stdout, " started @ %s", std::ctime(&startTime2) );
-  clock_t startClock = clock();
-
-  // call encoding function per layer
-  bool eos = false;
-
-  while( !eos )
-  {
-    // read GOP
-    bool keepLoop = true;
-    while( keepLoop )
-    {
-      for( auto & encApp : pcEncApp )
-      {
-#ifndef _DEBUG
-        try
-        {
-#endif
-          keepLoop = encApp->encodePrep( eos );
-#ifndef _DEBUG
-        }
-        catch( Exception &e )
-        {
-          std::cerr << e.what() << std::endl;
-          return EXIT_FAILURE;
-        }
-        catch( const std::bad_alloc &e )
-        {
-          std::cout << "Memory allocation failed: " << e.what() << std::endl;
-          return EXIT_FAILURE;
-        }
-#endif
-      }
-    }
-
-    // encode GOP
-    keepLoop = true;
-    while( keepLoop )
-    {
-      for( auto & encApp : pcEncApp )
-      {
-#ifndef _DEBUG
-        try
-        {
-#endif
-          keepLoop = encApp->encode();
-#ifndef _DEBUG
-        }
-        catch( Exception &e )
-        {
-          std::cerr << e.what() << std::endl;
-          return EXIT_FAILURE;
-        }
-        catch( const std::bad_alloc &e )
-        {
-          std::cout << "Memory allocation failed: " << e.what() << std::endl;
-          return EXIT_FAILURE;
-        }
-#endif
-      }
-    }
-  }
-  // ending time
-  clock_t endClock = clock();
-  auto endTime = std::chrono::steady_clock::now();
-  std::time_t endTime2 = std::chrono::system_clock::to_time_t(std::chrono::system_clock::now());
-#if JVET_O0756_CALCULATE_HDRMETRICS
-  auto metricTime = pcEncApp[0]->getMetricTime();
-
-  for( int layerIdx = 1; layerIdx < pcEncApp.size(); layerIdx++ )
-  {
-    metricTime += pcEncApp[layerIdx]->getMetricTime();
-  }
-  auto totalTime      = std::chrono::duration_cast<std::chrono::milliseconds>( endTime - startTime ).count();
-  auto encTime        = std::chrono::duration_cast<std::chrono::milliseconds>( endTime - startTime - metricTime ).count();
-  auto metricTimeuser = std::chrono::duration_cast<std::chrono::milliseconds>( metricTime ).count();
-#else
-  auto encTime = std::chrono::duration_cast<std::chrono::milliseconds>( endTime - startTime).count();
-#endif
-
-  for( auto & encApp : pcEncApp )
-  {
-    encApp->destroyLib();
-
-    // destroy application encoder class per layer
-    encApp->destroy();
-
-    delete encApp;
-  }
-
-  // destroy ROM
-  destroyROM();
-
-  pcEncApp.clear();
-
-  printf( "\n finished @ %s", std::ctime(&endTime2) );
-
-#if JVET_O0756_CALCULATE_HDRMETRICS
-  printf(" Encoding Time (Total Time): %12.3f ( %12.3f ) sec. [user] %12.3f ( %12.3f ) sec. [elapsed]\n",
-         ((endClock - startClock) * 1.0 / CLOCKS_PER_SEC) - (metricTimeuser/1000.0),
-         (endClock - startClock) * 1.0 / CLOCKS_PER_SEC,
-         encTime / 1000.0,
-         totalTime / 1000.0);
-#else
-  printf(" Total Time: %12.3f sec. [user] %12.3f sec. [elapsed]\n",
-         (endClock - startClock) * 1.0 / CLOCKS_PER_SEC,
-         encTime / 1000.0);
-#endif
-
     for(i = 0; i < argc; i++)
         free(argv[i]);
-    unlink(s->infilename);
 
-    /* read output bitstream */
-    f = fopen(s->outfilename, "rb");
-    if (!f) {
-        fprintf(stderr, "Could not open '%s'\n", s->outfilename);
-        return -1;
-    }
-
-    fseek(f, 0, SEEK_END);
-    out_buf_len = ftell(f);
-    fseek(f, 0, SEEK_SET);
-    out_buf = (uint8_t *)malloc(out_buf_len);
-    if (fread(out_buf, 1, out_buf_len, f) != out_buf_len) {
-        fprintf(stderr, "read error\n");
-        fclose(f);
-        free(out_buf);
-        return -1;
+    if (out_buf_len < 0) {
+        hevc_file_io_close(s->io, pbuf);
+        free(*pbuf);
+        *pbuf = NULL;
+    } else {
+        out_buf_len = hevc_file_io_close(s->io, pbuf);
     }
-    fclose(f);
-    unlink(s->outfilename);
-    *pbuf = out_buf;
     free(s);
     return out_buf_len;
 }
@@ -938,4 +998,5 @@ HEVCEncoder jvetvvc_encoder = {
   .open = jvetvvc_open,
   .encode = jvetvvc_encode,
   .close = jvetvvc_close,
+  .vvc = 1,
 };
@@ -56,6 +56,7 @@ THE POSSIBILITY OF SUCH DAMAGE.
 #include <assert.h>
 #include <cinttypes>
 #include "math.h"
+#include <mutex>
 
 //! \ingroup EncoderLib
 //! \{
@@ -76,6 +77,10 @@ private:
   double    m_dFrmRate; //--CFG_KDY
   double    m_MSEyuvframe[MAX_NUM_COMP]; // sum of MSEs
 
+  // the analyzers are globals shared by all the encoder instances of the
+  // process and updated from their worker threads
+  static std::mutex& getMutex() { static std::mutex m; return m; }
+
 public:
   virtual ~Analyze()  {}
   Analyze() { clear(); }
@@ -84,6 +89,7 @@ public:
     , bool isEncodeLtRef
   )
   {
+    std::lock_guard<std::mutex> lock( getMutex() );
     m_dAddBits  += bits;
     if (isEncodeLtRef)
       return;
@@ -97,12 +103,13 @@ public:
   }
   double  getPsnr(ComponentID compID) const { return  m_dPSNRSum[compID];  }
   double  getBits()                   const { return  m_dAddBits;   }
-  void    setBits(double numBits)     { m_dAddBits = numBits; }
+  void    setBits(double numBits)     { std::lock_guard<std::mutex> lock( getMutex() ); m_dAddBits = numBits; }
   uint32_t    getNumPic()                 const { return  m_uiNumPic;   }
 
   void    setFrmRate  (double dFrameRate) { m_dFrmRate = dFrameRate; } //--CFG_KDY
   void    clear()
   {
+    std::lock_guard<std::mutex> lock( getMutex() );
     m_dAddBits = 0;
     for(uint32_t i=0; i<MAX_NUM_COMP; i++)
     {
@@ -150,6 +157,7 @@ public:
 
   void    printOut ( char cDelim, const ChromaFormat chFmt, const bool printMSEBasedSNR, const bool printSequenceMSE, const bool printHexPsnr, const BitDepths &bitDepths )
   {
+    std::lock_guard<std::mutex> lock( getMutex() );
     vvencMsgLevel e_msg_level = cDelim == 'a' ? VVENC_INFO: VVENC_DETAILS;
     double dFps     =   m_dFrmRate; //--CFG_KDY
     double dScale   = dFps / 1000 / (double)m_uiNumPic;
@@ -414,6 +422,7 @@ public:
 
   void    printSummary(const ChromaFormat chFmt, const bool printSequenceMSE, const bool printHexPsnr, const BitDepths &bitDepths, const std::string &sFilename)
   {
+    std::lock_guard<std::mutex> lock( getMutex() );
     FILE* pFile = fopen (sFilename.c_str(), "at");
 
     double dFps     =   m_dFrmRate; //--CFG_KDY
@@ -2,32 +2,22 @@
     \brief    Encoder application main
 */
 
-#include <ctime>
 #include <iostream>
-#include <unistd.h>
-#include <chrono>
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string>
-#include <fstream>
 #include <cstring>
-#include <algorithm>
 #include <cstdarg>
 
 #include "vvenc/version.h"
 #include "vvenc/vvenc.h"
 
-#include "apputils/ParseArg.h"
-#include "apputils/YuvFileIO.h"
-#include "apputils/VVEncAppCfg.h"
 #include "EncoderLib/Analyze.h"
 
 extern "C" {
 #include "bpgenc.h"
 }
-#ifdef _WIN32
-#include <windows.h>
-#endif
 
 vvencMsgLevel g_verbosity = VVENC_VERBOSE;
 
@@ -64,569 +54,299 @@ void printVVEncErrorMsg( const std::string cAppname, const std::string cMessage,
   std::cout << std::endl;
 }
 
-bool parseCfg( int argc, char* argv[], apputils::VVEncAppCfg& rcVVEncAppCfg )
-{
-  try
-  {
-    if( ! rcVVEncAppCfg.parseCfg( argc, argv ) )
-    {
-      return false;
-    }
-  }
-  catch( apputils::df::program_options_lite::ParseFailure &e )
-  {
-    msgApp( nullptr, VVENC_ERROR, "Error parsing option \"%s\" with argument \"%s\".\n", e.arg.c_str(), e.val.c_str() );
-    return false;
-  }
-  g_verbosity = rcVVEncAppCfg.m_verbosity;
-
-  return true;
-}
-
 struct HEVCEncoderContext {
     HEVCEncodeParams params;
-    char infilename[1024];
-    char outfilename[1024];
-    FILE *yuv_file;
+    vvencEncoder *enc;
+    vvenc_config cfg;
+    vvencAccessUnit AU;
+    vvencYUVBuffer yuv;
+    uint8_t *buf;
+    int buf_len, buf_size;
     int frame_count;
 };
 
-#define ARGV_MAX 256
+/* return < 0 if error */
+static int add_nal(HEVCEncoderContext *s, const uint8_t *data, int data_len)
+{
+    int new_size, size;
+    uint8_t *new_buf;
+
+    size = s->buf_len + data_len;
+    if (size > s->buf_size) {
+        new_size = (s->buf_size * 3) / 2;
+        if (new_size < size)
+            new_size = size;
+        new_buf = (uint8_t *)realloc(s->buf, new_size);
+        if (!new_buf)
+            return -1;
+        s->buf = new_buf;
+        s->buf_size = new_size;
+    }
+    memcpy(s->buf + s->buf_len, data, data_len);
+    s->buf_len += data_len;
+    return 0;
+}
 
-static void add_opt(int *pargc, char **argv,
-                    const char *str)
+static void jvetvvenc_free(HEVCEncoderContext *s)
 {
-    int argc;
-    argc = *pargc;
-    if (argc >= ARGV_MAX)
-        abort();
-    argv[argc++] = strdup(str);
-    *pargc = argc;
+    if (s->enc)
+        vvenc_encoder_close(s->enc);
+    vvenc_YUVBuffer_free_buffer(&s->yuv);
+    vvenc_accessUnit_free_payload(&s->AU);
+    free(s->buf);
+    free(s);
 }
 
 static HEVCEncoderContext *jvetvvenc_open(const HEVCEncodeParams *params)
 {
     HEVCEncoderContext *s;
-    char buf[1024];
-    static int tmp_idx = 1;
+    vvenc_config *c;
+    vvencPresetMode preset;
+    vvencChromaFormat chroma_format;
+    int ret;
 
     s = (HEVCEncoderContext *)malloc(sizeof(HEVCEncoderContext));
+    if (!s)
+        return NULL;
     memset(s, 0, sizeof(*s));
 
     s->params = *params;
-#ifdef _WIN32
-    if (GetTempPath(sizeof(buf), buf) > sizeof(buf) - 1) {
-        fprintf(stderr, "Temporary path too long\n");
-        free(s);
-        return NULL;
-    }
-#else
-    strcpy(buf, "/tmp/");
-#endif
-    snprintf(s->infilename, sizeof(s->infilename), "%sout%d-%d.yuv", buf, getpid(), tmp_idx);
-    snprintf(s->outfilename, sizeof(s->outfilename), "%sout%d-%d.bin", buf, getpid(), tmp_idx);
-    tmp_idx++;
-
-    s->yuv_file = fopen(s->infilename, "wb");
-    if (!s->yuv_file) {
-        fprintf(stderr, "Could not open '%s'\n", s->infilename);
-        free(s);
-        return NULL;
-    }
-    return s;
-}
-
-static int jvetvvenc_encode(HEVCEncoderContext *s, Image *img)
-{
-    save_yuv1(img, s->yuv_file);
-    s->frame_count++;
-    return 0;
-}
-
-/* return the encoded data in *pbuf and the size. Return < 0 if error */
-static int jvetvvenc_close(HEVCEncoderContext *s, uint8_t **pbuf)
-{
-    //    BPGImageFormatEnum *preferred_chroma_format;
-    int argc;
-    char *argv[ARGV_MAX + 1];
-    char buf[1024];
-    const char *str;
-    FILE *f;
-    uint8_t *out_buf;
-    int out_buf_len, i;
-
-    fclose(s->yuv_file);
-    s->yuv_file = NULL;
-
-    vvenc::m_AnalyzeAll.clear();
-    vvenc::m_AnalyzeI.clear();
-    vvenc::m_AnalyzeP.clear();
-    vvenc::m_AnalyzeB.clear();
-    //vvenc::EncGOP::m_AnalyzeAll_in.clear();
-
-    argc = 0;
-    add_opt(&argc, argv, "jvetvvenc"); /* dummy executable name */
-
-///////////////////////////////////////////////////////////////////////////////////
-
-    snprintf(buf, sizeof(buf),"--input=%s", s->infilename);
-    add_opt(&argc, argv, buf);
-    snprintf(buf, sizeof(buf),"--size=%dx%d", s->params.width, s->params.height);
-    add_opt(&argc, argv, buf);
-
-    snprintf(buf, sizeof(buf),"--framerate=%d", 8 * s->params.frame_rate);
-    add_opt(&argc, argv, buf);
-    snprintf(buf, sizeof(buf),"--internal-bitdepth=%d", s->params.bit_depth);
-    add_opt(&argc, argv, buf);
+    vvenc_accessUnit_default(&s->AU);
+    vvenc_YUVBuffer_default(&s->yuv);
 
-    snprintf(buf, sizeof(buf),"--decodedpicturehash=%d",
-             s->params.sei_decoded_picture_hash);
-
-    switch(s->params.chroma_format) {
+    switch(params->chroma_format) {
     case BPG_FORMAT_GRAY:
-        str = "400";
+        chroma_format = VVENC_CHROMA_400;
         break;
     case BPG_FORMAT_420:
-        str = "420";
+        chroma_format = VVENC_CHROMA_420;
         break;
     case BPG_FORMAT_422:
-        str = "422";
+        chroma_format = VVENC_CHROMA_422;
         break;
     case BPG_FORMAT_444:
-        str = "444";
-        break;
-    default:
-        abort();
-    }
-
-    if (s->params.bit_depth == 8)
-    {
-      if (s->params.chroma_format == BPG_FORMAT_GRAY)
-      {
-        add_opt(&argc, argv, "--format=yuv400");
-      }
-      if (s->params.chroma_format == BPG_FORMAT_420)
-      {
-        add_opt(&argc, argv, "--format=yuv420");
-      }
-      if (s->params.chroma_format == BPG_FORMAT_422)
-      {
-        add_opt(&argc, argv, "--format=yuv422");
-      }
-      if (s->params.chroma_format == BPG_FORMAT_444)
-      {
-        add_opt(&argc, argv, "--format=yuv444");
-      }
-    }
-    if (s->params.bit_depth == 10)
-    {
-      if (s->params.chroma_format == BPG_FORMAT_GRAY)
-      {
-        add_opt(&argc, argv, "--format=yuv400_10");
-      }
-      if (s->params.chroma_format == BPG_FORMAT_420)
-      {
-        add_opt(&argc, argv, "--format=yuv420_10");
-      }
-      if (s->params.chroma_format == BPG_FORMAT_422)
-      {
-        add_opt(&argc, argv, "--format=yuv422_10");
-      }
-      if (s->params.chroma_format == BPG_FORMAT_444)
-      {
-        add_opt(&argc, argv, "--format=yuv444_10");
-      }
-    }
-
-    switch(s->params.color_space) {
-    case BPG_CS_YCbCr:
-        str = "ycbcr";
-        break;
-    case BPG_CS_RGB:
-        str = "rgb";
-        break;
-    case BPG_CS_YCgCo:
-        str = "ycgco";
-        break;
-    case BPG_CS_YCbCr_BT709:
-        str = "ycbcr_bt709";
-        break;
-    case BPG_CS_YCbCr_BT2020:
-        str = "ycbcr_bt2020";
+        chroma_format = VVENC_CHROMA_444;
         break;
     default:
         abort();
     }
 
-    if (s->params.color_space == BPG_CS_YCbCr) {
-      add_opt(&argc, argv, "--hdr=off");
-    }
-    if (s->params.color_space == BPG_CS_YCbCr_BT709) {
-      add_opt(&argc, argv, "--hdr=off");
-    }
-    if (s->params.color_space == BPG_CS_YCbCr_BT2020) {
-      add_opt(&argc, argv, "--hdr=hlg_2020");
-    }
-
-    if (s->params.compress_level == 8 || s->params.compress_level == 9) {
-      add_opt(&argc, argv, "--preset=slower");
-    }
-    if (s->params.compress_level == 6 || s->params.compress_level == 7) {
-      add_opt(&argc, argv, "--preset=slow");
-    }
-    if (s->params.compress_level == 4 || s->params.compress_level == 5) {
-      add_opt(&argc, argv, "--preset=medium");
-    }
-    if (s->params.compress_level == 2 || s->params.compress_level == 3) {
-      add_opt(&argc, argv, "--preset=fast");
-    }
-    if (s->params.compress_level == 0 || s->params.compress_level == 1) {
-      add_opt(&argc, argv, "--preset=faster");
-    }
-
-    if (s->params.lossless)
-    {
-      add_opt(&argc, argv, "--CostMode=lossless");
-      add_opt(&argc, argv, "--qp=0");
-      add_opt(&argc, argv, "--ChromaTS=1");
-      add_opt(&argc, argv, "--DepQuant=0");
-      add_opt(&argc, argv, "--RDOQ=0");
-      add_opt(&argc, argv, "--RDOQTS=0");
-      add_opt(&argc, argv, "--SBT=0");
-      add_opt(&argc, argv, "--ISP=0");
-      add_opt(&argc, argv, "--MTS=0");
-      add_opt(&argc, argv, "--LFNST=0");
-      add_opt(&argc, argv, "--JointCbCr=0");
-      add_opt(&argc, argv, "--LoopFilterDisable=1");
-      add_opt(&argc, argv, "--SAO=0");
-      add_opt(&argc, argv, "--ALF=0");
-      add_opt(&argc, argv, "--CCALF=0");
-      add_opt(&argc, argv, "--DMVR=0");
-      add_opt(&argc, argv, "--BIO=0");
-      add_opt(&argc, argv, "--PROF=0");
-      add_opt(&argc, argv, "--EDO=0");
-      //add_opt(&argc, argv, "--TSRCdisableLL=1");
-    }
+    if (params->compress_level >= 8)
+        preset = VVENC_SLOWER;
+    else if (params->compress_level >= 6)
+        preset = VVENC_SLOW;
+    else if (params->compress_level >= 4)
+        preset = VVENC_MEDIUM;
+    else if (params->compress_level >= 2)
+        preset = VVENC_FAST;
     else
-    {
-      add_opt(&argc, argv, "--CostMode=lossy");
-      snprintf(buf, sizeof(buf),"--qp=%d", s->params.qp);
-      add_opt(&argc, argv, buf);
-        add_opt(&argc, argv, "--ChromaTS=1");
-        add_opt(&argc, argv, "--DepQuant=1");
-        add_opt(&argc, argv, "--RDOQ=1");
-        add_opt(&argc, argv, "--RDOQTS=1");
-        add_opt(&argc, argv, "--SBT=1");
-        add_opt(&argc, argv, "--ISP=1");
-        add_opt(&argc, argv, "--MTS=1");
-        //add_opt(&argc, argv, "--MTSIntraMaxCand=4");
-        //add_opt(&argc, argv, "--MTSInterMaxCand=4");
-        add_opt(&argc, argv, "--LFNST=1");
-        add_opt(&argc, argv, "--JointCbCr=1");
-        add_opt(&argc, argv, "--LoopFilterDisable=0");
-        add_opt(&argc, argv, "--SAO=1");
-        add_opt(&argc, argv, "--ALF=1");
-        add_opt(&argc, argv, "--PROF=1");
-        //add_opt(&argc, argv, "--DualITree=1");
-    }
-
-    add_opt(&argc, argv, "--Log2MaxTbSize=5");
-    add_opt(&argc, argv, "--verbosity=6");
-    add_opt(&argc, argv, "--frames=1");
-    add_opt(&argc, argv, "--threads=4");
-    add_opt(&argc, argv, "--gopsize=1");
-    add_opt(&argc, argv, "--intraperiod=1");
-    add_opt(&argc, argv, "--profile=auto");
-    add_opt(&argc, argv, "--level=6.3");
-    add_opt(&argc, argv, "--tier=main");
-    add_opt(&argc, argv, "--accessunitdelimiter=0");
-    add_opt(&argc, argv, "--vuiparameterspresent=1");
-    add_opt(&argc, argv, "--hrdparameterspresent=0");
-    add_opt(&argc, argv, "--output=image.vvc");
-
-  std::string cAppname = argv[0];
-  std::size_t iPos = (int)cAppname.find_last_of("/");
-  if( std::string::npos != iPos )
-  {
-    cAppname = cAppname.substr(iPos+1 );
-  }
-
-  int iRet = 0;
-
-  vvenc_set_logging_callback( nullptr, msgFnc );
-
-  std::string cInputFile;
-  std::string cOutputfile = "";
-
-  apputils::VVEncAppCfg vvencappCfg;                           ///< encoder configuration
-  vvenc_init_default( &vvencappCfg, 1920, 1080, 60, 0, 32, vvencPresetMode::VVENC_MEDIUM );
-
-  // parse configuration
-  if ( ! parseCfg( argc, argv, vvencappCfg ) )
-  {
-    return 1;
-  }
-  // assign verbosity used for encoder output
-  g_verbosity = vvencappCfg.m_verbosity;
-
-  if( vvencappCfg.m_showVersion )
-  {
-    std::cout << cAppname  << " version " << vvenc_get_version()<< std::endl;
-    return 0;
-  }
-
-  if( !strcmp( vvencappCfg.m_inputFileName.c_str(), "-" )  )
-  {
-    if( vvencappCfg.m_RCNumPasses > 1 )
-    {
-      std::cout << cAppname << " [error]: 2 pass rate control and reading from stdin is not supported yet" << std::endl;
-      return -1;
-    }
+        preset = VVENC_FASTER;
+
+    g_verbosity = params->verbose ? VVENC_DETAILS : VVENC_WARNING;
+    vvenc_set_logging_callback(nullptr, msgFnc);
+
+    c = &s->cfg;
+    vvenc_init_default(c, params->width, params->height,
+                       8 * params->frame_rate, 0, params->qp, preset);
+    c->m_verbosity = g_verbosity;
+    c->m_inputFileChromaFormat = chroma_format;
+    c->m_internChromaFormat = chroma_format;
+    /* the samples are given at the coding bit depth */
+    c->m_inputBitDepth[0] = params->bit_depth;
+    c->m_MSBExtendedBitDepth[0] = params->bit_depth;
+    c->m_internalBitDepth[0] = params->bit_depth;
+
+    if (params->color_space == BPG_CS_YCbCr_BT2020)
+        c->m_HdrMode = VVENC_HDR_HLG_BT2020;
     else
-    {
-      std::cout << cAppname << " trying to read from stdin" << std::endl;
+        c->m_HdrMode = VVENC_HDR_OFF;
+
+    if (params->lossless) {
+        c->m_costMode = VVENC_COST_LOSSLESS_CODING;
+        c->m_QP = 0;
+        c->m_useChromaTS = 1;
+        c->m_DepQuantEnabled = 0;
+        c->m_RDOQ = 0;
+        c->m_useRDOQTS = 0;
+        c->m_SBT = 0;
+        c->m_ISP = 0;
+        c->m_MTS = 0;
+        c->m_LFNST = 0;
+        c->m_JointCbCrMode = 0;
+        c->m_bLoopFilterDisable = 1;
+        c->m_bUseSAO = 0;
+        c->m_alf = 0;
+        c->m_ccalf = 0;
+        c->m_DMVR = 0;
+        c->m_BDOF = 0;
+        c->m_PROF = 0;
+        c->m_EDO = 0;
+    } else {
+        c->m_costMode = VVENC_COST_STANDARD_LOSSY;
+        c->m_QP = params->qp;
+        c->m_useChromaTS = 1;
+        c->m_DepQuantEnabled = 1;
+        c->m_RDOQ = 1;
+        c->m_useRDOQTS = 1;
+        c->m_SBT = 1;
+        c->m_ISP = 1;
+        c->m_MTS = 1;
+        c->m_LFNST = 1;
+        c->m_JointCbCrMode = 1;
+        c->m_bLoopFilterDisable = 0;
+        c->m_bUseSAO = 1;
+        c->m_alf = 1;
+        c->m_PROF = 1;
     }
-  }
-
-  if( vvencappCfg.m_bitstreamFileName.empty() )
-  {
-    std::cout << cAppname  << " [error]: no output bitstream file given." << std::endl;
-    return -1;
-  }
-
-  cInputFile  = vvencappCfg.m_inputFileName;
-  cOutputfile = vvencappCfg.m_bitstreamFileName;
-
-  if( vvencappCfg.m_verbosity > VVENC_SILENT && vvencappCfg.m_verbosity < VVENC_NOTICE )
-  {
-    std::cout << "-------------------" << std::endl;
-    std::cout << cAppname  << " version " << vvenc_get_version() << std::endl;
-  }
 
-  vvencEncoder *enc = vvenc_encoder_create();
-  if( nullptr == enc )
-  {
-    return -1;
-  }
-
-  // initialize the encoder
-  iRet = vvenc_encoder_open( enc, &vvencappCfg );
-  if( 0 != iRet )
-  {
-    printVVEncErrorMsg( cAppname, "cannot create encoder", iRet, vvenc_get_last_error( enc ) );
-    vvenc_encoder_close( enc );
-    return iRet;
-  }
-
-  if( vvencappCfg.m_verbosity > VVENC_WARNING )
-  {
-    std::cout << cAppname << ": " << vvenc_get_enc_information( enc ) << std::endl;
-  }
-
-  vvenc_get_config( enc, &vvencappCfg ); // get the adapted config, because changes are needed for the yuv reader (m_MSBExtendedBitDepth)
+    c->m_log2MaxTbSize = 5;
+    c->m_framesToBeEncoded = 1;
+    c->m_numThreads = params->threads > 0 ? params->threads : 4;
+    if (params->frame_threads > 0)
+        c->m_maxParallelFrames = params->frame_threads;
+    if (params->wpp >= 0)
+        c->m_entropyCodingSyncEnabled = params->wpp;
+    /* Note: this vvenc version has no tile configuration */
+    if (params->tile_cols > 1 || params->tile_rows > 1)
+        fprintf(stderr, "vvenc does not support tiles, ignored.\n");
+    c->m_GOPSize = 1;
+    c->m_IntraPeriod = 1;
+    c->m_RCNumPasses = 1;
+    c->m_profile = VVENC_PROFILE_AUTO;
+    c->m_level = VVENC_LEVEL6_3;
+    c->m_levelTier = VVENC_TIER_MAIN;
+    c->m_AccessUnitDelimiter = 0;
+    c->m_vuiParametersPresent = 1;
+    c->m_hrdParametersPresent = 0;
+    c->m_decodedPictureHashSEIType = params->sei_decoded_picture_hash ?
+        VVENC_HASHTYPE_MD5 : VVENC_HASHTYPE_NONE;
+
+    /* the statistics are shared by all the vvenc encoders of the
+       process (only the verbose summary is affected) */
+    vvenc::m_AnalyzeAll.clear();
+    vvenc::m_AnalyzeI.clear();
+    vvenc::m_AnalyzeP.clear();
+    vvenc::m_AnalyzeB.clear();
 
-  if( vvencappCfg.m_verbosity >= VVENC_INFO )
-  {
-    std::cout << vvencappCfg.getConfigAsString( vvencappCfg.m_verbosity ) << std::endl;
-  }
+    s->enc = vvenc_encoder_create();
+    if (!s->enc)
+        goto fail;
 
-  // open output file
-  std::ofstream cOutBitstream;
-  if( !cOutputfile.empty() )
-  {
-    cOutBitstream.open( cOutputfile.c_str(), std::ios::out | std::ios::binary | std::ios::trunc);
-    if( !cOutBitstream.is_open() )
-    {
-      std::cout << cAppname  << " [error]: failed to open output file " << cOutputfile << std::endl;
-      return -1;
+    ret = vvenc_encoder_open(s->enc, c);
+    if (ret != 0) {
+        printVVEncErrorMsg("jvetvvenc", "cannot create encoder", ret,
+                           vvenc_get_last_error(s->enc));
+        goto fail;
+    }
+    /* get the adapted config */
+    vvenc_get_config(s->enc, c);
+
+    ret = vvenc_init_pass(s->enc, 0);
+    if (ret != 0) {
+        printVVEncErrorMsg("jvetvvenc", "cannot init encoder", ret,
+                           vvenc_get_last_error(s->enc));
+        goto fail;
     }
-  }
-
-  // --- allocate memory for output packets
-  vvencAccessUnit AU;
-  vvenc_accessUnit_default( &AU );
-  vvenc_accessUnit_alloc_payload( &AU, vvencappCfg.m_SourceWidth * vvencappCfg.m_SourceHeight );
-
-  // --- allocate memory for YUV input picture
-  vvencYUVBuffer cYUVInputBuffer;
-  vvenc_YUVBuffer_default( &cYUVInputBuffer );
-  vvenc_YUVBuffer_alloc_buffer( &cYUVInputBuffer, vvencappCfg.m_internChromaFormat, vvencappCfg.m_SourceWidth, vvencappCfg.m_SourceHeight );
-
-  // --- start timer
-  std::chrono::steady_clock::time_point cTPStartRun = std::chrono::steady_clock::now();
-  if( vvencappCfg.m_verbosity > VVENC_WARNING )
-  {
-    std::time_t startTime2 = std::chrono::system_clock::to_time_t(std::chrono::system_clock::now());
-    std::cout  << "started @ " << std::ctime(&startTime2)  << std::endl;
-  }
-
-  // calc temp. rate/scale
-  int temporalRate   = vvencappCfg.m_FrameRate;
-  int temporalScale  = 1;
 
-  switch( vvencappCfg.m_FrameRate )
-  {
-  case 23: temporalRate = 24000; temporalScale = 1001; break;
-  case 29: temporalRate = 30000; temporalScale = 1001; break;
-  case 59: temporalRate = 60000; temporalScale = 1001; break;
-  default: break;
-  }
+    vvenc_accessUnit_alloc_payload(&s->AU,
+                                   c->m_SourceWidth * c->m_SourceHeight);
+    vvenc_YUVBuffer_alloc_buffer(&s->yuv, c->m_internChromaFormat,
+                                 c->m_SourceWidth, c->m_SourceHeight);
+    return s;
+ fail:
+    jvetvvenc_free(s);
+    return NULL;
+}
 
-  unsigned int uiFrames = 0;
-  for( int pass = 0; pass < vvencappCfg.m_RCNumPasses; pass++ )
-  {
-    // initialize the encoder pass
-    iRet = vvenc_init_pass( enc, pass );
-    if( 0 != iRet )
-    {
-      printVVEncErrorMsg( cAppname, "cannot init encoder", iRet, vvenc_get_last_error( enc ) );
-      return iRet;
-    }
+static int jvetvvenc_encode(HEVCEncoderContext *s, Image *img)
+{
+    vvencYUVPlane *p;
+    int c_count, i, x, y, ret;
+    bool done;
 
-    // open the input file
-    apputils::YuvFileIO cYuvFileInput;
-    if( 0 != cYuvFileInput.open( cInputFile, false, vvencappCfg.m_inputBitDepth[0], vvencappCfg.m_MSBExtendedBitDepth[0], vvencappCfg.m_internalBitDepth[0],
-                                 vvencappCfg.m_inputFileChromaFormat, vvencappCfg.m_internChromaFormat, vvencappCfg.m_bClipOutputVideoToRec709Range, false ) )
-    {
-      std::cout << cAppname  << " [error]: failed to open input file " << cInputFile << std::endl;
-      return -1;
+    if (img->format == BPG_FORMAT_GRAY)
+        c_count = 1;
+    else
+        c_count = 3;
+    for(i = 0; i < c_count; i++) {
+        p = &s->yuv.planes[i];
+        for(y = 0; y < p->height; y++) {
+            int16_t *d = p->ptr + y * p->stride;
+            if (img->pixel_shift) {
+                const uint16_t *src = (const uint16_t *)
+                    (img->data[i] + (size_t)y * img->linesize[i]);
+                for(x = 0; x < p->width; x++)
+                    d[x] = src[x];
+            } else {
+                const uint8_t *src = img->data[i] + (size_t)y * img->linesize[i];
+                for(x = 0; x < p->width; x++)
+                    d[x] = src[x];
+            }
+        }
     }
 
-    const int iFrameSkip  = std::max( vvencappCfg.m_FrameSkip - vvenc_get_num_lead_frames(enc), 0 );
-    const int64_t iMaxFrames  = vvencappCfg.m_framesToBeEncoded + vvenc_get_num_lead_frames(enc) + vvenc_get_num_trail_frames(enc);
-    int64_t       iSeqNumber  = 0;
-    bool          bEof        = false;
-    bool          bEncodeDone = false;
-
-    uiFrames    = 0;
+    s->yuv.sequenceNumber = s->frame_count;
+    s->yuv.cts = (int64_t)s->frame_count * s->cfg.m_TicksPerSecond /
+        s->cfg.m_FrameRate;
+    s->yuv.ctsValid = true;
+    s->frame_count++;
 
-    if( iFrameSkip )
-    {
-      cYuvFileInput.skipYuvFrames(iFrameSkip, vvencappCfg.m_SourceWidth, vvencappCfg.m_SourceHeight);
-      iSeqNumber=iFrameSkip;
+    done = false;
+    ret = vvenc_encode(s->enc, &s->yuv, &s->AU, &done);
+    if (ret != 0) {
+        printVVEncErrorMsg("jvetvvenc", "encoding failed", ret,
+                           vvenc_get_last_error(s->enc));
+        return -1;
     }
+    if (s->AU.payloadUsedSize > 0 &&
+        add_nal(s, s->AU.payload, s->AU.payloadUsedSize) < 0)
+        return -1;
+    return 0;
+}
 
-    while( !bEof || !bEncodeDone )
-    {
-      vvencYUVBuffer* ptrYUVInputBuffer = nullptr;
-      if( !bEof )
-      {
-        if( 0 != cYuvFileInput.readYuvBuf( cYUVInputBuffer, bEof ) )
-        {
-          std::cout << " [error]: read file failed: " << cYuvFileInput.getLastError() << std::endl;
-          return -1;
-        }
-        if( ! bEof )
-        {
-          // set sequence number and cts
-          cYUVInputBuffer.sequenceNumber  = iSeqNumber;
-          cYUVInputBuffer.cts             = iSeqNumber * vvencappCfg.m_TicksPerSecond * temporalScale / temporalRate;
-          cYUVInputBuffer.ctsValid        = true;
-          ptrYUVInputBuffer               = &cYUVInputBuffer;
-          iSeqNumber++;
-          //std::cout << "process picture " << cYUVInputBuffer.m_uiSequenceNumber << " cts " << cYUVInputBuffer.m_uiCts << std::endl;
-        }
-        else if( vvencappCfg.m_verbosity > VVENC_ERROR && vvencappCfg.m_verbosity < VVENC_NOTICE )
-        {
-          std::cout << "EOF reached" << std::endl;
+/* return the encoded data in *pbuf and the size. Return < 0 if error */
+static int jvetvvenc_close(HEVCEncoderContext *s, uint8_t **pbuf)
+{
+    int buf_len, ret;
+    bool done;
+
+    /* flush the last compressed pictures */
+    done = false;
+    while (!done) {
+        ret = vvenc_encode(s->enc, nullptr, &s->AU, &done);
+        if (ret != 0) {
+            printVVEncErrorMsg("jvetvvenc", "encoding failed", ret,
+                               vvenc_get_last_error(s->enc));
+            jvetvvenc_free(s);
+            return -1;
         }
-      }
-
-      // call encode
-      iRet = vvenc_encode( enc, ptrYUVInputBuffer, &AU, &bEncodeDone );
-      if( 0 != iRet )
-      {
-        printVVEncErrorMsg( cAppname, "encoding failed", iRet, vvenc_get_last_error( enc ) );
-        return iRet;
-      }
-
-      if( AU.payloadUsedSize > 0 )
-      {
-        if( cOutBitstream.is_open() )
-        {
-          // write output
-          cOutBitstream.write( (const char*)AU.payload, AU.payloadUsedSize );
+        if (s->AU.payloadUsedSize > 0 &&
+            add_nal(s, s->AU.payload, s->AU.payloadUsedSize) < 0) {
+            jvetvvenc_free(s);
+            return -1;
         }
-        uiFrames++;
-      }
-
-      if( iMaxFrames > 0 && iSeqNumber >= ( iFrameSkip + iMaxFrames ) )
-      {
-        bEof = true;
-      }
-    }
-
-    cYuvFileInput.close();
-  }
-
-  std::chrono::steady_clock::time_point cTPEndRun = std::chrono::steady_clock::now();
-  double dTimeSec = (double)std::chrono::duration_cast<std::chrono::milliseconds>((cTPEndRun)-(cTPStartRun)).count() / 1000;
-
-  if( cOutBitstream.is_open() )
-  {
-    cOutBitstream.close();
-  }
-
-  vvenc_print_summary(enc);
-
-  // un-initialize the encoder
-  iRet = vvenc_encoder_close( enc );
-  if( 0 != iRet )
-  {
-    printVVEncErrorMsg( cAppname, "destroy encoder failed", iRet, vvenc_get_last_error( enc ) );
-    return iRet;
-  }
-
-  vvenc_YUVBuffer_free_buffer( &cYUVInputBuffer );
-  vvenc_accessUnit_free_payload( &AU );
-
-  if( 0 == uiFrames )
-  {
-    std::cout << "no frames encoded" << std::endl;
-  }
-
-  if( uiFrames && vvencappCfg.m_verbosity > VVENC_SILENT )
-  {
-    if( vvencappCfg.m_verbosity > VVENC_WARNING )
-    {
-      std::time_t endTime2 = std::chrono::system_clock::to_time_t(std::chrono::system_clock::now());
-      std::cout  << "finished @ " << std::ctime(&endTime2)  << std::endl;
     }
 
-    double dFps = (double)uiFrames / dTimeSec;
-    std::cout << "Total Time: " << dTimeSec << " sec. Fps(avg): " << dFps << " encoded Frames " << uiFrames << std::endl;
-  }
-
-    for(i = 0; i < argc; i++)
-        free(argv[i]);
-    unlink(s->infilename);
+    if (s->params.verbose)
+        vvenc_print_summary(s->enc);
 
-    /* read output bitstream */
-    f = fopen(s->outfilename, "rb");
-    if (!f) {
-        fprintf(stderr, "Could not open '%s'\n", s->outfilename);
-        return -1;
+    if (s->buf_len > 0 && s->buf_len < s->buf_size) {
+        uint8_t *new_buf;
+        /* if shrinking fails, the larger buffer is kept */
+        new_buf = (uint8_t *)realloc(s->buf, s->buf_len);
+        if (new_buf)
+            s->buf = new_buf;
     }
-
-    fseek(f, 0, SEEK_END);
-    out_buf_len = ftell(f);
-    fseek(f, 0, SEEK_SET);
-    out_buf = (uint8_t *)malloc(out_buf_len);
-    if (fread(out_buf, 1, out_buf_len, f) != out_buf_len) {
-        fprintf(stderr, "read error\n");
-        fclose(f);
-        free(out_buf);
-        return -1;
-    }
-    fclose(f);
-    unlink(s->outfilename);
-    *pbuf = out_buf;
-    free(s);
-    return out_buf_len;
+    *pbuf = s->buf;
+    buf_len = s->buf_len;
+    s->buf = NULL;
+    jvetvvenc_free(s);
+    return buf_len;
 }
 
 HEVCEncoder jvetvvenc_encoder = {
   .open = jvetvvenc_open,
   .encode = jvetvvenc_encode,
   .close = jvetvvenc_close,
+  .vvc = 1,
 };
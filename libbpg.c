@@ -22,6 +22,7 @@
  * THE SOFTWARE.
  */
 #include <math.h>
+#include <limits.h>
 #ifdef EMSCRIPTEN
 #include <emscripten.h>
 #endif
@@ -33,6 +34,7 @@
 /* The following global defines are used:
    - USE_VAR_BIT_DEPTH : support of bit depth > 8 bits
    - USE_PRED : support of animations 
+   - USE_STATS : collect decoding statistics (see bpg_decoder_get_stats())
 */
    
 #ifndef EMSCRIPTEN
@@ -47,6 +49,29 @@
 #include <assert.h>
 #include "libbpg.h"
 
+#ifdef USE_STATS
+#include <time.h>
+
+static int64_t get_time_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+#define STATS_TIME_DECL(t) int64_t t
+#define STATS_TIME_START(t) (t) = get_time_ns()
+#define STATS_TIME_ADD(s, field, t) (s)->stats.field += get_time_ns() - (t)
+#define STATS_ADD(s, field, v) (s)->stats.field += (v)
+#define STATS_MAX(s, field, v) do { if ((v) > (s)->stats.field) (s)->stats.field = (v); } while (0)
+#else
+#define STATS_TIME_DECL(t)
+#define STATS_TIME_START(t)
+#define STATS_TIME_ADD(s, field, t)
+#define STATS_ADD(s, field, v)
+#define STATS_MAX(s, field, v)
+#endif
+
 #define BPG_HEADER_MAGIC 0x425047fb
 
 #define ITAPS2 4 
@@ -58,7 +83,9 @@ typedef uint16_t PIXEL;
 typedef uint8_t PIXEL;
 #endif
 
-#define MAX_DATA_SIZE ((1 << 30) - 1)
+/* maximum image width. It ensures that the line sizes of all the
+   planes and output formats fit in an int */
+#define MAX_IMAGE_WIDTH ((1 << 28) - 1)
 
 typedef struct {
     int c_shift;
@@ -101,8 +128,8 @@ struct BPGDecoderContext {
     uint16_t frame_delay_num;
     uint16_t frame_delay_den;
     uint8_t *input_buf;
-    int input_buf_pos;
-    int input_buf_len;
+    size_t input_buf_pos;
+    size_t input_buf_len;
 
     /* the following is used for format conversion */
     uint8_t output_inited;
@@ -118,6 +145,9 @@ struct BPGDecoderContext {
     int16_t *c_buf4;
     ColorConvertState cvt;
     ColorConvertFunc *cvt_func;
+#ifdef USE_STATS
+    BPGDecoderStats stats;
+#endif
 };
 
 /* ffmpeg utilities */
@@ -146,13 +176,13 @@ void avpriv_report_missing_feature(void *avc, const char *msg, ...)
 #endif /* USE_AV_LOG */
 
 /* return < 0 if error, otherwise the consumed length */
-static int get_ue32(uint32_t *pv, const uint8_t *buf, int len)
+static int get_ue32(uint32_t *pv, const uint8_t *buf, size_t len)
 {
     const uint8_t *p;
     uint32_t v;
     int a;
 
-    if (len <= 0) 
+    if (len == 0) 
         return -1;
     p = buf;
     a = *p++;
@@ -166,7 +196,7 @@ static int get_ue32(uint32_t *pv, const uint8_t *buf, int len)
     }
     v = a & 0x7f;
     for(;;) {
-        if (len <= 0)
+        if (len == 0)
             return -1;
         a = *p++;
         len--;
@@ -178,33 +208,22 @@ static int get_ue32(uint32_t *pv, const uint8_t *buf, int len)
     return p - buf;
 }
 
-static int get_ue(uint32_t *pv, const uint8_t *buf, int len)
+/* return < 0 if error, otherwise the consumed length */
+static int64_t build_msps(uint8_t **pbuf, size_t *pbuf_len,
+                          const uint8_t *input_data, size_t input_data_len1,
+                          int width, int height, int chroma_format_idc,
+                          int bit_depth)
 {
+    size_t input_data_len = input_data_len1;
+    size_t idx, msps_len, buf_len, i;
     int ret;
-    ret = get_ue32(pv, buf, len);
-    if (ret < 0)
-        return ret;
-    /* limit the maximum size to avoid overflows in buffer
-       computations */
-    if (*pv > MAX_DATA_SIZE)
-        return -1;
-    return ret;
-}
-
-static int build_msps(uint8_t **pbuf, int *pbuf_len,
-                      const uint8_t *input_data, int input_data_len1,
-                      int width, int height, int chroma_format_idc,
-                      int bit_depth)
-{
-    int input_data_len = input_data_len1;
-    int idx, msps_len, ret, buf_len, i;
     uint32_t len;
     uint8_t *buf, *msps_buf;
 
     *pbuf = NULL;
 
     /* build the modified SPS header to please libavcodec */
-    ret = get_ue(&len, input_data, input_data_len);
+    ret = get_ue32(&len, input_data, input_data_len);
     if (ret < 0)
         return -1;
     input_data += ret;
@@ -213,8 +232,10 @@ static int build_msps(uint8_t **pbuf, int *pbuf_len,
     if (len > input_data_len)
         return -1;
 
-    msps_len = 1 + 4 + 4 + 1 + len;
+    msps_len = 1 + 4 + 4 + 1 + (size_t)len;
     msps_buf = av_malloc(msps_len);
+    if (!msps_buf)
+        return -1;
     idx = 0;
     msps_buf[idx++] = chroma_format_idc;
     msps_buf[idx++] = (width >> 24);
@@ -234,6 +255,10 @@ static int build_msps(uint8_t **pbuf, int *pbuf_len,
     
     buf_len = 4 + 2 + msps_len * 2;
     buf = av_malloc(buf_len);
+    if (!buf) {
+        av_free(msps_buf);
+        return -1;
+    }
 
     idx = 0;
     /* NAL header */
@@ -267,9 +292,10 @@ static int build_msps(uint8_t **pbuf, int *pbuf_len,
 }
 
 /* return the position of the end of the NAL or -1 if error */
-static int find_nal_end(const uint8_t *buf, int buf_len, int has_startcode)
+static int64_t find_nal_end(const uint8_t *buf, size_t buf_len,
+                            int has_startcode)
 {
-    int idx;
+    size_t idx;
 
     idx = 0;
     if (has_startcode) {
@@ -304,8 +330,8 @@ static int find_nal_end(const uint8_t *buf, int buf_len, int has_startcode)
 
 typedef struct {
     uint8_t *buf;
-    int size;
-    int len;
+    size_t size;
+    size_t len;
 } DynBuf;
 
 static void dyn_buf_init(DynBuf *s)
@@ -315,14 +341,14 @@ static void dyn_buf_init(DynBuf *s)
     s->len = 0;
 }
 
-static int dyn_buf_resize(DynBuf *s, int size)
+static int dyn_buf_resize(DynBuf *s, size_t size)
 {
-    int new_size;
+    size_t new_size;
     uint8_t *new_buf;
 
     if (size <= s->size)
         return 0;
-    new_size = (s->size * 3) / 2;
+    new_size = s->size + s->size / 2;
     if (new_size < size)
         new_size = size;
     new_buf = av_realloc(s->buf, new_size);
@@ -333,7 +359,7 @@ static int dyn_buf_resize(DynBuf *s, int size)
     return 0;
 }
 
-static int dyn_buf_push(DynBuf *s, const uint8_t *data, int len)
+static int dyn_buf_push(DynBuf *s, const uint8_t *data, size_t len)
 {
     if (dyn_buf_resize(s, s->len + len) < 0)
         return -1;
@@ -344,17 +370,19 @@ static int dyn_buf_push(DynBuf *s, const uint8_t *data, int len)
 
 extern AVCodec ff_hevc_decoder;
 
-static int hevc_decode_init1(DynBuf *pbuf, AVFrame **pframe,
-                             AVCodecContext **pc, 
-                             const uint8_t *buf, int buf_len,
-                             int width, int height, int chroma_format_idc,
-                             int bit_depth)
+static int64_t hevc_decode_init1(DynBuf *pbuf, AVFrame **pframe,
+                                 AVCodecContext **pc, 
+                                 const uint8_t *buf, size_t buf_len,
+                                 int width, int height, int chroma_format_idc,
+                                 int bit_depth)
 {
     AVCodec *codec;
     AVCodecContext *c;
     AVFrame *frame;
     uint8_t *nal_buf;
-    int nal_len, ret, ret1;
+    size_t nal_len;
+    int64_t ret;
+    int ret1;
 
     ret = build_msps(&nal_buf, &nal_len, buf, buf_len,
                      width, height, chroma_format_idc, bit_depth);
@@ -388,11 +416,14 @@ static int hevc_decode_init1(DynBuf *pbuf, AVFrame **pframe,
 
 static int hevc_write_frame(AVCodecContext *avctx,
                             AVFrame *frame,
-                            uint8_t *buf, int buf_len)
+                            uint8_t *buf, size_t buf_len)
 {
     AVPacket avpkt;
     int len, got_frame;
 
+    /* libavcodec packets are limited to INT_MAX bytes */
+    if (buf_len > INT_MAX - FF_INPUT_BUFFER_PADDING_SIZE)
+        return -1;
     av_init_packet(&avpkt);
     avpkt.data = (uint8_t *)buf;
     avpkt.size = buf_len;
@@ -405,16 +436,19 @@ static int hevc_write_frame(AVCodecContext *avctx,
         return 0;
 }
 
-static int hevc_decode_frame_internal(BPGDecoderContext *s,
-                                      DynBuf *abuf, DynBuf *cbuf,
-                                      const uint8_t *buf, int buf_len1,
-                                      int first_nal)
+static int64_t hevc_decode_frame_internal(BPGDecoderContext *s,
+                                          DynBuf *abuf, DynBuf *cbuf,
+                                          const uint8_t *buf, size_t buf_len1,
+                                          int first_nal)
 {
-    int nal_len, start, nal_buf_len, ret, nuh_layer_id, buf_len, has_alpha;
-    int nut, frame_start_found[2];
+    int start, nuh_layer_id, has_alpha, nut, frame_start_found[2];
+    int64_t nal_len, ret;
+    size_t nal_buf_len, buf_len;
     DynBuf *pbuf;
     uint8_t *nal_buf;
+    STATS_TIME_DECL(t0);
 
+    STATS_TIME_START(t0);
     has_alpha = (s->alpha_dec_ctx != NULL);
     buf_len = buf_len1;
     frame_start_found[0] = 0;
@@ -465,14 +499,20 @@ static int hevc_decode_frame_internal(BPGDecoderContext *s,
         nal_buf[1] = 0x00;
         nal_buf[2] = 0x01;
         memcpy(nal_buf + 3, buf + start, nal_len - start);
-        if (has_alpha && nuh_layer_id == 1)
+        if (has_alpha && nuh_layer_id == 1) {
             nal_buf[4] &= 0x7;
+            STATS_ADD(s, alpha_nal_count, 1);
+        }
+        STATS_ADD(s, nal_count, 1);
         pbuf->len += nal_buf_len;
         buf += nal_len;
         buf_len -= nal_len;
         first_nal = 0;
     }
-    
+    STATS_MAX(s, peak_demux_size, abuf->len + cbuf->len);
+    STATS_TIME_ADD(s, demux_time, t0);
+
+    STATS_TIME_START(t0);
     if (s->alpha_dec_ctx) {
         if (dyn_buf_resize(abuf, abuf->len + FF_INPUT_BUFFER_PADDING_SIZE) < 0)
             goto fail;
@@ -486,6 +526,8 @@ static int hevc_decode_frame_internal(BPGDecoderContext *s,
     ret = hevc_write_frame(s->dec_ctx, s->frame, cbuf->buf, cbuf->len);
     if (ret < 0)
         goto fail;
+    STATS_TIME_ADD(s, decode_time, t0);
+    STATS_ADD(s, frame_count, 1);
     ret = buf_len1 - buf_len;
  done:
     return ret;
@@ -495,18 +537,21 @@ static int hevc_decode_frame_internal(BPGDecoderContext *s,
 }
 
 /* decode the first frame */
-static int hevc_decode_start(BPGDecoderContext *s,
-                             const uint8_t *buf, int buf_len1,
-                             int width, int height, int chroma_format_idc,
-                             int bit_depth, int has_alpha)
+static int64_t hevc_decode_start(BPGDecoderContext *s,
+                                 const uint8_t *buf, size_t buf_len1,
+                                 int width, int height, int chroma_format_idc,
+                                 int bit_depth, int has_alpha)
 {
-    int ret, buf_len;
+    int64_t ret;
+    size_t buf_len;
     DynBuf abuf_s, *abuf = &abuf_s;
     DynBuf cbuf_s, *cbuf = &cbuf_s;
+    STATS_TIME_DECL(t0);
 
     dyn_buf_init(abuf);
     dyn_buf_init(cbuf);
 
+    STATS_TIME_START(t0);
     buf_len = buf_len1;
     if (has_alpha) {
         ret = hevc_decode_init1(abuf, &s->alpha_frame, &s->alpha_dec_ctx,
@@ -524,6 +569,7 @@ static int hevc_decode_start(BPGDecoderContext *s,
         goto fail;
     buf += ret;
     buf_len -= ret;
+    STATS_TIME_ADD(s, init_time, t0);
     
     ret = hevc_decode_frame_internal(s, abuf, cbuf, buf, buf_len, 1);
     av_free(abuf->buf);
@@ -537,10 +583,10 @@ static int hevc_decode_start(BPGDecoderContext *s,
 }
 
 #ifdef USE_PRED
-static int hevc_decode_frame(BPGDecoderContext *s,
-                             const uint8_t *buf, int buf_len)
+static int64_t hevc_decode_frame(BPGDecoderContext *s,
+                                 const uint8_t *buf, size_t buf_len)
 {
-    int ret;
+    int64_t ret;
     DynBuf abuf_s, *abuf = &abuf_s;
     DynBuf cbuf_s, *cbuf = &cbuf_s;
 
@@ -1381,11 +1427,15 @@ static int bpg_decoder_output_init(BPGDecoderContext *s,
         /* Note: too large if 422 and sizeof(PIXEL) = 1 */
         s->c_buf4 = av_malloc((s->w2 + 2 * ITAPS2 - 1) * sizeof(int16_t));
 
+        STATS_ADD(s, output_buf_size, 2 * s->w * sizeof(PIXEL) +
+                  (s->w2 + 2 * ITAPS2 - 1) * sizeof(int16_t));
+
         if (s->format == BPG_FORMAT_420) {
             for(i = 0; i < ITAPS; i++) {
                 s->cb_buf3[i] = av_malloc(s->w2 * sizeof(PIXEL));
                 s->cr_buf3[i] = av_malloc(s->w2 * sizeof(PIXEL));
             }
+            STATS_ADD(s, output_buf_size, 2 * ITAPS * s->w2 * sizeof(PIXEL));
         }
     }
     convert_init(&s->cvt, s->bit_depth, s->is_16bpp ? 16 : 8,
@@ -1429,6 +1479,9 @@ static void bpg_decoder_output_end(BPGDecoderContext *s)
 int bpg_decoder_start(BPGDecoderContext *s, BPGDecoderOutputFormat out_fmt)
 {
     int ret, c_idx;
+#ifdef USE_PRED
+    int64_t len;
+#endif
 
     if (!s->frame)
         return -1;
@@ -1448,11 +1501,11 @@ int bpg_decoder_start(BPGDecoderContext *s, BPGDecoderOutputFormat out_fmt)
             if (s->input_buf_pos >= s->input_buf_len) {
                 return -1;
             } else {
-                ret = hevc_decode_frame(s, s->input_buf + s->input_buf_pos, 
+                len = hevc_decode_frame(s, s->input_buf + s->input_buf_pos, 
                                         s->input_buf_len - s->input_buf_pos);
-                if (ret < 0)
+                if (len < 0)
                     return -1;
-                s->input_buf_pos += ret;
+                s->input_buf_pos += len;
             }
         } else 
 #endif
@@ -1495,14 +1548,16 @@ int bpg_decoder_get_line(BPGDecoderContext *s, void *rgb_line1)
     uint8_t *rgb_line = rgb_line1;
     int w, y, pos, y2, y1, incr, y_frac;
     PIXEL *y_ptr, *cb_ptr, *cr_ptr, *a_ptr;
+    STATS_TIME_DECL(t0);
 
     y = s->y;
     if ((unsigned)y >= s->h) 
         return -1;
     w = s->w;
     
-    y_ptr = (PIXEL *)(s->y_buf + y * s->y_linesize);
+    y_ptr = (PIXEL *)(s->y_buf + (size_t)y * s->y_linesize);
     incr = 3 + (s->is_rgba || s->is_cmyk);
+    STATS_TIME_START(t0);
     switch(s->format) {
     case BPG_FORMAT_GRAY:
         s->cvt_func(&s->cvt, rgb_line, y_ptr, NULL, NULL, w, incr);
@@ -1519,8 +1574,8 @@ int bpg_decoder_get_line(BPGDecoderContext *s, void *rgb_line1)
                     y1 = 0;
                 else if (y1 >= s->h2)
                     y1 = s->h2 - 1;
-                cb_ptr = (PIXEL *)(s->cb_buf + y1 * s->cb_linesize);
-                cr_ptr = (PIXEL *)(s->cr_buf + y1 * s->cr_linesize);
+                cb_ptr = (PIXEL *)(s->cb_buf + (size_t)y1 * s->cb_linesize);
+                cr_ptr = (PIXEL *)(s->cr_buf + (size_t)y1 * s->cr_linesize);
                 memcpy(s->cb_buf3[i], cb_ptr, s->w2 * sizeof(PIXEL));
                 memcpy(s->cr_buf3[i], cr_ptr, s->w2 * sizeof(PIXEL));
             }
@@ -1538,25 +1593,29 @@ int bpg_decoder_get_line(BPGDecoderContext *s, void *rgb_line1)
             y1 = y2 + ITAPS2 + 1;
             if (y1 >= s->h2)
                 y1 = s->h2 - 1;
-            cb_ptr = (PIXEL *)(s->cb_buf + y1 * s->cb_linesize);
-            cr_ptr = (PIXEL *)(s->cr_buf + y1 * s->cr_linesize);
+            cb_ptr = (PIXEL *)(s->cb_buf + (size_t)y1 * s->cb_linesize);
+            cr_ptr = (PIXEL *)(s->cr_buf + (size_t)y1 * s->cr_linesize);
             memcpy(s->cb_buf3[pos], cb_ptr, s->w2 * sizeof(PIXEL));
             memcpy(s->cr_buf3[pos], cr_ptr, s->w2 * sizeof(PIXEL));
         }
+        STATS_TIME_ADD(s, interp_time, t0);
+        STATS_TIME_START(t0);
         s->cvt_func(&s->cvt, rgb_line, y_ptr, s->cb_buf2, s->cr_buf2, w, incr);
         break;
     case BPG_FORMAT_422:
-        cb_ptr = (PIXEL *)(s->cb_buf + y * s->cb_linesize);
-        cr_ptr = (PIXEL *)(s->cr_buf + y * s->cr_linesize);
+        cb_ptr = (PIXEL *)(s->cb_buf + (size_t)y * s->cb_linesize);
+        cr_ptr = (PIXEL *)(s->cr_buf + (size_t)y * s->cr_linesize);
         interp2_h(s->cb_buf2, cb_ptr, w, s->bit_depth, s->c_h_phase, 
                   (PIXEL *)s->c_buf4);
         interp2_h(s->cr_buf2, cr_ptr, w, s->bit_depth, s->c_h_phase,
                   (PIXEL *)s->c_buf4);
+        STATS_TIME_ADD(s, interp_time, t0);
+        STATS_TIME_START(t0);
         s->cvt_func(&s->cvt, rgb_line, y_ptr, s->cb_buf2, s->cr_buf2, w, incr);
         break;
     case BPG_FORMAT_444:
-        cb_ptr = (PIXEL *)(s->cb_buf + y * s->cb_linesize);
-        cr_ptr = (PIXEL *)(s->cr_buf + y * s->cr_linesize);
+        cb_ptr = (PIXEL *)(s->cb_buf + (size_t)y * s->cb_linesize);
+        cr_ptr = (PIXEL *)(s->cr_buf + (size_t)y * s->cr_linesize);
         s->cvt_func(&s->cvt, rgb_line, y_ptr, cb_ptr, cr_ptr, w, incr);
         break;
     default:
@@ -1582,7 +1641,7 @@ int bpg_decoder_get_line(BPGDecoderContext *s, void *rgb_line1)
     } else
 #endif
     if (s->has_w_plane) {
-        a_ptr = (PIXEL *)(s->a_buf + y * s->a_linesize);
+        a_ptr = (PIXEL *)(s->a_buf + (size_t)y * s->a_linesize);
 #ifdef USE_RGB48
         if (s->is_16bpp) {
             alpha_combine16(&s->cvt, (uint16_t *)rgb_line, a_ptr, w, incr);
@@ -1599,7 +1658,7 @@ int bpg_decoder_get_line(BPGDecoderContext *s, void *rgb_line1)
 #ifdef USE_RGB48
         if (s->is_16bpp) {
             if (s->has_alpha) {
-                a_ptr = (PIXEL *)(s->a_buf + y * s->a_linesize);
+                a_ptr = (PIXEL *)(s->a_buf + (size_t)y * s->a_linesize);
                 gray_to_gray16(&s->cvt, 
                                (uint16_t *)rgb_line + 3, a_ptr, w, 4);
                 if (s->premultiplied_alpha)
@@ -1611,7 +1670,7 @@ int bpg_decoder_get_line(BPGDecoderContext *s, void *rgb_line1)
 #endif
         {
             if (s->has_alpha) {
-                a_ptr = (PIXEL *)(s->a_buf + y * s->a_linesize);
+                a_ptr = (PIXEL *)(s->a_buf + (size_t)y * s->a_linesize);
                 gray_to_gray8(&s->cvt, rgb_line + 3, a_ptr, w, 4);
                 if (s->premultiplied_alpha)
                     alpha_divide8((uint8_t *)rgb_line, w);
@@ -1621,11 +1680,42 @@ int bpg_decoder_get_line(BPGDecoderContext *s, void *rgb_line1)
             }
     }
 
+    STATS_TIME_ADD(s, convert_time, t0);
+    STATS_ADD(s, line_count, 1);
+
     /* go to next line */
     s->y++;
     return 0;
 }
 
+int bpg_decoder_get_lines(BPGDecoderContext *s, BPGDecoderLineFunc *func,
+                          void *opaque)
+{
+    uint8_t *line;
+    size_t line_size;
+    int ret;
+
+    if (!s->output_inited || (unsigned)s->y >= s->h)
+        return -1;
+    line_size = (size_t)s->w * (3 + (s->is_rgba || s->is_cmyk));
+    if (s->is_16bpp)
+        line_size *= 2;
+    line = av_malloc(line_size);
+    if (!line)
+        return -1;
+    ret = 0;
+    while (s->y < s->h) {
+        ret = bpg_decoder_get_line(s, line);
+        if (ret < 0)
+            break;
+        ret = func(opaque, s->y - 1, line);
+        if (ret < 0)
+            break;
+    }
+    av_free(line);
+    return ret;
+}
+
 BPGDecoderContext *bpg_decoder_open(void)
 {
     BPGDecoderContext *s;
@@ -1649,16 +1739,35 @@ typedef struct {
     uint16_t frame_delay_num;
     uint16_t frame_delay_den;
     BPGColorSpaceEnum color_space;
-    uint32_t hevc_data_len;
+    size_t hevc_data_len;
     BPGExtensionData *first_md;
 } BPGHeaderData;
 
-static int bpg_decode_header(BPGHeaderData *h,
-                             const uint8_t *buf, int buf_len,
-                             int header_only, int load_extensions)
+/* return < 0 if the image is too large to be decoded */
+static int check_image_size(uint32_t width, uint32_t height, int bit_depth,
+                            int has_alpha)
+{
+    uint64_t size;
+
+    if (width > MAX_IMAGE_WIDTH || height > INT32_MAX)
+        return -1;
+    /* all the decoded planes must be addressable */
+    size = (uint64_t)width * height * (3 + has_alpha);
+    if (bit_depth > 8)
+        size *= 2;
+    if (size > SIZE_MAX)
+        return -1;
+    return 0;
+}
+
+/* return < 0 if error, otherwise the header length */
+static int64_t bpg_decode_header(BPGHeaderData *h,
+                                 const uint8_t *buf, size_t buf_len,
+                                 int header_only, int load_extensions)
 {
-    int idx, flags1, flags2, has_extension, ret, alpha1_flag, alpha2_flag;
-    uint32_t extension_data_len;
+    int flags1, flags2, has_extension, ret, alpha1_flag, alpha2_flag;
+    uint32_t extension_data_len, hevc_data_len;
+    size_t idx;
 
     if (buf_len < 6)
         return -1;
@@ -1702,27 +1811,30 @@ static int bpg_decode_header(BPGHeaderData *h,
         (h->format == BPG_FORMAT_GRAY && h->color_space != 0) ||
         (h->has_w_plane && h->format == BPG_FORMAT_GRAY))
         return -1;
-    ret = get_ue(&h->width, buf + idx, buf_len - idx);
+    ret = get_ue32(&h->width, buf + idx, buf_len - idx);
     if (ret < 0)
         return -1;
     idx += ret;
-    ret = get_ue(&h->height, buf + idx, buf_len - idx);
+    ret = get_ue32(&h->height, buf + idx, buf_len - idx);
     if (ret < 0)
         return -1;
     idx += ret;
     if (h->width == 0 || h->height == 0)
         return -1;
+    if (check_image_size(h->width, h->height, h->bit_depth, h->has_alpha) < 0)
+        return -1;
     if (header_only)
         return idx;
 
-    ret = get_ue(&h->hevc_data_len, buf + idx, buf_len - idx);
+    ret = get_ue32(&hevc_data_len, buf + idx, buf_len - idx);
     if (ret < 0)
         return -1;
     idx += ret;
+    h->hevc_data_len = hevc_data_len;
            
     extension_data_len = 0;
     if (has_extension) {
-        ret = get_ue(&extension_data_len, buf + idx, buf_len - idx);
+        ret = get_ue32(&extension_data_len, buf + idx, buf_len - idx);
         if (ret < 0)
             return -1;
         idx += ret;
@@ -1730,11 +1842,11 @@ static int bpg_decode_header(BPGHeaderData *h,
 
     h->first_md = NULL;
     if (has_extension) {
-        int ext_end;
+        size_t ext_end;
 
-        ext_end = idx + extension_data_len;
-        if (ext_end > buf_len)
+        if (extension_data_len > buf_len - idx)
             return -1;
+        ext_end = idx + extension_data_len;
         if (load_extensions || h->has_animation) {
             BPGExtensionData *md, **plast_md;
             uint32_t tag, buf_len;
@@ -1746,30 +1858,30 @@ static int bpg_decode_header(BPGHeaderData *h,
                     goto fail;
                 idx += ret;
 
-                ret = get_ue(&buf_len, buf + idx, ext_end - idx);
+                ret = get_ue32(&buf_len, buf + idx, ext_end - idx);
                 if (ret < 0) 
                     goto fail;
                 idx += ret;
                 
-                if (idx + buf_len > ext_end) {
+                if (buf_len > ext_end - idx) {
                 fail:
                     bpg_decoder_free_extension_data(h->first_md);
                     return -1;
                 }
                 if (h->has_animation && tag == BPG_EXTENSION_TAG_ANIM_CONTROL) {
-                    int idx1;
+                    size_t idx1;
                     uint32_t loop_count, frame_delay_num, frame_delay_den;
 
                     idx1 = idx;
-                    ret = get_ue(&loop_count, buf + idx1, ext_end - idx1);
+                    ret = get_ue32(&loop_count, buf + idx1, ext_end - idx1);
                     if (ret < 0) 
                         goto fail;
                     idx1 += ret;
-                    ret = get_ue(&frame_delay_num, buf + idx1, ext_end - idx1);
+                    ret = get_ue32(&frame_delay_num, buf + idx1, ext_end - idx1);
                     if (ret < 0) 
                         goto fail;
                     idx1 += ret;
-                    ret = get_ue(&frame_delay_den, buf + idx1, ext_end - idx1);
+                    ret = get_ue32(&frame_delay_den, buf + idx1, ext_end - idx1);
                     if (ret < 0) 
                         goto fail;
                     idx1 += ret;
@@ -1791,6 +1903,8 @@ static int bpg_decode_header(BPGHeaderData *h,
                     plast_md = &md->next;
                     
                     md->buf = av_malloc(md->buf_len);
+                    if (!md->buf)
+                        goto fail;
                     memcpy(md->buf, buf + idx, md->buf_len);
                 }
                 idx += buf_len;
@@ -1812,15 +1926,21 @@ static int bpg_decode_header(BPGHeaderData *h,
     return idx;
 }
 
-int bpg_decoder_decode(BPGDecoderContext *img, const uint8_t *buf, int buf_len)
+int bpg_decoder_decode(BPGDecoderContext *img, const uint8_t *buf,
+                       size_t buf_len)
 {
-    int idx, has_alpha, bit_depth, color_space, ret;
+    int has_alpha, bit_depth, color_space;
+    int64_t idx, ret;
     uint32_t width, height;
     BPGHeaderData h_s, *h = &h_s;
+    STATS_TIME_DECL(t0);
 
+    STATS_TIME_START(t0);
     idx = bpg_decode_header(h, buf, buf_len, 0, img->keep_extension_data);
     if (idx < 0)
-        return idx;
+        return -1;
+    STATS_TIME_ADD(img, header_time, t0);
+    STATS_ADD(img, hevc_bytes, h->hevc_data_len);
     width = h->width;
     height = h->height;
     has_alpha = h->has_alpha;
@@ -1853,7 +1973,7 @@ int bpg_decoder_decode(BPGDecoderContext *img, const uint8_t *buf, int buf_len)
 
     img->first_md = h->first_md;
 
-    if (idx + h->hevc_data_len > buf_len)
+    if (h->hevc_data_len > buf_len - idx)
         goto fail;
 
     /* decode the first frame */
@@ -1867,7 +1987,7 @@ int bpg_decoder_decode(BPGDecoderContext *img, const uint8_t *buf, int buf_len)
     /* XXX: add an option to avoid decoding animations ? */
     img->decode_animation = 1;
     if (img->has_animation && img->decode_animation) { 
-        int len;
+        size_t len;
         /* keep trailing bitstream to decode the next frames */
         len = buf_len - idx;
         img->input_buf = av_malloc(len);
@@ -1894,6 +2014,17 @@ int bpg_decoder_decode(BPGDecoderContext *img, const uint8_t *buf, int buf_len)
     return -1;
 }
 
+int bpg_decoder_get_stats(BPGDecoderContext *s, BPGDecoderStats *p)
+{
+#ifdef USE_STATS
+    *p = s->stats;
+    return 0;
+#else
+    memset(p, 0, sizeof(*p));
+    return -1;
+#endif
+}
+
 void bpg_decoder_close(BPGDecoderContext *s)
 {
     bpg_decoder_output_end(s);
@@ -1931,7 +2062,7 @@ BPGExtensionData *bpg_decoder_get_extension_data(BPGDecoderContext *s)
 
 int bpg_decoder_get_info_from_buf(BPGImageInfo *p, 
                                   BPGExtensionData **pfirst_md,
-                                  const uint8_t *buf, int buf_len)
+                                  const uint8_t *buf, size_t buf_len)
 {
     BPGHeaderData h_s, *h = &h_s;
     int parse_extension;
@@ -25,6 +25,7 @@
 #define _LIBBPG_H
 
 #include <inttypes.h>
+#include <stddef.h>
 
 typedef struct BPGDecoderContext BPGDecoderContext;
 
@@ -87,6 +88,23 @@ typedef enum {
 
 #define BPG_DECODER_INFO_BUF_SIZE 16
 
+/* decoding statistics. The times are in nanoseconds. */
+typedef struct {
+    int64_t header_time; /* header and extension data parsing */
+    int64_t init_time; /* HEVC decoder setup */
+    int64_t demux_time; /* NAL splitting between the color and alpha layers */
+    int64_t decode_time; /* HEVC decoding */
+    int64_t interp_time; /* chroma upsampling in bpg_decoder_get_line() */
+    int64_t convert_time; /* color conversion and alpha handling */
+    int64_t hevc_bytes; /* size of the HEVC data of the first frame */
+    int64_t peak_demux_size; /* largest NAL buffer given to the decoder */
+    int64_t output_buf_size; /* size of the line buffers */
+    uint32_t frame_count; /* number of decoded frames */
+    uint32_t nal_count; /* number of NAL units (color and alpha) */
+    uint32_t alpha_nal_count; /* number of alpha NAL units */
+    uint32_t line_count; /* number of lines returned by bpg_decoder_get_line() */
+} BPGDecoderStats;
+
 BPGDecoderContext *bpg_decoder_open(void);
 
 /* If enable is true, extension data are kept during the image
@@ -96,7 +114,8 @@ BPGDecoderContext *bpg_decoder_open(void);
 void bpg_decoder_keep_extension_data(BPGDecoderContext *s, int enable);
 
 /* return 0 if 0K, < 0 if error */
-int bpg_decoder_decode(BPGDecoderContext *s, const uint8_t *buf, int buf_len);
+int bpg_decoder_decode(BPGDecoderContext *s, const uint8_t *buf,
+                       size_t buf_len);
 
 /* Return the first element of the extension data list */
 BPGExtensionData *bpg_decoder_get_extension_data(BPGDecoderContext *s);
@@ -114,6 +133,25 @@ void bpg_decoder_get_frame_duration(BPGDecoderContext *s, int *pnum, int *pden);
 /* return 0 if 0K, < 0 if error */
 int bpg_decoder_get_line(BPGDecoderContext *s, void *buf);
 
+/* Called by bpg_decoder_get_lines() for each line 'y' of the current
+   frame. 'buf' is only valid during the call. Return < 0 to stop the
+   conversion. */
+typedef int BPGDecoderLineFunc(void *opaque, int y, const void *buf);
+
+/* Convenience wrapper calling bpg_decoder_get_line() for the
+   remaining lines of the current frame (after bpg_decoder_start())
+   and giving them to 'func' one at a time. Only one output line is
+   allocated, but the whole decoded frame (and its alpha plane) stays
+   in memory as with bpg_decoder_get_line(): the decoding itself is
+   not done by rows. Return 0 if OK, < 0 if error or if 'func'
+   returned < 0. */
+int bpg_decoder_get_lines(BPGDecoderContext *s, BPGDecoderLineFunc *func,
+                          void *opaque);
+
+/* Get the statistics accumulated since bpg_decoder_open(). Return 0
+   if OK, < 0 if the library was compiled without USE_STATS. */
+int bpg_decoder_get_stats(BPGDecoderContext *s, BPGDecoderStats *p);
+
 void bpg_decoder_close(BPGDecoderContext *s);
 
 /* only useful for low level access to the image data */
@@ -131,7 +169,7 @@ uint8_t *bpg_decoder_get_data(BPGDecoderContext *s, int *pline_size, int plane);
    Return 0 if OK, < 0 if unrecognized data. */
 int bpg_decoder_get_info_from_buf(BPGImageInfo *p, 
                                   BPGExtensionData **pfirst_md,
-                                  const uint8_t *buf, int buf_len);
+                                  const uint8_t *buf, size_t buf_len);
 /* Free the extension data returned by bpg_decoder_get_info_from_buf() */
 void bpg_decoder_free_extension_data(BPGExtensionData *first_md);
 
@@ -0,0 +1,7735 @@
+/*
+ * BPG encoder
+ *
+ * Copyright (c) 2014 Fabrice Bellard
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+#include <math.h>
+#include <assert.h>
+#include <ctype.h>
+#include <errno.h>
+#include <unistd.h>
+#ifdef _WIN32
+#include <windows.h>
+#endif
+
+#include <png.h>
+#include <jpeglib.h>
+
+#include "libbpgenc.h"
+
+#if !defined(_WIN32)
+#define HAVE_THREADS
+#include <pthread.h>
+#include <signal.h>
+#endif
+
+typedef uint16_t PIXEL;
+
+static void put_ue(uint8_t **pp, uint32_t v);
+static void convert_dsp_init(void);
+
+static inline int clamp_pix(int a, int pixel_max)
+{
+    if (a < 0)
+        return 0;
+    else if (a > pixel_max)
+        return pixel_max;
+    else
+        return a;
+}
+
+static inline int max_int(int a, int b)
+{
+    if (a > b)
+        return a;
+    else
+        return b;
+}
+
+static inline int min_int(int a, int b)
+{
+    if (a < b)
+        return a;
+    else
+        return b;
+}
+
+static inline int sub_mod_int(int a, int b, int m)
+{
+    a -= b;
+    if (a < 0)
+        a += m;
+    return a;
+}
+
+static inline int add_mod_int(int a, int b, int m)
+{
+    a += b;
+    if (a >= m)
+        a -= m;
+    return a;
+}
+
+/* The image planes store (1 << pixel_shift) bytes per pixel. The
+   filters work on 16 bit rows which are converted with the following
+   functions. */
+
+/* return 'n' pixels of the row 'src' as 16 bit pixels. 'buf' is used
+   if the pixels must be converted. */
+static PIXEL *get_row16(const uint8_t *src, int n, int pixel_shift,
+                        PIXEL *buf)
+{
+    int i;
+
+    if (pixel_shift)
+        return (PIXEL *)src;
+    for(i = 0; i < n; i++)
+        buf[i] = src[i];
+    return buf;
+}
+
+static void put_row16(uint8_t *dst, const PIXEL *src, int n,
+                      int pixel_shift)
+{
+    int i;
+
+    if (pixel_shift) {
+        if ((PIXEL *)dst != src)
+            memcpy(dst, src, n * sizeof(PIXEL));
+    } else {
+        for(i = 0; i < n; i++)
+            dst[i] = src[i];
+    }
+}
+
+typedef struct {
+    int c_shift;
+    int c_rnd;
+    int c_0_25, c_0_5, c_one;
+    int rgb_to_ycc[3 * 3];
+    int y_one;
+    int y_offset;
+    int bit_depth;
+    int pixel_max;
+    int c_center;
+} ColorConvertState;
+
+static void convert_init(ColorConvertState *s, int in_bit_depth, 
+                         int out_bit_depth, BPGColorSpaceEnum color_space,
+                         int limited_range)
+{
+    double k_r, k_b, mult, mult_y, mult_c;
+    int in_pixel_max, out_pixel_max, c_shift, i;
+    double rgb_to_ycc[3 * 3];
+
+    /* XXX: could use one more bit */
+    c_shift = 31 - out_bit_depth;
+    in_pixel_max = (1 << in_bit_depth) - 1;
+    out_pixel_max = (1 << out_bit_depth) - 1;
+    mult = (double)out_pixel_max * (1 << c_shift) / (double)in_pixel_max;
+    //    printf("mult=%f c_shift=%d\n", mult, c_shift);
+    if (limited_range) {
+        mult_y = (double)(219 << (out_bit_depth - 8)) * (1 << c_shift) / 
+            (double)in_pixel_max;
+        mult_c = (double)(224 << (out_bit_depth - 8)) * (1 << c_shift) / 
+            (double)in_pixel_max;
+    } else {
+        mult_y = mult;
+        mult_c = mult;
+    }
+    switch(color_space) {
+    case BPG_CS_YCbCr:
+        k_r = 0.299;
+        k_b = 0.114;
+        goto convert_ycc;
+        
+    case BPG_CS_YCbCr_BT709:
+        k_r = 0.2126; 
+        k_b = 0.0722;
+        goto convert_ycc;
+        
+    case BPG_CS_YCbCr_BT2020:
+        k_r = 0.2627;
+        k_b = 0.0593;
+    convert_ycc:
+        rgb_to_ycc[0] = k_r;
+        rgb_to_ycc[1] = 1 - k_r - k_b;
+        rgb_to_ycc[2] = k_b;
+        rgb_to_ycc[3] = -0.5 * k_r / (1 - k_b);
+        rgb_to_ycc[4] = -0.5 * (1 - k_r - k_b) / (1 - k_b);
+        rgb_to_ycc[5] = 0.5;
+        rgb_to_ycc[6] = 0.5;
+        rgb_to_ycc[7] = -0.5 * (1 - k_r - k_b) / (1 - k_r);
+        rgb_to_ycc[8] = -0.5 * k_b / (1 - k_r);
+        
+        for(i = 0; i < 3; i++)
+            s->rgb_to_ycc[i] = lrint(rgb_to_ycc[i] * mult_y);
+        for(i = 3; i < 9; i++)
+            s->rgb_to_ycc[i] = lrint(rgb_to_ycc[i] * mult_c);
+        break;
+    case BPG_CS_YCgCo:
+        s->c_0_25 = lrint(0.25 * mult_y);
+        s->c_0_5 = lrint(0.5 * mult_y);
+        break;
+    default:
+        break;
+    }
+
+    s->c_one = lrint(mult);
+    s->c_shift = c_shift;
+    s->c_rnd = (1 << (c_shift - 1));
+    if (limited_range) {
+        s->y_offset = s->c_rnd + (16 << (c_shift + out_bit_depth - 8));
+        s->y_one = lrint(mult_y);
+    } else {
+        s->y_offset = s->c_rnd;
+        s->y_one = s->c_one;
+    }
+
+    s->bit_depth = out_bit_depth;
+    s->c_center = 1 << (out_bit_depth - 1);
+    s->pixel_max = out_pixel_max;
+
+    convert_dsp_init();
+}
+
+/* 8 bit input */
+static void rgb24_to_ycc(ColorConvertState *s,
+                         PIXEL *y_ptr, PIXEL *cb_ptr, PIXEL *cr_ptr,
+                         const void *src1, int n, int incr)
+{
+    const uint8_t *src = src1;
+    int i, r, g, b, c0, c1, c2, c3, c4, c5, c6, c7, c8, shift, rnd, center;
+    int pixel_max, y_offset;
+
+    c0 = s->rgb_to_ycc[0];
+    c1 = s->rgb_to_ycc[1];
+    c2 = s->rgb_to_ycc[2];
+    c3 = s->rgb_to_ycc[3];
+    c4 = s->rgb_to_ycc[4];
+    c5 = s->rgb_to_ycc[5];
+    c6 = s->rgb_to_ycc[6];
+    c7 = s->rgb_to_ycc[7];
+    c8 = s->rgb_to_ycc[8];
+    shift = s->c_shift;
+    rnd = s->c_rnd;
+    y_offset = s->y_offset;
+    center = s->c_center;
+    pixel_max = s->pixel_max;
+    for(i = 0; i < n; i++) {
+        r = src[0];
+        g = src[1];
+        b = src[2];
+        y_ptr[i] = clamp_pix((c0 * r + c1 * g + c2 * b +
+                              y_offset) >> shift, pixel_max);
+        cb_ptr[i] = clamp_pix(((c3 * r + c4 * g + c5 * b + 
+                                rnd) >> shift) + center, pixel_max);
+        cr_ptr[i] = clamp_pix(((c6 * r + c7 * g + c8 * b + 
+                                rnd) >> shift) + center, pixel_max);
+        src += incr;
+    }
+}
+
+static void rgb24_to_rgb(ColorConvertState *s,
+                         PIXEL *y_ptr, PIXEL *cb_ptr, PIXEL *cr_ptr,
+                         const void *src1, int n, int incr)
+{
+    const uint8_t *src = src1;
+    int i, r, g, b, c, shift, rnd;
+
+    c = s->y_one;
+    shift = s->c_shift;
+    rnd = s->y_offset;
+    for(i = 0; i < n; i++) {
+        r = src[0];
+        g = src[1];
+        b = src[2];
+        y_ptr[i] = (c * g + rnd) >> shift;
+        cb_ptr[i] = (c * b + rnd) >> shift;
+        cr_ptr[i] = (c * r + rnd) >> shift;
+        src += incr;
+    }
+}
+
+static void rgb24_to_ycgco(ColorConvertState *s,
+                           PIXEL *y_ptr, PIXEL *cb_ptr, PIXEL *cr_ptr,
+                           const void *src1, int n, int incr)
+{
+    const uint8_t *src = src1;
+    int i, r, g, b, t1, t2, pixel_max, c_0_5, c_0_25, rnd, shift, center;
+    int y_offset;
+
+    c_0_25 = s->c_0_25;
+    c_0_5 = s->c_0_5;
+    rnd = s->c_rnd;
+    shift = s->c_shift;
+    pixel_max = s->pixel_max;
+    center = s->c_center;
+    y_offset = s->y_offset;
+    for(i = 0; i < n; i++) {
+        r = src[0];
+        g = src[1];
+        b = src[2];
+        t1 = c_0_5 * g;
+        t2 = c_0_25 * (r + b);
+        y_ptr[i] = clamp_pix((t1 + t2 + y_offset) >> shift, pixel_max);
+        cb_ptr[i] = clamp_pix(((t1 - t2 + rnd) >> shift) + center, 
+                              pixel_max);
+        cr_ptr[i] = clamp_pix(((c_0_5 * (r - b) +
+                                rnd) >> shift) + center, pixel_max);
+        src += incr;
+    }
+}
+
+/* Note: used for alpha/W so no limited range */
+static void gray8_to_gray(ColorConvertState *s,
+                          PIXEL *y_ptr, const uint8_t *src, int n, int incr)
+{
+    int i, g, c, shift, rnd;
+
+    c = s->c_one;
+    shift = s->c_shift;
+    rnd = s->c_rnd;
+    for(i = 0; i < n; i++) {
+        g = src[0];
+        y_ptr[i] = (c * g + rnd) >> shift;
+        src += incr;
+    }
+}
+
+static void luma8_to_gray(ColorConvertState *s,
+                          PIXEL *y_ptr, const uint8_t *src, int n, int incr)
+{
+    int i, g, c, shift, rnd;
+
+    c = s->y_one;
+    shift = s->c_shift;
+    rnd = s->y_offset;
+    for(i = 0; i < n; i++) {
+        g = src[0];
+        y_ptr[i] = (c * g + rnd) >> shift;
+        src += incr;
+    }
+}
+
+/* 16 bit input */
+
+static void rgb48_to_ycc(ColorConvertState *s, 
+                         PIXEL *y_ptr, PIXEL *cb_ptr, PIXEL *cr_ptr,
+                         const void *src1, int n, int incr)
+{
+    const uint16_t *src = src1;
+    int i, r, g, b, c0, c1, c2, c3, c4, c5, c6, c7, c8, shift, rnd, center;
+    int pixel_max, y_offset;
+
+    c0 = s->rgb_to_ycc[0];
+    c1 = s->rgb_to_ycc[1];
+    c2 = s->rgb_to_ycc[2];
+    c3 = s->rgb_to_ycc[3];
+    c4 = s->rgb_to_ycc[4];
+    c5 = s->rgb_to_ycc[5];
+    c6 = s->rgb_to_ycc[6];
+    c7 = s->rgb_to_ycc[7];
+    c8 = s->rgb_to_ycc[8];
+    shift = s->c_shift;
+    rnd = s->c_rnd;
+    y_offset = s->y_offset;
+    center = s->c_center;
+    pixel_max = s->pixel_max;
+    for(i = 0; i < n; i++) {
+        r = src[0];
+        g = src[1];
+        b = src[2];
+        y_ptr[i] = clamp_pix((c0 * r + c1 * g + c2 * b +
+                              y_offset) >> shift, pixel_max);
+        cb_ptr[i] = clamp_pix(((c3 * r + c4 * g + c5 * b + 
+                                rnd) >> shift) + center, pixel_max);
+        cr_ptr[i] = clamp_pix(((c6 * r + c7 * g + c8 * b + 
+                                rnd) >> shift) + center, pixel_max);
+        src += incr;
+    }
+}
+
+static void rgb48_to_ycgco(ColorConvertState *s, 
+                           PIXEL *y_ptr, PIXEL *cb_ptr, PIXEL *cr_ptr,
+                           const void *src1, int n, int incr)
+{
+    const uint16_t *src = src1;
+    int i, r, g, b, t1, t2, pixel_max, c_0_5, c_0_25, rnd, shift, center;
+    int y_offset;
+
+    c_0_25 = s->c_0_25;
+    c_0_5 = s->c_0_5;
+    rnd = s->c_rnd;
+    y_offset = s->y_offset;
+    shift = s->c_shift;
+    pixel_max = s->pixel_max;
+    center = s->c_center;
+    for(i = 0; i < n; i++) {
+        r = src[0];
+        g = src[1];
+        b = src[2];
+        t1 = c_0_5 * g;
+        t2 = c_0_25 * (r + b);
+        y_ptr[i] = clamp_pix((t1 + t2 + y_offset) >> shift, pixel_max);
+        cb_ptr[i] = clamp_pix(((t1 - t2 + rnd) >> shift) + center, 
+                              pixel_max);
+        cr_ptr[i] = clamp_pix(((c_0_5 * (r - b) +
+                                rnd) >> shift) + center, pixel_max);
+        src += incr;
+    }
+}
+
+/* Note: use for alpha/W so no limited range */
+static void gray16_to_gray(ColorConvertState *s, 
+                           PIXEL *y_ptr, const uint16_t *src, int n, int incr)
+{
+    int i, g, c, shift, rnd;
+
+    c = s->c_one;
+    shift = s->c_shift;
+    rnd = s->c_rnd;
+    for(i = 0; i < n; i++) {
+        g = src[0];
+        y_ptr[i] = (c * g + rnd) >> shift;
+        src += incr;
+    }
+}
+
+static void luma16_to_gray(ColorConvertState *s, 
+                           PIXEL *y_ptr, const uint16_t *src, int n, int incr)
+{
+    int i, g, c, shift, rnd;
+
+    c = s->y_one;
+    shift = s->c_shift;
+    rnd = s->y_offset;
+    for(i = 0; i < n; i++) {
+        g = src[0];
+        y_ptr[i] = (c * g + rnd) >> shift;
+        src += incr;
+    }
+}
+
+static void rgb48_to_rgb(ColorConvertState *s, 
+                         PIXEL *y_ptr, PIXEL *cb_ptr, PIXEL *cr_ptr,
+                         const void *src1, int n, int incr)
+{
+    const uint16_t *src = src1;
+
+    luma16_to_gray(s, y_ptr, src + 1, n, incr);
+    luma16_to_gray(s, cb_ptr, src + 2, n, incr);
+    luma16_to_gray(s, cr_ptr, src + 0, n, incr);
+}
+
+typedef void RGBConvertFunc(ColorConvertState *s, 
+                            PIXEL *y_ptr, PIXEL *cb_ptr, PIXEL *cr_ptr,
+                            const void *src, int n, int incr);
+
+static RGBConvertFunc *rgb_to_cs[2][BPG_CS_COUNT] = {
+    {
+        rgb24_to_ycc,
+        rgb24_to_rgb,
+        rgb24_to_ycgco,
+        rgb24_to_ycc,
+        rgb24_to_ycc,
+    },
+    {
+        rgb48_to_ycc,
+        rgb48_to_rgb,
+        rgb48_to_ycgco,
+        rgb48_to_ycc,
+        rgb48_to_ycc,
+    }
+};
+    
+/* val = 1.0 - val */
+static void gray_one_minus(ColorConvertState *s, PIXEL *y_ptr, int n)
+{
+    int pixel_max = s->pixel_max;
+    int i;
+
+    for(i = 0; i < n; i++) {
+        y_ptr[i] = pixel_max - y_ptr[i];
+    }
+}
+
+/* val = -val for chroma */
+static void gray_neg_c(ColorConvertState *s, PIXEL *y_ptr, int n)
+{
+    int pixel_max = s->pixel_max;
+    int i, v;
+
+    for(i = 0; i < n; i++) {
+        v = y_ptr[i];
+        if (v == 0)
+            v = pixel_max;
+        else
+            v = pixel_max + 1 - v;
+        y_ptr[i] = v;
+    }
+}
+
+/* SIMD versions of the color conversion functions. They give exactly
+   the same results as the C versions (checked with bpgkbench). The
+   last pixels of each line are always converted by the C versions so
+   that the vector loads never read past the end of the line. */
+
+#if defined(__SSE2__) || defined(__x86_64__)
+#define HAVE_SSE2
+#include <emmintrin.h>
+#endif
+
+#if (defined(__x86_64__) || defined(__i386__)) && \
+    (defined(__clang__) || (defined(__GNUC__) && __GNUC__ >= 5))
+#define HAVE_AVX2
+#include <immintrin.h>
+#define AVX2_FUNC __attribute__((target("avx2")))
+#endif
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define HAVE_NEON
+#include <arm_neon.h>
+#endif
+
+/* number of pixels always converted by the C code at the end of a
+   line */
+#define CVT_TAIL 2
+
+#ifdef HAVE_SSE2
+
+/* low 32 bits of a * b on each 32 bit lane */
+static inline __m128i mullo32_sse2(__m128i a, __m128i b)
+{
+    __m128i lo, hi;
+    lo = _mm_mul_epu32(a, b);
+    hi = _mm_mul_epu32(_mm_srli_epi64(a, 32), _mm_srli_epi64(b, 32));
+    return _mm_unpacklo_epi32(_mm_shuffle_epi32(lo, _MM_SHUFFLE(0, 0, 2, 0)),
+                              _mm_shuffle_epi32(hi, _MM_SHUFFLE(0, 0, 2, 0)));
+}
+
+/* load 4 RGB pixels as 32 bit integers. With incr = 3, up to 6 bytes
+   after the last pixel are read. */
+static inline void load_rgb_sse2(__m128i *pr, __m128i *pg, __m128i *pb,
+                                 const void *src1, int incr, int is_16bit)
+{
+    __m128i a, b, t0, t1, mask, zero;
+
+    if (!is_16bit) {
+        const uint8_t *src = src1;
+        a = _mm_loadu_si128((const __m128i *)src);
+        if (incr == 3) {
+            b = _mm_unpacklo_epi64(
+                _mm_unpacklo_epi32(a, _mm_srli_si128(a, 3)),
+                _mm_unpacklo_epi32(_mm_srli_si128(a, 6),
+                                   _mm_srli_si128(a, 9)));
+            a = b;
+        }
+        mask = _mm_set1_epi32(0xff);
+        *pr = _mm_and_si128(a, mask);
+        *pg = _mm_and_si128(_mm_srli_epi32(a, 8), mask);
+        *pb = _mm_and_si128(_mm_srli_epi32(a, 16), mask);
+    } else {
+        const uint16_t *src = src1;
+        a = _mm_loadu_si128((const __m128i *)src);
+        b = _mm_loadu_si128((const __m128i *)(src + 2 * incr));
+        if (incr == 3) {
+            a = _mm_unpacklo_epi64(a, _mm_srli_si128(a, 6));
+            b = _mm_unpacklo_epi64(b, _mm_srli_si128(b, 6));
+        }
+        /* a = r0 g0 b0 x0 r1 g1 b1 x1, b = r2 g2 b2 x2 r3 g3 b3 x3 */
+        t0 = _mm_unpacklo_epi16(a, b);
+        t1 = _mm_unpackhi_epi16(a, b);
+        /* a = r0 r1 r2 r3 g0 g1 g2 g3, b = b0 b1 b2 b3 x0 x1 x2 x3 */
+        a = _mm_unpacklo_epi16(t0, t1);
+        b = _mm_unpackhi_epi16(t0, t1);
+        zero = _mm_setzero_si128();
+        *pr = _mm_unpacklo_epi16(a, zero);
+        *pg = _mm_unpackhi_epi16(a, zero);
+        *pb = _mm_unpacklo_epi16(b, zero);
+    }
+}
+
+/* (c0 * r + c1 * g + c2 * b + rnd) >> shift */
+static inline __m128i madd3_sse2(__m128i r, __m128i g, __m128i b,
+                                 __m128i c0, __m128i c1, __m128i c2,
+                                 __m128i rnd, __m128i shift)
+{
+    __m128i a;
+    a = _mm_add_epi32(mullo32_sse2(r, c0), mullo32_sse2(g, c1));
+    a = _mm_add_epi32(a, mullo32_sse2(b, c2));
+    return _mm_sra_epi32(_mm_add_epi32(a, rnd), shift);
+}
+
+/* clamp 8 values between 0 and pixel_max and store them */
+static inline void store_pix_sse2(PIXEL *dst, __m128i a0, __m128i a1,
+                                  __m128i pixel_max)
+{
+    __m128i a;
+    a = _mm_packs_epi32(a0, a1);
+    a = _mm_min_epi16(_mm_max_epi16(a, _mm_setzero_si128()), pixel_max);
+    _mm_storeu_si128((__m128i *)dst, a);
+}
+
+static inline void rgb_to_ycc_sse2(ColorConvertState *s,
+                                   PIXEL *y_ptr, PIXEL *cb_ptr, PIXEL *cr_ptr,
+                                   const void *src1, int n, int incr,
+                                   int is_16bit)
+{
+    const uint8_t *src = src1;
+    __m128i r[2], g[2], b[2], v[2], c[9];
+    __m128i shift, rnd, y_offset, center, pixel_max;
+    int i, j, pixel_size;
+
+    for(i = 0; i < 9; i++)
+        c[i] = _mm_set1_epi32(s->rgb_to_ycc[i]);
+    shift = _mm_cvtsi32_si128(s->c_shift);
+    rnd = _mm_set1_epi32(s->c_rnd);
+    y_offset = _mm_set1_epi32(s->y_offset);
+    center = _mm_set1_epi32(s->c_center);
+    pixel_max = _mm_set1_epi16(s->pixel_max);
+    pixel_size = incr << is_16bit;
+    for(i = 0; i + 8 <= n - CVT_TAIL; i += 8) {
+        for(j = 0; j < 2; j++) {
+            load_rgb_sse2(&r[j], &g[j], &b[j],
+                          src + (i + 4 * j) * pixel_size, incr, is_16bit);
+        }
+        for(j = 0; j < 2; j++) {
+            v[j] = madd3_sse2(r[j], g[j], b[j], c[0], c[1], c[2],
+                              y_offset, shift);
+        }
+        store_pix_sse2(y_ptr + i, v[0], v[1], pixel_max);
+        for(j = 0; j < 2; j++) {
+            v[j] = _mm_add_epi32(madd3_sse2(r[j], g[j], b[j],
+                                            c[3], c[4], c[5], rnd, shift),
+                                 center);
+        }
+        store_pix_sse2(cb_ptr + i, v[0], v[1], pixel_max);
+        for(j = 0; j < 2; j++) {
+            v[j] = _mm_add_epi32(madd3_sse2(r[j], g[j], b[j],
+                                            c[6], c[7], c[8], rnd, shift),
+                                 center);
+        }
+        store_pix_sse2(cr_ptr + i, v[0], v[1], pixel_max);
+    }
+    if (is_16bit) {
+        rgb48_to_ycc(s, y_ptr + i, cb_ptr + i, cr_ptr + i,
+                     src + i * pixel_size, n - i, incr);
+    } else {
+        rgb24_to_ycc(s, y_ptr + i, cb_ptr + i, cr_ptr + i,
+                     src + i * pixel_size, n - i, incr);
+    }
+}
+
+static void rgb24_to_ycc_sse2(ColorConvertState *s,
+                              PIXEL *y_ptr, PIXEL *cb_ptr, PIXEL *cr_ptr,
+                              const void *src, int n, int incr)
+{
+    rgb_to_ycc_sse2(s, y_ptr, cb_ptr, cr_ptr, src, n, incr, 0);
+}
+
+static void rgb48_to_ycc_sse2(ColorConvertState *s,
+                              PIXEL *y_ptr, PIXEL *cb_ptr, PIXEL *cr_ptr,
+                              const void *src, int n, int incr)
+{
+    rgb_to_ycc_sse2(s, y_ptr, cb_ptr, cr_ptr, src, n, incr, 1);
+}
+
+static inline void rgb_to_ycgco_sse2(ColorConvertState *s,
+                                     PIXEL *y_ptr, PIXEL *cb_ptr,
+                                     PIXEL *cr_ptr, const void *src1, int n,
+                                     int incr, int is_16bit)
+{
+    const uint8_t *src = src1;
+    __m128i r, g, b, t1, t2, v[3][2];
+    __m128i c_0_5, c_0_25, shift, rnd, y_offset, center, pixel_max;
+    int i, j, pixel_size;
+
+    c_0_5 = _mm_set1_epi32(s->c_0_5);
+    c_0_25 = _mm_set1_epi32(s->c_0_25);
+    shift = _mm_cvtsi32_si128(s->c_shift);
+    rnd = _mm_set1_epi32(s->c_rnd);
+    y_offset = _mm_set1_epi32(s->y_offset);
+    center = _mm_set1_epi32(s->c_center);
+    pixel_max = _mm_set1_epi16(s->pixel_max);
+    pixel_size = incr << is_16bit;
+    for(i = 0; i + 8 <= n - CVT_TAIL; i += 8) {
+        for(j = 0; j < 2; j++) {
+            load_rgb_sse2(&r, &g, &b,
+                          src + (i + 4 * j) * pixel_size, incr, is_16bit);
+            t1 = mullo32_sse2(g, c_0_5);
+            t2 = mullo32_sse2(_mm_add_epi32(r, b), c_0_25);
+            v[0][j] = _mm_sra_epi32(_mm_add_epi32(_mm_add_epi32(t1, t2),
+                                                  y_offset), shift);
+            v[1][j] = _mm_add_epi32(_mm_sra_epi32(
+                _mm_add_epi32(_mm_sub_epi32(t1, t2), rnd), shift), center);
+            t1 = mullo32_sse2(_mm_sub_epi32(r, b), c_0_5);
+            v[2][j] = _mm_add_epi32(_mm_sra_epi32(_mm_add_epi32(t1, rnd),
+                                                  shift), center);
+        }
+        store_pix_sse2(y_ptr + i, v[0][0], v[0][1], pixel_max);
+        store_pix_sse2(cb_ptr + i, v[1][0], v[1][1], pixel_max);
+        store_pix_sse2(cr_ptr + i, v[2][0], v[2][1], pixel_max);
+    }
+    if (is_16bit) {
+        rgb48_to_ycgco(s, y_ptr + i, cb_ptr + i, cr_ptr + i,
+                       src + i * pixel_size, n - i, incr);
+    } else {
+        rgb24_to_ycgco(s, y_ptr + i, cb_ptr + i, cr_ptr + i,
+                       src + i * pixel_size, n - i, incr);
+    }
+}
+
+static void rgb24_to_ycgco_sse2(ColorConvertState *s,
+                                PIXEL *y_ptr, PIXEL *cb_ptr, PIXEL *cr_ptr,
+                                const void *src, int n, int incr)
+{
+    rgb_to_ycgco_sse2(s, y_ptr, cb_ptr, cr_ptr, src, n, incr, 0);
+}
+
+static void rgb48_to_ycgco_sse2(ColorConvertState *s,
+                                PIXEL *y_ptr, PIXEL *cb_ptr, PIXEL *cr_ptr,
+                                const void *src, int n, int incr)
+{
+    rgb_to_ycgco_sse2(s, y_ptr, cb_ptr, cr_ptr, src, n, incr, 1);
+}
+
+static inline void rgb_to_rgb_sse2(ColorConvertState *s,
+                                   PIXEL *y_ptr, PIXEL *cb_ptr, PIXEL *cr_ptr,
+                                   const void *src1, int n, int incr,
+                                   int is_16bit)
+{
+    const uint8_t *src = src1;
+    __m128i r, g, b, c, shift, rnd, pixel_max, v[3][2];
+    int i, j, pixel_size;
+
+    c = _mm_set1_epi32(s->y_one);
+    shift = _mm_cvtsi32_si128(s->c_shift);
+    rnd = _mm_set1_epi32(s->y_offset);
+    pixel_max = _mm_set1_epi16(s->pixel_max);
+    pixel_size = incr << is_16bit;
+    for(i = 0; i + 8 <= n - CVT_TAIL; i += 8) {
+        for(j = 0; j < 2; j++) {
+            load_rgb_sse2(&r, &g, &b,
+                          src + (i + 4 * j) * pixel_size, incr, is_16bit);
+            v[0][j] = _mm_sra_epi32(_mm_add_epi32(mullo32_sse2(g, c), rnd),
+                                    shift);
+            v[1][j] = _mm_sra_epi32(_mm_add_epi32(mullo32_sse2(b, c), rnd),
+                                    shift);
+            v[2][j] = _mm_sra_epi32(_mm_add_epi32(mullo32_sse2(r, c), rnd),
+                                    shift);
+        }
+        /* the result is always in range so the clamping has no effect */
+        store_pix_sse2(y_ptr + i, v[0][0], v[0][1], pixel_max);
+        store_pix_sse2(cb_ptr + i, v[1][0], v[1][1], pixel_max);
+        store_pix_sse2(cr_ptr + i, v[2][0], v[2][1], pixel_max);
+    }
+    if (is_16bit) {
+        rgb48_to_rgb(s, y_ptr + i, cb_ptr + i, cr_ptr + i,
+                     src + i * pixel_size, n - i, incr);
+    } else {
+        rgb24_to_rgb(s, y_ptr + i, cb_ptr + i, cr_ptr + i,
+                     src + i * pixel_size, n - i, incr);
+    }
+}
+
+static void rgb24_to_rgb_sse2(ColorConvertState *s,
+                              PIXEL *y_ptr, PIXEL *cb_ptr, PIXEL *cr_ptr,
+                              const void *src, int n, int incr)
+{
+    rgb_to_rgb_sse2(s, y_ptr, cb_ptr, cr_ptr, src, n, incr, 0);
+}
+
+static void rgb48_to_rgb_sse2(ColorConvertState *s,
+                              PIXEL *y_ptr, PIXEL *cb_ptr, PIXEL *cr_ptr,
+                              const void *src, int n, int incr)
+{
+    rgb_to_rgb_sse2(s, y_ptr, cb_ptr, cr_ptr, src, n, incr, 1);
+}
+
+static void gray_one_minus_sse2(ColorConvertState *s, PIXEL *y_ptr, int n)
+{
+    __m128i pixel_max, v;
+    int i;
+
+    pixel_max = _mm_set1_epi16(s->pixel_max);
+    for(i = 0; i + 8 <= n; i += 8) {
+        v = _mm_loadu_si128((__m128i *)(y_ptr + i));
+        _mm_storeu_si128((__m128i *)(y_ptr + i), _mm_sub_epi16(pixel_max, v));
+    }
+    gray_one_minus(s, y_ptr + i, n - i);
+}
+
+static void gray_neg_c_sse2(ColorConvertState *s, PIXEL *y_ptr, int n)
+{
+    __m128i c, v, zero;
+    int i;
+
+    /* 0 gives pixel_max, otherwise pixel_max + 1 - v */
+    c = _mm_set1_epi16(s->pixel_max + 1);
+    zero = _mm_setzero_si128();
+    for(i = 0; i + 8 <= n; i += 8) {
+        v = _mm_loadu_si128((__m128i *)(y_ptr + i));
+        v = _mm_add_epi16(_mm_sub_epi16(c, v), _mm_cmpeq_epi16(v, zero));
+        _mm_storeu_si128((__m128i *)(y_ptr + i), v);
+    }
+    gray_neg_c(s, y_ptr + i, n - i);
+}
+
+#endif /* HAVE_SSE2 */
+
+#ifdef HAVE_AVX2
+
+static int cpu_has_avx2(void)
+{
+    static int has_avx2 = -1;
+    if (has_avx2 < 0) {
+        __builtin_cpu_init();
+        has_avx2 = __builtin_cpu_supports("avx2") != 0;
+    }
+    return has_avx2;
+}
+
+/* load 8 RGB pixels as 32 bit integers */
+static inline AVX2_FUNC void load_rgb_avx2(__m256i *pr, __m256i *pg,
+                                           __m256i *pb, const uint8_t *src,
+                                           int incr, int is_16bit)
+{
+    __m128i r[2], g[2], b[2];
+    int j;
+
+    for(j = 0; j < 2; j++) {
+        load_rgb_sse2(&r[j], &g[j], &b[j], src + ((4 * j * incr) << is_16bit),
+                      incr, is_16bit);
+    }
+    *pr = _mm256_inserti128_si256(_mm256_castsi128_si256(r[0]), r[1], 1);
+    *pg = _mm256_inserti128_si256(_mm256_castsi128_si256(g[0]), g[1], 1);
+    *pb = _mm256_inserti128_si256(_mm256_castsi128_si256(b[0]), b[1], 1);
+}
+
+static inline AVX2_FUNC __m256i madd3_avx2(__m256i r, __m256i g, __m256i b,
+                                           __m256i c0, __m256i c1, __m256i c2,
+                                           __m256i rnd, __m128i shift)
+{
+    __m256i a;
+    a = _mm256_add_epi32(_mm256_mullo_epi32(r, c0),
+                         _mm256_mullo_epi32(g, c1));
+    a = _mm256_add_epi32(a, _mm256_mullo_epi32(b, c2));
+    return _mm256_sra_epi32(_mm256_add_epi32(a, rnd), shift);
+}
+
+static inline AVX2_FUNC void store_pix_avx2(PIXEL *dst, __m256i a,
+                                            __m128i pixel_max)
+{
+    __m128i b;
+    b = _mm_packs_epi32(_mm256_castsi256_si128(a),
+                        _mm256_extracti128_si256(a, 1));
+    b = _mm_min_epi16(_mm_max_epi16(b, _mm_setzero_si128()), pixel_max);
+    _mm_storeu_si128((__m128i *)dst, b);
+}
+
+static inline AVX2_FUNC void rgb_to_ycc_avx2(ColorConvertState *s,
+                                             PIXEL *y_ptr, PIXEL *cb_ptr,
+                                             PIXEL *cr_ptr, const void *src1,
+                                             int n, int incr, int is_16bit)
+{
+    const uint8_t *src = src1;
+    __m256i r, g, b, c[9], rnd, y_offset, center;
+    __m128i shift, pixel_max;
+    int i, pixel_size;
+
+    for(i = 0; i < 9; i++)
+        c[i] = _mm256_set1_epi32(s->rgb_to_ycc[i]);
+    shift = _mm_cvtsi32_si128(s->c_shift);
+    rnd = _mm256_set1_epi32(s->c_rnd);
+    y_offset = _mm256_set1_epi32(s->y_offset);
+    center = _mm256_set1_epi32(s->c_center);
+    pixel_max = _mm_set1_epi16(s->pixel_max);
+    pixel_size = incr << is_16bit;
+    for(i = 0; i + 8 <= n - CVT_TAIL; i += 8) {
+        load_rgb_avx2(&r, &g, &b, src + i * pixel_size, incr, is_16bit);
+        store_pix_avx2(y_ptr + i,
+                       madd3_avx2(r, g, b, c[0], c[1], c[2], y_offset, shift),
+                       pixel_max);
+        store_pix_avx2(cb_ptr + i,
+                       _mm256_add_epi32(madd3_avx2(r, g, b, c[3], c[4], c[5],
+                                                   rnd, shift), center),
+                       pixel_max);
+        store_pix_avx2(cr_ptr + i,
+                       _mm256_add_epi32(madd3_avx2(r, g, b, c[6], c[7], c[8],
+                                                   rnd, shift), center),
+                       pixel_max);
+    }
+    if (is_16bit) {
+        rgb48_to_ycc(s, y_ptr + i, cb_ptr + i, cr_ptr + i,
+                     src + i * pixel_size, n - i, incr);
+    } else {
+        rgb24_to_ycc(s, y_ptr + i, cb_ptr + i, cr_ptr + i,
+                     src + i * pixel_size, n - i, incr);
+    }
+}
+
+static AVX2_FUNC void rgb24_to_ycc_avx2(ColorConvertState *s,
+                                        PIXEL *y_ptr, PIXEL *cb_ptr,
+                                        PIXEL *cr_ptr, const void *src,
+                                        int n, int incr)
+{
+    rgb_to_ycc_avx2(s, y_ptr, cb_ptr, cr_ptr, src, n, incr, 0);
+}
+
+static AVX2_FUNC void rgb48_to_ycc_avx2(ColorConvertState *s,
+                                        PIXEL *y_ptr, PIXEL *cb_ptr,
+                                        PIXEL *cr_ptr, const void *src,
+                                        int n, int incr)
+{
+    rgb_to_ycc_avx2(s, y_ptr, cb_ptr, cr_ptr, src, n, incr, 1);
+}
+
+static inline AVX2_FUNC void rgb_to_ycgco_avx2(ColorConvertState *s,
+                                               PIXEL *y_ptr, PIXEL *cb_ptr,
+                                               PIXEL *cr_ptr,
+                                               const void *src1, int n,
+                                               int incr, int is_16bit)
+{
+    const uint8_t *src = src1;
+    __m256i r, g, b, t1, t2, c_0_5, c_0_25, rnd, y_offset, center;
+    __m128i shift, pixel_max;
+    int i, pixel_size;
+
+    c_0_5 = _mm256_set1_epi32(s->c_0_5);
+    c_0_25 = _mm256_set1_epi32(s->c_0_25);
+    shift = _mm_cvtsi32_si128(s->c_shift);
+    rnd = _mm256_set1_epi32(s->c_rnd);
+    y_offset = _mm256_set1_epi32(s->y_offset);
+    center = _mm256_set1_epi32(s->c_center);
+    pixel_max = _mm_set1_epi16(s->pixel_max);
+    pixel_size = incr << is_16bit;
+    for(i = 0; i + 8 <= n - CVT_TAIL; i += 8) {
+        load_rgb_avx2(&r, &g, &b, src + i * pixel_size, incr, is_16bit);
+        t1 = _mm256_mullo_epi32(g, c_0_5);
+        t2 = _mm256_mullo_epi32(_mm256_add_epi32(r, b), c_0_25);
+        store_pix_avx2(y_ptr + i,
+                       _mm256_sra_epi32(_mm256_add_epi32(
+                           _mm256_add_epi32(t1, t2), y_offset), shift),
+                       pixel_max);
+        store_pix_avx2(cb_ptr + i,
+                       _mm256_add_epi32(_mm256_sra_epi32(_mm256_add_epi32(
+                           _mm256_sub_epi32(t1, t2), rnd), shift), center),
+                       pixel_max);
+        t1 = _mm256_mullo_epi32(_mm256_sub_epi32(r, b), c_0_5);
+        store_pix_avx2(cr_ptr + i,
+                       _mm256_add_epi32(_mm256_sra_epi32(
+                           _mm256_add_epi32(t1, rnd), shift), center),
+                       pixel_max);
+    }
+    if (is_16bit) {
+        rgb48_to_ycgco(s, y_ptr + i, cb_ptr + i, cr_ptr + i,
+                       src + i * pixel_size, n - i, incr);
+    } else {
+        rgb24_to_ycgco(s, y_ptr + i, cb_ptr + i, cr_ptr + i,
+                       src + i * pixel_size, n - i, incr);
+    }
+}
+
+static AVX2_FUNC void rgb24_to_ycgco_avx2(ColorConvertState *s,
+                                          PIXEL *y_ptr, PIXEL *cb_ptr,
+                                          PIXEL *cr_ptr, const void *src,
+                                          int n, int incr)
+{
+    rgb_to_ycgco_avx2(s, y_ptr, cb_ptr, cr_ptr, src, n, incr, 0);
+}
+
+static AVX2_FUNC void rgb48_to_ycgco_avx2(ColorConvertState *s,
+                                          PIXEL *y_ptr, PIXEL *cb_ptr,
+                                          PIXEL *cr_ptr, const void *src,
+                                          int n, int incr)
+{
+    rgb_to_ycgco_avx2(s, y_ptr, cb_ptr, cr_ptr, src, n, incr, 1);
+}
+
+static inline AVX2_FUNC void rgb_to_rgb_avx2(ColorConvertState *s,
+                                             PIXEL *y_ptr, PIXEL *cb_ptr,
+                                             PIXEL *cr_ptr, const void *src1,
+                                             int n, int incr, int is_16bit)
+{
+    const uint8_t *src = src1;
+    __m256i r, g, b, c, rnd;
+    __m128i shift, pixel_max;
+    int i, pixel_size;
+
+    c = _mm256_set1_epi32(s->y_one);
+    shift = _mm_cvtsi32_si128(s->c_shift);
+    rnd = _mm256_set1_epi32(s->y_offset);
+    pixel_max = _mm_set1_epi16(s->pixel_max);
+    pixel_size = incr << is_16bit;
+    for(i = 0; i + 8 <= n - CVT_TAIL; i += 8) {
+        load_rgb_avx2(&r, &g, &b, src + i * pixel_size, incr, is_16bit);
+        store_pix_avx2(y_ptr + i, _mm256_sra_epi32(_mm256_add_epi32(
+                           _mm256_mullo_epi32(g, c), rnd), shift), pixel_max);
+        store_pix_avx2(cb_ptr + i, _mm256_sra_epi32(_mm256_add_epi32(
+                           _mm256_mullo_epi32(b, c), rnd), shift), pixel_max);
+        store_pix_avx2(cr_ptr + i, _mm256_sra_epi32(_mm256_add_epi32(
+                           _mm256_mullo_epi32(r, c), rnd), shift), pixel_max);
+    }
+    if (is_16bit) {
+        rgb48_to_rgb(s, y_ptr + i, cb_ptr + i, cr_ptr + i,
+                     src + i * pixel_size, n - i, incr);
+    } else {
+        rgb24_to_rgb(s, y_ptr + i, cb_ptr + i, cr_ptr + i,
+                     src + i * pixel_size, n - i, incr);
+    }
+}
+
+static AVX2_FUNC void rgb24_to_rgb_avx2(ColorConvertState *s,
+                                        PIXEL *y_ptr, PIXEL *cb_ptr,
+                                        PIXEL *cr_ptr, const void *src,
+                                        int n, int incr)
+{
+    rgb_to_rgb_avx2(s, y_ptr, cb_ptr, cr_ptr, src, n, incr, 0);
+}
+
+static AVX2_FUNC void rgb48_to_rgb_avx2(ColorConvertState *s,
+                                        PIXEL *y_ptr, PIXEL *cb_ptr,
+                                        PIXEL *cr_ptr, const void *src,
+                                        int n, int incr)
+{
+    rgb_to_rgb_avx2(s, y_ptr, cb_ptr, cr_ptr, src, n, incr, 1);
+}
+
+static AVX2_FUNC void gray_one_minus_avx2(ColorConvertState *s,
+                                          PIXEL *y_ptr, int n)
+{
+    __m256i pixel_max, v;
+    int i;
+
+    pixel_max = _mm256_set1_epi16(s->pixel_max);
+    for(i = 0; i + 16 <= n; i += 16) {
+        v = _mm256_loadu_si256((__m256i *)(y_ptr + i));
+        _mm256_storeu_si256((__m256i *)(y_ptr + i),
+                            _mm256_sub_epi16(pixel_max, v));
+    }
+    gray_one_minus(s, y_ptr + i, n - i);
+}
+
+static AVX2_FUNC void gray_neg_c_avx2(ColorConvertState *s,
+                                      PIXEL *y_ptr, int n)
+{
+    __m256i c, v, zero;
+    int i;
+
+    c = _mm256_set1_epi16(s->pixel_max + 1);
+    zero = _mm256_setzero_si256();
+    for(i = 0; i + 16 <= n; i += 16) {
+        v = _mm256_loadu_si256((__m256i *)(y_ptr + i));
+        v = _mm256_add_epi16(_mm256_sub_epi16(c, v),
+                             _mm256_cmpeq_epi16(v, zero));
+        _mm256_storeu_si256((__m256i *)(y_ptr + i), v);
+    }
+    gray_neg_c(s, y_ptr + i, n - i);
+}
+
+#endif /* HAVE_AVX2 */
+
+#ifdef HAVE_NEON
+
+/* load 8 RGB pixels as two groups of 4 32 bit integers */
+static inline void load_rgb_neon(int32x4_t *r, int32x4_t *g, int32x4_t *b,
+                                 const void *src, int incr, int is_16bit)
+{
+    uint16x8_t r16, g16, b16;
+
+    if (!is_16bit) {
+        if (incr == 4) {
+            uint8x8x4_t a = vld4_u8((const uint8_t *)src);
+            r16 = vmovl_u8(a.val[0]);
+            g16 = vmovl_u8(a.val[1]);
+            b16 = vmovl_u8(a.val[2]);
+        } else {
+            uint8x8x3_t a = vld3_u8((const uint8_t *)src);
+            r16 = vmovl_u8(a.val[0]);
+            g16 = vmovl_u8(a.val[1]);
+            b16 = vmovl_u8(a.val[2]);
+        }
+    } else {
+        if (incr == 4) {
+            uint16x8x4_t a = vld4q_u16((const uint16_t *)src);
+            r16 = a.val[0];
+            g16 = a.val[1];
+            b16 = a.val[2];
+        } else {
+            uint16x8x3_t a = vld3q_u16((const uint16_t *)src);
+            r16 = a.val[0];
+            g16 = a.val[1];
+            b16 = a.val[2];
+        }
+    }
+    r[0] = vreinterpretq_s32_u32(vmovl_u16(vget_low_u16(r16)));
+    r[1] = vreinterpretq_s32_u32(vmovl_u16(vget_high_u16(r16)));
+    g[0] = vreinterpretq_s32_u32(vmovl_u16(vget_low_u16(g16)));
+    g[1] = vreinterpretq_s32_u32(vmovl_u16(vget_high_u16(g16)));
+    b[0] = vreinterpretq_s32_u32(vmovl_u16(vget_low_u16(b16)));
+    b[1] = vreinterpretq_s32_u32(vmovl_u16(vget_high_u16(b16)));
+}
+
+/* (c0 * r + c1 * g + c2 * b + rnd) >> shift. 'shift' contains -shift. */
+static inline int32x4_t madd3_neon(int32x4_t r, int32x4_t g, int32x4_t b,
+                                   int32_t c0, int32_t c1, int32_t c2,
+                                   int32x4_t rnd, int32x4_t shift)
+{
+    int32x4_t a;
+    a = vmlaq_n_s32(rnd, r, c0);
+    a = vmlaq_n_s32(a, g, c1);
+    a = vmlaq_n_s32(a, b, c2);
+    return vshlq_s32(a, shift);
+}
+
+static inline void store_pix_neon(PIXEL *dst, int32x4_t a0, int32x4_t a1,
+                                  int16x8_t pixel_max)
+{
+    int16x8_t a;
+    a = vcombine_s16(vqmovn_s32(a0), vqmovn_s32(a1));
+    a = vminq_s16(vmaxq_s16(a, vdupq_n_s16(0)), pixel_max);
+    vst1q_u16(dst, vreinterpretq_u16_s16(a));
+}
+
+static inline void rgb_to_ycc_neon(ColorConvertState *s,
+                                   PIXEL *y_ptr, PIXEL *cb_ptr, PIXEL *cr_ptr,
+                                   const void *src1, int n, int incr,
+                                   int is_16bit)
+{
+    const uint8_t *src = src1;
+    const int *c = s->rgb_to_ycc;
+    int32x4_t r[2], g[2], b[2], v[2], shift, rnd, y_offset, center;
+    int16x8_t pixel_max;
+    int i, j, pixel_size;
+
+    shift = vdupq_n_s32(-s->c_shift);
+    rnd = vdupq_n_s32(s->c_rnd);
+    y_offset = vdupq_n_s32(s->y_offset);
+    center = vdupq_n_s32(s->c_center);
+    pixel_max = vdupq_n_s16(s->pixel_max);
+    pixel_size = incr << is_16bit;
+    for(i = 0; i + 8 <= n; i += 8) {
+        load_rgb_neon(r, g, b, src + i * pixel_size, incr, is_16bit);
+        for(j = 0; j < 2; j++) {
+            v[j] = madd3_neon(r[j], g[j], b[j], c[0], c[1], c[2],
+                              y_offset, shift);
+        }
+        store_pix_neon(y_ptr + i, v[0], v[1], pixel_max);
+        for(j = 0; j < 2; j++) {
+            v[j] = vaddq_s32(madd3_neon(r[j], g[j], b[j], c[3], c[4], c[5],
+                                        rnd, shift), center);
+        }
+        store_pix_neon(cb_ptr + i, v[0], v[1], pixel_max);
+        for(j = 0; j < 2; j++) {
+            v[j] = vaddq_s32(madd3_neon(r[j], g[j], b[j], c[6], c[7], c[8],
+                                        rnd, shift), center);
+        }
+        store_pix_neon(cr_ptr + i, v[0], v[1], pixel_max);
+    }
+    if (is_16bit) {
+        rgb48_to_ycc(s, y_ptr + i, cb_ptr + i, cr_ptr + i,
+                     src + i * pixel_size, n - i, incr);
+    } else {
+        rgb24_to_ycc(s, y_ptr + i, cb_ptr + i, cr_ptr + i,
+                     src + i * pixel_size, n - i, incr);
+    }
+}
+
+static void rgb24_to_ycc_neon(ColorConvertState *s,
+                              PIXEL *y_ptr, PIXEL *cb_ptr, PIXEL *cr_ptr,
+                              const void *src, int n, int incr)
+{
+    rgb_to_ycc_neon(s, y_ptr, cb_ptr, cr_ptr, src, n, incr, 0);
+}
+
+static void rgb48_to_ycc_neon(ColorConvertState *s,
+                              PIXEL *y_ptr, PIXEL *cb_ptr, PIXEL *cr_ptr,
+                              const void *src, int n, int incr)
+{
+    rgb_to_ycc_neon(s, y_ptr, cb_ptr, cr_ptr, src, n, incr, 1);
+}
+
+static inline void rgb_to_ycgco_neon(ColorConvertState *s,
+                                     PIXEL *y_ptr, PIXEL *cb_ptr,
+                                     PIXEL *cr_ptr, const void *src1, int n,
+                                     int incr, int is_16bit)
+{
+    const uint8_t *src = src1;
+    int32x4_t r[2], g[2], b[2], t1, t2, v[3][2];
+    int32x4_t shift, rnd, y_offset, center;
+    int16x8_t pixel_max;
+    int i, j, pixel_size, c_0_5, c_0_25;
+
+    c_0_5 = s->c_0_5;
+    c_0_25 = s->c_0_25;
+    shift = vdupq_n_s32(-s->c_shift);
+    rnd = vdupq_n_s32(s->c_rnd);
+    y_offset = vdupq_n_s32(s->y_offset);
+    center = vdupq_n_s32(s->c_center);
+    pixel_max = vdupq_n_s16(s->pixel_max);
+    pixel_size = incr << is_16bit;
+    for(i = 0; i + 8 <= n; i += 8) {
+        load_rgb_neon(r, g, b, src + i * pixel_size, incr, is_16bit);
+        for(j = 0; j < 2; j++) {
+            t1 = vmulq_n_s32(g[j], c_0_5);
+            t2 = vmulq_n_s32(vaddq_s32(r[j], b[j]), c_0_25);
+            v[0][j] = vshlq_s32(vaddq_s32(vaddq_s32(t1, t2), y_offset),
+                                shift);
+            v[1][j] = vaddq_s32(vshlq_s32(vaddq_s32(vsubq_s32(t1, t2), rnd),
+                                          shift), center);
+            t1 = vmulq_n_s32(vsubq_s32(r[j], b[j]), c_0_5);
+            v[2][j] = vaddq_s32(vshlq_s32(vaddq_s32(t1, rnd), shift),
+                                center);
+        }
+        store_pix_neon(y_ptr + i, v[0][0], v[0][1], pixel_max);
+        store_pix_neon(cb_ptr + i, v[1][0], v[1][1], pixel_max);
+        store_pix_neon(cr_ptr + i, v[2][0], v[2][1], pixel_max);
+    }
+    if (is_16bit) {
+        rgb48_to_ycgco(s, y_ptr + i, cb_ptr + i, cr_ptr + i,
+                       src + i * pixel_size, n - i, incr);
+    } else {
+        rgb24_to_ycgco(s, y_ptr + i, cb_ptr + i, cr_ptr + i,
+                       src + i * pixel_size, n - i, incr);
+    }
+}
+
+static void rgb24_to_ycgco_neon(ColorConvertState *s,
+                                PIXEL *y_ptr, PIXEL *cb_ptr, PIXEL *cr_ptr,
+                                const void *src, int n, int incr)
+{
+    rgb_to_ycgco_neon(s, y_ptr, cb_ptr, cr_ptr, src, n, incr, 0);
+}
+
+static void rgb48_to_ycgco_neon(ColorConvertState *s,
+                                PIXEL *y_ptr, PIXEL *cb_ptr, PIXEL *cr_ptr,
+                                const void *src, int n, int incr)
+{
+    rgb_to_ycgco_neon(s, y_ptr, cb_ptr, cr_ptr, src, n, incr, 1);
+}
+
+static inline void rgb_to_rgb_neon(ColorConvertState *s,
+                                   PIXEL *y_ptr, PIXEL *cb_ptr, PIXEL *cr_ptr,
+                                   const void *src1, int n, int incr,
+                                   int is_16bit)
+{
+    const uint8_t *src = src1;
+    int32x4_t r[2], g[2], b[2], v[3][2], shift, rnd;
+    int16x8_t pixel_max;
+    int i, j, pixel_size, c;
+
+    c = s->y_one;
+    shift = vdupq_n_s32(-s->c_shift);
+    rnd = vdupq_n_s32(s->y_offset);
+    pixel_max = vdupq_n_s16(s->pixel_max);
+    pixel_size = incr << is_16bit;
+    for(i = 0; i + 8 <= n; i += 8) {
+        load_rgb_neon(r, g, b, src + i * pixel_size, incr, is_16bit);
+        for(j = 0; j < 2; j++) {
+            v[0][j] = vshlq_s32(vmlaq_n_s32(rnd, g[j], c), shift);
+            v[1][j] = vshlq_s32(vmlaq_n_s32(rnd, b[j], c), shift);
+            v[2][j] = vshlq_s32(vmlaq_n_s32(rnd, r[j], c), shift);
+        }
+        store_pix_neon(y_ptr + i, v[0][0], v[0][1], pixel_max);
+        store_pix_neon(cb_ptr + i, v[1][0], v[1][1], pixel_max);
+        store_pix_neon(cr_ptr + i, v[2][0], v[2][1], pixel_max);
+    }
+    if (is_16bit) {
+        rgb48_to_rgb(s, y_ptr + i, cb_ptr + i, cr_ptr + i,
+                     src + i * pixel_size, n - i, incr);
+    } else {
+        rgb24_to_rgb(s, y_ptr + i, cb_ptr + i, cr_ptr + i,
+                     src + i * pixel_size, n - i, incr);
+    }
+}
+
+static void rgb24_to_rgb_neon(ColorConvertState *s,
+                              PIXEL *y_ptr, PIXEL *cb_ptr, PIXEL *cr_ptr,
+                              const void *src, int n, int incr)
+{
+    rgb_to_rgb_neon(s, y_ptr, cb_ptr, cr_ptr, src, n, incr, 0);
+}
+
+static void rgb48_to_rgb_neon(ColorConvertState *s,
+                              PIXEL *y_ptr, PIXEL *cb_ptr, PIXEL *cr_ptr,
+                              const void *src, int n, int incr)
+{
+    rgb_to_rgb_neon(s, y_ptr, cb_ptr, cr_ptr, src, n, incr, 1);
+}
+
+static void gray_one_minus_neon(ColorConvertState *s, PIXEL *y_ptr, int n)
+{
+    uint16x8_t pixel_max;
+    int i;
+
+    pixel_max = vdupq_n_u16(s->pixel_max);
+    for(i = 0; i + 8 <= n; i += 8)
+        vst1q_u16(y_ptr + i, vsubq_u16(pixel_max, vld1q_u16(y_ptr + i)));
+    gray_one_minus(s, y_ptr + i, n - i);
+}
+
+static void gray_neg_c_neon(ColorConvertState *s, PIXEL *y_ptr, int n)
+{
+    uint16x8_t c, v;
+    int i;
+
+    c = vdupq_n_u16(s->pixel_max + 1);
+    for(i = 0; i + 8 <= n; i += 8) {
+        v = vld1q_u16(y_ptr + i);
+        /* vceqq gives 0xffff (= -1) when v is 0 */
+        v = vaddq_u16(vsubq_u16(c, v), vceqq_u16(v, vdupq_n_u16(0)));
+        vst1q_u16(y_ptr + i, v);
+    }
+    gray_neg_c(s, y_ptr + i, n - i);
+}
+
+#endif /* HAVE_NEON */
+
+typedef void GrayConvertFunc(ColorConvertState *s, PIXEL *y_ptr, int n);
+
+static GrayConvertFunc *gray_one_minus_func = gray_one_minus;
+static GrayConvertFunc *gray_neg_c_func = gray_neg_c;
+
+static void set_convert_funcs(RGBConvertFunc *ycc24, RGBConvertFunc *rgb24,
+                              RGBConvertFunc *ycgco24, RGBConvertFunc *ycc48,
+                              RGBConvertFunc *rgb48, RGBConvertFunc *ycgco48,
+                              GrayConvertFunc *one_minus,
+                              GrayConvertFunc *neg_c)
+{
+    int i;
+
+    for(i = 0; i < BPG_CS_COUNT; i++) {
+        if (i == BPG_CS_RGB) {
+            rgb_to_cs[0][i] = rgb24;
+            rgb_to_cs[1][i] = rgb48;
+        } else if (i == BPG_CS_YCgCo) {
+            rgb_to_cs[0][i] = ycgco24;
+            rgb_to_cs[1][i] = ycgco48;
+        } else {
+            rgb_to_cs[0][i] = ycc24;
+            rgb_to_cs[1][i] = ycc48;
+        }
+    }
+    gray_one_minus_func = one_minus;
+    gray_neg_c_func = neg_c;
+}
+
+/* select the fastest conversion functions for the CPU */
+static void convert_dsp_init(void)
+{
+    static int inited;
+
+    if (inited)
+        return;
+    inited = 1;
+#ifdef HAVE_SSE2
+    set_convert_funcs(rgb24_to_ycc_sse2, rgb24_to_rgb_sse2,
+                      rgb24_to_ycgco_sse2, rgb48_to_ycc_sse2,
+                      rgb48_to_rgb_sse2, rgb48_to_ycgco_sse2,
+                      gray_one_minus_sse2, gray_neg_c_sse2);
+#endif
+#ifdef HAVE_AVX2
+    if (cpu_has_avx2()) {
+        set_convert_funcs(rgb24_to_ycc_avx2, rgb24_to_rgb_avx2,
+                          rgb24_to_ycgco_avx2, rgb48_to_ycc_avx2,
+                          rgb48_to_rgb_avx2, rgb48_to_ycgco_avx2,
+                          gray_one_minus_avx2, gray_neg_c_avx2);
+    }
+#endif
+#ifdef HAVE_NEON
+    set_convert_funcs(rgb24_to_ycc_neon, rgb24_to_rgb_neon,
+                      rgb24_to_ycgco_neon, rgb48_to_ycc_neon,
+                      rgb48_to_rgb_neon, rgb48_to_ycgco_neon,
+                      gray_one_minus_neon, gray_neg_c_neon);
+#endif
+}
+
+
+/* decimation */
+
+/* phase = 0 */
+#define DP0TAPS2 7
+#define DP0TAPS (2 * DP0TAPS + 1)
+#define DP0C0 64
+#define DP0C1 40
+#define DP0C3 (-11)
+#define DP0C5 4
+#define DP0C7 (-1)
+
+/* phase = 0.5 */
+#define DP1TAPS2 5
+#define DP1TAPS (2 * DP1TAPS2)
+#define DP1C0 57
+#define DP1C1 17
+#define DP1C2 (-8)
+#define DP1C3 (-4)
+#define DP1C4 2
+
+#define DTAPS_MAX 7
+
+/* chroma aligned with luma samples */
+static void decimate2p0_simple(PIXEL *dst, PIXEL *src, int n, int bit_depth)
+{
+    int n2, i, pixel_max;
+    pixel_max = (1 << bit_depth) - 1;
+    n2 = (n + 1) / 2;
+    for(i = 0; i < n2; i++) {
+        dst[i] = clamp_pix(((src[-7] + src[7]) * DP0C7 + 
+                            (src[-5] + src[5]) * DP0C5 + 
+                            (src[-3] + src[3]) * DP0C3 + 
+                            (src[-1] + src[1]) * DP0C1 + 
+                            src[0] * DP0C0 + 64) >> 7, pixel_max);
+        src += 2;
+    }
+}
+
+/* same with more precision and no saturation */
+static void decimate2p0_simple16(int16_t *dst, PIXEL *src, int n, int bit_depth)
+{
+    int n2, i, shift, rnd;
+    shift = bit_depth - 7;
+    rnd = 1 << (shift - 1);
+    n2 = (n + 1) / 2;
+    for(i = 0; i < n2; i++) {
+        dst[i] = ((src[-7] + src[7]) * DP0C7 + 
+                  (src[-5] + src[5]) * DP0C5 + 
+                  (src[-3] + src[3]) * DP0C3 + 
+                  (src[-1] + src[1]) * DP0C1 + 
+                  src[0] * DP0C0 + rnd) >> shift;
+    src += 2;
+    }
+}
+
+
+/* chroma half way between luma samples */
+static void decimate2p1_simple(PIXEL *dst, PIXEL *src, int n, int bit_depth)
+{
+    int n2, i, pixel_max;
+    pixel_max = (1 << bit_depth) - 1;
+    n2 = (n + 1) / 2;
+    for(i = 0; i < n2; i++) {
+        dst[i] = clamp_pix(((src[-4] + src[5]) * DP1C4 + 
+                            (src[-3] + src[4]) * DP1C3 + 
+                            (src[-2] + src[3]) * DP1C2 + 
+                            (src[-1] + src[2]) * DP1C1 + 
+                            (src[0] + src[1]) * DP1C0 + 64) >> 7, pixel_max);
+        src += 2;
+    }
+}
+
+/* same with more precision and no saturation */
+static void decimate2p1_simple16(int16_t *dst, PIXEL *src, int n, int bit_depth)
+{
+    int n2, i, shift, rnd;
+    shift = bit_depth - 7;
+    rnd = 1 << (shift - 1);
+    n2 = (n + 1) / 2;
+    for(i = 0; i < n2; i++) {
+        dst[i] = ((src[-4] + src[5]) * DP1C4 + 
+                  (src[-3] + src[4]) * DP1C3 + 
+                  (src[-2] + src[3]) * DP1C2 + 
+                  (src[-1] + src[2]) * DP1C1 + 
+                  (src[0] + src[1]) * DP1C0 + rnd) >> shift;
+        src += 2;
+    }
+}
+
+/* src[] contains the DP1TAPS input lines */
+static void decimate2_v_simple(PIXEL *dst, int16_t **src, int n,
+                               int bit_depth)
+{
+    int16_t *src0, *src1, *src2, *src3, *src4, *src5, *srcm1, *srcm2, *srcm3, *srcm4;
+    int i, shift, offset, pixel_max;
+
+    srcm4 = src[0];
+    srcm3 = src[1];
+    srcm2 = src[2];
+    srcm1 = src[3];
+    src0 = src[4];
+    src1 = src[5];
+    src2 = src[6];
+    src3 = src[7];
+    src4 = src[8];
+    src5 = src[9];
+    
+    shift = 21 - bit_depth;
+    offset = 1 << (shift - 1);
+    pixel_max = (1 << bit_depth) - 1;
+    for(i = 0; i < n; i++) {
+        dst[i] = clamp_pix(((srcm4[i] + src5[i]) * DP1C4 + 
+                            (srcm3[i] + src4[i]) * DP1C3 + 
+                            (srcm2[i] + src3[i]) * DP1C2 + 
+                            (srcm1[i] + src2[i]) * DP1C1 + 
+                            (src0[i] + src1[i]) * DP1C0 + offset) >> shift, pixel_max);
+    }
+}
+
+typedef void Decimate2Func(PIXEL *dst, PIXEL *src, int n, int bit_depth);
+typedef void Decimate2Func16(int16_t *dst, PIXEL *src, int n, int bit_depth);
+typedef void Decimate2VFunc(PIXEL *dst, int16_t **src, int n, int bit_depth);
+
+/* SIMD versions of the decimation filters. They give exactly the same
+   results as the C versions. The horizontal filters need 'n + 2 *
+   DPxTAPS2' valid input pixels as the C versions and the last outputs
+   are computed by the C versions so that the vector loads stay in
+   the line. */
+
+#if defined(HAVE_SSE2) || defined(HAVE_NEON)
+
+/* coefficients applied to src[2 * i + DP0_K0 + j] */
+#define DP0_K0 (-7)
+#define DP0_NTAPS 16
+static const int16_t dp0_taps[DP0_NTAPS] = {
+    DP0C7, 0, DP0C5, 0, DP0C3, 0, DP0C1, DP0C0,
+    DP0C1, 0, DP0C3, 0, DP0C5, 0, DP0C7, 0,
+};
+
+/* coefficients applied to src[2 * i + DP1_K0 + j] */
+#define DP1_K0 (-4)
+#define DP1_NTAPS 10
+static const int16_t dp1_taps[DP1_NTAPS] = {
+    DP1C4, DP1C3, DP1C2, DP1C1, DP1C0, DP1C0, DP1C1, DP1C2, DP1C3, DP1C4,
+};
+
+#endif
+
+#ifdef HAVE_SSE2
+
+/* 32 bit filter sums for the 4 output pixels starting at 'src'. The
+   filter is applied by pairs of taps with pmaddwd. */
+static inline __m128i decimate2_h4_sse2(const PIXEL *src, const __m128i *c,
+                                        int k0, int n_pairs)
+{
+    __m128i sum;
+    int j;
+
+    sum = _mm_setzero_si128();
+    for(j = 0; j < n_pairs; j++) {
+        sum = _mm_add_epi32(sum, _mm_madd_epi16(_mm_loadu_si128((__m128i *)(src + k0 + 2 * j)), c[j]));
+    }
+    return sum;
+}
+
+/* 'is_16' selects the decimate2px_simple16() output */
+static inline void decimate2_h_sse2(void *dst1, PIXEL *src, int n,
+                                    int bit_depth, int phase, int is_16)
+{
+    const int16_t *taps;
+    int16_t *dst = dst1;
+    __m128i c[DP0_NTAPS / 2], rnd, shift, pixel_max, a0, a1, r;
+    int i, j, k0, n_pairs, sh;
+
+    if (phase == 0) {
+        taps = dp0_taps;
+        k0 = DP0_K0;
+        n_pairs = DP0_NTAPS / 2;
+    } else {
+        taps = dp1_taps;
+        k0 = DP1_K0;
+        n_pairs = DP1_NTAPS / 2;
+    }
+    for(j = 0; j < n_pairs; j++) {
+        c[j] = _mm_setr_epi16(taps[2 * j], taps[2 * j + 1],
+                              taps[2 * j], taps[2 * j + 1],
+                              taps[2 * j], taps[2 * j + 1],
+                              taps[2 * j], taps[2 * j + 1]);
+    }
+    if (is_16)
+        sh = bit_depth - 7;
+    else
+        sh = 7;
+    rnd = _mm_set1_epi32(1 << (sh - 1));
+    shift = _mm_cvtsi32_si128(sh);
+    pixel_max = _mm_set1_epi16((1 << bit_depth) - 1);
+    for(i = 0; 2 * (i + 8) <= n; i += 8) {
+        a0 = decimate2_h4_sse2(src + 2 * i, c, k0, n_pairs);
+        a1 = decimate2_h4_sse2(src + 2 * i + 8, c, k0, n_pairs);
+        a0 = _mm_sra_epi32(_mm_add_epi32(a0, rnd), shift);
+        a1 = _mm_sra_epi32(_mm_add_epi32(a1, rnd), shift);
+        r = _mm_packs_epi32(a0, a1);
+        if (!is_16)
+            r = _mm_min_epi16(_mm_max_epi16(r, _mm_setzero_si128()), pixel_max);
+        _mm_storeu_si128((__m128i *)(dst + i), r);
+    }
+    if (phase == 0) {
+        if (is_16)
+            decimate2p0_simple16(dst + i, src + 2 * i, n - 2 * i, bit_depth);
+        else
+            decimate2p0_simple((PIXEL *)dst + i, src + 2 * i, n - 2 * i, bit_depth);
+    } else {
+        if (is_16)
+            decimate2p1_simple16(dst + i, src + 2 * i, n - 2 * i, bit_depth);
+        else
+            decimate2p1_simple((PIXEL *)dst + i, src + 2 * i, n - 2 * i, bit_depth);
+    }
+}
+
+static void decimate2p0_simple_sse2(PIXEL *dst, PIXEL *src, int n,
+                                    int bit_depth)
+{
+    decimate2_h_sse2(dst, src, n, bit_depth, 0, 0);
+}
+
+static void decimate2p0_simple16_sse2(int16_t *dst, PIXEL *src, int n,
+                                      int bit_depth)
+{
+    decimate2_h_sse2(dst, src, n, bit_depth, 0, 1);
+}
+
+static void decimate2p1_simple_sse2(PIXEL *dst, PIXEL *src, int n,
+                                    int bit_depth)
+{
+    decimate2_h_sse2(dst, src, n, bit_depth, 1, 0);
+}
+
+static void decimate2p1_simple16_sse2(int16_t *dst, PIXEL *src, int n,
+                                      int bit_depth)
+{
+    decimate2_h_sse2(dst, src, n, bit_depth, 1, 1);
+}
+
+/* the 16 bit sums of symmetric lines may overflow, so the lines are
+   interleaved and multiplied with pmaddwd */
+static void decimate2_v_simple_sse2(PIXEL *dst, int16_t **src, int n,
+                                    int bit_depth)
+{
+    static const int16_t coefs[DP1TAPS2] = { DP1C4, DP1C3, DP1C2, DP1C1, DP1C0 };
+    int16_t *src1[DP1TAPS];
+    __m128i c[DP1TAPS2], offset, shift, pixel_max, a, b, lo, hi, r;
+    int i, j, sh;
+
+    for(j = 0; j < DP1TAPS2; j++)
+        c[j] = _mm_set1_epi16(coefs[j]);
+    sh = 21 - bit_depth;
+    offset = _mm_set1_epi32(1 << (sh - 1));
+    shift = _mm_cvtsi32_si128(sh);
+    pixel_max = _mm_set1_epi16((1 << bit_depth) - 1);
+    for(i = 0; i + 8 <= n; i += 8) {
+        lo = offset;
+        hi = offset;
+        for(j = 0; j < DP1TAPS2; j++) {
+            a = _mm_loadu_si128((__m128i *)(src[j] + i));
+            b = _mm_loadu_si128((__m128i *)(src[DP1TAPS - 1 - j] + i));
+            lo = _mm_add_epi32(lo, _mm_madd_epi16(_mm_unpacklo_epi16(a, b), c[j]));
+            hi = _mm_add_epi32(hi, _mm_madd_epi16(_mm_unpackhi_epi16(a, b), c[j]));
+        }
+        r = _mm_packs_epi32(_mm_sra_epi32(lo, shift), _mm_sra_epi32(hi, shift));
+        r = _mm_min_epi16(_mm_max_epi16(r, _mm_setzero_si128()), pixel_max);
+        _mm_storeu_si128((__m128i *)(dst + i), r);
+    }
+    if (i < n) {
+        for(j = 0; j < DP1TAPS; j++)
+            src1[j] = src[j] + i;
+        decimate2_v_simple(dst + i, src1, n - i, bit_depth);
+    }
+}
+
+#endif /* HAVE_SSE2 */
+
+#ifdef HAVE_AVX2
+
+static inline AVX2_FUNC __m256i decimate2_h8_avx2(const PIXEL *src,
+                                                  const __m256i *c,
+                                                  int k0, int n_pairs)
+{
+    __m256i sum;
+    int j;
+
+    sum = _mm256_setzero_si256();
+    for(j = 0; j < n_pairs; j++) {
+        sum = _mm256_add_epi32(sum, _mm256_madd_epi16(_mm256_loadu_si256((__m256i *)(src + k0 + 2 * j)), c[j]));
+    }
+    return sum;
+}
+
+static inline AVX2_FUNC void decimate2_h_avx2(void *dst1, PIXEL *src, int n,
+                                              int bit_depth, int phase,
+                                              int is_16)
+{
+    const int16_t *taps;
+    int16_t *dst = dst1;
+    __m256i c[DP0_NTAPS / 2], rnd, pixel_max, a0, a1, r;
+    __m128i shift;
+    int i, j, k0, n_pairs, sh;
+
+    if (phase == 0) {
+        taps = dp0_taps;
+        k0 = DP0_K0;
+        n_pairs = DP0_NTAPS / 2;
+    } else {
+        taps = dp1_taps;
+        k0 = DP1_K0;
+        n_pairs = DP1_NTAPS / 2;
+    }
+    for(j = 0; j < n_pairs; j++) {
+        c[j] = _mm256_set1_epi32((uint16_t)taps[2 * j] |
+                                 ((uint32_t)(uint16_t)taps[2 * j + 1] << 16));
+    }
+    if (is_16)
+        sh = bit_depth - 7;
+    else
+        sh = 7;
+    rnd = _mm256_set1_epi32(1 << (sh - 1));
+    shift = _mm_cvtsi32_si128(sh);
+    pixel_max = _mm256_set1_epi16((1 << bit_depth) - 1);
+    for(i = 0; 2 * (i + 16) <= n; i += 16) {
+        a0 = decimate2_h8_avx2(src + 2 * i, c, k0, n_pairs);
+        a1 = decimate2_h8_avx2(src + 2 * i + 16, c, k0, n_pairs);
+        a0 = _mm256_sra_epi32(_mm256_add_epi32(a0, rnd), shift);
+        a1 = _mm256_sra_epi32(_mm256_add_epi32(a1, rnd), shift);
+        /* packs works on each 128 bit lane */
+        r = _mm256_permute4x64_epi64(_mm256_packs_epi32(a0, a1),
+                                     _MM_SHUFFLE(3, 1, 2, 0));
+        if (!is_16) {
+            r = _mm256_min_epi16(_mm256_max_epi16(r, _mm256_setzero_si256()),
+                                 pixel_max);
+        }
+        _mm256_storeu_si256((__m256i *)(dst + i), r);
+    }
+    decimate2_h_sse2(dst + i, src + 2 * i, n - 2 * i, bit_depth, phase, is_16);
+}
+
+static AVX2_FUNC void decimate2p0_simple_avx2(PIXEL *dst, PIXEL *src, int n,
+                                              int bit_depth)
+{
+    decimate2_h_avx2(dst, src, n, bit_depth, 0, 0);
+}
+
+static AVX2_FUNC void decimate2p0_simple16_avx2(int16_t *dst, PIXEL *src,
+                                                int n, int bit_depth)
+{
+    decimate2_h_avx2(dst, src, n, bit_depth, 0, 1);
+}
+
+static AVX2_FUNC void decimate2p1_simple_avx2(PIXEL *dst, PIXEL *src, int n,
+                                              int bit_depth)
+{
+    decimate2_h_avx2(dst, src, n, bit_depth, 1, 0);
+}
+
+static AVX2_FUNC void decimate2p1_simple16_avx2(int16_t *dst, PIXEL *src,
+                                                int n, int bit_depth)
+{
+    decimate2_h_avx2(dst, src, n, bit_depth, 1, 1);
+}
+
+static AVX2_FUNC void decimate2_v_simple_avx2(PIXEL *dst, int16_t **src,
+                                              int n, int bit_depth)
+{
+    static const int16_t coefs[DP1TAPS2] = { DP1C4, DP1C3, DP1C2, DP1C1, DP1C0 };
+    int16_t *src1[DP1TAPS];
+    __m256i c[DP1TAPS2], offset, pixel_max, a, b, lo, hi, r;
+    __m128i shift;
+    int i, j, sh;
+
+    for(j = 0; j < DP1TAPS2; j++)
+        c[j] = _mm256_set1_epi16(coefs[j]);
+    sh = 21 - bit_depth;
+    offset = _mm256_set1_epi32(1 << (sh - 1));
+    shift = _mm_cvtsi32_si128(sh);
+    pixel_max = _mm256_set1_epi16((1 << bit_depth) - 1);
+    for(i = 0; i + 16 <= n; i += 16) {
+        lo = offset;
+        hi = offset;
+        for(j = 0; j < DP1TAPS2; j++) {
+            a = _mm256_loadu_si256((__m256i *)(src[j] + i));
+            b = _mm256_loadu_si256((__m256i *)(src[DP1TAPS - 1 - j] + i));
+            lo = _mm256_add_epi32(lo, _mm256_madd_epi16(_mm256_unpacklo_epi16(a, b), c[j]));
+            hi = _mm256_add_epi32(hi, _mm256_madd_epi16(_mm256_unpackhi_epi16(a, b), c[j]));
+        }
+        /* unpack and packs work on each 128 bit lane, so the pixel
+           order is preserved */
+        r = _mm256_packs_epi32(_mm256_sra_epi32(lo, shift),
+                               _mm256_sra_epi32(hi, shift));
+        r = _mm256_min_epi16(_mm256_max_epi16(r, _mm256_setzero_si256()),
+                             pixel_max);
+        _mm256_storeu_si256((__m256i *)(dst + i), r);
+    }
+    if (i < n) {
+        for(j = 0; j < DP1TAPS; j++)
+            src1[j] = src[j] + i;
+        decimate2_v_simple_sse2(dst + i, src1, n - i, bit_depth);
+    }
+}
+
+#endif /* HAVE_AVX2 */
+
+#ifdef HAVE_NEON
+
+/* 8 output pixels: the taps are loaded with vld2 so that the input
+   pixels used by each tap are contiguous */
+static inline void decimate2_h8_neon(int32x4_t *plo, int32x4_t *phi,
+                                     const PIXEL *src, const int16_t *taps,
+                                     int k0, int n_taps)
+{
+    int32x4_t lo, hi;
+    int16x8_t v;
+    int j;
+
+    lo = vdupq_n_s32(0);
+    hi = vdupq_n_s32(0);
+    for(j = 0; j < n_taps; j++) {
+        if (taps[j] == 0)
+            continue;
+        v = vreinterpretq_s16_u16(vld2q_u16((const uint16_t *)(src + k0 + j)).val[0]);
+        lo = vmlal_n_s16(lo, vget_low_s16(v), taps[j]);
+        hi = vmlal_n_s16(hi, vget_high_s16(v), taps[j]);
+    }
+    *plo = lo;
+    *phi = hi;
+}
+
+static inline void decimate2_h_neon(void *dst1, PIXEL *src, int n,
+                                    int bit_depth, int phase, int is_16)
+{
+    const int16_t *taps;
+    int16_t *dst = dst1;
+    int32x4_t lo, hi, rnd, shift;
+    int16x8_t r, pixel_max;
+    int i, k0, n_taps, sh;
+
+    if (phase == 0) {
+        taps = dp0_taps;
+        k0 = DP0_K0;
+        n_taps = DP0_NTAPS;
+    } else {
+        taps = dp1_taps;
+        k0 = DP1_K0;
+        n_taps = DP1_NTAPS;
+    }
+    if (is_16)
+        sh = bit_depth - 7;
+    else
+        sh = 7;
+    rnd = vdupq_n_s32(1 << (sh - 1));
+    shift = vdupq_n_s32(-sh);
+    pixel_max = vdupq_n_s16((1 << bit_depth) - 1);
+    for(i = 0; 2 * (i + 8) <= n; i += 8) {
+        decimate2_h8_neon(&lo, &hi, src + 2 * i, taps, k0, n_taps);
+        lo = vshlq_s32(vaddq_s32(lo, rnd), shift);
+        hi = vshlq_s32(vaddq_s32(hi, rnd), shift);
+        r = vcombine_s16(vqmovn_s32(lo), vqmovn_s32(hi));
+        if (!is_16)
+            r = vminq_s16(vmaxq_s16(r, vdupq_n_s16(0)), pixel_max);
+        vst1q_s16(dst + i, r);
+    }
+    if (phase == 0) {
+        if (is_16)
+            decimate2p0_simple16(dst + i, src + 2 * i, n - 2 * i, bit_depth);
+        else
+            decimate2p0_simple((PIXEL *)dst + i, src + 2 * i, n - 2 * i, bit_depth);
+    } else {
+        if (is_16)
+            decimate2p1_simple16(dst + i, src + 2 * i, n - 2 * i, bit_depth);
+        else
+            decimate2p1_simple((PIXEL *)dst + i, src + 2 * i, n - 2 * i, bit_depth);
+    }
+}
+
+static void decimate2p0_simple_neon(PIXEL *dst, PIXEL *src, int n,
+                                    int bit_depth)
+{
+    decimate2_h_neon(dst, src, n, bit_depth, 0, 0);
+}
+
+static void decimate2p0_simple16_neon(int16_t *dst, PIXEL *src, int n,
+                                      int bit_depth)
+{
+    decimate2_h_neon(dst, src, n, bit_depth, 0, 1);
+}
+
+static void decimate2p1_simple_neon(PIXEL *dst, PIXEL *src, int n,
+                                    int bit_depth)
+{
+    decimate2_h_neon(dst, src, n, bit_depth, 1, 0);
+}
+
+static void decimate2p1_simple16_neon(int16_t *dst, PIXEL *src, int n,
+                                      int bit_depth)
+{
+    decimate2_h_neon(dst, src, n, bit_depth, 1, 1);
+}
+
+static void decimate2_v_simple_neon(PIXEL *dst, int16_t **src, int n,
+                                    int bit_depth)
+{
+    static const int16_t coefs[DP1TAPS2] = { DP1C4, DP1C3, DP1C2, DP1C1, DP1C0 };
+    int16_t *src1[DP1TAPS];
+    int32x4_t lo, hi, shift;
+    int16x8_t a, b, r;
+    int i, j, sh;
+
+    sh = 21 - bit_depth;
+    shift = vdupq_n_s32(-sh);
+    for(i = 0; i + 8 <= n; i += 8) {
+        lo = vdupq_n_s32(1 << (sh - 1));
+        hi = lo;
+        for(j = 0; j < DP1TAPS2; j++) {
+            a = vld1q_s16(src[j] + i);
+            b = vld1q_s16(src[DP1TAPS - 1 - j] + i);
+            lo = vmlaq_n_s32(lo, vaddl_s16(vget_low_s16(a), vget_low_s16(b)),
+                             coefs[j]);
+            hi = vmlaq_n_s32(hi, vaddl_s16(vget_high_s16(a), vget_high_s16(b)),
+                             coefs[j]);
+        }
+        r = vcombine_s16(vqmovn_s32(vshlq_s32(lo, shift)),
+                         vqmovn_s32(vshlq_s32(hi, shift)));
+        r = vminq_s16(vmaxq_s16(r, vdupq_n_s16(0)),
+                      vdupq_n_s16((1 << bit_depth) - 1));
+        vst1q_u16(dst + i, vreinterpretq_u16_s16(r));
+    }
+    if (i < n) {
+        for(j = 0; j < DP1TAPS; j++)
+            src1[j] = src[j] + i;
+        decimate2_v_simple(dst + i, src1, n - i, bit_depth);
+    }
+}
+
+#endif /* HAVE_NEON */
+
+static Decimate2Func *decimate2p0_simple_func = decimate2p0_simple;
+static Decimate2Func *decimate2p1_simple_func = decimate2p1_simple;
+static Decimate2Func16 *decimate2p0_simple16_func = decimate2p0_simple16;
+static Decimate2Func16 *decimate2p1_simple16_func = decimate2p1_simple16;
+static Decimate2VFunc *decimate2_v_simple_func = decimate2_v_simple;
+
+static void set_decimate_funcs(Decimate2Func *p0, Decimate2Func *p1,
+                               Decimate2Func16 *p0_16, Decimate2Func16 *p1_16,
+                               Decimate2VFunc *v)
+{
+    decimate2p0_simple_func = p0;
+    decimate2p1_simple_func = p1;
+    decimate2p0_simple16_func = p0_16;
+    decimate2p1_simple16_func = p1_16;
+    decimate2_v_simple_func = v;
+}
+
+/* select the fastest decimation functions for the CPU */
+static void decimate_dsp_init(void)
+{
+    static int inited;
+
+    if (inited)
+        return;
+    inited = 1;
+#ifdef HAVE_SSE2
+    set_decimate_funcs(decimate2p0_simple_sse2, decimate2p1_simple_sse2,
+                       decimate2p0_simple16_sse2, decimate2p1_simple16_sse2,
+                       decimate2_v_simple_sse2);
+#endif
+#ifdef HAVE_AVX2
+    if (cpu_has_avx2()) {
+        set_decimate_funcs(decimate2p0_simple_avx2, decimate2p1_simple_avx2,
+                           decimate2p0_simple16_avx2, decimate2p1_simple16_avx2,
+                           decimate2_v_simple_avx2);
+    }
+#endif
+#ifdef HAVE_NEON
+    set_decimate_funcs(decimate2p0_simple_neon, decimate2p1_simple_neon,
+                       decimate2p0_simple16_neon, decimate2p1_simple16_neon,
+                       decimate2_v_simple_neon);
+#endif
+}
+
+/* src1 is a temporary buffer of length n + 2 * DTAPS */
+static void decimate2_h(PIXEL *dst, PIXEL *src, int n, PIXEL *src1,
+                        int bit_depth, int phase)
+{
+    PIXEL v;
+    int d, i;
+
+    if (phase == 0) 
+        d = DP0TAPS2;
+    else
+        d = DP1TAPS2;
+    /* add edge pixels */
+    v = src[0];
+    for(i = 0; i < d; i++)
+        src1[i] = v;
+    memcpy(src1 + d, src, n * sizeof(PIXEL));
+    v = src[n - 1];
+    for(i = 0; i < d; i++)
+        src1[d + n + i] = v;
+    if (phase == 0)
+        decimate2p0_simple_func(dst, src1 + d, n, bit_depth);
+    else
+        decimate2p1_simple_func(dst, src1 + d, n, bit_depth);
+}
+
+/* src1 is a temporary buffer of length n + 2 * DTAPS */
+static void decimate2_h16(int16_t *dst, PIXEL *src, int n, PIXEL *src1,
+                          int bit_depth, int phase)
+{
+    PIXEL v;
+    int d, i;
+
+    if (phase == 0) 
+        d = DP0TAPS2;
+    else
+        d = DP1TAPS2;
+    /* add edge pixels */
+    v = src[0];
+    for(i = 0; i < d; i++)
+        src1[i] = v;
+    memcpy(src1 + d, src, n * sizeof(PIXEL));
+    v = src[n - 1];
+    for(i = 0; i < d; i++)
+        src1[d + n + i] = v;
+    if (phase == 0)
+        decimate2p0_simple16_func(dst, src1 + d, n, bit_depth);
+    else
+        decimate2p1_simple16_func(dst, src1 + d, n, bit_depth);
+        
+}
+
+static void decimate2_v(PIXEL *dst, int16_t **src, int pos, int n,
+                        int bit_depth)
+{
+    int16_t *src1[DP1TAPS];
+    int i;
+
+    pos = sub_mod_int(pos, 4, DP1TAPS);
+    for(i = 0; i < DP1TAPS; i++) {
+        src1[i] = src[pos];
+        pos = add_mod_int(pos, 1, DP1TAPS);
+    }
+    decimate2_v_simple_func(dst, src1, n, bit_depth);
+}
+
+/* Note: we do the horizontal decimation first to use less CPU cache */
+static void decimate2_hv(uint8_t *dst, int dst_linesize,
+                         uint8_t *src, int src_linesize, 
+                         int w, int h, int bit_depth, int h_phase,
+                         int pixel_shift)
+{
+    PIXEL *buf1, *row, *out_row, *ptr;
+    int16_t *buf2[DP1TAPS];
+    int w2, pos, i, y, y1, y2;
+    
+    w2 = (w + 1) / 2;
+
+    buf1 = malloc(sizeof(PIXEL) * (w + 2 * DTAPS_MAX));
+    if (pixel_shift) {
+        row = NULL;
+        out_row = NULL;
+    } else {
+        row = malloc(sizeof(PIXEL) * w);
+        out_row = malloc(sizeof(PIXEL) * w2);
+    }
+    /* init line buffer */
+    for(i = 0; i < DP1TAPS; i++) {
+        buf2[i] = malloc(sizeof(int16_t) * w2);
+        y = i;
+        if (y > DP1TAPS2)
+            y -= DP1TAPS;
+        if (y < 0) {
+            /* copy from first line */
+            memcpy(buf2[i], buf2[0], sizeof(int16_t) * w2);
+        } else if (y >= h) {
+            /* copy from last line (only happens for small height) */
+            memcpy(buf2[i], buf2[h - 1], sizeof(int16_t) * w2);
+        } else {
+            ptr = get_row16(src + (size_t)src_linesize * y, w, pixel_shift, row);
+            decimate2_h16(buf2[i], ptr, w, buf1, bit_depth, h_phase);
+        }
+    }
+
+    for(y = 0; y < h; y++) {
+        pos = y % DP1TAPS;
+        if ((y & 1) == 0) {
+            /* filter one line */
+            y2 = y >> 1;
+            if (pixel_shift)
+                ptr = (PIXEL *)(dst + (size_t)y2 * dst_linesize);
+            else
+                ptr = out_row;
+            decimate2_v(ptr, buf2, pos, w2, bit_depth);
+            put_row16(dst + (size_t)y2 * dst_linesize, ptr, w2, pixel_shift);
+        }
+        /* add a new line in the buffer */
+        y1 = y + DP1TAPS2 + 1;
+        pos = add_mod_int(pos, DP1TAPS2 + 1, DP1TAPS);
+        if (y1 >= h) {
+            /* copy last line */
+            memcpy(buf2[pos], buf2[sub_mod_int(pos, 1, DP1TAPS)],
+                   sizeof(int16_t) * w2);
+        } else {
+            /* horizontally decimate new line */
+            ptr = get_row16(src + (size_t)src_linesize * y1, w, pixel_shift, row);
+            decimate2_h16(buf2[pos], ptr, w, buf1, bit_depth, h_phase);
+        }
+    }
+
+    for(i = 0; i < DP1TAPS; i++)
+        free(buf2[i]);
+    free(buf1);
+    free(row);
+    free(out_row);
+}
+
+/* Lanczos resampler used to resize the images when they are loaded.
+   The filters are separable with RESAMPLE_BITS fixed point
+   coefficients. The horizontal filter reads an edge extended row and
+   the vertical one a list of row pointers, so that both have no edge
+   case. */
+
+#define RESAMPLE_BITS 14
+#define LANCZOS_A 3
+
+/* 'src' is the edge extended row: the first sample of output 'i' is
+   src[pos[i]]. 'n_taps' is a multiple of 8. */
+typedef void ResampleHFunc(PIXEL *dst, const PIXEL *src, int n,
+                           const int *pos, const int16_t *coefs, int n_taps,
+                           int pixel_max);
+/* 'n_taps' is a multiple of 2 */
+typedef void ResampleVFunc(PIXEL *dst, const PIXEL **src, int n,
+                           const int16_t *coefs, int n_taps, int pixel_max);
+
+static void resample_h(PIXEL *dst, const PIXEL *src, int n,
+                       const int *pos, const int16_t *coefs, int n_taps,
+                       int pixel_max)
+{
+    const PIXEL *s;
+    int i, k, sum;
+
+    for(i = 0; i < n; i++) {
+        s = src + pos[i];
+        sum = 1 << (RESAMPLE_BITS - 1);
+        for(k = 0; k < n_taps; k++)
+            sum += s[k] * coefs[k];
+        dst[i] = clamp_pix(sum >> RESAMPLE_BITS, pixel_max);
+        coefs += n_taps;
+    }
+}
+
+static inline void resample_v1(PIXEL *dst, const PIXEL **src, int start,
+                               int end, const int16_t *coefs, int n_taps,
+                               int pixel_max)
+{
+    int i, k, sum;
+
+    for(i = start; i < end; i++) {
+        sum = 1 << (RESAMPLE_BITS - 1);
+        for(k = 0; k < n_taps; k++)
+            sum += src[k][i] * coefs[k];
+        dst[i] = clamp_pix(sum >> RESAMPLE_BITS, pixel_max);
+    }
+}
+
+static void resample_v(PIXEL *dst, const PIXEL **src, int n,
+                       const int16_t *coefs, int n_taps, int pixel_max)
+{
+    resample_v1(dst, src, 0, n, coefs, n_taps, pixel_max);
+}
+
+#ifdef HAVE_SSE2
+
+/* the 4 sums of 'a' are computed in parallel */
+static inline __m128i hsum4_sse2(const __m128i *a)
+{
+    __m128i t0, t1;
+    t0 = _mm_add_epi32(_mm_unpacklo_epi32(a[0], a[1]),
+                       _mm_unpackhi_epi32(a[0], a[1]));
+    t1 = _mm_add_epi32(_mm_unpacklo_epi32(a[2], a[3]),
+                       _mm_unpackhi_epi32(a[2], a[3]));
+    return _mm_add_epi32(_mm_unpacklo_epi64(t0, t1),
+                         _mm_unpackhi_epi64(t0, t1));
+}
+
+static void resample_h_sse2(PIXEL *dst, const PIXEL *src, int n,
+                            const int *pos, const int16_t *coefs, int n_taps,
+                            int pixel_max)
+{
+    __m128i a[4], rnd, pmax, r;
+    const PIXEL *s;
+    const int16_t *c;
+    int i, j, k;
+
+    rnd = _mm_set1_epi32(1 << (RESAMPLE_BITS - 1));
+    pmax = _mm_set1_epi16(pixel_max);
+    for(i = 0; i + 4 <= n; i += 4) {
+        for(j = 0; j < 4; j++) {
+            s = src + pos[i + j];
+            c = coefs + (i + j) * n_taps;
+            a[j] = _mm_setzero_si128();
+            for(k = 0; k < n_taps; k += 8) {
+                a[j] = _mm_add_epi32(a[j], _mm_madd_epi16(_mm_loadu_si128((__m128i *)(s + k)),
+                                                          _mm_loadu_si128((__m128i *)(c + k))));
+            }
+        }
+        r = _mm_srai_epi32(_mm_add_epi32(hsum4_sse2(a), rnd), RESAMPLE_BITS);
+        r = _mm_packs_epi32(r, r);
+        r = _mm_min_epi16(_mm_max_epi16(r, _mm_setzero_si128()), pmax);
+        _mm_storel_epi64((__m128i *)(dst + i), r);
+    }
+    if (i < n) {
+        resample_h(dst + i, src, n - i, pos + i, coefs + i * n_taps, n_taps,
+                   pixel_max);
+    }
+}
+
+/* output the samples 'start' to 'end' - 1 */
+static inline void resample_v1_sse2(PIXEL *dst, const PIXEL **src, int start,
+                                    int end, const int16_t *coefs,
+                                    int n_taps, int pixel_max)
+{
+    __m128i lo, hi, a, b, c, rnd, pmax, r;
+    int i, k;
+
+    rnd = _mm_set1_epi32(1 << (RESAMPLE_BITS - 1));
+    pmax = _mm_set1_epi16(pixel_max);
+    for(i = start; i + 8 <= end; i += 8) {
+        lo = rnd;
+        hi = rnd;
+        for(k = 0; k < n_taps; k += 2) {
+            a = _mm_loadu_si128((__m128i *)(src[k] + i));
+            b = _mm_loadu_si128((__m128i *)(src[k + 1] + i));
+            c = _mm_set1_epi32((uint16_t)coefs[k] |
+                               ((uint32_t)(uint16_t)coefs[k + 1] << 16));
+            lo = _mm_add_epi32(lo, _mm_madd_epi16(_mm_unpacklo_epi16(a, b), c));
+            hi = _mm_add_epi32(hi, _mm_madd_epi16(_mm_unpackhi_epi16(a, b), c));
+        }
+        r = _mm_packs_epi32(_mm_srai_epi32(lo, RESAMPLE_BITS),
+                            _mm_srai_epi32(hi, RESAMPLE_BITS));
+        r = _mm_min_epi16(_mm_max_epi16(r, _mm_setzero_si128()), pmax);
+        _mm_storeu_si128((__m128i *)(dst + i), r);
+    }
+    resample_v1(dst, src, i, end, coefs, n_taps, pixel_max);
+}
+
+static void resample_v_sse2(PIXEL *dst, const PIXEL **src, int n,
+                            const int16_t *coefs, int n_taps, int pixel_max)
+{
+    resample_v1_sse2(dst, src, 0, n, coefs, n_taps, pixel_max);
+}
+
+#endif /* HAVE_SSE2 */
+
+#ifdef HAVE_AVX2
+
+/* no AVX2 version of the horizontal filter: combining two 128 bit
+   loads per 256 bit register is slower than SSE2 */
+
+/* the lanes are unpacked and packed in the same order, so no
+   permutation is needed */
+static AVX2_FUNC void resample_v_avx2(PIXEL *dst, const PIXEL **src, int n,
+                                      const int16_t *coefs, int n_taps,
+                                      int pixel_max)
+{
+    __m256i lo, hi, a, b, c, rnd, pmax, r;
+    int i, k;
+
+    rnd = _mm256_set1_epi32(1 << (RESAMPLE_BITS - 1));
+    pmax = _mm256_set1_epi16(pixel_max);
+    for(i = 0; i + 16 <= n; i += 16) {
+        lo = rnd;
+        hi = rnd;
+        for(k = 0; k < n_taps; k += 2) {
+            a = _mm256_loadu_si256((__m256i *)(src[k] + i));
+            b = _mm256_loadu_si256((__m256i *)(src[k + 1] + i));
+            c = _mm256_set1_epi32((uint16_t)coefs[k] |
+                                  ((uint32_t)(uint16_t)coefs[k + 1] << 16));
+            lo = _mm256_add_epi32(lo, _mm256_madd_epi16(_mm256_unpacklo_epi16(a, b), c));
+            hi = _mm256_add_epi32(hi, _mm256_madd_epi16(_mm256_unpackhi_epi16(a, b), c));
+        }
+        r = _mm256_packs_epi32(_mm256_srai_epi32(lo, RESAMPLE_BITS),
+                               _mm256_srai_epi32(hi, RESAMPLE_BITS));
+        r = _mm256_min_epi16(_mm256_max_epi16(r, _mm256_setzero_si256()), pmax);
+        _mm256_storeu_si256((__m256i *)(dst + i), r);
+    }
+    resample_v1_sse2(dst, src, i, n, coefs, n_taps, pixel_max);
+}
+
+#endif /* HAVE_AVX2 */
+
+#ifdef HAVE_NEON
+
+static void resample_h_neon(PIXEL *dst, const PIXEL *src, int n,
+                            const int *pos, const int16_t *coefs, int n_taps,
+                            int pixel_max)
+{
+    const int16_t *s;
+    int32x4_t acc;
+    int32x2_t sum2;
+    int16x8_t a, c;
+    int i, k, sum;
+
+    for(i = 0; i < n; i++) {
+        s = (const int16_t *)(src + pos[i]);
+        acc = vdupq_n_s32(0);
+        for(k = 0; k < n_taps; k += 8) {
+            a = vld1q_s16(s + k);
+            c = vld1q_s16(coefs + k);
+            acc = vmlal_s16(acc, vget_low_s16(a), vget_low_s16(c));
+            acc = vmlal_s16(acc, vget_high_s16(a), vget_high_s16(c));
+        }
+        sum2 = vadd_s32(vget_low_s32(acc), vget_high_s32(acc));
+        sum = vget_lane_s32(vpadd_s32(sum2, sum2), 0) +
+            (1 << (RESAMPLE_BITS - 1));
+        dst[i] = clamp_pix(sum >> RESAMPLE_BITS, pixel_max);
+        coefs += n_taps;
+    }
+}
+
+static void resample_v_neon(PIXEL *dst, const PIXEL **src, int n,
+                            const int16_t *coefs, int n_taps, int pixel_max)
+{
+    int32x4_t lo, hi;
+    int16x8_t a, r;
+    int i, k;
+
+    for(i = 0; i + 8 <= n; i += 8) {
+        lo = vdupq_n_s32(1 << (RESAMPLE_BITS - 1));
+        hi = lo;
+        for(k = 0; k < n_taps; k++) {
+            a = vld1q_s16((const int16_t *)(src[k] + i));
+            lo = vmlal_n_s16(lo, vget_low_s16(a), coefs[k]);
+            hi = vmlal_n_s16(hi, vget_high_s16(a), coefs[k]);
+        }
+        r = vcombine_s16(vqshrn_n_s32(lo, RESAMPLE_BITS),
+                         vqshrn_n_s32(hi, RESAMPLE_BITS));
+        r = vminq_s16(vmaxq_s16(r, vdupq_n_s16(0)), vdupq_n_s16(pixel_max));
+        vst1q_u16(dst + i, vreinterpretq_u16_s16(r));
+    }
+    resample_v1(dst, src, i, n, coefs, n_taps, pixel_max);
+}
+
+#endif /* HAVE_NEON */
+
+static ResampleHFunc *resample_h_func = resample_h;
+static ResampleVFunc *resample_v_func = resample_v;
+
+/* select the fastest resampling functions for the CPU */
+static void resample_dsp_init(void)
+{
+    static int inited;
+
+    if (inited)
+        return;
+    inited = 1;
+#ifdef HAVE_SSE2
+    resample_h_func = resample_h_sse2;
+    resample_v_func = resample_v_sse2;
+#endif
+#ifdef HAVE_AVX2
+    if (cpu_has_avx2())
+        resample_v_func = resample_v_avx2;
+#endif
+#ifdef HAVE_NEON
+    resample_h_func = resample_h_neon;
+    resample_v_func = resample_v_neon;
+#endif
+}
+
+/* The CPU detection and the DSP function pointers are lazily
+   initialized without locking, so they must be set before any worker
+   thread may use them. */
+static void encoder_dsp_init(void)
+{
+    convert_dsp_init();
+    decimate_dsp_init();
+    resample_dsp_init();
+}
+
+static double lanczos(double x)
+{
+    if (x == 0)
+        return 1;
+    if (fabs(x) >= LANCZOS_A)
+        return 0;
+    x *= M_PI;
+    return LANCZOS_A * sin(x) * sin(x / LANCZOS_A) / (x * x);
+}
+
+/* Return the coefficients of the filters resampling 'src_n' samples
+   to 'n'. The number of taps is rounded up to a multiple of 'align'.
+   pos[i] receives the index of the first input sample of output 'i'
+   (it can be outside the input). */
+static int16_t *resample_filter_init(int **ppos, int *pn_taps,
+                                     int src_n, int n, int align)
+{
+    double scale, fscale, radius, center, sum;
+    double *weights;
+    int16_t *coefs, *c;
+    int *pos, n_taps, i, k, k_max, c_sum;
+
+    scale = (double)src_n / n;
+    /* when downscaling, the filter is stretched to remove the
+       frequencies above the new Nyquist limit */
+    fscale = scale > 1 ? scale : 1;
+    radius = LANCZOS_A * fscale;
+    n_taps = (int)ceil(2 * radius) + 1;
+    n_taps = (n_taps + align - 1) / align * align;
+    weights = malloc(sizeof(weights[0]) * n_taps);
+    coefs = malloc(sizeof(coefs[0]) * n * n_taps);
+    pos = malloc(sizeof(pos[0]) * n);
+    for(i = 0; i < n; i++) {
+        /* the sample centers are aligned */
+        center = (i + 0.5) * scale - 0.5;
+        pos[i] = (int)floor(center - radius) + 1;
+        sum = 0;
+        for(k = 0; k < n_taps; k++) {
+            weights[k] = lanczos((pos[i] + k - center) / fscale);
+            sum += weights[k];
+        }
+        /* the rounding error is added to the largest coefficient so
+           that flat areas are preserved */
+        c = coefs + i * n_taps;
+        c_sum = 0;
+        k_max = 0;
+        for(k = 0; k < n_taps; k++) {
+            c[k] = lrint(weights[k] / sum * (1 << RESAMPLE_BITS));
+            c_sum += c[k];
+            if (weights[k] > weights[k_max])
+                k_max = k;
+        }
+        c[k_max] += (1 << RESAMPLE_BITS) - c_sum;
+    }
+    free(weights);
+    *ppos = pos;
+    *pn_taps = n_taps;
+    return coefs;
+}
+
+typedef struct {
+    int src_w, src_h; /* input size */
+    int w, h; /* output size */
+    int pixel_max;
+    int h_taps, v_taps;
+    int *h_pos, *v_pos;
+    int16_t *h_coefs, *v_coefs;
+    PIXEL *h_buf; /* edge extended input row */
+    PIXEL **v_buf; /* last 'v_taps' horizontally resampled rows */
+    const PIXEL **v_rows; /* input rows of the vertical filter */
+    int y; /* number of input rows */
+    int y_out; /* number of output rows */
+} Resampler;
+
+static void resampler_init(Resampler *r, int src_w, int src_h, int w, int h,
+                           int bit_depth)
+{
+    int i;
+
+    resample_dsp_init();
+    memset(r, 0, sizeof(*r));
+    r->src_w = src_w;
+    r->src_h = src_h;
+    r->w = w;
+    r->h = h;
+    r->pixel_max = (1 << bit_depth) - 1;
+    r->h_coefs = resample_filter_init(&r->h_pos, &r->h_taps, src_w, w, 8);
+    /* the first sample of an output is always less than 'h_taps'
+       samples outside the input */
+    for(i = 0; i < w; i++)
+        r->h_pos[i] += r->h_taps;
+    r->h_buf = malloc(sizeof(PIXEL) * (src_w + 2 * r->h_taps));
+    r->v_coefs = resample_filter_init(&r->v_pos, &r->v_taps, src_h, h, 2);
+    r->v_buf = malloc(sizeof(r->v_buf[0]) * r->v_taps);
+    for(i = 0; i < r->v_taps; i++)
+        r->v_buf[i] = malloc(sizeof(PIXEL) * w);
+    r->v_rows = malloc(sizeof(r->v_rows[0]) * r->v_taps);
+}
+
+/* add the next input row */
+static void resampler_put_row(Resampler *r, const PIXEL *src)
+{
+    PIXEL *buf = r->h_buf, v;
+    int i, b = r->h_taps;
+
+    v = src[0];
+    for(i = 0; i < b; i++)
+        buf[i] = v;
+    memcpy(buf + b, src, r->src_w * sizeof(PIXEL));
+    v = src[r->src_w - 1];
+    for(i = 0; i < b; i++)
+        buf[b + r->src_w + i] = v;
+    resample_h_func(r->v_buf[r->y % r->v_taps], buf, r->w,
+                    r->h_pos, r->h_coefs, r->h_taps, r->pixel_max);
+    r->y++;
+}
+
+/* Output the next row to 'dst' if its input rows are available and
+   return TRUE. The rows must be read after each resampler_put_row()
+   because only the last 'v_taps' input rows are kept. */
+static int resampler_get_row(Resampler *r, PIXEL *dst)
+{
+    int k, y, y0, y1;
+
+    if (r->y_out >= r->h)
+        return 0;
+    y0 = r->v_pos[r->y_out];
+    y1 = y0 + r->v_taps - 1;
+    if (y1 > r->src_h - 1)
+        y1 = r->src_h - 1;
+    if (y1 >= r->y)
+        return 0;
+    for(k = 0; k < r->v_taps; k++) {
+        y = y0 + k;
+        if (y < 0)
+            y = 0;
+        else if (y > r->src_h - 1)
+            y = r->src_h - 1;
+        r->v_rows[k] = r->v_buf[y % r->v_taps];
+    }
+    resample_v_func(dst, r->v_rows, r->w, r->v_coefs + r->y_out * r->v_taps,
+                    r->v_taps, r->pixel_max);
+    r->y_out++;
+    return 1;
+}
+
+static void resampler_end(Resampler *r)
+{
+    int i;
+
+    for(i = 0; i < r->v_taps; i++)
+        free(r->v_buf[i]);
+    free(r->v_buf);
+    free(r->v_rows);
+    free(r->h_buf);
+    free(r->h_pos);
+    free(r->v_pos);
+    free(r->h_coefs);
+    free(r->v_coefs);
+}
+
+/* Simple thread pool. A job executes func(opaque, i) for 0 <= i <
+   n. The thread waiting for a job also executes its remaining items,
+   so that the items of a job can start and wait for other jobs. */
+
+typedef struct ThreadJob {
+    ThreadFunc *func;
+    void *opaque;
+    int n; /* number of items */
+    int next; /* next item to start */
+    int done; /* number of finished items */
+    struct ThreadJob *next_job;
+} ThreadJob;
+
+static int get_cpu_count(void)
+{
+#ifdef _WIN32
+    SYSTEM_INFO si;
+    GetSystemInfo(&si);
+    return max_int(si.dwNumberOfProcessors, 1);
+#else
+    return max_int(sysconf(_SC_NPROCESSORS_ONLN), 1);
+#endif
+}
+
+#ifdef HAVE_THREADS
+
+struct ThreadPool {
+    pthread_mutex_t lock;
+    pthread_cond_t cond; /* a job was added or the pool is stopped */
+    pthread_cond_t done_cond; /* an item is finished */
+    ThreadJob *first_job; /* jobs having items to start */
+    int stop;
+    int n_threads;
+    pthread_t *threads;
+};
+
+/* execute the next item of 'job' (the lock must be held). Return
+   FALSE if all its items are started. */
+static int thread_pool_exec(ThreadPool *tp, ThreadJob *job)
+{
+    ThreadJob **pjob;
+    int idx;
+
+    if (job->next >= job->n)
+        return 0;
+    idx = job->next++;
+    if (job->next == job->n) {
+        for(pjob = &tp->first_job; *pjob != job; pjob = &(*pjob)->next_job)
+            continue;
+        *pjob = job->next_job;
+    }
+    pthread_mutex_unlock(&tp->lock);
+    job->func(job->opaque, idx);
+    pthread_mutex_lock(&tp->lock);
+    if (++job->done == job->n)
+        pthread_cond_broadcast(&tp->done_cond);
+    return 1;
+}
+
+static void *thread_pool_worker(void *opaque)
+{
+    ThreadPool *tp = opaque;
+
+    pthread_mutex_lock(&tp->lock);
+    for(;;) {
+        if (tp->first_job)
+            thread_pool_exec(tp, tp->first_job);
+        else if (tp->stop)
+            break;
+        else
+            pthread_cond_wait(&tp->cond, &tp->lock);
+    }
+    pthread_mutex_unlock(&tp->lock);
+    return NULL;
+}
+
+void thread_pool_free(ThreadPool *tp)
+{
+    int i;
+
+    if (!tp)
+        return;
+    pthread_mutex_lock(&tp->lock);
+    tp->stop = 1;
+    pthread_cond_broadcast(&tp->cond);
+    pthread_mutex_unlock(&tp->lock);
+    for(i = 0; i < tp->n_threads; i++)
+        pthread_join(tp->threads[i], NULL);
+    pthread_cond_destroy(&tp->done_cond);
+    pthread_cond_destroy(&tp->cond);
+    pthread_mutex_destroy(&tp->lock);
+    free(tp->threads);
+    free(tp);
+}
+
+/* return NULL if no thread could be created */
+ThreadPool *thread_pool_new(int n_threads)
+{
+    ThreadPool *tp;
+    int i;
+
+    encoder_dsp_init();
+    tp = malloc(sizeof(ThreadPool));
+    memset(tp, 0, sizeof(*tp));
+    pthread_mutex_init(&tp->lock, NULL);
+    pthread_cond_init(&tp->cond, NULL);
+    pthread_cond_init(&tp->done_cond, NULL);
+    tp->threads = malloc(sizeof(tp->threads[0]) * n_threads);
+    for(i = 0; i < n_threads; i++) {
+        if (pthread_create(&tp->threads[i], NULL, thread_pool_worker, tp))
+            break;
+    }
+    tp->n_threads = i;
+    if (tp->n_threads == 0) {
+        thread_pool_free(tp);
+        return NULL;
+    }
+    return tp;
+}
+
+#else
+
+void thread_pool_free(ThreadPool *tp)
+{
+}
+
+ThreadPool *thread_pool_new(int n_threads)
+{
+    return NULL;
+}
+
+#endif /* !HAVE_THREADS */
+
+/* start the job. If 'tp' is NULL, it is executed immediately. */
+static void thread_pool_start(ThreadPool *tp, ThreadJob *job,
+                              ThreadFunc *func, void *opaque, int n)
+{
+    int i;
+#ifdef HAVE_THREADS
+    ThreadJob **pjob;
+#endif
+
+    job->func = func;
+    job->opaque = opaque;
+    job->n = n;
+    job->next = 0;
+    job->done = 0;
+    job->next_job = NULL;
+#ifdef HAVE_THREADS
+    if (tp && n > 0) {
+        pthread_mutex_lock(&tp->lock);
+        for(pjob = &tp->first_job; *pjob != NULL; pjob = &(*pjob)->next_job)
+            continue;
+        *pjob = job;
+        pthread_cond_broadcast(&tp->cond);
+        pthread_mutex_unlock(&tp->lock);
+        return;
+    }
+#endif
+    for(i = 0; i < n; i++)
+        func(opaque, i);
+    job->next = n;
+    job->done = n;
+}
+
+/* wait for the end of a job started with thread_pool_start() */
+static void thread_pool_wait(ThreadPool *tp, ThreadJob *job)
+{
+#ifdef HAVE_THREADS
+    if (tp) {
+        pthread_mutex_lock(&tp->lock);
+        while (thread_pool_exec(tp, job))
+            continue;
+        while (job->done < job->n)
+            pthread_cond_wait(&tp->done_cond, &tp->lock);
+        pthread_mutex_unlock(&tp->lock);
+    }
+#endif
+}
+
+void thread_pool_run(ThreadPool *tp, ThreadFunc *func, void *opaque, int n)
+{
+    ThreadJob job;
+    thread_pool_start(tp, &job, func, opaque, n);
+    thread_pool_wait(tp, &job);
+}
+
+/* pool used to read and convert the input images (NULL if no
+   threads) */
+static ThreadPool *ingest_pool;
+static int ingest_threads = 1;
+
+void bpg_encoder_set_ingest_threads(int n_threads)
+{
+    if (n_threads < 1)
+        n_threads = 1;
+    if (n_threads == ingest_threads)
+        return;
+    thread_pool_free(ingest_pool);
+    ingest_pool = NULL;
+    ingest_threads = n_threads;
+    if (ingest_threads > 1)
+        ingest_pool = thread_pool_new(ingest_threads - 1);
+}
+
+static void get_plane_res(Image *img, int *pw, int *ph, int i)
+{
+    if (img->format == BPG_FORMAT_420 && (i == 1 || i == 2)) {
+        *pw = (img->w + 1) / 2;
+        *ph = (img->h + 1) / 2;
+    } else if (img->format == BPG_FORMAT_422 && (i == 1 || i == 2)) {
+        *pw = (img->w + 1) / 2;
+        *ph = img->h;
+    } else {
+        *pw = img->w;
+        *ph = img->h;
+    }
+}
+
+#define W_PAD 16
+
+/* the encoded picture size is a multiple of CB_SIZE. We assume the
+   HEVC encoder uses the same value */
+#define CB_SIZE 8
+
+/* maximum image width. The line sizes (at most 8 bytes per pixel
+   for the 16 bit RGBA input rows) must fit in an int. Same limit as
+   the decoder. */
+#define MAX_IMAGE_WIDTH ((1 << 28) - 1)
+
+/* maximum plane size given to a single HEVC encoder instance. Larger
+   images must be encoded with BPGEncoderParameters.tile_split. */
+#define MAX_ENCODER_PLANE_SIZE INT32_MAX
+
+/* return BPG_ENC_ERR_TOO_LARGE if a w x h image cannot be
+   allocated */
+static int image_check_size(int w, int h)
+{
+    if (w <= 0 || h <= 0 || w > MAX_IMAGE_WIDTH ||
+        (uint64_t)w * (uint64_t)h * 2 > SIZE_MAX / 4)
+        return BPG_ENC_ERR_TOO_LARGE;
+    return BPG_ENC_OK;
+}
+
+/* 8 bit pixels are stored as bytes. Return NULL if the image is too
+   large or if there is not enough memory. */
+Image *image_alloc(int w, int h, BPGImageFormatEnum format, int has_alpha,
+                   BPGColorSpaceEnum color_space, int bit_depth)
+{
+    Image *img;
+    int i, linesize, w1, h1, c_count;
+
+    if (image_check_size(w, h) < 0)
+        return NULL;
+
+    img = malloc(sizeof(Image));
+    if (!img)
+        return NULL;
+    memset(img, 0, sizeof(*img));
+    
+    img->w = w;
+    img->h = h;
+    img->format = format;
+    img->has_alpha = has_alpha;
+    img->bit_depth = bit_depth;
+    img->color_space = color_space;
+    img->pixel_shift = (bit_depth > 8);
+    img->c_h_phase = 1;
+
+    if (img->format == BPG_FORMAT_GRAY)
+        c_count = 1;
+    else
+        c_count = 3;
+    if (has_alpha)
+        c_count++;
+    for(i = 0; i < c_count; i++) {
+        get_plane_res(img, &w1, &h1, i);
+        /* multiple of 16 pixels to add borders */
+        w1 = (w1 + (W_PAD - 1)) & ~(W_PAD - 1);
+        h1 = (h1 + (W_PAD - 1)) & ~(W_PAD - 1);
+        
+        linesize = w1 << img->pixel_shift;
+        img->data[i] = malloc((size_t)linesize * h1);
+        img->linesize[i] = linesize;
+        if (!img->data[i]) {
+            image_free(img);
+            return NULL;
+        }
+    }
+    return img;
+}
+
+void image_free(Image *img)
+{
+    int i, c_count;
+    if (img->format == BPG_FORMAT_GRAY)
+        c_count = 1;
+    else
+        c_count = 3;
+    if (img->has_alpha)
+        c_count++;
+    for(i = 0; i < c_count; i++)
+        free(img->data[i]);
+    free(img);
+}
+
+typedef struct {
+    Image *img;
+    int h_phase;
+    int linesize1, h1; /* size of the decimated planes */
+} ChromaDecimateState;
+
+static void ycc444_to_ycc422_plane(void *opaque, int idx)
+{
+    ChromaDecimateState *s = opaque;
+    Image *img = s->img;
+    uint8_t *data1;
+    PIXEL *buf1, *row, *out_row, *src, *dst;
+    int i, y, pixel_shift;
+
+    i = 1 + idx;
+    pixel_shift = img->pixel_shift;
+    buf1 = malloc(sizeof(PIXEL) * (img->w + 2 * DTAPS_MAX));
+    row = malloc(sizeof(PIXEL) * img->w);
+    out_row = malloc(sizeof(PIXEL) * ((img->w + 1) / 2));
+    data1 = malloc((size_t)s->linesize1 * s->h1);
+    for(y = 0; y < img->h; y++) {
+        src = get_row16(img->data[i] + (size_t)y * img->linesize[i], img->w,
+                        pixel_shift, row);
+        if (pixel_shift)
+            dst = (PIXEL *)(data1 + (size_t)y * s->linesize1);
+        else
+            dst = out_row;
+        decimate2_h(dst, src, img->w, buf1, img->bit_depth, s->h_phase);
+        put_row16(data1 + (size_t)y * s->linesize1, dst, (img->w + 1) / 2,
+                  pixel_shift);
+    }
+    free(img->data[i]);
+    img->data[i] = data1;
+    img->linesize[i] = s->linesize1;
+    free(out_row);
+    free(row);
+    free(buf1);
+}
+
+/* the two chroma planes are decimated in parallel */
+int image_ycc444_to_ycc422(Image *img, int h_phase)
+{
+    ChromaDecimateState s_s, *s = &s_s;
+    int w1;
+
+    if (img->format != BPG_FORMAT_444)
+        return -1;
+    decimate_dsp_init();
+    w1 = (img->w + 1) / 2;
+    w1 = (w1 + (W_PAD - 1)) & ~(W_PAD - 1);
+    s->img = img;
+    s->h_phase = h_phase;
+    s->linesize1 = w1 << img->pixel_shift;
+    s->h1 = (img->h + (W_PAD - 1)) & ~(W_PAD - 1);
+    thread_pool_run(ingest_pool, ycc444_to_ycc422_plane, s, 2);
+    img->format = BPG_FORMAT_422;
+    img->c_h_phase = h_phase;
+    return 0;
+}
+
+static void ycc444_to_ycc420_plane(void *opaque, int idx)
+{
+    ChromaDecimateState *s = opaque;
+    Image *img = s->img;
+    uint8_t *data1;
+    int i;
+
+    i = 1 + idx;
+    data1 = malloc((size_t)s->linesize1 * s->h1);
+    decimate2_hv(data1, s->linesize1,
+                 img->data[i], img->linesize[i],
+                 img->w, img->h, img->bit_depth, s->h_phase,
+                 img->pixel_shift);
+    free(img->data[i]);
+    img->data[i] = data1;
+    img->linesize[i] = s->linesize1;
+}
+
+int image_ycc444_to_ycc420(Image *img, int h_phase)
+{
+    ChromaDecimateState s_s, *s = &s_s;
+    int w1;
+
+    if (img->format != BPG_FORMAT_444)
+        return -1;
+    decimate_dsp_init();
+    w1 = (img->w + 1) / 2;
+    w1 = (w1 + (W_PAD - 1)) & ~(W_PAD - 1);
+    s->img = img;
+    s->h_phase = h_phase;
+    s->linesize1 = w1 << img->pixel_shift;
+    s->h1 = ((img->h + 1) / 2 + (W_PAD - 1)) & ~(W_PAD - 1);
+    thread_pool_run(ingest_pool, ycc444_to_ycc420_plane, s, 2);
+    img->format = BPG_FORMAT_420;
+    img->c_h_phase = h_phase;
+    return 0;
+}
+
+/* duplicate the last pixel of a row of 'w' pixels up to 'w1' pixels */
+static void pad_row(uint8_t *ptr, int w, int w1, int pixel_shift)
+{
+    PIXEL *ptr16, v;
+    int x;
+
+    if (pixel_shift) {
+        ptr16 = (PIXEL *)ptr;
+        v = ptr16[w - 1];
+        for(x = w; x < w1; x++)
+            ptr16[x] = v;
+    } else {
+        if (w1 > w)
+            memset(ptr + w, ptr[w - 1], w1 - w);
+    }
+}
+
+typedef struct {
+    Image *img;
+    int w1, h1; /* padded image size */
+} ImagePadState;
+
+static void image_pad_plane(void *opaque, int c_idx)
+{
+    ImagePadState *s = opaque;
+    Image *img = s->img;
+    int y, c_w, c_h, c_w1, c_h1, h_shift, v_shift;
+    uint8_t *ptr, *ptr1;
+
+    if (img->format == BPG_FORMAT_420 && 
+        (c_idx == 1 || c_idx == 2)) {
+        h_shift = 1;
+        v_shift = 1;
+    } else if (img->format == BPG_FORMAT_422 && 
+               (c_idx == 1 || c_idx == 2)) {
+        h_shift = 1;
+        v_shift = 0;
+    } else {
+        h_shift = 0;
+        v_shift = 0;
+    }
+
+    c_w = (img->w + h_shift) >> h_shift;
+    c_h = (img->h + v_shift) >> v_shift;
+    c_w1 = s->w1 >> h_shift;
+    c_h1 = s->h1 >> v_shift;
+
+    /* pad horizontally */
+    for(y = 0; y < c_h; y++) {
+        ptr = img->data[c_idx] + (size_t)img->linesize[c_idx] * y;
+        pad_row(ptr, c_w, c_w1, img->pixel_shift);
+    }
+
+    /* pad vertically */
+    ptr1 = img->data[c_idx] + (size_t)img->linesize[c_idx] * (c_h - 1);
+    for(y = c_h; y < c_h1; y++) {
+        ptr = img->data[c_idx] + (size_t)img->linesize[c_idx] * y;
+        memcpy(ptr, ptr1, c_w1 << img->pixel_shift);
+    }
+}
+
+/* duplicate right and bottom samples so that the image has a width
+   and height multiple of cb_size (power of two) */
+void image_pad(Image *img, int cb_size)
+{
+    ImagePadState s_s, *s = &s_s;
+    int w1, h1, c_count;
+
+    if (cb_size <= 1)
+        return;
+    w1 = (img->w + cb_size - 1) & ~(cb_size - 1);
+    h1 = (img->h + cb_size - 1) & ~(cb_size - 1);
+    if (img->padded) {
+        /* already done by the image reader */
+        assert(cb_size == CB_SIZE);
+        goto done;
+    }
+    
+    if (img->format == BPG_FORMAT_GRAY)
+        c_count = 1;
+    else
+        c_count = 3;
+    if (img->has_alpha)
+        c_count++;
+    s->img = img;
+    s->w1 = w1;
+    s->h1 = h1;
+    thread_pool_run(ingest_pool, image_pad_plane, s, c_count);
+ done:
+    img->w = w1;
+    img->h = h1;
+}
+
+/* convert the 16 bit components to 8 bits */
+void image_convert16to8(Image *img)
+{
+    int w, h, stride, y, x, c_count, i;
+    uint8_t *plane;
+
+    if (img->bit_depth > 8 || img->pixel_shift != 1)
+        return;
+    if (img->format == BPG_FORMAT_GRAY)
+        c_count = 1;
+    else
+        c_count = 3;
+    if (img->has_alpha)
+        c_count++;
+    for(i = 0; i < c_count; i++) {
+        get_plane_res(img, &w, &h, i);
+        stride = w;
+        plane = malloc((size_t)stride * h);
+        for(y = 0; y < h; y++) {
+            const uint16_t *src;
+            uint8_t *dst;
+            dst = plane + (size_t)stride * y;
+            src = (uint16_t *)(img->data[i] + (size_t)img->linesize[i] * y);
+            for(x = 0; x < w; x++)
+                dst[x] = src[x];
+        }
+        free(img->data[i]);
+        img->data[i] = plane;
+        img->linesize[i] = stride;
+    }
+    img->pixel_shift = 0;
+}
+
+/* Streaming image ingest: the image readers give the input rows one
+   by one. Each row is decimated to the chroma format of the encoder,
+   converted to the final pixel size and padded as soon as possible,
+   so that only the final image is allocated.
+
+   The readers either store the 16 bit rows of each plane
+   (image_ingest_get_row()) or give their raw rows with a conversion
+   function (image_ingest_get_input_row()). In the latter case, the
+   rows are processed by batches in the ingest thread pool while the
+   reader decodes the next batch: the rows of a batch are converted
+   by stripes, then each plane is decimated and padded in
+   parallel. */
+
+/* convert a raw input row to the 16 bit rows of each plane */
+typedef void IngestConvertFunc(void *opaque, PIXEL **dst, const uint8_t *src);
+
+/* number of input rows of a batch when threads are used */
+#define INGEST_BATCH_ROWS 32
+
+typedef struct {
+    int src_w, src_h; /* size of the rows given by the reader */
+    int w, h; /* input plane size after resizing */
+    int out_w, out_h; /* output plane size */
+    int pad_w, pad_h; /* padded output plane size */
+    uint8_t h_dec, v_dec; /* true if decimated horizontally/vertically */
+    int y; /* number of input rows */
+    int y_out; /* number of output rows */
+    int batch_y; /* index of the first input row of the batch */
+    PIXEL *rows; /* input rows of the batch if they cannot be stored
+                    in the image */
+    PIXEL *out_row; /* output row if it cannot be stored in the image */
+    PIXEL *h_buf; /* edge extended row for the horizontal decimation */
+    int16_t *v_buf[DP1TAPS]; /* input rows of the vertical decimation */
+    Resampler *rs; /* NULL if the plane is not resized */
+    PIXEL *rs_row; /* resized row */
+} IngestPlane;
+
+typedef struct {
+    Image *img;
+    int c_count;
+    IngestPlane planes[4];
+    int batch_rows; /* maximum number of input rows in a batch */
+
+    /* raw input rows (see image_ingest_set_input()) */
+    IngestConvertFunc *convert_func;
+    void *convert_opaque;
+    int input_linesize;
+    uint8_t *input_buf[2]; /* one is filled by the reader while the
+                              other one is processed */
+    int input_idx; /* index of the buffer filled by the reader */
+    int input_count; /* number of rows in it */
+
+    /* batch being processed */
+    const uint8_t *batch_buf;
+    int batch_count;
+    int n_stripes;
+    ThreadJob job;
+    int job_pending;
+} ImageIngest;
+
+/* Prepare the conversion of src_w x src_h rows in 'in_format' to the
+   w x h image given to bpg_encoder_encode(). If 'chroma_format' < 0,
+   the image is kept in 'in_format' and is not padded. Return an error
+   code if the image cannot be allocated. */
+static int image_ingest_init(ImageIngest *s, int src_w, int src_h,
+                              int w, int h,
+                              BPGImageFormatEnum in_format, int has_alpha,
+                              BPGColorSpaceEnum color_space, int bit_depth,
+                              int chroma_format)
+{
+    Image *img;
+    IngestPlane *p;
+    BPGImageFormatEnum format;
+    int c_h_phase, i, j, w1, h1, h_shift, v_shift, ret;
+
+    ret = image_check_size(w, h);
+    if (ret < 0)
+        return ret;
+    format = in_format;
+    c_h_phase = 1;
+    if (chroma_format >= 0) {
+        /* same conversions as bpg_encoder_encode() */
+        if (in_format == BPG_FORMAT_444 && color_space != BPG_CS_RGB) {
+            if (chroma_format == BPG_FORMAT_420 ||
+                chroma_format == BPG_FORMAT_420_VIDEO) {
+                format = BPG_FORMAT_420;
+                c_h_phase = (chroma_format == BPG_FORMAT_420);
+            } else if (chroma_format == BPG_FORMAT_422 ||
+                       chroma_format == BPG_FORMAT_422_VIDEO) {
+                format = BPG_FORMAT_422;
+                c_h_phase = (chroma_format == BPG_FORMAT_422);
+            }
+        }
+    }
+    img = image_alloc(w, h, format, has_alpha, color_space, bit_depth);
+    if (!img)
+        return BPG_ENC_ERR_NOMEM;
+    img->c_h_phase = c_h_phase;
+    img->padded = (chroma_format >= 0);
+    w1 = (w + CB_SIZE - 1) & ~(CB_SIZE - 1);
+    h1 = (h + CB_SIZE - 1) & ~(CB_SIZE - 1);
+
+    memset(s, 0, sizeof(*s));
+    s->img = img;
+    s->batch_rows = 1;
+    if (format == BPG_FORMAT_GRAY)
+        s->c_count = 1;
+    else
+        s->c_count = 3;
+    if (has_alpha)
+        s->c_count++;
+    for(i = 0; i < s->c_count; i++) {
+        p = &s->planes[i];
+        get_plane_res(img, &p->out_w, &p->out_h, i);
+        if (format != in_format && (i == 1 || i == 2)) {
+            p->h_dec = 1;
+            p->v_dec = (format == BPG_FORMAT_420);
+            p->w = w;
+            p->h = h;
+        } else {
+            p->w = p->out_w;
+            p->h = p->out_h;
+        }
+        /* subsampling of the input */
+        h_shift = (in_format == BPG_FORMAT_420 ||
+                   in_format == BPG_FORMAT_422) && (i == 1 || i == 2);
+        v_shift = (in_format == BPG_FORMAT_420) && (i == 1 || i == 2);
+        p->src_w = (src_w + h_shift) >> h_shift;
+        p->src_h = (src_h + v_shift) >> v_shift;
+        if (p->src_w != p->w || p->src_h != p->h) {
+            p->rs = malloc(sizeof(Resampler));
+            resampler_init(p->rs, p->src_w, p->src_h, p->w, p->h, bit_depth);
+            p->rs_row = malloc(sizeof(PIXEL) * p->w);
+        }
+        if (img->padded) {
+            h_shift = (format == BPG_FORMAT_420 ||
+                       format == BPG_FORMAT_422) && (i == 1 || i == 2);
+            v_shift = (format == BPG_FORMAT_420) && (i == 1 || i == 2);
+            p->pad_w = w1 >> h_shift;
+            p->pad_h = h1 >> v_shift;
+        } else {
+            p->pad_w = p->out_w;
+            p->pad_h = p->out_h;
+        }
+        if (p->h_dec || img->pixel_shift == 0 || p->rs)
+            p->rows = malloc(sizeof(PIXEL) * p->src_w);
+        if (p->h_dec) {
+            p->h_buf = malloc(sizeof(PIXEL) * (p->w + 2 * DTAPS_MAX));
+            if (img->pixel_shift == 0)
+                p->out_row = malloc(sizeof(PIXEL) * p->out_w);
+        }
+        if (p->v_dec) {
+            for(j = 0; j < DP1TAPS; j++)
+                p->v_buf[j] = malloc(sizeof(int16_t) * p->out_w);
+        }
+    }
+    if (format != in_format)
+        decimate_dsp_init();
+    return BPG_ENC_OK;
+}
+
+/* The input rows have 'linesize' bytes and are converted by
+   'convert_func'. Only image_ingest_get_input_row() and
+   image_ingest_put_input_row() can then be used. */
+static void image_ingest_set_input(ImageIngest *s, int linesize,
+                                   IngestConvertFunc *convert_func,
+                                   void *opaque)
+{
+    IngestPlane *p;
+    int c, n_bufs;
+
+    s->convert_func = convert_func;
+    s->convert_opaque = opaque;
+    s->input_linesize = linesize;
+    n_bufs = 1;
+    if (ingest_pool) {
+        s->batch_rows = INGEST_BATCH_ROWS;
+        n_bufs = 2;
+        for(c = 0; c < s->c_count; c++) {
+            p = &s->planes[c];
+            if (p->rows) {
+                free(p->rows);
+                p->rows = malloc(sizeof(PIXEL) * p->src_w * s->batch_rows);
+            }
+        }
+    }
+    for(c = 0; c < n_bufs; c++)
+        s->input_buf[c] = malloc((size_t)linesize * s->batch_rows);
+}
+
+/* return the buffer of the input row 'i' of the batch of plane 'c' */
+static PIXEL *image_ingest_batch_row(ImageIngest *s, int c, int i)
+{
+    IngestPlane *p = &s->planes[c];
+    Image *img = s->img;
+
+    if (p->rows)
+        return p->rows + (size_t)p->src_w * i;
+    else
+        return (PIXEL *)(img->data[c] +
+                         (size_t)img->linesize[c] * (p->batch_y + i));
+}
+
+/* return the buffer where the next input row of plane 'c' must be
+   stored (p->src_w pixels) */
+static PIXEL *image_ingest_get_row(ImageIngest *s, int c)
+{
+    IngestPlane *p = &s->planes[c];
+
+    p->batch_y = p->y;
+    return image_ingest_batch_row(s, c, 0);
+}
+
+static PIXEL *image_ingest_get_out_row(ImageIngest *s, int c)
+{
+    IngestPlane *p = &s->planes[c];
+    Image *img = s->img;
+
+    if (p->out_row)
+        return p->out_row;
+    else
+        return (PIXEL *)(img->data[c] + (size_t)img->linesize[c] * p->y_out);
+}
+
+/* store the next output row of plane 'c' and pad it horizontally */
+static void image_ingest_write_row(ImageIngest *s, int c, const PIXEL *src)
+{
+    IngestPlane *p = &s->planes[c];
+    Image *img = s->img;
+    uint8_t *dst;
+
+    dst = img->data[c] + (size_t)img->linesize[c] * p->y_out;
+    put_row16(dst, src, p->out_w, img->pixel_shift);
+    pad_row(dst, p->out_w, p->pad_w, img->pixel_shift);
+    p->y_out++;
+}
+
+/* output the rows of a vertically decimated plane whose input rows
+   are available. If 'flush' is true, the last input row is repeated
+   to output the end of the plane. */
+static void image_ingest_decimate_v(ImageIngest *s, int c, int flush)
+{
+    IngestPlane *p = &s->planes[c];
+    PIXEL *dst;
+    int y;
+
+    while (p->y_out < p->out_h) {
+        y = 2 * p->y_out;
+        if (y + DP1TAPS2 >= p->y) {
+            if (!flush)
+                break;
+            memcpy(p->v_buf[p->y % DP1TAPS],
+                   p->v_buf[(p->y - 1) % DP1TAPS],
+                   sizeof(int16_t) * p->out_w);
+            p->y++;
+        } else {
+            dst = image_ingest_get_out_row(s, c);
+            decimate2_v(dst, p->v_buf, y % DP1TAPS, p->out_w,
+                        s->img->bit_depth);
+            image_ingest_write_row(s, c, dst);
+        }
+    }
+}
+
+/* process the next input row 'src' of plane 'c' once resized */
+static void image_ingest_process_row1(ImageIngest *s, int c, PIXEL *src)
+{
+    IngestPlane *p = &s->planes[c];
+    Image *img = s->img;
+    PIXEL *dst;
+    int16_t *buf;
+    int i;
+
+    if (p->v_dec) {
+        buf = p->v_buf[p->y % DP1TAPS];
+        decimate2_h16(buf, src, p->w, p->h_buf, img->bit_depth,
+                      img->c_h_phase);
+        if (p->y == 0) {
+            /* the rows before the first one are copies of it */
+            for(i = DP1TAPS2 + 1; i < DP1TAPS; i++)
+                memcpy(p->v_buf[i], buf, sizeof(int16_t) * p->out_w);
+        }
+        p->y++;
+        image_ingest_decimate_v(s, c, 0);
+    } else if (p->h_dec) {
+        dst = image_ingest_get_out_row(s, c);
+        decimate2_h(dst, src, p->w, p->h_buf, img->bit_depth,
+                    img->c_h_phase);
+        p->y++;
+        image_ingest_write_row(s, c, dst);
+    } else {
+        p->y++;
+        image_ingest_write_row(s, c, src);
+    }
+}
+
+/* Return the image row where the input row 'i' after the current
+   one of plane 'c' can be directly stored with the final pixel size.
+   Only valid if the plane is not decimated nor resized. The allocated
+   image height is a multiple of 16 rows. */
+static uint8_t *image_ingest_get_image_row(ImageIngest *s, int c, int i)
+{
+    IngestPlane *p = &s->planes[c];
+    Image *img = s->img;
+
+    assert(!p->h_dec && !p->rs);
+    return img->data[c] + (size_t)img->linesize[c] * (p->y + i);
+}
+
+/* process the row stored in the buffer given by
+   image_ingest_get_image_row(s, c, 0) */
+static void image_ingest_put_image_row(ImageIngest *s, int c)
+{
+    IngestPlane *p = &s->planes[c];
+    Image *img = s->img;
+
+    pad_row(img->data[c] + (size_t)img->linesize[c] * p->y_out,
+            p->out_w, p->pad_w, img->pixel_shift);
+    p->y++;
+    p->y_out++;
+}
+
+/* process the next input row 'src' of plane 'c' */
+static void image_ingest_process_row(ImageIngest *s, int c, PIXEL *src)
+{
+    IngestPlane *p = &s->planes[c];
+
+    if (p->rs) {
+        resampler_put_row(p->rs, src);
+        while (resampler_get_row(p->rs, p->rs_row))
+            image_ingest_process_row1(s, c, p->rs_row);
+    } else {
+        image_ingest_process_row1(s, c, src);
+    }
+}
+
+/* process the row stored in the buffer given by
+   image_ingest_get_row() */
+static void image_ingest_put_row(ImageIngest *s, int c)
+{
+    image_ingest_process_row(s, c, image_ingest_batch_row(s, c, 0));
+}
+
+static void image_ingest_convert_stripe(void *opaque, int idx)
+{
+    ImageIngest *s = opaque;
+    PIXEL *dst[4];
+    int i, c, start, end;
+
+    start = s->batch_count * idx / s->n_stripes;
+    end = s->batch_count * (idx + 1) / s->n_stripes;
+    for(i = start; i < end; i++) {
+        for(c = 0; c < s->c_count; c++)
+            dst[c] = image_ingest_batch_row(s, c, i);
+        s->convert_func(s->convert_opaque, dst,
+                        s->batch_buf + (size_t)s->input_linesize * i);
+    }
+}
+
+static void image_ingest_process_plane(void *opaque, int c)
+{
+    ImageIngest *s = opaque;
+    int i;
+
+    for(i = 0; i < s->batch_count; i++)
+        image_ingest_process_row(s, c, image_ingest_batch_row(s, c, i));
+}
+
+/* convert the rows of the batch by stripes, then process each
+   plane. It is a single job, so 'idx' is always 0. */
+static void image_ingest_process_batch(void *opaque, int idx)
+{
+    ImageIngest *s = opaque;
+    int c;
+
+    (void)idx;
+    for(c = 0; c < s->c_count; c++)
+        s->planes[c].batch_y = s->planes[c].y;
+    s->n_stripes = ingest_threads;
+    if (s->n_stripes > s->batch_count)
+        s->n_stripes = s->batch_count;
+    thread_pool_run(ingest_pool, image_ingest_convert_stripe, s,
+                    s->n_stripes);
+    thread_pool_run(ingest_pool, image_ingest_process_plane, s,
+                    s->c_count);
+}
+
+/* wait until the previous batch is processed and start the
+   processing of the pending input rows */
+static void image_ingest_flush_input(ImageIngest *s)
+{
+    if (s->job_pending) {
+        thread_pool_wait(ingest_pool, &s->job);
+        s->job_pending = 0;
+    }
+    if (s->input_count == 0)
+        return;
+    s->batch_buf = s->input_buf[s->input_idx];
+    s->batch_count = s->input_count;
+    s->input_count = 0;
+    thread_pool_start(ingest_pool, &s->job, image_ingest_process_batch, s, 1);
+    s->job_pending = 1;
+    if (s->input_buf[1])
+        s->input_idx ^= 1;
+}
+
+/* return the buffer where the next raw input row must be stored */
+static uint8_t *image_ingest_get_input_row(ImageIngest *s)
+{
+    return s->input_buf[s->input_idx] +
+        (size_t)s->input_linesize * s->input_count;
+}
+
+static void image_ingest_put_input_row(ImageIngest *s)
+{
+    if (++s->input_count == s->batch_rows)
+        image_ingest_flush_input(s);
+}
+
+/* output the pending rows and pad the plane vertically */
+static void image_ingest_end_plane(void *opaque, int c)
+{
+    ImageIngest *s = opaque;
+    IngestPlane *p = &s->planes[c];
+    Image *img = s->img;
+    uint8_t *last_row;
+    int y;
+
+    if (p->v_dec)
+        image_ingest_decimate_v(s, c, 1);
+    last_row = img->data[c] + (size_t)img->linesize[c] * (p->y_out - 1);
+    for(y = p->y_out; y < p->pad_h; y++) {
+        memcpy(img->data[c] + (size_t)img->linesize[c] * y, last_row,
+               p->pad_w << img->pixel_shift);
+    }
+}
+
+/* process the pending input rows and wait for the end of the
+   batches */
+static void image_ingest_wait(ImageIngest *s)
+{
+    image_ingest_flush_input(s);
+    if (s->job_pending) {
+        thread_pool_wait(ingest_pool, &s->job);
+        s->job_pending = 0;
+    }
+}
+
+static void image_ingest_close(ImageIngest *s)
+{
+    IngestPlane *p;
+    int c, j;
+
+    image_ingest_wait(s);
+    for(c = 0; c < s->c_count; c++) {
+        p = &s->planes[c];
+        free(p->rows);
+        free(p->out_row);
+        free(p->h_buf);
+        for(j = 0; j < DP1TAPS; j++)
+            free(p->v_buf[j]);
+        if (p->rs) {
+            resampler_end(p->rs);
+            free(p->rs);
+            free(p->rs_row);
+        }
+    }
+    free(s->input_buf[0]);
+    free(s->input_buf[1]);
+}
+
+/* output the pending rows, pad the image vertically and return it */
+static Image *image_ingest_end(ImageIngest *s)
+{
+    image_ingest_wait(s);
+    thread_pool_run(ingest_pool, image_ingest_end_plane, s, s->c_count);
+    image_ingest_close(s);
+    return s->img;
+}
+
+/* called instead of image_ingest_end() if the reader fails */
+static void image_ingest_abort(ImageIngest *s)
+{
+    s->input_count = 0;
+    image_ingest_close(s);
+    image_free(s->img);
+    s->img = NULL;
+}
+
+/* box filter: each destination sample is the average of the source
+   samples it covers. Both planes have (1 << pixel_shift) bytes per
+   pixel. */
+static void downscale_plane(uint8_t *dst, int dst_linesize, int dw, int dh,
+                            const uint8_t *src, int src_linesize,
+                            int sw, int sh, int pixel_shift)
+{
+    int x, y, x0, x1, y0, y1, i, j, n, v;
+    const uint8_t *s;
+    uint64_t sum;
+    uint8_t *d;
+
+    for(y = 0; y < dh; y++) {
+        y0 = (int64_t)y * sh / dh;
+        y1 = (int64_t)(y + 1) * sh / dh;
+        if (y1 <= y0)
+            y1 = y0 + 1;
+        d = dst + (size_t)dst_linesize * y;
+        for(x = 0; x < dw; x++) {
+            x0 = (int64_t)x * sw / dw;
+            x1 = (int64_t)(x + 1) * sw / dw;
+            if (x1 <= x0)
+                x1 = x0 + 1;
+            sum = 0;
+            for(j = y0; j < y1; j++) {
+                s = src + (size_t)src_linesize * j;
+                if (pixel_shift) {
+                    for(i = x0; i < x1; i++)
+                        sum += ((const PIXEL *)s)[i];
+                } else {
+                    for(i = x0; i < x1; i++)
+                        sum += s[i];
+                }
+            }
+            n = (x1 - x0) * (y1 - y0);
+            v = (sum + (n >> 1)) / n;
+            if (pixel_shift)
+                ((PIXEL *)d)[x] = v;
+            else
+                d[x] = v;
+        }
+    }
+}
+
+/* return a new image of size w x h with the same format as 'img' */
+Image *image_downscale(Image *img, int w, int h)
+{
+    Image *img1;
+    int c_count, i, sw, sh, dw, dh;
+
+    img1 = image_alloc(w, h, img->format, img->has_alpha, img->color_space,
+                       img->bit_depth);
+    img1->c_h_phase = img->c_h_phase;
+    img1->has_w_plane = img->has_w_plane;
+    img1->limited_range = img->limited_range;
+    img1->premultiplied_alpha = img->premultiplied_alpha;
+
+    if (img->format == BPG_FORMAT_GRAY)
+        c_count = 1;
+    else
+        c_count = 3;
+    if (img->has_alpha)
+        c_count++;
+    for(i = 0; i < c_count; i++) {
+        get_plane_res(img, &sw, &sh, i);
+        get_plane_res(img1, &dw, &dh, i);
+        downscale_plane(img1->data[i], img1->linesize[i], dw, dh,
+                        img->data[i], img->linesize[i], sw, sh,
+                        img->pixel_shift);
+    }
+    return img1;
+}
+
+static int image_get_plane_count(Image *img)
+{
+    int c_count;
+    if (img->format == BPG_FORMAT_GRAY)
+        c_count = 1;
+    else
+        c_count = 3;
+    if (img->has_alpha)
+        c_count++;
+    return c_count;
+}
+
+/* return a copy of 'img' (including the padding) */
+Image *image_dup(Image *img)
+{
+    Image *img1;
+    int i, w1, h1;
+
+    /* the planes are allocated with a height multiple of W_PAD */
+    img1 = malloc(sizeof(Image));
+    *img1 = *img;
+    for(i = 0; i < image_get_plane_count(img); i++) {
+        get_plane_res(img, &w1, &h1, i);
+        h1 = (h1 + (W_PAD - 1)) & ~(W_PAD - 1);
+        img1->data[i] = malloc((size_t)img->linesize[i] * h1);
+        memcpy(img1->data[i], img->data[i], (size_t)img->linesize[i] * h1);
+    }
+    return img1;
+}
+
+typedef struct {
+    Image *img; /* destination */
+    Image *src_img;
+} ImageResizeState;
+
+static void image_resize_plane(void *opaque, int c_idx)
+{
+    ImageResizeState *s = opaque;
+    Image *img = s->img, *src_img = s->src_img;
+    Resampler rs_s, *rs = &rs_s;
+    PIXEL *buf;
+    int sw, sh, dw, dh, y, y_out;
+
+    get_plane_res(src_img, &sw, &sh, c_idx);
+    get_plane_res(img, &dw, &dh, c_idx);
+    resampler_init(rs, sw, sh, dw, dh, img->bit_depth);
+    buf = malloc(sizeof(PIXEL) * max_int(sw, dw));
+    y_out = 0;
+    for(y = 0; y < sh; y++) {
+        resampler_put_row(rs, get_row16(src_img->data[c_idx] +
+                                        (size_t)src_img->linesize[c_idx] * y,
+                                        sw, src_img->pixel_shift, buf));
+        while (resampler_get_row(rs, buf)) {
+            put_row16(img->data[c_idx] + (size_t)img->linesize[c_idx] * y_out,
+                      buf, dw, img->pixel_shift);
+            y_out++;
+        }
+    }
+    assert(y_out == dh);
+    free(buf);
+    resampler_end(rs);
+}
+
+/* return a new image of size w x h with the same format as 'img',
+   resampled with the Lanczos filter. 'img' is not modified and the
+   new image is not padded. */
+Image *image_resize(Image *img, int w, int h)
+{
+    ImageResizeState s_s, *s = &s_s;
+    Image *img1;
+
+    img1 = image_alloc(w, h, img->format, img->has_alpha, img->color_space,
+                       img->bit_depth);
+    img1->c_h_phase = img->c_h_phase;
+    img1->has_w_plane = img->has_w_plane;
+    img1->limited_range = img->limited_range;
+    img1->premultiplied_alpha = img->premultiplied_alpha;
+
+    resample_dsp_init();
+    s->img = img1;
+    s->src_img = img;
+    thread_pool_run(ingest_pool, image_resize_plane, s,
+                    image_get_plane_count(img));
+    return img1;
+}
+
+BPGMetaData *bpg_md_alloc(uint32_t tag)
+{
+    BPGMetaData *md;
+    md = malloc(sizeof(BPGMetaData));
+    memset(md, 0, sizeof(*md));
+    md->tag = tag;
+    return md;
+}
+
+void bpg_md_free(BPGMetaData *md)
+{
+    BPGMetaData *md_next;
+
+    while (md != NULL) {
+        md_next = md->next;
+        free(md->buf);
+        free(md);
+        md = md_next;
+    }
+}
+
+/* return a copy of the metadata list 'md' */
+BPGMetaData *bpg_md_dup(const BPGMetaData *md)
+{
+    BPGMetaData *md1, **pmd, *first_md;
+
+    first_md = NULL;
+    pmd = &first_md;
+    for(; md != NULL; md = md->next) {
+        md1 = bpg_md_alloc(md->tag);
+        md1->buf_len = md->buf_len;
+        md1->buf = malloc(md->buf_len);
+        memcpy(md1->buf, md->buf, md->buf_len);
+        *pmd = md1;
+        pmd = &md1->next;
+    }
+    return first_md;
+}
+
+/* compute the size of a w x h image resized according to 'rp' */
+static void get_resize_size(int *pw, int *ph, int w, int h,
+                            const ResizeParams *rp)
+{
+    int w1, h1;
+
+    w1 = w;
+    h1 = h;
+    if (rp->w > 0 && rp->h > 0) {
+        w1 = rp->w;
+        h1 = rp->h;
+    } else if (rp->w > 0) {
+        w1 = rp->w;
+        h1 = max_int((int)((double)h * w1 / w + 0.5), 1);
+    } else if (rp->h > 0) {
+        h1 = rp->h;
+        w1 = max_int((int)((double)w * h1 / h + 0.5), 1);
+    }
+    if (rp->max_size > 0 && (w1 > rp->max_size || h1 > rp->max_size)) {
+        if (w1 >= h1) {
+            h1 = max_int((int)((double)h1 * rp->max_size / w1 + 0.5), 1);
+            w1 = rp->max_size;
+        } else {
+            w1 = max_int((int)((double)w1 * rp->max_size / h1 + 0.5), 1);
+            h1 = rp->max_size;
+        }
+    }
+    *pw = w1;
+    *ph = h1;
+}
+
+typedef struct {
+    ColorConvertState cvt;
+    RGBConvertFunc *convert_func;
+    BPGImageFormatEnum format;
+    int w, has_alpha, bit_depth;
+} PNGConvertState;
+
+static void png_convert_row(void *opaque, PIXEL **dst, const uint8_t *row)
+{
+    PNGConvertState *s = opaque;
+    ColorConvertState *cvt = &s->cvt;
+    int w = s->w, has_alpha = s->has_alpha;
+
+    if (s->format != BPG_FORMAT_GRAY) {
+        s->convert_func(cvt, dst[0], dst[1], dst[2], row, w, 3 + has_alpha);
+        if (has_alpha) {
+            if (s->bit_depth == 16) {
+                gray16_to_gray(cvt, dst[3], (uint16_t *)row + 3, w, 4);
+            } else {
+                gray8_to_gray(cvt, dst[3], row + 3, w, 4);
+            }
+        }
+    } else if (s->bit_depth == 16) {
+        luma16_to_gray(cvt, dst[0], (uint16_t *)row, w, 1 + has_alpha);
+        if (has_alpha) {
+            gray16_to_gray(cvt, dst[1], (uint16_t *)row + 1, w, 2);
+        }
+    } else {
+        luma8_to_gray(cvt, dst[0], row, w, 1 + has_alpha);
+        if (has_alpha) {
+            gray8_to_gray(cvt, dst[1], row + 1, w, 2);
+        }
+    }
+}
+
+/* if 'chroma_format' >= 0, the image is directly output in the
+   format expected by the encoder (see image_ingest_init()) */
+Image *read_png(BPGMetaData **pmd,
+                FILE *f, BPGColorSpaceEnum color_space, int out_bit_depth,
+                int limited_range, int premultiplied_alpha,
+                int chroma_format, const ResizeParams *rp)
+{
+    png_structp png_ptr;
+    png_infop info_ptr;
+    int bit_depth, color_type;
+    Image *img;
+    uint8_t **rows;
+    int y, has_alpha, linesize, bpp, passes, w, h, w1, h1;
+    BPGImageFormatEnum format;
+    PNGConvertState pcs_s, *pcs = &pcs_s;
+    ImageIngest ing_s, *ing = &ing_s;
+    BPGMetaData *md, **plast_md, *first_md;
+    
+    png_ptr = png_create_read_struct(PNG_LIBPNG_VER_STRING,
+                                     NULL, NULL, NULL);
+    if (png_ptr == NULL) {
+        return NULL;
+    }
+    
+    info_ptr = png_create_info_struct(png_ptr);
+    if (info_ptr == NULL) {
+       png_destroy_read_struct(&png_ptr, NULL, NULL);
+       return NULL;
+    }
+    
+    ing->img = NULL;
+    if (setjmp(png_jmpbuf(png_ptr))) {
+        /* the pending rows may still be processed by other threads */
+        if (ing->img)
+            image_ingest_abort(ing);
+        png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
+        return NULL;
+    }
+    
+    png_init_io(png_ptr, f);
+    
+    png_read_info(png_ptr, info_ptr);
+    
+    bit_depth   = png_get_bit_depth(png_ptr, info_ptr);
+    color_type = png_get_color_type(png_ptr, info_ptr);
+
+    switch (color_type) {
+    case PNG_COLOR_TYPE_PALETTE:
+        png_set_palette_to_rgb(png_ptr);
+        bit_depth = 8;
+        break;
+    case PNG_COLOR_TYPE_GRAY:
+    case PNG_COLOR_TYPE_GRAY_ALPHA:
+        if (bit_depth < 8) {
+            png_set_expand_gray_1_2_4_to_8(png_ptr);
+            bit_depth = 8;
+        }
+        break;
+    }
+    assert(bit_depth == 8 || bit_depth == 16);
+
+#if __BYTE_ORDER__ != __ORDER_BIG_ENDIAN__
+    if (bit_depth == 16) {
+        png_set_swap(png_ptr);
+    }
+#endif
+
+    if (color_type == PNG_COLOR_TYPE_GRAY ||
+        color_type == PNG_COLOR_TYPE_GRAY_ALPHA) {
+        format = BPG_FORMAT_GRAY;
+        color_space = BPG_CS_YCbCr;
+    } else {
+        format = BPG_FORMAT_444;
+    }
+    
+    has_alpha = (color_type == PNG_COLOR_TYPE_GRAY_ALPHA ||
+                 color_type == PNG_COLOR_TYPE_RGB_ALPHA);
+
+    if (png_get_valid(png_ptr, info_ptr, PNG_INFO_tRNS)) {
+        png_set_tRNS_to_alpha(png_ptr);
+        has_alpha = 1;
+    }
+
+    if (premultiplied_alpha) {
+        png_set_alpha_mode(png_ptr, PNG_ALPHA_ASSOCIATED, PNG_GAMMA_LINEAR);
+    }
+
+    /* non interlaced images are read row by row */
+    passes = png_set_interlace_handling(png_ptr);
+    png_read_update_info(png_ptr, info_ptr);
+
+    w = png_get_image_width(png_ptr, info_ptr);
+    h = png_get_image_height(png_ptr, info_ptr);
+
+    if (format == BPG_FORMAT_GRAY)
+        bpp = (1 + has_alpha) * (bit_depth / 8);
+    else
+        bpp = (3 + has_alpha) * (bit_depth / 8);
+    linesize = bpp * w;
+
+    convert_init(&pcs->cvt, bit_depth, out_bit_depth, color_space,
+                 limited_range);
+    pcs->convert_func = rgb_to_cs[bit_depth == 16][color_space];
+    pcs->format = format;
+    pcs->w = w;
+    pcs->has_alpha = has_alpha;
+    pcs->bit_depth = bit_depth;
+
+    get_resize_size(&w1, &h1, w, h, rp);
+    if (image_ingest_init(ing, w, h, w1, h1, format, has_alpha, color_space,
+                          out_bit_depth, chroma_format) < 0) {
+        fprintf(stderr, "Could not allocate the image\n");
+        png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
+        return NULL;
+    }
+    image_ingest_set_input(ing, linesize, png_convert_row, pcs);
+    img = ing->img;
+    img->limited_range = limited_range;
+    img->premultiplied_alpha = premultiplied_alpha;
+
+    if (passes > 1) {
+        rows = malloc(sizeof(rows[0]) * h);
+        for (y = 0; y < h; y++) {
+            rows[y] = malloc(linesize);
+        }
+        png_read_image(png_ptr, rows);
+        for (y = 0; y < h; y++) {
+            memcpy(image_ingest_get_input_row(ing), rows[y], linesize);
+            image_ingest_put_input_row(ing);
+            free(rows[y]);
+        }
+        free(rows);
+    } else {
+        for (y = 0; y < h; y++) {
+            png_read_row(png_ptr, image_ingest_get_input_row(ing), NULL);
+            image_ingest_put_input_row(ing);
+        }
+    }
+    image_ingest_end(ing);
+        
+    png_read_end(png_ptr, info_ptr);
+    
+    /* get the ICC profile if present */
+    first_md = NULL;
+    plast_md = &first_md;
+    {
+        png_charp name;
+        int comp_type;
+        png_bytep iccp_buf;
+        png_uint_32 iccp_buf_len;
+        
+        if (png_get_iCCP(png_ptr, info_ptr,
+                         &name, &comp_type, &iccp_buf, &iccp_buf_len) == 
+            PNG_INFO_iCCP) {
+            md = bpg_md_alloc(BPG_EXTENSION_TAG_ICCP);
+            md->buf_len = iccp_buf_len;
+            md->buf = malloc(iccp_buf_len);
+            memcpy(md->buf, iccp_buf, iccp_buf_len);
+            *plast_md = md;
+            plast_md = &md->next;
+        }
+    }
+
+    png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
+    
+    *pmd = first_md;
+    return img;
+}
+
+static BPGMetaData *jpeg_get_metadata(jpeg_saved_marker_ptr first_marker)
+{
+    static const char app1_exif[] = "Exif\0";
+    static const char app1_xmp[] = "http://ns.adobe.com/xap/1.0/";
+    static const char app2_iccp[] = "ICC_PROFILE";
+    jpeg_saved_marker_ptr marker;
+    BPGMetaData *md, **plast_md, *first_md;
+    int has_exif, has_xmp, l, iccp_chunk_count, i;
+    jpeg_saved_marker_ptr iccp_chunks[256];
+    
+    iccp_chunk_count = 0;
+    has_exif = 0;
+    has_xmp = 0;
+    first_md = NULL;
+    plast_md = &first_md;
+    for (marker = first_marker; marker != NULL; marker = marker->next) {
+#if 0
+        printf("marker=APP%d len=%d\n", 
+               marker->marker - JPEG_APP0, marker->data_length);
+#endif
+        if (!has_exif && marker->marker == JPEG_APP0 + 1 &&
+            marker->data_length > sizeof(app1_exif) &&
+            !memcmp(marker->data, app1_exif, sizeof(app1_exif))) {
+            md = bpg_md_alloc(BPG_EXTENSION_TAG_EXIF);
+            l = sizeof(app1_exif);
+            md->buf_len = marker->data_length - l;
+            md->buf = malloc(md->buf_len);
+            memcpy(md->buf, marker->data + l, md->buf_len);
+            *plast_md = md;
+            plast_md = &md->next;
+            has_exif = 1;
+        } else if (!has_xmp && marker->marker == JPEG_APP0 + 1 &&
+                   marker->data_length > sizeof(app1_xmp) &&
+                   !memcmp(marker->data, app1_xmp, sizeof(app1_xmp)) && 
+                   !has_xmp) {
+            md = bpg_md_alloc(BPG_EXTENSION_TAG_XMP);
+            l = sizeof(app1_xmp);
+            md->buf_len = marker->data_length - l;
+            md->buf = malloc(md->buf_len);
+            memcpy(md->buf, marker->data + l, md->buf_len);
+            *plast_md = md;
+            plast_md = &md->next;
+            has_xmp = 1;
+        } else if (marker->marker == JPEG_APP0 + 2 &&
+                   marker->data_length > (sizeof(app2_iccp) + 2) &&
+                   !memcmp(marker->data, app2_iccp, sizeof(app2_iccp))) {
+            int chunk_count, chunk_index;
+            l = sizeof(app2_iccp);
+            chunk_index = marker->data[l];
+            chunk_count = marker->data[l];
+            if (chunk_index == 0 || chunk_count == 0) 
+                continue;
+            if (iccp_chunk_count == 0) {
+                iccp_chunk_count = chunk_count;
+                for(i = 0; i < chunk_count; i++) {
+                    iccp_chunks[i] = NULL;
+                }
+            } else {
+                if (chunk_count != iccp_chunk_count)
+                    continue;
+            }
+            if (chunk_index > iccp_chunk_count)
+                continue;
+            iccp_chunks[chunk_index - 1] = marker;
+        }
+    }
+
+    if (iccp_chunk_count != 0) {
+        int len, hlen, idx;
+        /* check that no chunk are missing */
+        len = 0;
+        hlen = sizeof(app2_iccp) + 2;
+        for(i = 0; i < iccp_chunk_count; i++) {
+            if (!iccp_chunks[i])
+                break;
+            len += iccp_chunks[i]->data_length - hlen;
+        }
+        if (i == iccp_chunk_count) {
+            md = bpg_md_alloc(BPG_EXTENSION_TAG_ICCP);
+            md->buf_len = len;
+            md->buf = malloc(md->buf_len);
+            idx = 0;
+            for(i = 0; i < iccp_chunk_count; i++) {
+                l = iccp_chunks[i]->data_length - hlen;
+                memcpy(md->buf + idx, iccp_chunks[i]->data + hlen, l);
+                idx += l;
+            }
+            assert(idx == len);
+            *plast_md = md;
+            plast_md = &md->next;
+        }
+    }
+    return first_md;
+}
+
+typedef struct {
+    ColorConvertState cvt;
+    int w, c_count;
+    int plane_idx[4];
+} JPEGConvertState;
+
+static void jpeg_convert_row(void *opaque, PIXEL **dst, const uint8_t *row)
+{
+    JPEGConvertState *s = opaque;
+    int c_idx;
+
+    for(c_idx = 0; c_idx < s->c_count; c_idx++) {
+        gray8_to_gray(&s->cvt, dst[s->plane_idx[c_idx]], row + c_idx,
+                      s->w, s->c_count);
+    }
+}
+
+Image *read_jpeg(BPGMetaData **pmd, FILE *f, 
+                 int out_bit_depth, int chroma_format,
+                 const ResizeParams *rp)
+{
+    struct jpeg_decompress_struct cinfo;
+    struct jpeg_error_mgr jerr;
+    int w, h, w1, i, y_h, c_h, y, v_shift, y1, idx, c_idx;
+    int h1, plane_idx[4], has_alpha, has_w_plane, dst_w, dst_h, scaled;
+    Image *img;
+    ImageIngest ing_s, *ing = &ing_s;
+    BPGImageFormatEnum format;
+    BPGColorSpaceEnum color_space;
+    ColorConvertState cvt_s, *cvt = &cvt_s;
+    BPGMetaData *first_md = NULL;
+    uint32_t comp_hv;
+
+    cinfo.err = jpeg_std_error(&jerr);
+    jpeg_create_decompress(&cinfo);
+
+    jpeg_save_markers(&cinfo, JPEG_APP0 + 1, 65535);
+    jpeg_save_markers(&cinfo, JPEG_APP0 + 2, 65535);
+
+    jpeg_stdio_src(&cinfo, f);
+    
+    jpeg_read_header(&cinfo, TRUE);
+    
+    cinfo.raw_data_out = TRUE;
+    cinfo.do_fancy_upsampling = TRUE;
+    
+    w = cinfo.image_width;
+    h = cinfo.image_height;
+
+    /* use the DCT scaling to decode an image at least as large as the
+       final one */
+    get_resize_size(&dst_w, &dst_h, w, h, rp);
+    for(i = 1; i < 8; i++) {
+        if ((w * i + 7) / 8 >= dst_w && (h * i + 7) / 8 >= dst_h)
+            break;
+    }
+    /* no scaling if the size does not change (small images) */
+    if ((w * i + 7) / 8 == w && (h * i + 7) / 8 == h)
+        i = 8;
+    cinfo.scale_num = i;
+    cinfo.scale_denom = 8;
+    /* the scaled planes are upsampled to 4:4:4 by libjpeg */
+    scaled = (i < 8);
+
+    has_w_plane = 0;
+    comp_hv = 0;
+    if (cinfo.num_components < 1 || cinfo.num_components > 4)
+        goto unsupported;
+    for(i = 0; i < cinfo.num_components; i++) {
+        comp_hv |= cinfo.comp_info[i].h_samp_factor << (i * 8 + 4);
+        comp_hv |= cinfo.comp_info[i].v_samp_factor << (i * 8);
+    }
+    switch(cinfo.jpeg_color_space) {
+    case JCS_GRAYSCALE:
+        if (cinfo.num_components != 1 || comp_hv != 0x11)
+            goto unsupported;
+        if (scaled)
+            cinfo.raw_data_out = FALSE;
+        format = BPG_FORMAT_GRAY;
+        color_space = BPG_CS_YCbCr;
+        break;
+    case JCS_YCbCr:
+        if (cinfo.num_components != 3)
+            goto unsupported;
+        switch(scaled ? 0 : comp_hv) {
+        case 0x111111:
+            format = BPG_FORMAT_444;
+            break;
+        case 0x111121:
+            format = BPG_FORMAT_422;
+            break;
+        case 0x111122:
+            format = BPG_FORMAT_420;
+            break;
+        default:
+            cinfo.raw_data_out = FALSE;
+            format = BPG_FORMAT_444;
+            cinfo.out_color_space = JCS_YCbCr;
+            break;
+        }
+        color_space = BPG_CS_YCbCr;
+        break;
+    case JCS_RGB:
+        if (cinfo.num_components != 3)
+            goto unsupported;
+        format = BPG_FORMAT_444;
+        color_space = BPG_CS_RGB;
+        cinfo.raw_data_out = FALSE;
+        cinfo.out_color_space = JCS_RGB;
+        break;
+    case JCS_YCCK:
+        if (cinfo.num_components != 4)
+            goto unsupported;
+        switch(scaled ? 0 : comp_hv) {
+        case 0x11111111:
+            format = BPG_FORMAT_444;
+            color_space = BPG_CS_YCbCr;
+            break;
+        case 0x22111121:
+            format = BPG_FORMAT_422;
+            color_space = BPG_CS_YCbCr;
+            break;
+        case 0x22111122:
+            format = BPG_FORMAT_420;
+            color_space = BPG_CS_YCbCr;
+            break;
+        default:
+            cinfo.raw_data_out = FALSE;
+            format = BPG_FORMAT_444;
+            cinfo.out_color_space = JCS_CMYK;
+            color_space = BPG_CS_RGB;
+            break;
+        }
+        has_w_plane = 1;
+        break;
+    case JCS_CMYK:
+        if (cinfo.num_components != 4)
+            goto unsupported;
+        format = BPG_FORMAT_444;
+        color_space = BPG_CS_RGB;
+        has_w_plane = 1;
+        cinfo.raw_data_out = FALSE;
+        cinfo.out_color_space = JCS_CMYK;
+        break;
+    default:
+    unsupported:
+        fprintf(stderr, "Unsupported JPEG parameters (cs=%d n_comp=%d comp_hv=%x)\n",
+                cinfo.jpeg_color_space, cinfo.num_components, comp_hv);
+        img = NULL;
+        goto the_end;
+    }
+
+    v_shift = (format == BPG_FORMAT_420);
+    has_alpha = (cinfo.num_components == 4);
+    jpeg_calc_output_dimensions(&cinfo);
+    if (image_ingest_init(ing, cinfo.output_width, cinfo.output_height,
+                          dst_w, dst_h, format, has_alpha, color_space,
+                          out_bit_depth, chroma_format) < 0) {
+        fprintf(stderr, "Could not allocate the image\n");
+        jpeg_destroy_decompress(&cinfo);
+        *pmd = NULL;
+        return NULL;
+    }
+    img = ing->img;
+    img->has_w_plane = has_w_plane;
+
+    convert_init(cvt, 8, out_bit_depth, color_space, 0);
+
+    jpeg_start_decompress(&cinfo);
+
+    if (color_space == BPG_CS_RGB) {
+        plane_idx[0] = 2;
+        plane_idx[1] = 0;
+        plane_idx[2] = 1;
+    } else {
+        plane_idx[0] = 0;
+        plane_idx[1] = 1;
+        plane_idx[2] = 2;
+    }
+    plane_idx[3] = 3;
+        
+    if (cinfo.raw_data_out) {
+        JSAMPROW rows[4][16];
+        JSAMPROW *plane_pointer[4];
+        uint8_t direct[4];
+
+        /* the planes are read at their native subsampling. JPEG
+           chroma samples are centered as in BPG_FORMAT_420 and
+           BPG_FORMAT_422. */
+        y_h = 8 * cinfo.max_v_samp_factor;
+        if (cinfo.num_components == 1)
+            c_h = 0;
+        else
+            c_h = 8;
+        w1 = (w + 15) & ~15;
+        for(c_idx = 0; c_idx < cinfo.num_components; c_idx++) {
+            if (c_idx == 1 || c_idx == 2) {
+                h1 = c_h;
+            } else {
+                h1 = y_h;
+            }
+            idx = plane_idx[c_idx];
+            /* 8 bit samples are directly decoded in the image when
+               no conversion is needed */
+            direct[c_idx] = (img->pixel_shift == 0 &&
+                             !ing->planes[idx].h_dec &&
+                             !ing->planes[idx].rs &&
+                             !(color_space == BPG_CS_YCbCr && has_w_plane));
+            if (!direct[c_idx]) {
+                for(i = 0; i < h1; i++) {
+                    rows[c_idx][i] = malloc(w1);
+                }
+            }
+            plane_pointer[c_idx] = rows[c_idx];
+        }
+        
+        while (cinfo.output_scanline < cinfo.output_height) {
+            y = cinfo.output_scanline;
+            for(c_idx = 0; c_idx < cinfo.num_components; c_idx++) {
+                if (direct[c_idx]) {
+                    if (c_idx == 1 || c_idx == 2)
+                        h1 = c_h;
+                    else
+                        h1 = y_h;
+                    for(i = 0; i < h1; i++) {
+                        rows[c_idx][i] =
+                            image_ingest_get_image_row(ing, plane_idx[c_idx], i);
+                    }
+                }
+            }
+            jpeg_read_raw_data(&cinfo, plane_pointer, y_h);
+            
+            for(c_idx = 0; c_idx < cinfo.num_components; c_idx++) {
+                if (c_idx == 1 || c_idx == 2) {
+                    h1 = c_h;
+                    y1 = (y >> v_shift);
+                } else {
+                    h1 = y_h;
+                    y1 = y;
+                }
+                idx = plane_idx[c_idx];
+                w1 = ing->planes[idx].src_w;
+                /* the last rows may be outside the image */
+                if (h1 > ing->planes[idx].src_h - y1)
+                    h1 = ing->planes[idx].src_h - y1;
+                for(i = 0; i < h1; i++) {
+                    PIXEL *ptr;
+                    if (direct[c_idx]) {
+                        image_ingest_put_image_row(ing, idx);
+                        continue;
+                    }
+                    ptr = image_ingest_get_row(ing, idx);
+                    gray8_to_gray(cvt, ptr, rows[c_idx][i], w1, 1);
+                    if (color_space == BPG_CS_YCbCr && has_w_plane) {
+                        /* negate color */
+                        if (c_idx == 0) {
+                            gray_one_minus_func(cvt, ptr, w1);
+                        } else if (c_idx <= 2) {
+                            gray_neg_c_func(cvt, ptr, w1);
+                        }
+                    }
+                    image_ingest_put_row(ing, idx);
+                }
+            }
+        }
+    
+        for(c_idx = 0; c_idx < cinfo.num_components; c_idx++) {
+            if (direct[c_idx])
+                continue;
+            if (c_idx == 1 || c_idx == 2) {
+                h1 = c_h;
+            } else {
+                h1 = y_h;
+            }
+            for(i = 0; i < h1; i++) {
+                free(rows[c_idx][i]);
+            }
+        }
+    } else {
+        JSAMPROW rows[1];
+        JPEGConvertState jcs_s, *jcs = &jcs_s;
+
+        jcs->cvt = *cvt;
+        jcs->w = cinfo.output_width;
+        jcs->c_count = cinfo.output_components;
+        memcpy(jcs->plane_idx, plane_idx, sizeof(plane_idx));
+        image_ingest_set_input(ing, jcs->c_count * jcs->w, jpeg_convert_row,
+                               jcs);
+        while (cinfo.output_scanline < cinfo.output_height) {
+            rows[0] = image_ingest_get_input_row(ing);
+            jpeg_read_scanlines(&cinfo, rows, 1);
+            image_ingest_put_input_row(ing);
+        }
+        /* 'jcs' is used until the end of the last batch */
+        image_ingest_wait(ing);
+    }
+    image_ingest_end(ing);
+    
+    first_md = jpeg_get_metadata(cinfo.marker_list);
+
+ the_end:
+    jpeg_finish_decompress(&cinfo);
+    
+    jpeg_destroy_decompress(&cinfo);
+    *pmd = first_md;
+    return img;
+}
+
+/* PNM reader (binary PGM, PPM and PAM files) */
+
+/* read the next header token. Return -1 if error. */
+static int pnm_get_token(FILE *f, char *buf, int buf_size)
+{
+    int c, len;
+
+    for(;;) {
+        c = getc(f);
+        if (c == '#') {
+            /* comment up to the end of the line */
+            do {
+                c = getc(f);
+            } while (c != '\n' && c != EOF);
+        }
+        if (c == EOF)
+            return -1;
+        if (!isspace(c))
+            break;
+    }
+    len = 0;
+    while (c != EOF && !isspace(c)) {
+        if (len >= buf_size - 1)
+            return -1;
+        buf[len++] = c;
+        c = getc(f);
+    }
+    /* the whitespace after the token is consumed */
+    buf[len] = '\0';
+    return 0;
+}
+
+static int pnm_get_int(FILE *f, int *pval)
+{
+    char buf[32];
+    char *p;
+    long v;
+
+    if (pnm_get_token(f, buf, sizeof(buf)) < 0)
+        return -1;
+    v = strtol(buf, &p, 10);
+    if (*p != '\0' || v < 1 || v > INT32_MAX)
+        return -1;
+    *pval = v;
+    return 0;
+}
+
+/* convert the big endian samples of 'row', premultiply the color by
+   the alpha if needed and scale the samples from 'maxval' to
+   'out_maxval' */
+static void pnm_prepare_row(uint8_t *row, int w, int c_count, int bps,
+                            int maxval, int out_maxval,
+                            int premultiplied_alpha)
+{
+    int i, j, n, a, r, v;
+
+#if __BYTE_ORDER__ != __ORDER_BIG_ENDIAN__
+    if (bps == 2) {
+        n = w * c_count;
+        for(i = 0; i < n; i++) {
+            a = row[2 * i];
+            row[2 * i] = row[2 * i + 1];
+            row[2 * i + 1] = a;
+        }
+    }
+#endif
+    if (premultiplied_alpha) {
+        r = maxval >> 1;
+        for(i = 0; i < w; i++) {
+            if (bps == 2) {
+                uint16_t *p = (uint16_t *)row + i * c_count;
+                a = p[c_count - 1];
+                for(j = 0; j < c_count - 1; j++)
+                    p[j] = ((uint32_t)p[j] * a + r) / maxval;
+            } else {
+                uint8_t *p = row + i * c_count;
+                a = p[c_count - 1];
+                for(j = 0; j < c_count - 1; j++)
+                    p[j] = (p[j] * a + r) / maxval;
+            }
+        }
+    }
+    if (maxval != out_maxval) {
+        n = w * c_count;
+        r = maxval >> 1;
+        for(i = 0; i < n; i++) {
+            if (bps == 2)
+                v = ((uint16_t *)row)[i];
+            else
+                v = row[i];
+            v = ((uint32_t)min_int(v, maxval) * out_maxval + r) / maxval;
+            if (bps == 2)
+                ((uint16_t *)row)[i] = v;
+            else
+                row[i] = v;
+        }
+    }
+}
+
+Image *read_pnm(BPGMetaData **pmd, FILE *f, BPGColorSpaceEnum color_space,
+                int out_bit_depth, int limited_range, int premultiplied_alpha,
+                int chroma_format, const ResizeParams *rp)
+{
+    char buf[64];
+    int type, w, h, depth, maxval, in_bit_depth, bps, linesize, y, w1, h1;
+    int has_alpha;
+    uint8_t *row;
+    Image *img;
+    BPGImageFormatEnum format;
+    PNGConvertState pcs_s, *pcs = &pcs_s;
+    ImageIngest ing_s, *ing = &ing_s;
+
+    *pmd = NULL;
+    if (getc(f) != 'P')
+        goto fail;
+    type = getc(f);
+    w = h = maxval = depth = 0;
+    if (type == '5' || type == '6') {
+        if (pnm_get_int(f, &w) < 0 || pnm_get_int(f, &h) < 0 ||
+            pnm_get_int(f, &maxval) < 0)
+            goto fail;
+        depth = (type == '5') ? 1 : 3;
+    } else if (type == '7') {
+        for(;;) {
+            if (pnm_get_token(f, buf, sizeof(buf)) < 0)
+                goto fail;
+            if (!strcmp(buf, "ENDHDR")) {
+                break;
+            } else if (!strcmp(buf, "WIDTH")) {
+                if (pnm_get_int(f, &w) < 0)
+                    goto fail;
+            } else if (!strcmp(buf, "HEIGHT")) {
+                if (pnm_get_int(f, &h) < 0)
+                    goto fail;
+            } else if (!strcmp(buf, "DEPTH")) {
+                if (pnm_get_int(f, &depth) < 0)
+                    goto fail;
+            } else if (!strcmp(buf, "MAXVAL")) {
+                if (pnm_get_int(f, &maxval) < 0)
+                    goto fail;
+            } else if (!strcmp(buf, "TUPLTYPE")) {
+                /* the layout is given by DEPTH */
+                if (pnm_get_token(f, buf, sizeof(buf)) < 0)
+                    goto fail;
+            } else {
+                goto fail;
+            }
+        }
+    } else {
+        goto fail;
+    }
+    if (w == 0 || h == 0 || depth < 1 || depth > 4 || maxval > 65535)
+        goto fail;
+    /* smallest bit depth containing maxval. The samples are scaled if
+       maxval is not of the form 2^n - 1. */
+    for(in_bit_depth = 1; in_bit_depth < 16; in_bit_depth++) {
+        if (maxval <= (1 << in_bit_depth) - 1)
+            break;
+    }
+    bps = (maxval > 255) ? 2 : 1;
+
+    if (depth <= 2) {
+        format = BPG_FORMAT_GRAY;
+        color_space = BPG_CS_YCbCr;
+    } else {
+        format = BPG_FORMAT_444;
+    }
+    has_alpha = !(depth & 1);
+    linesize = w * depth * bps;
+
+    convert_init(&pcs->cvt, in_bit_depth, out_bit_depth, color_space,
+                 limited_range);
+    pcs->convert_func = rgb_to_cs[bps == 2][color_space];
+    pcs->format = format;
+    pcs->w = w;
+    pcs->has_alpha = has_alpha;
+    pcs->bit_depth = bps * 8;
+
+    get_resize_size(&w1, &h1, w, h, rp);
+    if (image_ingest_init(ing, w, h, w1, h1, format, has_alpha, color_space,
+                          out_bit_depth, chroma_format) < 0) {
+        fprintf(stderr, "Could not allocate the image\n");
+        return NULL;
+    }
+    image_ingest_set_input(ing, linesize, png_convert_row, pcs);
+    img = ing->img;
+    img->limited_range = limited_range;
+    img->premultiplied_alpha = premultiplied_alpha;
+
+    for(y = 0; y < h; y++) {
+        row = image_ingest_get_input_row(ing);
+        if (fread(row, 1, linesize, f) != (size_t)linesize) {
+            image_ingest_abort(ing);
+            fprintf(stderr, "Truncated PNM file\n");
+            return NULL;
+        }
+        pnm_prepare_row(row, w, depth, bps, maxval, (1 << in_bit_depth) - 1,
+                        premultiplied_alpha && has_alpha);
+        image_ingest_put_input_row(ing);
+    }
+    return image_ingest_end(ing);
+ fail:
+    fprintf(stderr, "Unsupported PNM file\n");
+    return NULL;
+}
+
+/* Planar YUV input, either raw or in a YUV4MPEG2 (Y4M) stream */
+
+
+/* parse the header of a Y4M stream. Return -1 if error. */
+static int y4m_read_header(FILE *f, YUVParams *yp)
+{
+    char line[256], *p, *q;
+    int c, len, bits;
+
+    len = 0;
+    for(;;) {
+        c = getc(f);
+        if (c == EOF || len >= (int)sizeof(line) - 1)
+            return -1;
+        if (c == '\n')
+            break;
+        line[len++] = c;
+    }
+    line[len] = '\0';
+    if (strncmp(line, "YUV4MPEG2", 9) != 0)
+        return -1;
+
+    yp->w = 0;
+    yp->h = 0;
+    yp->format = BPG_FORMAT_420;
+    yp->c_h_phase = 1;
+    yp->bit_depth = 8;
+    yp->y4m = 1;
+    yp->frame_rate_num = 0;
+    yp->frame_rate_den = 0;
+    p = line + 9;
+    for(;;) {
+        while (*p == ' ')
+            p++;
+        if (*p == '\0')
+            break;
+        q = p;
+        while (*q != ' ' && *q != '\0')
+            q++;
+        if (*q != '\0')
+            *q++ = '\0';
+        switch(*p) {
+        case 'W':
+            yp->w = atoi(p + 1);
+            break;
+        case 'H':
+            yp->h = atoi(p + 1);
+            break;
+        case 'F':
+            if (sscanf(p + 1, "%d:%d", &yp->frame_rate_num,
+                       &yp->frame_rate_den) != 2 ||
+                yp->frame_rate_num <= 0 || yp->frame_rate_den <= 0) {
+                yp->frame_rate_num = 0;
+                yp->frame_rate_den = 0;
+            }
+            break;
+        case 'C':
+            p++;
+            if (!strncmp(p, "mono", 4)) {
+                yp->format = BPG_FORMAT_GRAY;
+                p += 4;
+            } else {
+                if (!strncmp(p, "420", 3))
+                    yp->format = BPG_FORMAT_420;
+                else if (!strncmp(p, "422", 3))
+                    yp->format = BPG_FORMAT_422;
+                else if (!strncmp(p, "444", 3))
+                    yp->format = BPG_FORMAT_444;
+                else
+                    return -1;
+                p += 3;
+            }
+            /* chroma position of 4:2:0 */
+            if (!strcmp(p, "mpeg2") || !strcmp(p, "paldv")) {
+                yp->c_h_phase = 0;
+            } else if (*p == 'p' || (yp->format == BPG_FORMAT_GRAY &&
+                                     *p != '\0')) {
+                bits = atoi(p + (*p == 'p'));
+                if (bits < 8 || bits > 16)
+                    return -1;
+                yp->bit_depth = bits;
+            } else if (*p != '\0' && strcmp(p, "jpeg") != 0) {
+                return -1;
+            }
+            break;
+        default:
+            /* interlacing, aspect ratio and extensions are ignored */
+            break;
+        }
+        p = q;
+    }
+    if (yp->w <= 0 || yp->h <= 0)
+        return -1;
+    return 0;
+}
+
+/* Open a YUV input ('-' is the standard input). If the frame geometry
+   is not given in 'yp' (yp->w = 0), the file must be a Y4M stream
+   whose header is read. Return NULL if error. */
+FILE *yuv_open(YUVParams *yp, const char *filename)
+{
+    FILE *f;
+
+    if (!strcmp(filename, "-"))
+        f = stdin;
+    else
+        f = fopen(filename, "rb");
+    if (!f)
+        return NULL;
+    if (yp->w == 0 && y4m_read_header(f, yp) < 0) {
+        if (f != stdin)
+            fclose(f);
+        return NULL;
+    }
+    return f;
+}
+
+void yuv_close(FILE *f)
+{
+    if (f != stdin)
+        fclose(f);
+}
+
+/* convert 'n' samples of 'bps' bytes by shifting them. 'shift' < 0
+   reduces the bit depth. 16 bit samples are little endian words or
+   native words if 'native_endian' is true. */
+static void yuv_to_pixel(PIXEL *dst, const uint8_t *src, int n, int bps,
+                         int native_endian, int shift, int pixel_max)
+{
+    int i, v, rnd;
+
+    rnd = 0;
+    if (shift < 0)
+        rnd = 1 << (-shift - 1);
+    for(i = 0; i < n; i++) {
+        if (bps == 2 && native_endian)
+            v = ((const uint16_t *)src)[i];
+        else if (bps == 2)
+            v = src[2 * i] | (src[2 * i + 1] << 8);
+        else
+            v = src[i];
+        if (shift >= 0)
+            v <<= shift;
+        else
+            v = (v + rnd) >> -shift;
+        if (v > pixel_max)
+            v = pixel_max;
+        dst[i] = v;
+    }
+}
+
+/* Return row 'y' of plane 'c' having 'row_size' bytes. It is either
+   stored in 'buf' or returned in place. Return NULL if error. */
+typedef const uint8_t *YUVGetRowFunc(void *opaque, uint8_t *buf, int c, int y,
+                                     int row_size);
+
+/* Convert the planes given by 'get_row' to an image. Return an error
+   code. */
+static int yuv_ingest(Image **pimg, const YUVParams *yp, int native_endian,
+                      YUVGetRowFunc *get_row, void *opaque,
+                      BPGColorSpaceEnum color_space, int out_bit_depth,
+                      int limited_range, int chroma_format,
+                      const ResizeParams *rp)
+{
+    ImageIngest ing_s, *ing = &ing_s;
+    IngestPlane *p;
+    Image *img;
+    uint8_t *buf, *dst;
+    const uint8_t *row;
+    int c, y, w1, h1, bps, row_size, direct, shift, ret;
+
+    *pimg = NULL;
+    get_resize_size(&w1, &h1, yp->w, yp->h, rp);
+    ret = image_ingest_init(ing, yp->w, yp->h, w1, h1, yp->format, 0,
+                            color_space, out_bit_depth, chroma_format);
+    if (ret < 0)
+        return ret;
+    img = ing->img;
+    if (img->format == yp->format)
+        img->c_h_phase = yp->c_h_phase;
+    img->limited_range = limited_range;
+
+    bps = (yp->bit_depth > 8) ? 2 : 1;
+    shift = out_bit_depth - yp->bit_depth;
+    buf = malloc(yp->w * bps);
+    if (!buf) {
+        image_ingest_abort(ing);
+        return BPG_ENC_ERR_NOMEM;
+    }
+    for(c = 0; c < ing->c_count; c++) {
+        p = &ing->planes[c];
+        row_size = p->src_w * bps;
+        direct = (!p->h_dec && !p->rs && shift == 0 &&
+                  bps == (1 << img->pixel_shift));
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+        if (!native_endian)
+            direct &= (bps == 1);
+#endif
+        for(y = 0; y < p->src_h; y++) {
+            if (direct) {
+                dst = image_ingest_get_image_row(ing, c, 0);
+                row = get_row(opaque, dst, c, y, row_size);
+                if (row && row != dst)
+                    memcpy(dst, row, row_size);
+            } else {
+                row = get_row(opaque, buf, c, y, row_size);
+            }
+            if (!row) {
+                free(buf);
+                image_ingest_abort(ing);
+                return BPG_ENC_ERR_PARAM;
+            }
+            if (direct) {
+                image_ingest_put_image_row(ing, c);
+            } else {
+                yuv_to_pixel(image_ingest_get_row(ing, c), row, p->src_w,
+                             bps, native_endian, shift,
+                             (1 << out_bit_depth) - 1);
+                image_ingest_put_row(ing, c);
+            }
+        }
+    }
+    free(buf);
+    *pimg = image_ingest_end(ing);
+    return BPG_ENC_OK;
+}
+
+typedef struct {
+    FILE *f;
+    const YUVParams *yp;
+} YUVFileState;
+
+static const uint8_t *yuv_file_get_row(void *opaque, uint8_t *buf, int c,
+                                       int y, int row_size)
+{
+    YUVFileState *s = opaque;
+
+    if (fread(buf, 1, row_size, s->f) != (size_t)row_size) {
+        /* no message at the end of the stream */
+        if (c != 0 || y != 0 || s->yp->y4m)
+            fprintf(stderr, "Truncated YUV frame\n");
+        return NULL;
+    }
+    return buf;
+}
+
+/* Read the next YUV frame of 'f'. Return NULL at the end of the
+   stream or if error. When no conversion is needed, the planes are
+   directly read into the image. */
+Image *read_yuv(FILE *f, const YUVParams *yp, BPGColorSpaceEnum color_space,
+                int out_bit_depth, int limited_range, int chroma_format,
+                const ResizeParams *rp)
+{
+    YUVFileState fs_s, *fs = &fs_s;
+    Image *img;
+    int c, len, ret;
+
+    if (yp->y4m) {
+        /* frame header */
+        len = 0;
+        for(;;) {
+            c = getc(f);
+            if (c == EOF)
+                return NULL;
+            if (c == '\n')
+                break;
+            if (len < 5 && c != "FRAME"[len]) {
+                fprintf(stderr, "Invalid Y4M frame header\n");
+                return NULL;
+            }
+            len++;
+        }
+        if (len < 5) {
+            fprintf(stderr, "Invalid Y4M frame header\n");
+            return NULL;
+        }
+    }
+
+    fs->f = f;
+    fs->yp = yp;
+    ret = yuv_ingest(&img, yp, 0, yuv_file_get_row, fs, color_space,
+                     out_bit_depth, limited_range, chroma_format, rp);
+    if (ret == BPG_ENC_ERR_TOO_LARGE || ret == BPG_ENC_ERR_NOMEM)
+        fprintf(stderr, "Could not allocate the image\n");
+    return img;
+}
+
+/* 'chroma_format' is the preferred chroma format of the encoder or -1
+   to get a 4:4:4 (or grayscale) image with 16 bit pixels. YUV inputs
+   keep their chroma format in this case. The image is resized
+   according to 'rp'. If 'raw_params->w' is not 0, the input is a raw
+   YUV file with this geometry. */
+Image *load_image(BPGMetaData **pmd, const char *infilename,
+                  BPGColorSpaceEnum color_space, int bit_depth,
+                  int limited_range, int premultiplied_alpha,
+                  int chroma_format, const ResizeParams *rp,
+                  const YUVParams *raw_params)
+{
+    FILE *f;
+    uint8_t buf[9];
+    Image *img;
+    BPGMetaData *md;
+    YUVParams yp_s, *yp = &yp_s;
+
+    *pmd = NULL;
+
+    if (raw_params->w > 0 || !strcmp(infilename, "-")) {
+        *yp = *raw_params;
+        f = yuv_open(yp, infilename);
+        if (!f)
+            return NULL;
+        img = read_yuv(f, yp, color_space, bit_depth, limited_range,
+                       chroma_format, rp);
+        yuv_close(f);
+        return img;
+    }
+
+    f = fopen(infilename, "rb");
+    if (!f)
+        return NULL;
+    md = NULL;
+    memset(buf, 0, sizeof(buf));
+    fread(buf, 1, sizeof(buf), f);
+    fseek(f, 0, SEEK_SET);
+    if (png_sig_cmp(buf, 0, 8) == 0) {
+        img = read_png(&md, f, color_space, bit_depth, limited_range,
+                       premultiplied_alpha, chroma_format, rp);
+    } else if (buf[0] == 'P' && buf[1] >= '5' && buf[1] <= '7' &&
+               isspace(buf[2])) {
+        img = read_pnm(&md, f, color_space, bit_depth, limited_range,
+                       premultiplied_alpha, chroma_format, rp);
+    } else if (!memcmp(buf, "YUV4MPEG2", 9)) {
+        /* first frame of the stream */
+        if (y4m_read_header(f, yp) < 0) {
+            fprintf(stderr, "Invalid Y4M header\n");
+            img = NULL;
+        } else {
+            img = read_yuv(f, yp, color_space, bit_depth, limited_range,
+                           chroma_format, rp);
+        }
+    } else {
+        img = read_jpeg(&md, f, bit_depth, chroma_format, rp);
+    }
+    fclose(f);
+    *pmd = md;
+    return img;
+}
+
+int bpg_image_from_rgb(Image **pimg, const uint8_t *data, int linesize,
+                       int w, int h, int c_count, int in_bit_depth,
+                       BPGColorSpaceEnum color_space, int bit_depth,
+                       int limited_range, int premultiplied_alpha,
+                       int chroma_format, const ResizeParams *rp)
+{
+    PNGConvertState pcs_s, *pcs = &pcs_s;
+    ImageIngest ing_s, *ing = &ing_s;
+    ResizeParams rp_s;
+    BPGImageFormatEnum format;
+    int y, w1, h1, bps, has_alpha, row_size, ret;
+
+    *pimg = NULL;
+    if (c_count < 1 || c_count > 4 || in_bit_depth < 1 ||
+        in_bit_depth > 16 || bit_depth < 8 || bit_depth > BIT_DEPTH_MAX ||
+        (unsigned)color_space >= BPG_CS_COUNT)
+        return BPG_ENC_ERR_PARAM;
+    if (!rp) {
+        memset(&rp_s, 0, sizeof(rp_s));
+        rp = &rp_s;
+    }
+    if (c_count <= 2) {
+        format = BPG_FORMAT_GRAY;
+        color_space = BPG_CS_YCbCr;
+    } else {
+        format = BPG_FORMAT_444;
+    }
+    has_alpha = !(c_count & 1);
+    bps = (in_bit_depth > 8) ? 2 : 1;
+    row_size = w * c_count * bps;
+
+    convert_init(&pcs->cvt, in_bit_depth, bit_depth, color_space,
+                 limited_range);
+    pcs->convert_func = rgb_to_cs[bps == 2][color_space];
+    pcs->format = format;
+    pcs->w = w;
+    pcs->has_alpha = has_alpha;
+    pcs->bit_depth = bps * 8;
+
+    get_resize_size(&w1, &h1, w, h, rp);
+    ret = image_ingest_init(ing, w, h, w1, h1, format, has_alpha,
+                            color_space, bit_depth, chroma_format);
+    if (ret < 0)
+        return ret;
+    image_ingest_set_input(ing, row_size, png_convert_row, pcs);
+    ing->img->limited_range = limited_range;
+    ing->img->premultiplied_alpha = premultiplied_alpha && has_alpha;
+
+    for(y = 0; y < h; y++) {
+        memcpy(image_ingest_get_input_row(ing),
+               data + (size_t)linesize * y, row_size);
+        image_ingest_put_input_row(ing);
+    }
+    *pimg = image_ingest_end(ing);
+    return BPG_ENC_OK;
+}
+
+typedef struct {
+    const uint8_t * const *data;
+    const int *linesize;
+} YUVMemState;
+
+static const uint8_t *yuv_mem_get_row(void *opaque, uint8_t *buf, int c,
+                                      int y, int row_size)
+{
+    YUVMemState *s = opaque;
+    return s->data[c] + (size_t)s->linesize[c] * y;
+}
+
+int bpg_image_from_yuv(Image **pimg, const uint8_t * const data[3],
+                       const int linesize[3], const YUVParams *yp,
+                       BPGColorSpaceEnum color_space, int bit_depth,
+                       int limited_range, int chroma_format,
+                       const ResizeParams *rp)
+{
+    YUVMemState ms_s, *ms = &ms_s;
+    ResizeParams rp_s;
+
+    *pimg = NULL;
+    if (yp->bit_depth < 8 || yp->bit_depth > 16 ||
+        bit_depth < 8 || bit_depth > BIT_DEPTH_MAX ||
+        (yp->format != BPG_FORMAT_GRAY && yp->format != BPG_FORMAT_420 &&
+         yp->format != BPG_FORMAT_422 && yp->format != BPG_FORMAT_444) ||
+        (unsigned)color_space >= BPG_CS_COUNT)
+        return BPG_ENC_ERR_PARAM;
+    if (!rp) {
+        memset(&rp_s, 0, sizeof(rp_s));
+        rp = &rp_s;
+    }
+    ms->data = data;
+    ms->linesize = linesize;
+    return yuv_ingest(pimg, yp, 1, yuv_mem_get_row, ms, color_space,
+                      bit_depth, limited_range, chroma_format, rp);
+}
+
+void save_yuv1(Image *img, FILE *f)
+{
+    int c_w, c_h, i, c_count, y;
+
+    if (img->format == BPG_FORMAT_GRAY)
+        c_count = 1;
+    else
+        c_count = 3;
+    for(i = 0; i < c_count; i++) {
+        get_plane_res(img, &c_w, &c_h, i);
+        for(y = 0; y < c_h; y++) {
+            fwrite(img->data[i] + (size_t)y * img->linesize[i], 
+                   1, c_w << img->pixel_shift, f);
+        }
+    }
+}
+
+void save_yuv(Image *img, const char *filename)
+{
+    FILE *f;
+
+    f = fopen(filename, "wb");
+    if (!f) {
+        fprintf(stderr, "Could not open %s\n", filename);
+        return;
+    }
+    save_yuv1(img, f);
+    fclose(f);
+}
+
+/* return the position of the end of the NAL or -1 if error */
+static int find_nal_end(const uint8_t *buf, int buf_len)
+{
+    int idx;
+
+    idx = 0;
+    if (buf_len >= 4 &&
+        buf[0] == 0 && buf[1] == 0 && buf[2] == 0 && buf[3] == 1) {
+        idx = 4;
+    } else if (buf_len >= 3 &&
+               buf[0] == 0 && buf[1] == 0 && buf[2] == 1) {
+        idx = 3;
+    } else {
+        return -1;
+    }
+    /* NAL header */
+    if (idx + 2 > buf_len)
+        return -1;
+    /* find the last byte */
+    for(;;) {
+        if (idx + 2 >= buf_len) {
+            idx = buf_len;
+            break;
+        }
+        if (buf[idx] == 0 && buf[idx + 1] == 0 && buf[idx + 2] == 1)
+            break;
+        if (idx + 3 < buf_len &&
+            buf[idx] == 0 && buf[idx + 1] == 0 && buf[idx + 2] == 0 && buf[idx + 3] == 1)
+            break;
+        idx++;
+    }
+    return idx;
+}
+
+/* return the position of the end of the NAL or -1 if error */
+static int extract_nal(uint8_t **pnal_buf, int *pnal_len, 
+                       const uint8_t *buf, int buf_len)
+{
+    int idx, start, end, len;
+    uint8_t *nal_buf;
+    int nal_len;
+
+    end = find_nal_end(buf, buf_len);
+    if (end < 0)
+        return -1;
+    if (buf[2] == 1)
+        start = 3;
+    else
+        start = 4;
+    len = end - start;
+    
+    nal_buf = malloc(len);
+    nal_len = 0;
+    idx = start;
+    while (idx < end) {
+        if (idx + 2 < end && buf[idx] == 0 && buf[idx + 1] == 0 && buf[idx + 2] == 3) {
+            nal_buf[nal_len++] = 0;
+            nal_buf[nal_len++] = 0;
+            idx += 3;
+        } else {
+            nal_buf[nal_len++] = buf[idx++];
+        }
+    }
+    while (idx < end) {
+        nal_buf[nal_len++] = buf[idx++];
+    }
+    *pnal_buf = nal_buf;
+    *pnal_len = nal_len;
+    return idx;
+}
+
+/* big endian variable length 7 bit encoding */
+static void put_ue(uint8_t **pp, uint32_t v)
+{
+    uint8_t *p = *pp;
+    int i, j;
+    
+    for(i = 1; i < 5; i++) {
+        if (v < (1 << (7 * i)))
+            break;
+    }
+    for(j = i - 1; j >= 1; j--)
+        *p++ = ((v >> (7 * j)) & 0x7f) | 0x80;
+    *p++ = v & 0x7f;
+    *pp = p;
+}
+
+typedef struct {
+    const uint8_t *buf;
+    int idx;
+    int buf_len;
+} GetBitState;
+
+static void init_get_bits(GetBitState *s, const uint8_t *buf, int buf_len)
+{
+    s->buf = buf;
+    s->buf_len = buf_len;
+    s->idx = 0;
+}
+
+static void skip_bits(GetBitState *s, int n)
+{
+    s->idx += n;
+}
+
+/* 1 <= n <= 25. return '0' bits if past the end of the buffer. */
+static uint32_t get_bits(GetBitState *s, int n)
+{
+    const uint8_t *buf = s->buf;
+    int p, i;
+    uint32_t v;
+
+    p = s->idx >> 3;
+    if ((p + 3) < s->buf_len) {
+        v = (buf[p] << 24) | (buf[p + 1] << 16) | 
+            (buf[p + 2] << 8) | buf[p + 3];
+    } else {
+        v = 0;
+        for(i = 0; i < 3; i++) {
+            if ((p + i) < s->buf_len)
+                v |= buf[p + i] << (24 - i * 8);
+        }
+    }
+    v = (v >> (32 - (s->idx & 7) - n)) & ((1 << n) - 1);
+    s->idx += n;
+    return v;
+}
+
+/* 1 <= n <= 32 */
+static uint32_t get_bits_long(GetBitState *s, int n)
+{
+    uint32_t v;
+
+    if (n <= 25) {
+        v = get_bits(s, n);
+    } else {
+        n -= 16;
+        v = get_bits(s, 16) << n;
+        v |= get_bits(s, n);
+    }
+    return v;
+}
+
+/* at most 32 bits are supported */
+static uint32_t get_ue_golomb(GetBitState *s)
+{
+    int i;
+    i = 0;
+    for(;;) {
+        if (get_bits(s, 1))
+            break;
+        i++;
+        if (i == 32)
+            return 0xffffffff;
+    }
+    if (i == 0)
+        return 0;
+    else
+        return ((1 << i) | get_bits_long(s, i)) - 1;
+}
+
+typedef struct {
+    uint8_t *buf;
+    int idx;
+} PutBitState;
+
+static void init_put_bits(PutBitState *s, uint8_t *buf)
+{
+    s->buf = buf;
+    s->idx = 0;
+}
+
+static void put_bit(PutBitState *s, int bit)
+{
+    s->buf[s->idx >> 3] |= bit << (7 - (s->idx & 7));
+    s->idx++;
+}
+
+static void put_bits(PutBitState *s, int n, uint32_t v)
+{
+    int i;
+
+    for(i = 0; i < n; i++) {
+        put_bit(s, (v >> (n - 1 - i)) & 1);
+    }
+}
+
+static void put_ue_golomb(PutBitState *s, uint32_t v)
+{
+    uint32_t a;
+    int n;
+
+    v++;
+    n = 0;
+    a = v;
+    while (a != 0) {
+        a >>= 1;
+        n++;
+    }
+    if (n > 1)
+        put_bits(s, n - 1, 0);
+    put_bits(s, n, v);
+}
+
+typedef BPGDynBuf DynBuf;
+
+static int dyn_buf_resize(DynBuf *s, int size)
+{
+    int new_size;
+    uint8_t *new_buf;
+
+    if (size <= s->size)
+        return 0;
+    new_size = (s->size * 3) / 2;
+    if (new_size < size)
+        new_size = size;
+    new_buf = realloc(s->buf, new_size);
+    if (!new_buf) 
+        return -1;
+    s->buf = new_buf;
+    s->size = new_size;
+    return 0;
+}
+
+/* suppress the VPS NAL and keep only the useful part of the SPS
+   header. The decoder can rebuild a valid HEVC stream if needed. */
+static int build_modified_sps(uint8_t **pout_buf, int *pout_buf_len,
+                              const uint8_t *buf, int buf_len)
+{
+    int nal_unit_type, nal_len, idx, i, ret, msps_buf_len;
+    int out_buf_len, out_buf_len_max;
+    uint8_t *nal_buf, *msps_buf, *out_buf;
+    GetBitState gb_s, *gb = &gb_s;
+    PutBitState pb_s, *pb = &pb_s;
+    uint8_t *p;
+
+    idx = extract_nal(&nal_buf, &nal_len, buf, buf_len);
+    if (idx < 0)
+        return -1;
+    if (nal_len < 2) {
+        free(nal_buf);
+        return -1;
+    }
+    nal_unit_type = (nal_buf[0] >> 1) & 0x3f;
+    free(nal_buf);
+    if (nal_unit_type != 32)  {
+        fprintf(stderr, "expecting VPS nal (%d)\n", nal_unit_type);
+        return -1; /* expect VPS nal */
+    }
+
+    ret = extract_nal(&nal_buf, &nal_len, buf + idx, buf_len);
+    if (ret < 0)
+        return -1;
+    idx += ret;
+    if (nal_len < 2)
+        return -1;
+    nal_unit_type = (nal_buf[0] >> 1) & 0x3f;
+    if (nal_unit_type != 33) {
+        fprintf(stderr, "expecting SPS nal (%d)\n", nal_unit_type);
+        return -1; /* expect SPS nal */
+    }
+
+    /* skip the initial part of the SPS up to and including
+       log2_min_cb_size */
+    {
+        int vps_id, max_sub_layers, profile_idc, sps_id;
+        int chroma_format_idc, width, height, bit_depth_luma, bit_depth_chroma;
+        int log2_max_poc_lsb, sublayer_ordering_info, log2_min_cb_size;
+        int log2_diff_max_min_coding_block_size, log2_min_tb_size;
+        int log2_diff_max_min_transform_block_size;
+        int max_transform_hierarchy_depth_inter;
+        int max_transform_hierarchy_depth_intra;
+        int scaling_list_enable_flag, amp_enabled_flag, sao_enabled;
+        int pcm_enabled_flag, nb_st_rps;
+        int long_term_ref_pics_present_flag, sps_strong_intra_smoothing_enable_flag, vui_present;
+        int sps_temporal_mvp_enabled_flag;
+        int pcm_sample_bit_depth_luma_minus1;
+        int pcm_sample_bit_depth_chroma_minus1;
+        int log2_min_pcm_luma_coding_block_size_minus3;
+        int log2_diff_max_min_pcm_luma_coding_block_size;
+        int pcm_loop_filter_disabled_flag;
+        int sps_extension_flag, sps_range_extension_flag, sps_extension_7bits;
+        int sps_range_extension_flags;
+
+        init_get_bits(gb, nal_buf, nal_len);
+        skip_bits(gb, 16); /* nal header */
+        vps_id = get_bits(gb, 4);
+        if (vps_id != 0) {
+            fprintf(stderr, "VPS id 0 expected\n");
+            return -1;
+        }
+        max_sub_layers = get_bits(gb, 3);
+        if (max_sub_layers != 0) {
+            fprintf(stderr, "max_sub_layers == 0 expected\n");
+            return -1;
+        }
+        skip_bits(gb, 1); /* temporal_id_nesting_flag */
+        /* profile tier level */
+        skip_bits(gb, 2); /* profile_space */
+        skip_bits(gb, 1); /* tier_flag */
+        profile_idc = get_bits(gb, 5);
+        for(i = 0; i < 32; i++) {
+            skip_bits(gb, 1); /* profile_compatibility_flag */
+        }
+        skip_bits(gb, 1); /* progressive_source_flag */
+        skip_bits(gb, 1); /* interlaced_source_flag */
+        skip_bits(gb, 1); /* non_packed_constraint_flag */
+        skip_bits(gb, 1); /* frame_only_constraint_flag */
+        skip_bits(gb, 44); /*  XXX_reserved_zero_44 */
+        skip_bits(gb, 8); /* level_idc */
+
+        sps_id = get_ue_golomb(gb);
+        if (sps_id != 0) {
+            fprintf(stderr, "SPS id 0 expected (%d)\n", sps_id);
+            return -1;
+        }
+        chroma_format_idc = get_ue_golomb(gb);
+        if (chroma_format_idc == 3) {
+            get_bits(gb, 1); /* separate_colour_plane_flag */
+        }
+        width = get_ue_golomb(gb);
+        height = get_ue_golomb(gb);
+        /* pic conformance_flag */
+        if (get_bits(gb, 1)) {
+            get_ue_golomb(gb); /* left_offset */
+            get_ue_golomb(gb); /* right_offset */
+            get_ue_golomb(gb); /* top_offset */
+            get_ue_golomb(gb); /* bottom_offset */
+        }
+        bit_depth_luma = get_ue_golomb(gb) + 8;
+        bit_depth_chroma = get_ue_golomb(gb) + 8;
+        log2_max_poc_lsb = get_ue_golomb(gb) + 4;
+        /*if (log2_max_poc_lsb != 8) {
+            fprintf(stderr, "log2_max_poc_lsb must be 8 (%d)\n", log2_max_poc_lsb);
+            return -1;
+        }*/
+        sublayer_ordering_info = get_bits(gb, 1);
+        get_ue_golomb(gb); /* max_dec_pic_buffering */
+        get_ue_golomb(gb); /* num_reorder_pics */
+        get_ue_golomb(gb); /* max_latency_increase */
+        
+        log2_min_cb_size = get_ue_golomb(gb) + 3;
+        log2_diff_max_min_coding_block_size = get_ue_golomb(gb);
+        log2_min_tb_size = get_ue_golomb(gb) + 2;
+        log2_diff_max_min_transform_block_size = get_ue_golomb(gb);
+               
+        max_transform_hierarchy_depth_inter = get_ue_golomb(gb);
+        max_transform_hierarchy_depth_intra = get_ue_golomb(gb);
+        if (max_transform_hierarchy_depth_inter != max_transform_hierarchy_depth_intra) {
+            fprintf(stderr, "max_transform_hierarchy_depth_inter must be the same as max_transform_hierarchy_depth_intra (%d %d)\n", max_transform_hierarchy_depth_inter, max_transform_hierarchy_depth_intra);
+            return -1;
+        }
+
+        scaling_list_enable_flag = get_bits(gb, 1);
+        if (scaling_list_enable_flag != 0) {
+            fprintf(stderr, "scaling_list_enable_flag must be 0\n");
+            return -1;
+        }
+        amp_enabled_flag = get_bits(gb, 1);
+        /*if (!amp_enabled_flag) {
+            fprintf(stderr, "amp_enabled_flag must be set (%d)\n", amp_enabled_flag);
+            return -1;
+        }*/
+        sao_enabled = get_bits(gb, 1);
+        pcm_enabled_flag = get_bits(gb, 1);
+        if (pcm_enabled_flag) {
+            pcm_sample_bit_depth_luma_minus1 = get_bits(gb, 4);
+            pcm_sample_bit_depth_chroma_minus1 = get_bits(gb, 4);
+            log2_min_pcm_luma_coding_block_size_minus3 = get_ue_golomb(gb);
+            log2_diff_max_min_pcm_luma_coding_block_size = get_ue_golomb(gb);
+            pcm_loop_filter_disabled_flag = get_bits(gb, 1);
+        }
+        nb_st_rps = get_ue_golomb(gb);
+        /*if (nb_st_rps != 0) {
+            fprintf(stderr, "nb_st_rps must be 0 (%d)\n", nb_st_rps);
+            return -1;
+        }*/
+        long_term_ref_pics_present_flag = get_bits(gb, 1);
+        /*if (long_term_ref_pics_present_flag) {
+            fprintf(stderr, "nlong_term_ref_pics_present_flag must be 0 (%d)\n", long_term_ref_pics_present_flag); //SAO=1, AMT=1
+            return -1;
+        }*/
+        sps_temporal_mvp_enabled_flag = get_bits(gb, 1);
+        if (!sps_temporal_mvp_enabled_flag) {
+            fprintf(stderr, "sps_temporal_mvp_enabled_flag must be set (%d)\n", sps_temporal_mvp_enabled_flag);
+            return -1;
+        }
+        sps_strong_intra_smoothing_enable_flag = get_bits(gb, 1);
+        vui_present = get_bits(gb, 1);
+        if (vui_present) {
+            int sar_present, sar_idx, overscan_info_present_flag;
+            int video_signal_type_present_flag, chroma_loc_info_present_flag;
+            int default_display_window_flag, vui_timing_info_present_flag;
+            int vui_poc_proportional_to_timing_flag;
+            int vui_hrd_parameters_present_flag, bitstream_restriction_flag;
+
+            sar_present = get_bits(gb, 1);
+            if (sar_present) {
+                sar_idx = get_bits(gb, 8);
+                if (sar_idx == 255) {
+                    skip_bits(gb, 16); /* sar_num */ 
+                    skip_bits(gb, 16); /* sar_den */ 
+                }
+            }
+            
+            overscan_info_present_flag = get_bits(gb, 1);
+            if (overscan_info_present_flag) {
+                skip_bits(gb, 1); /* overscan_appropriate_flag */
+            }
+
+            video_signal_type_present_flag = get_bits(gb, 1);
+            /*if (video_signal_type_present_flag) {
+                fprintf(stderr, "video_signal_type_present_flag must be 0\n");
+                return -1;
+            }*/
+            chroma_loc_info_present_flag = get_bits(gb, 1);
+            if (chroma_loc_info_present_flag) {
+                get_ue_golomb(gb);
+                get_ue_golomb(gb);
+            }
+            skip_bits(gb, 1); /* neutra_chroma_indication_flag */
+            skip_bits(gb, 1);
+            skip_bits(gb, 1);
+            default_display_window_flag = get_bits(gb, 1);
+            if (default_display_window_flag) {
+                fprintf(stderr, "default_display_window_flag must be 0 (%d)\n", default_display_window_flag);
+                return -1;
+            }
+            vui_timing_info_present_flag = get_bits(gb, 1);
+            if (vui_timing_info_present_flag) {
+                skip_bits(gb, 32);
+                skip_bits(gb, 32);
+                vui_poc_proportional_to_timing_flag = get_bits(gb, 1);
+                if (vui_poc_proportional_to_timing_flag) {
+                    get_ue_golomb(gb);
+                }
+                vui_hrd_parameters_present_flag = get_bits(gb, 1);
+                if (vui_hrd_parameters_present_flag) {
+                    fprintf(stderr, "vui_hrd_parameters_present_flag must be 0\n");
+                    return -1;
+                }
+            }
+            bitstream_restriction_flag = get_bits(gb, 1);
+            if (bitstream_restriction_flag) {
+                skip_bits(gb, 1);
+                skip_bits(gb, 1);
+                skip_bits(gb, 1);
+                get_ue_golomb(gb);
+                get_ue_golomb(gb);
+                get_ue_golomb(gb);
+                get_ue_golomb(gb);
+                get_ue_golomb(gb);
+            }
+        }
+        sps_extension_flag = get_bits(gb, 1);
+        sps_range_extension_flag = 0;
+        sps_range_extension_flags = 0;
+        if (sps_extension_flag) {
+            sps_range_extension_flag = get_bits(gb, 1);
+            sps_extension_7bits = get_bits(gb, 7);
+            if (sps_extension_7bits != 0) {
+                fprintf(stderr, "sps_extension_7bits must be 0\n");
+                return -1;
+            }
+            if (sps_range_extension_flag) {
+                sps_range_extension_flags = get_bits(gb, 9);
+                if (sps_range_extension_flags & ((1 << (8 - 3)) | 
+                                                 (1 << (8 - 4)) | 
+                                                 (1 << (8 - 6)) | 
+                                                 (1 << (8 - 8)))) {
+                    fprintf(stderr, "unsupported range extensions (0x%x)\n",
+                            sps_range_extension_flags);
+                    return -1;
+                }
+            }
+        }
+
+        /* build the modified SPS */
+        msps_buf = malloc(nal_len + 32);
+        memset(msps_buf, 0, nal_len + 16);
+        
+        init_put_bits(pb, msps_buf);
+        put_ue_golomb(pb, log2_min_cb_size - 3);
+        put_ue_golomb(pb, log2_diff_max_min_coding_block_size);
+        put_ue_golomb(pb, log2_min_tb_size - 2);
+        put_ue_golomb(pb, log2_diff_max_min_transform_block_size);
+        put_ue_golomb(pb, max_transform_hierarchy_depth_intra);
+        put_bits(pb, 1, sao_enabled);
+        put_bits(pb, 1, pcm_enabled_flag);
+        if (pcm_enabled_flag) {
+            put_bits(pb, 4, pcm_sample_bit_depth_luma_minus1);
+            put_bits(pb, 4, pcm_sample_bit_depth_chroma_minus1);
+            put_ue_golomb(pb, log2_min_pcm_luma_coding_block_size_minus3);
+            put_ue_golomb(pb, log2_diff_max_min_pcm_luma_coding_block_size);
+            put_bits(pb, 1, pcm_loop_filter_disabled_flag);
+        }
+        put_bits(pb, 1, sps_strong_intra_smoothing_enable_flag);
+        put_bits(pb, 1, sps_extension_flag);
+        if (sps_extension_flag) {
+            put_bits(pb, 1, sps_range_extension_flag);
+            put_bits(pb, 7, 0);
+            if (sps_range_extension_flag) {
+                put_bits(pb, 9, sps_range_extension_flags);
+            }
+        }
+        msps_buf_len = (pb->idx + 7) >> 3;
+
+        out_buf_len_max = 5 + msps_buf_len;
+        out_buf = malloc(out_buf_len_max);
+
+        //        printf("msps_n_bits=%d\n", pb->idx);
+        p = out_buf;
+        put_ue(&p, msps_buf_len); /* header length */
+
+        memcpy(p, msps_buf, msps_buf_len);
+        p += msps_buf_len;
+        
+        out_buf_len = p - out_buf;
+        free(msps_buf);
+        free(nal_buf);
+    }
+    *pout_buf = out_buf;
+    *pout_buf_len = out_buf_len;
+    return idx;
+}
+
+static int add_frame_duration_sei(DynBuf *out_buf, uint16_t frame_ticks)
+{
+    uint8_t nal_buf[128], *q;
+    int nut, nal_len;
+
+    q = nal_buf;
+    *q++ = 0x00;
+    *q++ = 0x00;
+    *q++ = 0x01;
+    nut = 39; /* prefix SEI NUT */
+    *q++ = (nut << 1);
+    *q++ = 1;
+    *q++ = 0xff;  /* payload_type = 257 */
+    *q++ = 0x02;
+    *q++ = 2; /* payload_size = 2 */
+    *q++ = frame_ticks >> 8;
+    *q++ = frame_ticks;
+    *q++ = 0x80; /* extra '1' bit and align to byte */
+    /* Note: the 0x00 0x00 b pattern with b <= 3 cannot happen, so no
+       need to escape */
+    nal_len = q - nal_buf;
+    if (dyn_buf_resize(out_buf, out_buf->len + nal_len) < 0)
+        return -1;
+    memcpy(out_buf->buf + out_buf->len, nal_buf, nal_len);
+    out_buf->len += nal_len;
+    return 0;
+}
+
+static int build_modified_hevc(uint8_t **pout_buf, 
+                               const uint8_t *cbuf, int cbuf_len,
+                               const uint8_t *abuf, int abuf_len,
+                               const uint16_t *frame_duration_tab,
+                               int frame_count)
+{
+    DynBuf out_buf_s, *out_buf = &out_buf_s;
+    uint8_t *msps;
+    const uint8_t *nal_buf;
+    int msps_len, cidx, aidx, is_alpha, nal_len, first_nal, start, l, frame_num;
+    
+    bpg_dyn_buf_init(out_buf);
+    
+    /* add alpha MSPS */
+    aidx = 0; /* avoids warning */
+    if (abuf) {
+        aidx = build_modified_sps(&msps, &msps_len, abuf, abuf_len);
+        if (aidx < 0)
+            goto fail;
+        if (dyn_buf_resize(out_buf, out_buf->len + msps_len) < 0)
+            goto fail;
+        memcpy(out_buf->buf + out_buf->len, msps, msps_len);
+        out_buf->len += msps_len;
+        free(msps);
+    }
+    
+    /* add color MSPS */
+    cidx = build_modified_sps(&msps, &msps_len, cbuf, cbuf_len);
+    if (cidx < 0)
+        goto fail;
+    if (dyn_buf_resize(out_buf, out_buf->len + msps_len) < 0)
+        goto fail;
+    memcpy(out_buf->buf + out_buf->len, msps, msps_len);
+    out_buf->len += msps_len;
+    free(msps);
+
+    /* add the remaining NALs, alternating between alpha (if present)
+       and color. The PPS are kept unchanged, hence the WPP and tile
+       settings. */
+    is_alpha = (abuf != NULL);
+    first_nal = 1;
+    frame_num = 0;
+    for(;;) {
+        if (!is_alpha) {
+            if (cidx >= cbuf_len) {
+                if (abuf) {
+                    fprintf(stderr, "Incorrect number of alpha NALs\n");
+                    goto fail;
+                }
+                break;
+            }
+            nal_buf = cbuf + cidx;
+            nal_len = find_nal_end(nal_buf, cbuf_len - cidx);
+            //            printf("cidx=%d/%d nal_len=%d\n", cidx, cbuf_len, nal_len);
+            if (nal_len < 0)
+                goto fail;
+            cidx += nal_len;
+        } else {
+            if (aidx >= abuf_len) 
+                break;
+            nal_buf = abuf + aidx;
+            nal_len = find_nal_end(nal_buf, abuf_len - aidx);
+            //            printf("aidx=%d/%d nal_len=%d\n", aidx, abuf_len, nal_len);
+            if (nal_len < 0)
+                goto fail;
+            aidx += nal_len;
+        }
+        start = 3 + (nal_buf[2] == 0);
+        if (!is_alpha) {
+            int nut;
+            /* add SEI NAL for the frame duration (animation case) */
+            nut = (nal_buf[start] >> 1) & 0x3f;
+            if ((nut <= 9 || (nut >= 16 && nut <= 21)) &&  
+                start + 2 < nal_len && (nal_buf[start + 2] & 0x80)) {
+                int frame_ticks;
+                assert(frame_num < frame_count);
+                frame_ticks = frame_duration_tab[frame_num];
+                if (frame_ticks > 1) {
+                    add_frame_duration_sei(out_buf, frame_ticks);
+                }
+                frame_num++;
+            }
+        }
+        if (first_nal) {
+            /* skip first start code */
+            l = start;
+        } else {
+            l = 0;
+        }
+        if (dyn_buf_resize(out_buf, out_buf->len + nal_len - l) < 0)
+            goto fail;
+        //        printf("add nal len=%d\n", nal_len - l);
+        memcpy(out_buf->buf + out_buf->len, nal_buf + l, nal_len - l);
+        if (is_alpha) {
+            /* set nul_layer_id of alpha to '1' */
+            out_buf->buf[out_buf->len + (start - l) + 1] |= 1 << 3;
+        }
+        out_buf->len += nal_len - l;
+
+        if (abuf) {
+            is_alpha ^= 1;
+        }
+        first_nal = 0;
+    }
+    *pout_buf = out_buf->buf;
+    return out_buf->len;
+ fail:
+    free(out_buf->buf);
+    return -1;
+}
+
+/* Tile stitching: the tiles of a still picture are encoded as separate
+   pictures and their slices are put in a single picture whose PPS
+   defines the tile grid. Since the prediction and (with
+   loop_filter_across_tiles_enabled_flag = 0) the loop filters do not
+   cross the tile boundaries, the tiles decode exactly as the separate
+   pictures. The tiles must be aligned on the CTB size except at the
+   right and bottom edges of the picture. */
+
+typedef struct {
+    /* SPS */
+    int chroma_format_idc;
+    int log2_ctb_size;
+    int sao_enabled;
+    int width, height; /* coded picture size */
+    int size_pos, size_end; /* bit positions of the picture size and
+                               conformance window in the SPS */
+    int sps_end; /* bit position of rbsp_stop_one_bit */
+    /* PPS */
+    int dependent_slice_segments_enabled;
+    int output_flag_present;
+    int num_extra_slice_header_bits;
+    int slice_chroma_qp_offsets_present;
+    int loop_filter_across_slices_enabled;
+    int deblocking_filter_override_enabled;
+    int deblocking_filter_disabled;
+    int slice_segment_header_extension_present;
+    int chroma_qp_offset_list_enabled;
+    int tiles_pos; /* bit position of tiles_enabled_flag */
+    int pps_end; /* bit position of rbsp_stop_one_bit */
+} HEVCStitchInfo;
+
+static int ceil_log2(uint32_t v)
+{
+    int n;
+    n = 0;
+    while (((uint64_t)1 << n) < v)
+        n++;
+    return n;
+}
+
+/* return the bit position of rbsp_stop_one_bit or -1 if error */
+static int get_rbsp_end(const uint8_t *buf, int buf_len)
+{
+    int i, n;
+
+    for(i = buf_len - 1; i >= 2 && buf[i] == 0; i--)
+        continue;
+    if (i < 2)
+        return -1;
+    n = 7;
+    while (!((buf[i] >> (7 - n)) & 1))
+        n--;
+    return i * 8 + n;
+}
+
+/* return the general_level_idc of the lowest level allowing a w x h
+   picture (255 = level 8.5, no limit) */
+/* HEVC level limits (table A.6) */
+#define HEVC_LEVEL_COUNT 8
+
+static const uint32_t hevc_max_luma_ps[HEVC_LEVEL_COUNT] = {
+    36864, 122880, 245760, 552960, 983040, 2228224, 8912896, 35651584,
+};
+static const uint8_t hevc_level_idc[HEVC_LEVEL_COUNT] = {
+    30, 60, 63, 90, 93, 120, 150, 180,
+};
+static const uint8_t hevc_max_tile_cols[HEVC_LEVEL_COUNT] = {
+    1, 1, 1, 2, 3, 5, 10, 20,
+};
+static const uint8_t hevc_max_tile_rows[HEVC_LEVEL_COUNT] = {
+    1, 1, 1, 2, 3, 5, 11, 22,
+};
+
+/* return the index of the lowest level allowing a w x h picture with
+   a cols x rows tile grid or HEVC_LEVEL_COUNT if none */
+static int hevc_get_level(int w, int h, int cols, int rows)
+{
+    double max_dim;
+    int i;
+
+    for(i = 0; i < HEVC_LEVEL_COUNT; i++) {
+        max_dim = sqrt(hevc_max_luma_ps[i] * 8.0);
+        if ((uint64_t)w * h <= hevc_max_luma_ps[i] &&
+            w <= max_dim && h <= max_dim &&
+            cols <= hevc_max_tile_cols[i] && rows <= hevc_max_tile_rows[i])
+            return i;
+    }
+    return HEVC_LEVEL_COUNT;
+}
+
+static int hevc_get_level_idc(int w, int h, int cols, int rows)
+{
+    int i = hevc_get_level(w, h, cols, rows);
+    return i < HEVC_LEVEL_COUNT ? hevc_level_idc[i] : 255;
+}
+
+/* copy the bits [start, end) of 'buf' */
+static void put_bits_from(PutBitState *pb, const uint8_t *buf, int buf_len,
+                          int start, int end)
+{
+    GetBitState gb_s, *gb = &gb_s;
+
+    init_get_bits(gb, buf, buf_len);
+    skip_bits(gb, start);
+    while (gb->idx < end)
+        put_bit(pb, get_bits(gb, 1));
+}
+
+/* add the NAL 'buf' (without emulation prevention) with a start
+   code */
+static int dyn_buf_put_nal(DynBuf *s, const uint8_t *buf, int buf_len)
+{
+    uint8_t *q;
+    int i, zero_count;
+
+    if (dyn_buf_resize(s, s->len + 4 + buf_len + buf_len / 2 + 1) < 0)
+        return -1;
+    q = s->buf + s->len;
+    *q++ = 0x00;
+    *q++ = 0x00;
+    *q++ = 0x00;
+    *q++ = 0x01;
+    zero_count = 0;
+    for(i = 0; i < buf_len; i++) {
+        if (zero_count >= 2 && buf[i] <= 3) {
+            *q++ = 0x03;
+            zero_count = 0;
+        }
+        *q++ = buf[i];
+        if (buf[i] == 0)
+            zero_count++;
+        else
+            zero_count = 0;
+    }
+    /* cabac_zero_words */
+    if (zero_count > 0)
+        *q++ = 0x03;
+    s->len = q - s->buf;
+    return 0;
+}
+
+/* parse the SPS fields needed to rewrite the slice headers */
+static int stitch_parse_sps(HEVCStitchInfo *si,
+                            const uint8_t *nal_buf, int nal_len)
+{
+    GetBitState gb_s, *gb = &gb_s;
+    int i, log2_min_cb_size;
+
+    init_get_bits(gb, nal_buf, nal_len);
+    skip_bits(gb, 16); /* nal header */
+    skip_bits(gb, 4); /* vps_id */
+    if (get_bits(gb, 3) != 0) /* max_sub_layers */
+        return -1;
+    skip_bits(gb, 1); /* temporal_id_nesting_flag */
+    skip_bits(gb, 96); /* profile_tier_level */
+    get_ue_golomb(gb); /* sps_id */
+    si->chroma_format_idc = get_ue_golomb(gb);
+    if (si->chroma_format_idc == 3) {
+        if (get_bits(gb, 1)) /* separate_colour_plane_flag */
+            return -1;
+    }
+    si->size_pos = gb->idx;
+    si->width = get_ue_golomb(gb);
+    si->height = get_ue_golomb(gb);
+    /* pic conformance_flag */
+    if (get_bits(gb, 1)) {
+        for(i = 0; i < 4; i++)
+            get_ue_golomb(gb);
+    }
+    si->size_end = gb->idx;
+    get_ue_golomb(gb); /* bit_depth_luma */
+    get_ue_golomb(gb); /* bit_depth_chroma */
+    get_ue_golomb(gb); /* log2_max_poc_lsb */
+    skip_bits(gb, 1); /* sublayer_ordering_info */
+    get_ue_golomb(gb); /* max_dec_pic_buffering */
+    get_ue_golomb(gb); /* num_reorder_pics */
+    get_ue_golomb(gb); /* max_latency_increase */
+    log2_min_cb_size = get_ue_golomb(gb) + 3;
+    si->log2_ctb_size = log2_min_cb_size + get_ue_golomb(gb);
+    get_ue_golomb(gb); /* log2_min_tb_size */
+    get_ue_golomb(gb); /* log2_diff_max_min_transform_block_size */
+    get_ue_golomb(gb); /* max_transform_hierarchy_depth_inter */
+    get_ue_golomb(gb); /* max_transform_hierarchy_depth_intra */
+    if (get_bits(gb, 1)) /* scaling_list_enable_flag */
+        return -1;
+    skip_bits(gb, 1); /* amp_enabled_flag */
+    si->sao_enabled = get_bits(gb, 1);
+    if (si->log2_ctb_size < 4 || si->log2_ctb_size > 6)
+        return -1;
+    si->sps_end = get_rbsp_end(nal_buf, nal_len);
+    if (si->sps_end < 0)
+        return -1;
+    return 0;
+}
+
+/* parse the PPS fields needed to rewrite the slice headers. The PPS
+   must not already have tiles. */
+static int stitch_parse_pps(HEVCStitchInfo *si,
+                            const uint8_t *nal_buf, int nal_len)
+{
+    GetBitState gb_s, *gb = &gb_s;
+    int v, transform_skip_enabled_flag;
+
+    init_get_bits(gb, nal_buf, nal_len);
+    skip_bits(gb, 16); /* nal header */
+    get_ue_golomb(gb); /* pps_id */
+    get_ue_golomb(gb); /* sps_id */
+    si->dependent_slice_segments_enabled = get_bits(gb, 1);
+    si->output_flag_present = get_bits(gb, 1);
+    si->num_extra_slice_header_bits = get_bits(gb, 3);
+    skip_bits(gb, 1); /* sign_data_hiding_enabled_flag */
+    skip_bits(gb, 1); /* cabac_init_present_flag */
+    get_ue_golomb(gb); /* num_ref_idx_l0_default_active_minus1 */
+    get_ue_golomb(gb); /* num_ref_idx_l1_default_active_minus1 */
+    get_ue_golomb(gb); /* init_qp_minus26 (se) */
+    skip_bits(gb, 1); /* constrained_intra_pred_flag */
+    transform_skip_enabled_flag = get_bits(gb, 1);
+    if (get_bits(gb, 1)) /* cu_qp_delta_enabled_flag */
+        get_ue_golomb(gb); /* diff_cu_qp_delta_depth */
+    get_ue_golomb(gb); /* pps_cb_qp_offset (se) */
+    get_ue_golomb(gb); /* pps_cr_qp_offset (se) */
+    si->slice_chroma_qp_offsets_present = get_bits(gb, 1);
+    skip_bits(gb, 1); /* weighted_pred_flag */
+    skip_bits(gb, 1); /* weighted_bipred_flag */
+    skip_bits(gb, 1); /* transquant_bypass_enabled_flag */
+    si->tiles_pos = gb->idx;
+    if (get_bits(gb, 1)) /* tiles_enabled_flag */
+        return -1;
+    /* tiles and WPP cannot be combined in the Main profiles */
+    if (get_bits(gb, 1)) /* entropy_coding_sync_enabled_flag */
+        return -1;
+    si->loop_filter_across_slices_enabled = get_bits(gb, 1);
+    si->deblocking_filter_override_enabled = 0;
+    si->deblocking_filter_disabled = 0;
+    if (get_bits(gb, 1)) { /* deblocking_filter_control_present_flag */
+        si->deblocking_filter_override_enabled = get_bits(gb, 1);
+        si->deblocking_filter_disabled = get_bits(gb, 1);
+        if (!si->deblocking_filter_disabled) {
+            get_ue_golomb(gb); /* beta_offset_div2 (se) */
+            get_ue_golomb(gb); /* tc_offset_div2 (se) */
+        }
+    }
+    if (get_bits(gb, 1)) /* pps_scaling_list_data_present_flag */
+        return -1;
+    skip_bits(gb, 1); /* lists_modification_present_flag */
+    get_ue_golomb(gb); /* log2_parallel_merge_level_minus2 */
+    si->slice_segment_header_extension_present = get_bits(gb, 1);
+    si->chroma_qp_offset_list_enabled = 0;
+    if (get_bits(gb, 1)) { /* pps_extension_present_flag */
+        v = get_bits(gb, 8);
+        if (v & 0x7f) /* only the range extension is supported */
+            return -1;
+        if (v & 0x80) {
+            if (transform_skip_enabled_flag)
+                get_ue_golomb(gb); /* log2_max_transform_skip_block_size_minus2 */
+            skip_bits(gb, 1); /* cross_component_prediction_enabled_flag */
+            si->chroma_qp_offset_list_enabled = get_bits(gb, 1);
+        }
+    }
+    si->pps_end = get_rbsp_end(nal_buf, nal_len);
+    if (si->pps_end < 0)
+        return -1;
+    return 0;
+}
+
+/* parse the SPS of the HEVC bitstream 'buf' (it follows the VPS) */
+static int stitch_get_sps(HEVCStitchInfo *si, const uint8_t *buf, int buf_len)
+{
+    uint8_t *nal_buf;
+    int idx, nal_len, ret;
+
+    idx = find_nal_end(buf, buf_len);
+    if (idx < 0 || extract_nal(&nal_buf, &nal_len, buf + idx,
+                               buf_len - idx) < 0)
+        return -1;
+    ret = stitch_parse_sps(si, nal_buf, nal_len);
+    free(nal_buf);
+    return ret;
+}
+
+/* build the SPS of the stitched picture from the SPS of the tiles. The
+   coded size is coded_w x coded_h and the picture is cropped to
+   width x height. */
+static int stitch_build_sps(DynBuf *out_buf, const HEVCStitchInfo *si,
+                            const uint8_t *nal_buf, int nal_len,
+                            int level_idc, int coded_w, int coded_h,
+                            int width, int height)
+{
+    PutBitState pb_s, *pb = &pb_s;
+    uint8_t *buf;
+    int buf_len, ret, sub_w, sub_h;
+
+    buf_len = nal_len + 32;
+    buf = malloc(buf_len);
+    if (!buf)
+        return -1;
+    memset(buf, 0, buf_len);
+    init_put_bits(pb, buf);
+    put_bits_from(pb, nal_buf, nal_len, 0, 112);
+    put_bits(pb, 8, level_idc); /* general_level_idc */
+    put_bits_from(pb, nal_buf, nal_len, 120, si->size_pos);
+    put_ue_golomb(pb, coded_w);
+    put_ue_golomb(pb, coded_h);
+    if (coded_w != width || coded_h != height) {
+        sub_w = 1 + (si->chroma_format_idc == 1 || si->chroma_format_idc == 2);
+        sub_h = 1 + (si->chroma_format_idc == 1);
+        put_bits(pb, 1, 1); /* conformance_window_flag */
+        put_ue_golomb(pb, 0);
+        put_ue_golomb(pb, (coded_w - width) / sub_w);
+        put_ue_golomb(pb, 0);
+        put_ue_golomb(pb, (coded_h - height) / sub_h);
+    } else {
+        put_bits(pb, 1, 0); /* conformance_window_flag */
+    }
+    put_bits_from(pb, nal_buf, nal_len, si->size_end, si->sps_end);
+    /* rbsp_trailing_bits */
+    put_bit(pb, 1);
+    ret = dyn_buf_put_nal(out_buf, buf, (pb->idx + 7) >> 3);
+    free(buf);
+    return ret;
+}
+
+/* build the PPS of the stitched picture from the PPS of the tiles */
+static int stitch_build_pps(DynBuf *out_buf, const HEVCStitchInfo *si,
+                            const uint8_t *nal_buf, int nal_len,
+                            int cols, int rows,
+                            const int *col_pos, const int *row_pos)
+{
+    PutBitState pb_s, *pb = &pb_s;
+    uint8_t *buf;
+    int i, ctb_size, buf_len, ret;
+
+    buf_len = nal_len + 16 + (cols + rows) * 8;
+    buf = malloc(buf_len);
+    if (!buf)
+        return -1;
+    memset(buf, 0, buf_len);
+    ctb_size = 1 << si->log2_ctb_size;
+    init_put_bits(pb, buf);
+    put_bits_from(pb, nal_buf, nal_len, 0, si->tiles_pos);
+    put_bits(pb, 1, 1); /* tiles_enabled_flag */
+    put_bits(pb, 1, 0); /* entropy_coding_sync_enabled_flag */
+    put_ue_golomb(pb, cols - 1);
+    put_ue_golomb(pb, rows - 1);
+    put_bits(pb, 1, 0); /* uniform_spacing_flag */
+    for(i = 0; i < cols - 1; i++)
+        put_ue_golomb(pb, (col_pos[i + 1] - col_pos[i]) / ctb_size - 1);
+    for(i = 0; i < rows - 1; i++)
+        put_ue_golomb(pb, (row_pos[i + 1] - row_pos[i]) / ctb_size - 1);
+    put_bits(pb, 1, 0); /* loop_filter_across_tiles_enabled_flag */
+    put_bits_from(pb, nal_buf, nal_len, si->tiles_pos + 2, si->pps_end);
+    /* rbsp_trailing_bits */
+    put_bit(pb, 1);
+    ret = dyn_buf_put_nal(out_buf, buf, (pb->idx + 7) >> 3);
+    free(buf);
+    return ret;
+}
+
+/* rewrite the slice segment header of an IDR slice of the tile whose
+   top left CTB is (tile_x, tile_y) and whose width and height are
+   tile_w x tile_h CTBs. The picture has pic_w x pic_h CTBs. Return the
+   length of the new slice or -1 if error. */
+static int stitch_slice(uint8_t *out, const HEVCStitchInfo *si,
+                        const uint8_t *nal_buf, int nal_len,
+                        int first_tile, int tile_x, int tile_y,
+                        int tile_w, int tile_h, int pic_w, int pic_h)
+{
+    GetBitState gb_s, *gb = &gb_s;
+    PutBitState pb_s, *pb = &pb_s;
+    int nut, first_slice, dependent, addr, pos, n, len;
+    int sao_luma, sao_chroma, deblocking_disabled, data_pos;
+
+    nut = (nal_buf[0] >> 1) & 0x3f;
+    if (nut != 19 && nut != 20) {
+        fprintf(stderr, "expecting IDR nal (%d)\n", nut);
+        return -1;
+    }
+    init_get_bits(gb, nal_buf, nal_len);
+    init_put_bits(pb, out);
+    skip_bits(gb, 16); /* nal header */
+    put_bits_from(pb, nal_buf, nal_len, 0, 16);
+    first_slice = get_bits(gb, 1);
+    put_bits(pb, 1, first_slice && first_tile);
+    pos = gb->idx;
+    skip_bits(gb, 1); /* no_output_of_prior_pics_flag */
+    get_ue_golomb(gb); /* slice_pic_parameter_set_id */
+    put_bits_from(pb, nal_buf, nal_len, pos, gb->idx);
+
+    dependent = 0;
+    addr = 0;
+    if (!first_slice) {
+        if (si->dependent_slice_segments_enabled)
+            dependent = get_bits(gb, 1);
+        n = ceil_log2(tile_w * tile_h);
+        if (n > 0)
+            addr = get_bits_long(gb, n);
+    }
+    if (!(first_slice && first_tile)) {
+        if (si->dependent_slice_segments_enabled)
+            put_bits(pb, 1, dependent);
+        /* the slice segment address is in raster scan of the picture */
+        addr = (tile_y + addr / tile_w) * pic_w + tile_x + addr % tile_w;
+        put_bits(pb, ceil_log2(pic_w * pic_h), addr);
+    }
+
+    pos = gb->idx;
+    if (!dependent) {
+        skip_bits(gb, si->num_extra_slice_header_bits);
+        if (get_ue_golomb(gb) != 2) { /* slice_type */
+            fprintf(stderr, "expecting I slice\n");
+            return -1;
+        }
+        if (si->output_flag_present)
+            skip_bits(gb, 1); /* pic_output_flag */
+        sao_luma = 0;
+        sao_chroma = 0;
+        if (si->sao_enabled) {
+            sao_luma = get_bits(gb, 1);
+            if (si->chroma_format_idc != 0)
+                sao_chroma = get_bits(gb, 1);
+        }
+        get_ue_golomb(gb); /* slice_qp_delta (se) */
+        if (si->slice_chroma_qp_offsets_present) {
+            get_ue_golomb(gb); /* slice_cb_qp_offset (se) */
+            get_ue_golomb(gb); /* slice_cr_qp_offset (se) */
+        }
+        if (si->chroma_qp_offset_list_enabled)
+            skip_bits(gb, 1); /* cu_chroma_qp_offset_enabled_flag */
+        deblocking_disabled = si->deblocking_filter_disabled;
+        if (si->deblocking_filter_override_enabled && get_bits(gb, 1)) {
+            deblocking_disabled = get_bits(gb, 1);
+            if (!deblocking_disabled) {
+                get_ue_golomb(gb); /* slice_beta_offset_div2 (se) */
+                get_ue_golomb(gb); /* slice_tc_offset_div2 (se) */
+            }
+        }
+        if (si->loop_filter_across_slices_enabled &&
+            (sao_luma || sao_chroma || !deblocking_disabled))
+            skip_bits(gb, 1); /* slice_loop_filter_across_slices_enabled_flag */
+    }
+    put_bits_from(pb, nal_buf, nal_len, pos, gb->idx);
+    put_ue_golomb(pb, 0); /* num_entry_point_offsets */
+
+    pos = gb->idx;
+    if (si->slice_segment_header_extension_present) {
+        n = get_ue_golomb(gb);
+        skip_bits(gb, 8 * n);
+    }
+    /* byte_alignment() */
+    if (get_bits(gb, 1) != 1)
+        return -1;
+    put_bits_from(pb, nal_buf, nal_len, pos, gb->idx - 1);
+    put_bit(pb, 1);
+    data_pos = (gb->idx + 7) >> 3;
+    if (data_pos > nal_len)
+        return -1;
+    len = (pb->idx + 7) >> 3;
+    memcpy(out + len, nal_buf + data_pos, nal_len - data_pos);
+    return len + nal_len - data_pos;
+}
+
+/* stitch the HEVC bitstreams 'buf_tab' of the cols x rows tiles
+   (raster order) of a still picture. The tile (i, j) starts at
+   (col_pos[i], row_pos[j]) luma samples. col_pos[cols] and
+   row_pos[rows] are the picture size. The tiles must have the same
+   encoding parameters. Return the length of the new bitstream or < 0
+   if error. */
+static int hevc_stitch_tiles(uint8_t **pout_buf,
+                             uint8_t * const *buf_tab, const int *len_tab,
+                             int cols, int rows,
+                             const int *col_pos, const int *row_pos)
+{
+    DynBuf out_buf_s, *out_buf = &out_buf_s;
+    HEVCStitchInfo si_s, *si = &si_s, si1;
+    uint8_t *msps0, *msps, *nal_buf, *slice_buf;
+    const uint8_t *buf, *pps0;
+    int msps0_len, msps_len, pps_len0, i, j, k, idx, len, level_idc;
+    int coded_w, coded_h;
+    int ret, nal_len, nut, start, ctb_size, pic_w, pic_h, slice_count;
+    int tile_x, tile_y, tile_w, tile_h;
+
+    /* a single tile is kept as is (the PPS cannot signal a 1x1 tile
+       grid) */
+    if (cols * rows == 1) {
+        *pout_buf = malloc(len_tab[0]);
+        if (!*pout_buf)
+            return -1;
+        memcpy(*pout_buf, buf_tab[0], len_tab[0]);
+        return len_tab[0];
+    }
+
+    bpg_dyn_buf_init(out_buf);
+    msps0 = NULL;
+    nal_buf = NULL;
+    pps0 = NULL;
+    pps_len0 = 0;
+    coded_w = 0;
+    coded_h = 0;
+    msps0_len = 0;
+
+    /* the tiles must have the same SPS (except the size) and PPS */
+    for(k = 0; k < cols * rows; k++) {
+        buf = buf_tab[k];
+        len = len_tab[k];
+        idx = build_modified_sps(&msps, &msps_len, buf, len);
+        if (idx < 0)
+            goto fail;
+        nal_len = find_nal_end(buf + idx, len - idx);
+        if (nal_len < 0) {
+            free(msps);
+            goto fail;
+        }
+        start = 3 + (buf[idx + 2] == 0);
+        nut = (buf[idx + start] >> 1) & 0x3f;
+        if (nut != 34) {
+            fprintf(stderr, "expecting PPS nal (%d)\n", nut);
+            free(msps);
+            goto fail;
+        }
+        if (k == 0) {
+            msps0 = msps;
+            msps0_len = msps_len;
+            pps0 = buf + idx;
+            pps_len0 = nal_len;
+        } else {
+            ret = (msps_len != msps0_len ||
+                   memcmp(msps, msps0, msps_len) != 0 ||
+                   nal_len != pps_len0 ||
+                   memcmp(buf + idx, pps0, nal_len) != 0);
+            free(msps);
+            if (ret) {
+                fprintf(stderr, "the tiles have different parameter sets\n");
+                goto fail;
+            }
+        }
+        /* the encoder may have padded the tiles of the last column and
+           row */
+        if (k == cols - 1 || k == (rows - 1) * cols) {
+            if (stitch_get_sps(&si1, buf, len) < 0)
+                goto fail;
+            if (k == cols - 1)
+                coded_w = col_pos[cols - 1] + si1.width;
+            if (k == (rows - 1) * cols)
+                coded_h = row_pos[rows - 1] + si1.height;
+        }
+    }
+
+    /* VPS and SPS of the first tile with the size and level of the
+       picture */
+    buf = buf_tab[0];
+    len = len_tab[0];
+    level_idc = hevc_get_level_idc(coded_w, coded_h, cols, rows);
+    idx = extract_nal(&nal_buf, &nal_len, buf, len);
+    if (idx < 0 || nal_len < 18)
+        goto fail;
+    nal_buf[17] = level_idc; /* general_level_idc */
+    if (dyn_buf_put_nal(out_buf, nal_buf, nal_len) < 0)
+        goto fail;
+    free(nal_buf);
+    nal_buf = NULL;
+    if (extract_nal(&nal_buf, &nal_len, buf + idx, len - idx) < 0)
+        goto fail;
+    if (stitch_parse_sps(si, nal_buf, nal_len) < 0 ||
+        stitch_build_sps(out_buf, si, nal_buf, nal_len, level_idc,
+                         coded_w, coded_h, col_pos[cols], row_pos[rows]) < 0)
+        goto fail;
+    free(nal_buf);
+    nal_buf = NULL;
+
+    ctb_size = 1 << si->log2_ctb_size;
+    for(i = 1; i < cols; i++) {
+        if ((col_pos[i] & (ctb_size - 1)) != 0)
+            goto fail;
+    }
+    for(j = 1; j < rows; j++) {
+        if ((row_pos[j] & (ctb_size - 1)) != 0)
+            goto fail;
+    }
+    /* minimum tile size of the HEVC profiles */
+    for(i = 0; i < cols; i++) {
+        if (cols > 1 && col_pos[i + 1] - col_pos[i] < 256) {
+            fprintf(stderr, "tile columns must be at least 256 pixels wide\n");
+            goto fail;
+        }
+    }
+    for(j = 0; j < rows; j++) {
+        if (rows > 1 && row_pos[j + 1] - row_pos[j] < 64) {
+            fprintf(stderr, "tile rows must be at least 64 pixels high\n");
+            goto fail;
+        }
+    }
+    pic_w = (coded_w + ctb_size - 1) >> si->log2_ctb_size;
+    pic_h = (coded_h + ctb_size - 1) >> si->log2_ctb_size;
+
+    /* PPS with the tile grid */
+    if (extract_nal(&nal_buf, &nal_len, pps0, pps_len0) < 0)
+        goto fail;
+    if (stitch_parse_pps(si, nal_buf, nal_len) < 0 ||
+        stitch_build_pps(out_buf, si, nal_buf, nal_len,
+                         cols, rows, col_pos, row_pos) < 0)
+        goto fail;
+    free(nal_buf);
+    nal_buf = NULL;
+
+    /* slices of each tile. The other NALs (parameter sets, SEI) are
+       removed. */
+    for(k = 0; k < cols * rows; k++) {
+        i = k % cols;
+        j = k / cols;
+        tile_x = col_pos[i] >> si->log2_ctb_size;
+        tile_y = row_pos[j] >> si->log2_ctb_size;
+        tile_w = (col_pos[i + 1] - col_pos[i] + ctb_size - 1) >>
+            si->log2_ctb_size;
+        tile_h = (row_pos[j + 1] - row_pos[j] + ctb_size - 1) >>
+            si->log2_ctb_size;
+        buf = buf_tab[k];
+        len = len_tab[k];
+        idx = 0;
+        slice_count = 0;
+        while (idx < len) {
+            ret = extract_nal(&nal_buf, &nal_len, buf + idx, len - idx);
+            if (ret < 0 || nal_len < 2)
+                goto fail;
+            idx += ret;
+            nut = (nal_buf[0] >> 1) & 0x3f;
+            if (nut < 32) {
+                slice_buf = malloc(nal_len + 16);
+                if (!slice_buf)
+                    goto fail;
+                memset(slice_buf, 0, nal_len + 16);
+                ret = stitch_slice(slice_buf, si, nal_buf, nal_len,
+                                   (k == 0), tile_x, tile_y, tile_w, tile_h,
+                                   pic_w, pic_h);
+                if (ret >= 0)
+                    ret = dyn_buf_put_nal(out_buf, slice_buf, ret);
+                free(slice_buf);
+                if (ret < 0)
+                    goto fail;
+                slice_count++;
+            }
+            free(nal_buf);
+            nal_buf = NULL;
+        }
+        if (slice_count == 0)
+            goto fail;
+    }
+    free(msps0);
+    *pout_buf = out_buf->buf;
+    return out_buf->len;
+ fail:
+    free(nal_buf);
+    free(msps0);
+    free(out_buf->buf);
+    return -1;
+}
+
+void *mallocz(size_t size)
+{
+    void *ptr;
+    ptr = malloc(size);
+    if (!ptr)
+        return NULL;
+    memset(ptr, 0, size);
+    return ptr;
+}
+
+/* Input and output of the encoders which read a YUV file and write a
+   bitstream file. The encoder is given pipes (/dev/fd/N, or named
+   pipes on Windows) which are fed and drained by two threads while it
+   runs. Temporary files are used if it is not possible. Note: the YUV
+   frames are buffered in memory until hevc_file_io_start() because
+   the encoders only start reading when all the frames are given. When
+   the frames of an animation exceed HEVC_FILE_IO_MAX_BUF bytes, they
+   are written to a temporary file instead. */
+
+#define HEVC_FILE_IO_MAX_BUF (256 << 20)
+
+struct HEVCFileIO {
+    DynBuf in_buf; /* YUV frames */
+    FILE *in_file; /* YUV frames if they do not fit in 'in_buf' */
+    int frame_count;
+    char infilename[1024];
+    char outfilename[1024];
+    int started;
+    int use_pipes;
+#ifdef HAVE_THREADS
+    int in_fds[2]; /* the encoder reads in_fds[0] */
+    int out_fds[2]; /* the encoder writes out_fds[1] */
+    pthread_t writer, reader;
+#endif
+#ifdef _WIN32
+    HANDLE in_pipe, out_pipe; /* server ends of the named pipes */
+    HANDLE writer, reader;
+#endif
+#if defined(HAVE_THREADS) || defined(_WIN32)
+    DynBuf out_buf;
+    int read_error;
+#endif
+};
+
+HEVCFileIO *hevc_file_io_new(void)
+{
+    return mallocz(sizeof(HEVCFileIO));
+}
+
+/* unique index for the names of the concurrent encodes */
+static int hevc_file_io_idx = 1;
+
+/* set the names of the temporary files */
+static int hevc_file_io_set_tmp_names(HEVCFileIO *s)
+{
+    char buf[256];
+    int idx;
+
+#ifdef _WIN32
+    if (GetTempPath(sizeof(buf), buf) > sizeof(buf) - 1) {
+        fprintf(stderr, "Temporary path too long\n");
+        return -1;
+    }
+#else
+    strcpy(buf, "/tmp/");
+#endif
+    idx = __atomic_fetch_add(&hevc_file_io_idx, 1, __ATOMIC_RELAXED);
+    snprintf(s->infilename, sizeof(s->infilename), "%sout%d-%d.yuv",
+             buf, getpid(), idx);
+    snprintf(s->outfilename, sizeof(s->outfilename), "%sout%d-%d.bin",
+             buf, getpid(), idx);
+    return 0;
+}
+
+/* move the buffered frames to a temporary file */
+static int hevc_file_io_open_tmp(HEVCFileIO *s)
+{
+    if (hevc_file_io_set_tmp_names(s) < 0)
+        return -1;
+    s->in_file = fopen(s->infilename, "wb");
+    if (!s->in_file) {
+        fprintf(stderr, "Could not open '%s'\n", s->infilename);
+        return -1;
+    }
+    if (fwrite(s->in_buf.buf, 1, s->in_buf.len, s->in_file) !=
+        (size_t)s->in_buf.len) {
+        fprintf(stderr, "Could not write '%s'\n", s->infilename);
+        return -1;
+    }
+    free(s->in_buf.buf);
+    bpg_dyn_buf_init(&s->in_buf);
+    return 0;
+}
+
+int hevc_file_io_add_image(HEVCFileIO *s, Image *img)
+{
+    int c_w, c_h, i, c_count, y, row_size;
+    size_t frame_size;
+
+    if (img->format == BPG_FORMAT_GRAY)
+        c_count = 1;
+    else
+        c_count = 3;
+    frame_size = 0;
+    for(i = 0; i < c_count; i++) {
+        get_plane_res(img, &c_w, &c_h, i);
+        frame_size += (size_t)(c_w << img->pixel_shift) * c_h;
+    }
+    /* a still image is always kept in memory */
+    if (!s->in_file && s->frame_count > 0 &&
+        s->in_buf.len + frame_size > HEVC_FILE_IO_MAX_BUF) {
+        if (hevc_file_io_open_tmp(s) < 0)
+            return -1;
+    }
+    for(i = 0; i < c_count; i++) {
+        get_plane_res(img, &c_w, &c_h, i);
+        row_size = c_w << img->pixel_shift;
+        if (s->in_file) {
+            for(y = 0; y < c_h; y++) {
+                if (fwrite(img->data[i] + (size_t)y * img->linesize[i],
+                           1, row_size, s->in_file) != (size_t)row_size) {
+                    fprintf(stderr, "Could not write '%s'\n",
+                            s->infilename);
+                    return -1;
+                }
+            }
+        } else {
+            if (dyn_buf_resize(&s->in_buf, s->in_buf.len +
+                               (size_t)row_size * c_h) < 0)
+                return -1;
+            for(y = 0; y < c_h; y++) {
+                memcpy(s->in_buf.buf + s->in_buf.len,
+                       img->data[i] + (size_t)y * img->linesize[i],
+                       row_size);
+                s->in_buf.len += row_size;
+            }
+        }
+    }
+    s->frame_count++;
+    return 0;
+}
+
+#ifdef HAVE_THREADS
+
+static void *hevc_file_io_writer(void *opaque)
+{
+    HEVCFileIO *s = opaque;
+    const uint8_t *p;
+    sigset_t set;
+    ssize_t ret;
+    size_t len;
+
+    /* the encoder may stop reading before the end: write() then
+       returns EPIPE */
+    sigemptyset(&set);
+    sigaddset(&set, SIGPIPE);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+    p = s->in_buf.buf;
+    len = s->in_buf.len;
+    while (len > 0) {
+        ret = write(s->in_fds[1], p, len);
+        if (ret < 0) {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+        p += ret;
+        len -= ret;
+    }
+    close(s->in_fds[1]);
+    return NULL;
+}
+
+static void *hevc_file_io_reader(void *opaque)
+{
+    HEVCFileIO *s = opaque;
+    DynBuf *b = &s->out_buf;
+    uint8_t tmp_buf[4096];
+    ssize_t ret;
+
+    for(;;) {
+        /* the output is still drained after an allocation error so
+           that the encoder is not blocked */
+        if (!s->read_error && dyn_buf_resize(b, b->len + 65536) < 0)
+            s->read_error = 1;
+        if (s->read_error)
+            ret = read(s->out_fds[0], tmp_buf, sizeof(tmp_buf));
+        else
+            ret = read(s->out_fds[0], b->buf + b->len, b->size - b->len);
+        if (ret < 0) {
+            if (errno == EINTR)
+                continue;
+            s->read_error = 1;
+            break;
+        }
+        if (ret == 0)
+            break;
+        if (!s->read_error)
+            b->len += ret;
+    }
+    return NULL;
+}
+
+/* return < 0 if the pipes cannot be used */
+static int hevc_file_io_start_pipes(HEVCFileIO *s)
+{
+    if (pipe(s->in_fds) < 0)
+        return -1;
+    if (pipe(s->out_fds) < 0)
+        goto fail1;
+    snprintf(s->infilename, sizeof(s->infilename), "/dev/fd/%d",
+             s->in_fds[0]);
+    snprintf(s->outfilename, sizeof(s->outfilename), "/dev/fd/%d",
+             s->out_fds[1]);
+    if (access(s->infilename, R_OK) < 0)
+        goto fail2;
+    if (pthread_create(&s->writer, NULL, hevc_file_io_writer, s))
+        goto fail2;
+    if (pthread_create(&s->reader, NULL, hevc_file_io_reader, s)) {
+        /* stop the writer */
+        close(s->in_fds[0]);
+        pthread_join(s->writer, NULL);
+        close(s->out_fds[0]);
+        close(s->out_fds[1]);
+        return -1;
+    }
+    s->use_pipes = 1;
+    return 0;
+ fail2:
+    close(s->out_fds[0]);
+    close(s->out_fds[1]);
+ fail1:
+    close(s->in_fds[0]);
+    close(s->in_fds[1]);
+    return -1;
+}
+
+#endif /* HAVE_THREADS */
+
+#ifdef _WIN32
+
+static DWORD WINAPI hevc_file_io_writer(LPVOID opaque)
+{
+    HEVCFileIO *s = opaque;
+    const uint8_t *p;
+    size_t len;
+    DWORD n;
+
+    if (ConnectNamedPipe(s->in_pipe, NULL) ||
+        GetLastError() == ERROR_PIPE_CONNECTED) {
+        p = s->in_buf.buf;
+        len = s->in_buf.len;
+        /* fails if the encoder stops reading before the end */
+        while (len > 0 &&
+               WriteFile(s->in_pipe, p, len > (1 << 20) ? (1 << 20) : len,
+                         &n, NULL)) {
+            p += n;
+            len -= n;
+        }
+    }
+    CloseHandle(s->in_pipe);
+    return 0;
+}
+
+static DWORD WINAPI hevc_file_io_reader(LPVOID opaque)
+{
+    HEVCFileIO *s = opaque;
+    DynBuf *b = &s->out_buf;
+    uint8_t tmp_buf[4096];
+    DWORD n;
+    BOOL ret;
+
+    if (!ConnectNamedPipe(s->out_pipe, NULL) &&
+        GetLastError() != ERROR_PIPE_CONNECTED) {
+        s->read_error = 1;
+        return 0;
+    }
+    for(;;) {
+        /* the output is still drained after an allocation error so
+           that the encoder is not blocked */
+        if (!s->read_error && dyn_buf_resize(b, b->len + 65536) < 0)
+            s->read_error = 1;
+        if (s->read_error)
+            ret = ReadFile(s->out_pipe, tmp_buf, sizeof(tmp_buf), &n, NULL);
+        else
+            ret = ReadFile(s->out_pipe, b->buf + b->len, b->size - b->len,
+                           &n, NULL);
+        if (!ret) {
+            /* end of file when the encoder closes the pipe */
+            if (GetLastError() != ERROR_BROKEN_PIPE)
+                s->read_error = 1;
+            break;
+        }
+        if (!s->read_error)
+            b->len += n;
+    }
+    return 0;
+}
+
+/* connect to the pipe 'name' and disconnect at once. It ends a
+   ConnectNamedPipe() call of the server. */
+static void hevc_file_io_connect_dummy(const char *name, DWORD access)
+{
+    HANDLE h;
+
+    h = CreateFileA(name, access, 0, NULL, OPEN_EXISTING, 0, NULL);
+    if (h != INVALID_HANDLE_VALUE)
+        CloseHandle(h);
+}
+
+/* return < 0 if the pipes cannot be used */
+static int hevc_file_io_start_pipes(HEVCFileIO *s)
+{
+    int idx;
+
+    idx = __atomic_fetch_add(&hevc_file_io_idx, 1, __ATOMIC_RELAXED);
+    snprintf(s->infilename, sizeof(s->infilename),
+             "\\\\.\\pipe\\bpgenc%lu-%d-in", GetCurrentProcessId(), idx);
+    snprintf(s->outfilename, sizeof(s->outfilename),
+             "\\\\.\\pipe\\bpgenc%lu-%d-out", GetCurrentProcessId(), idx);
+    s->in_pipe = CreateNamedPipeA(s->infilename, PIPE_ACCESS_OUTBOUND,
+                                  PIPE_TYPE_BYTE | PIPE_WAIT, 1,
+                                  65536, 65536, 0, NULL);
+    if (s->in_pipe == INVALID_HANDLE_VALUE)
+        return -1;
+    s->out_pipe = CreateNamedPipeA(s->outfilename, PIPE_ACCESS_INBOUND,
+                                   PIPE_TYPE_BYTE | PIPE_WAIT, 1,
+                                   65536, 65536, 0, NULL);
+    if (s->out_pipe == INVALID_HANDLE_VALUE)
+        goto fail1;
+    s->writer = CreateThread(NULL, 0, hevc_file_io_writer, s, 0, NULL);
+    if (!s->writer)
+        goto fail2;
+    s->reader = CreateThread(NULL, 0, hevc_file_io_reader, s, 0, NULL);
+    if (!s->reader) {
+        /* stop the writer (it closes in_pipe) */
+        hevc_file_io_connect_dummy(s->infilename, GENERIC_READ);
+        WaitForSingleObject(s->writer, INFINITE);
+        CloseHandle(s->writer);
+        CloseHandle(s->out_pipe);
+        return -1;
+    }
+    s->use_pipes = 1;
+    return 0;
+ fail2:
+    CloseHandle(s->out_pipe);
+ fail1:
+    CloseHandle(s->in_pipe);
+    return -1;
+}
+
+/* end the transfers. The encoder has closed its ends of the pipes. */
+static void hevc_file_io_end_pipes(HEVCFileIO *s)
+{
+    /* if the encoder did not open a pipe, the thread still waits for
+       a connection: a dummy client unblocks it. Otherwise the pipe
+       instance is busy and the connection fails. */
+    hevc_file_io_connect_dummy(s->infilename, GENERIC_READ);
+    hevc_file_io_connect_dummy(s->outfilename, GENERIC_WRITE);
+    WaitForSingleObject(s->writer, INFINITE);
+    WaitForSingleObject(s->reader, INFINITE);
+    CloseHandle(s->writer);
+    CloseHandle(s->reader);
+    CloseHandle(s->out_pipe);
+}
+
+#endif /* _WIN32 */
+
+int hevc_file_io_start(HEVCFileIO *s, const char **pinfilename,
+                       const char **poutfilename)
+{
+#if defined(HAVE_THREADS) || defined(_WIN32)
+    if (!s->in_file && hevc_file_io_start_pipes(s) == 0)
+        goto done;
+#endif
+
+    /* temporary files: both names are set when the YUV file is
+       created */
+    if (!s->in_file && hevc_file_io_open_tmp(s) < 0)
+        goto fail;
+    if (fclose(s->in_file) != 0) {
+        s->in_file = NULL;
+        fprintf(stderr, "Could not write '%s'\n", s->infilename);
+        goto fail;
+    }
+    s->in_file = NULL;
+ done:
+    s->started = 1;
+    *pinfilename = s->infilename;
+    *poutfilename = s->outfilename;
+    return 0;
+ fail:
+    if (s->infilename[0] != '\0')
+        unlink(s->infilename);
+    return -1;
+}
+
+int hevc_file_io_close(HEVCFileIO *s, uint8_t **pbuf)
+{
+    uint8_t *out_buf;
+    int out_buf_len;
+    FILE *f;
+
+    out_buf = NULL;
+    out_buf_len = -1;
+#if defined(HAVE_THREADS) || defined(_WIN32)
+    if (s->use_pipes) {
+#ifdef _WIN32
+        hevc_file_io_end_pipes(s);
+#else
+        /* the encoder has closed its files: closing the remaining
+           ends of the pipes ends the threads */
+        close(s->in_fds[0]);
+        close(s->out_fds[1]);
+        pthread_join(s->writer, NULL);
+        pthread_join(s->reader, NULL);
+        close(s->out_fds[0]);
+#endif
+        if (!s->read_error) {
+            out_buf = s->out_buf.buf;
+            out_buf_len = s->out_buf.len;
+        } else {
+            free(s->out_buf.buf);
+        }
+        goto done;
+    }
+#endif
+    if (s->started) {
+        unlink(s->infilename);
+        f = fopen(s->outfilename, "rb");
+        if (!f) {
+            fprintf(stderr, "Could not open '%s'\n", s->outfilename);
+            goto done;
+        }
+        fseek(f, 0, SEEK_END);
+        out_buf_len = ftell(f);
+        fseek(f, 0, SEEK_SET);
+        out_buf = malloc(out_buf_len);
+        if (!out_buf ||
+            fread(out_buf, 1, out_buf_len, f) != out_buf_len) {
+            fprintf(stderr, "read error\n");
+            free(out_buf);
+            out_buf = NULL;
+            out_buf_len = -1;
+        }
+        fclose(f);
+        unlink(s->outfilename);
+    }
+ done:
+    if (s->in_file) {
+        /* error before hevc_file_io_start() */
+        fclose(s->in_file);
+        unlink(s->infilename);
+    }
+    free(s->in_buf.buf);
+    free(s);
+    *pbuf = out_buf;
+    return out_buf_len;
+}
+
+const char *hevc_encoder_name[HEVC_ENCODER_COUNT] = {
+#if defined(USE_X265)
+    "x265",
+#endif
+#if defined(USE_SVT)
+    "svt_hevc",
+#endif
+#if defined(USE_JCTVC)
+    "jctvc",
+#endif
+#if defined(USE_JVETVVC)
+    "jvetvvc",
+#endif
+#if defined(USE_JVETVVENC)
+    "jvetvvenc",
+#endif
+};
+
+static HEVCEncoder *hevc_encoder_tab[HEVC_ENCODER_COUNT] = {
+#if defined(USE_X265)
+    &x265_hevc_encoder,
+#endif
+#if defined(USE_SVT)
+    &x265_svt_encoder,
+#endif
+#if defined(USE_JCTVC)
+    &jctvc_encoder,
+#endif
+#if defined(USE_JVETVVC)
+    &jvetvvc_encoder,
+#endif
+#if defined(USE_JVETVVENC)
+    &jvetvvenc_encoder,
+#endif
+};
+
+#define IMAGE_HEADER_MAGIC 0x425047fb
+
+struct BPGEncoderContext {
+    BPGEncoderParameters params;
+    BPGMetaData *first_md;
+    HEVCEncoder *encoder;
+    int frame_count;
+    HEVCEncoderContext *enc_ctx;
+    HEVCEncoderContext *alpha_enc_ctx;
+    int session;
+    int tile_split; /* current image encoded by tiles */
+    HEVCEncodeParams enc_ep, alpha_ep; /* parameters of the open
+                                          encoders (session mode) or
+                                          of the tile encoders */
+    int frame_ticks;
+    uint16_t *frame_duration_tab;
+    int frame_duration_tab_size;
+};
+
+const char *bpg_encoder_get_error_string(int err)
+{
+    switch(err) {
+    case BPG_ENC_OK:
+        return "No error";
+    case BPG_ENC_ERR_NOMEM:
+        return "Not enough memory";
+    case BPG_ENC_ERR_PARAM:
+        return "Invalid parameters";
+    case BPG_ENC_ERR_TOO_LARGE:
+        return "Image is too large";
+    case BPG_ENC_ERR_CONVERT:
+        return "Cannot convert image";
+    case BPG_ENC_ERR_ENCODER:
+        return "Error while encoding picture";
+    case BPG_ENC_ERR_BITSTREAM:
+        return "Error while creating HEVC data";
+    case BPG_ENC_ERR_WRITE:
+        return "Error while writing BPG data";
+    default:
+        return "Unknown error";
+    }
+}
+
+BPGEncoderParameters *bpg_encoder_param_alloc(void)
+{
+    BPGEncoderParameters *p;
+    p = mallocz(sizeof(BPGEncoderParameters));
+    if (!p)
+        return NULL;
+    p->qp = DEFAULT_QP;
+    p->alpha_qp = -1;
+    p->preferred_chroma_format = BPG_FORMAT_420;
+    p->preferred_color_space = BPG_CS_YCbCr;
+    p->compress_level = DEFAULT_COMPRESS_LEVEL;
+    p->frame_delay_num = 1;
+    p->frame_delay_den = 25;
+    p->loop_count = 0;
+    p->limited_range = 0;
+    p->wpp = -1;
+    return p;
+}
+
+void bpg_encoder_param_free(BPGEncoderParameters *p)
+{
+    free(p);
+}
+
+BPGEncoderContext *bpg_encoder_open(BPGEncoderParameters *p)
+{
+    BPGEncoderContext *s;
+
+    if ((unsigned)p->encoder_type >= HEVC_ENCODER_COUNT)
+        return NULL;
+    encoder_dsp_init();
+    s = mallocz(sizeof(BPGEncoderContext));
+    if (!s)
+        return NULL;
+    s->params = *p;
+    s->encoder = hevc_encoder_tab[s->params.encoder_type];
+    s->frame_ticks = 1;
+    return s;
+}
+
+void bpg_encoder_set_extension_data(BPGEncoderContext *s, 
+                                    BPGMetaData *md)
+{
+    s->first_md = md;
+}
+
+int bpg_encoder_set_session(BPGEncoderContext *s, int enable)
+{
+    if (enable && (s->params.animated || !s->encoder->encode_picture))
+        return -1;
+    s->session = enable;
+    return 0;
+}
+
+/* close the HEVC encoder 'enc_ctx' and return the length of its
+   output or < 0 if error. */
+static int bpg_encoder_close_hevc(BPGEncoderContext *s,
+                                  HEVCEncoderContext *enc_ctx,
+                                  uint8_t **pbuf)
+{
+    int len;
+
+    *pbuf = NULL;
+    len = s->encoder->close(enc_ctx, pbuf);
+    if (len < 0) {
+        free(*pbuf);
+        *pbuf = NULL;
+    }
+    return len;
+}
+
+/* open an HEVC encoder with the parameters 'ep' in *penc_ctx. In
+   session mode, the encoder of the previous image is kept if it has
+   the same parameters, including the picture size. */
+static int bpg_encoder_open_hevc(BPGEncoderContext *s,
+                                 HEVCEncoderContext **penc_ctx,
+                                 HEVCEncodeParams *enc_ep,
+                                 const HEVCEncodeParams *ep)
+{
+    uint8_t *buf;
+
+    if (*penc_ctx) {
+        if (s->session && !memcmp(enc_ep, ep, sizeof(*ep)))
+            return 0;
+        bpg_encoder_close_hevc(s, *penc_ctx, &buf);
+        free(buf);
+        *penc_ctx = NULL;
+    }
+    *penc_ctx = s->encoder->open(ep);
+    if (!*penc_ctx)
+        return -1;
+    *enc_ep = *ep;
+    return 0;
+}
+
+/* encode an image or close an HEVC encoder. The color and alpha
+   encoders are independent, so their jobs can run in parallel. */
+typedef struct {
+    BPGEncoderContext *s;
+    HEVCEncoderContext *enc_ctx;
+    Image *img; /* image to encode or NULL to close the encoder */
+    int session; /* encode 'img' with encode_picture() */
+    uint8_t *buf; /* output of close() or encode_picture() */
+    int ret;
+} HEVCEncodeJob;
+
+static void hevc_job_init(HEVCEncodeJob *job, BPGEncoderContext *s,
+                          HEVCEncoderContext *enc_ctx, Image *img)
+{
+    job->s = s;
+    job->enc_ctx = enc_ctx;
+    job->img = img;
+    job->session = s->session;
+    job->buf = NULL;
+    job->ret = 0;
+}
+
+static void hevc_job_exec(HEVCEncodeJob *job)
+{
+    if (!job->img) {
+        job->ret = bpg_encoder_close_hevc(job->s, job->enc_ctx, &job->buf);
+    } else if (job->session) {
+        job->ret = job->s->encoder->encode_picture(job->enc_ctx, job->img,
+                                                   &job->buf);
+        if (job->ret < 0) {
+            free(job->buf);
+            job->buf = NULL;
+        }
+    } else {
+        job->ret = job->s->encoder->encode(job->enc_ctx, job->img);
+    }
+}
+
+#ifdef HAVE_THREADS
+static void *hevc_job_thread(void *opaque)
+{
+    hevc_job_exec(opaque);
+    return NULL;
+}
+#endif
+
+/* execute 'job' and, if not NULL, 'alpha_job'. The alpha job runs in
+   its own thread while the color job runs in the calling thread. Note:
+   the HM and VTM glues serialize their encodes, so the two jobs only
+   overlap with x265, SVT and vvenc. */
+static void hevc_jobs_exec(HEVCEncodeJob *job, HEVCEncodeJob *alpha_job)
+{
+#ifdef HAVE_THREADS
+    pthread_t tid;
+
+    if (alpha_job &&
+        pthread_create(&tid, NULL, hevc_job_thread, alpha_job) == 0) {
+        hevc_job_exec(job);
+        pthread_join(tid, NULL);
+        return;
+    }
+#endif
+    hevc_job_exec(job);
+    if (alpha_job)
+        hevc_job_exec(alpha_job);
+}
+
+/* build the BPG picture data from the color and alpha bitstreams and
+   write it. The bitstreams are freed. */
+static int bpg_encoder_write_hevc(BPGEncoderContext *s,
+                                  uint8_t *out_buf, int out_buf_len,
+                                  uint8_t *alpha_buf, int alpha_buf_len,
+                                  BPGEncoderWriteFunc *write_func,
+                                  void *opaque)
+{
+    uint8_t *hevc_buf;
+    int hevc_buf_len, ret;
+
+    hevc_buf = NULL;
+    hevc_buf_len = build_modified_hevc(&hevc_buf, out_buf, out_buf_len,
+                                       alpha_buf, alpha_buf_len,
+                                       s->frame_duration_tab, s->frame_count);
+    if (hevc_buf_len < 0) {
+        ret = BPG_ENC_ERR_BITSTREAM;
+        goto done;
+    }
+    
+    ret = BPG_ENC_OK;
+    if (write_func(opaque, hevc_buf, hevc_buf_len) != hevc_buf_len)
+        ret = BPG_ENC_ERR_WRITE;
+    free(hevc_buf);
+ done:
+    free(out_buf);
+    free(alpha_buf);
+    return ret;
+}
+
+static int bpg_encoder_encode_trailer(BPGEncoderContext *s, 
+                                      BPGEncoderWriteFunc *write_func,
+                                      void *opaque)
+{
+    HEVCEncodeJob job, alpha_job;
+
+    hevc_job_init(&job, s, s->enc_ctx, NULL);
+    hevc_job_init(&alpha_job, s, s->alpha_enc_ctx, NULL);
+    hevc_jobs_exec(&job, s->alpha_enc_ctx ? &alpha_job : NULL);
+    s->enc_ctx = NULL;
+    s->alpha_enc_ctx = NULL;
+    if (job.ret < 0 || alpha_job.ret < 0) {
+        free(job.buf);
+        free(alpha_job.buf);
+        return BPG_ENC_ERR_ENCODER;
+    }
+    return bpg_encoder_write_hevc(s, job.buf, job.ret,
+                                  alpha_job.buf, alpha_job.ret,
+                                  write_func, opaque);
+}
+
+typedef struct {
+    BPGEncoderContext *s;
+    Image *img, *img_alpha;
+    int cols, rows;
+    int *col_pos, *row_pos; /* tile positions (cols + 1 and rows + 1
+                               entries) */
+    uint8_t **buf_tab; /* bitstreams of the color tiles, then of the
+                          alpha tiles */
+    int *len_tab;
+    int threads; /* number of threads of each tile encoder */
+} TileEncodeState;
+
+/* encode the tile 'idx' with a new encoder instance */
+static void tile_encode(void *opaque, int idx)
+{
+    TileEncodeState *ts = opaque;
+    BPGEncoderContext *s = ts->s;
+    HEVCEncodeParams ep;
+    HEVCEncoderContext *enc_ctx;
+    Image tile_s, *tile = &tile_s, *img;
+    uint8_t *buf;
+    int n, i, j, c, c_count, x, y, x1, y1;
+
+    n = ts->cols * ts->rows;
+    if (idx < n) {
+        img = ts->img;
+        ep = s->enc_ep;
+    } else {
+        img = ts->img_alpha;
+        ep = s->alpha_ep;
+    }
+    i = (idx % n) % ts->cols;
+    j = (idx % n) / ts->cols;
+    x = ts->col_pos[i];
+    y = ts->row_pos[j];
+
+    /* the tile references the planes of the image */
+    *tile = *img;
+    tile->w = ts->col_pos[i + 1] - x;
+    tile->h = ts->row_pos[j + 1] - y;
+    if (img->format == BPG_FORMAT_GRAY)
+        c_count = 1;
+    else
+        c_count = 3;
+    for(c = 0; c < c_count; c++) {
+        x1 = x;
+        y1 = y;
+        if (c > 0 && (img->format == BPG_FORMAT_420 ||
+                      img->format == BPG_FORMAT_422))
+            x1 >>= 1;
+        if (c > 0 && img->format == BPG_FORMAT_420)
+            y1 >>= 1;
+        tile->data[c] = img->data[c] + (size_t)img->linesize[c] * y1 +
+            (x1 << img->pixel_shift);
+    }
+
+    ep.width = tile->w;
+    ep.height = tile->h;
+    ep.tile_cols = 0;
+    ep.tile_rows = 0;
+    ep.wpp = 0; /* not allowed with tiles */
+    ep.threads = ts->threads;
+    ep.frame_threads = 1; /* single picture */
+    ts->len_tab[idx] = -1;
+    enc_ctx = s->encoder->open(&ep);
+    if (!enc_ctx)
+        return;
+    if (s->encoder->encode(enc_ctx, tile) < 0) {
+        bpg_encoder_close_hevc(s, enc_ctx, &buf);
+        free(buf);
+        return;
+    }
+    ts->len_tab[idx] = bpg_encoder_close_hevc(s, enc_ctx, &ts->buf_tab[idx]);
+}
+
+/* encode a still image by tiles (see hevc_stitch_tiles()). The color
+   and alpha bitstreams are returned in 'job' and 'alpha_job'. */
+static int bpg_encoder_encode_tiles(BPGEncoderContext *s,
+                                    Image *img, Image *img_alpha,
+                                    HEVCEncodeJob *job,
+                                    HEVCEncodeJob *alpha_job)
+{
+    TileEncodeState ts_s, *ts = &ts_s;
+    ThreadPool *tp;
+    int i, n, n_jobs, n_threads, n_workers, nx, ny, w_max, h_max, level, ret;
+
+    memset(ts, 0, sizeof(*ts));
+    ts->s = s;
+    ts->img = img;
+    ts->img_alpha = img_alpha;
+    /* the tile boundaries are multiples of 64, hence of the CTB
+       size. The HEVC profiles require tiles of at least 256 x 64 luma
+       samples. The grid is also limited to the tile count allowed by
+       the level of the picture (at most 20 x 22 for level 6 and
+       above). */
+    nx = max_int(img->w / 64, 1);
+    ny = max_int(img->h / 64, 1);
+    level = min_int(hevc_get_level(img->w, img->h, 1, 1),
+                    HEVC_LEVEL_COUNT - 1);
+    ts->cols = min_int(max_int(s->enc_ep.tile_cols, 1),
+                       min_int(max_int(img->w / 256, 1),
+                               hevc_max_tile_cols[level]));
+    ts->rows = min_int(max_int(s->enc_ep.tile_rows, 1),
+                       min_int(ny, hevc_max_tile_rows[level]));
+    n = ts->cols * ts->rows;
+    n_jobs = n;
+    if (img_alpha)
+        n_jobs += n;
+    ret = BPG_ENC_ERR_NOMEM;
+    ts->col_pos = malloc(sizeof(ts->col_pos[0]) * (ts->cols + 1));
+    ts->row_pos = malloc(sizeof(ts->row_pos[0]) * (ts->rows + 1));
+    ts->buf_tab = mallocz(sizeof(ts->buf_tab[0]) * n_jobs);
+    ts->len_tab = malloc(sizeof(ts->len_tab[0]) * n_jobs);
+    if (!ts->col_pos || !ts->row_pos || !ts->buf_tab || !ts->len_tab)
+        goto done;
+
+    w_max = 0;
+    for(i = 0; i < ts->cols; i++) {
+        ts->col_pos[i] = 64 * (i * nx / ts->cols);
+        if (i > 0)
+            w_max = max_int(w_max, ts->col_pos[i] - ts->col_pos[i - 1]);
+    }
+    ts->col_pos[ts->cols] = img->w;
+    w_max = max_int(w_max, img->w - ts->col_pos[ts->cols - 1]);
+    h_max = 0;
+    for(i = 0; i < ts->rows; i++) {
+        ts->row_pos[i] = 64 * (i * ny / ts->rows);
+        if (i > 0)
+            h_max = max_int(h_max, ts->row_pos[i] - ts->row_pos[i - 1]);
+    }
+    ts->row_pos[ts->rows] = img->h;
+    h_max = max_int(h_max, img->h - ts->row_pos[ts->rows - 1]);
+    ret = BPG_ENC_ERR_TOO_LARGE;
+    if ((uint64_t)w_max * h_max * 2 > MAX_ENCODER_PLANE_SIZE)
+        goto done;
+
+    /* the tile encoders share the thread budget of the encoder (or
+       the number of CPUs): at most 'n_threads' tiles are encoded at
+       the same time and the remaining threads are given to their
+       encoders */
+    n_threads = s->enc_ep.threads;
+    if (n_threads <= 0)
+        n_threads = get_cpu_count();
+    n_workers = min_int(n_jobs, n_threads);
+    ts->threads = max_int(n_threads / n_workers, 1);
+    tp = NULL;
+    if (n_workers > 1)
+        tp = thread_pool_new(n_workers - 1);
+    thread_pool_run(tp, tile_encode, ts, n_jobs);
+    thread_pool_free(tp);
+
+    ret = BPG_ENC_ERR_ENCODER;
+    for(i = 0; i < n_jobs; i++) {
+        if (ts->len_tab[i] < 0)
+            goto done;
+    }
+    ret = BPG_ENC_ERR_BITSTREAM;
+    job->ret = hevc_stitch_tiles(&job->buf, ts->buf_tab, ts->len_tab,
+                                 ts->cols, ts->rows,
+                                 ts->col_pos, ts->row_pos);
+    if (job->ret < 0)
+        goto done;
+    if (img_alpha) {
+        alpha_job->ret = hevc_stitch_tiles(&alpha_job->buf, ts->buf_tab + n,
+                                           ts->len_tab + n,
+                                           ts->cols, ts->rows,
+                                           ts->col_pos, ts->row_pos);
+        if (alpha_job->ret < 0)
+            goto done;
+    }
+    ret = BPG_ENC_OK;
+ done:
+    if (ts->buf_tab) {
+        for(i = 0; i < n_jobs; i++)
+            free(ts->buf_tab[i]);
+    }
+    free(ts->buf_tab);
+    free(ts->len_tab);
+    free(ts->col_pos);
+    free(ts->row_pos);
+    return ret;
+}
+
+int bpg_encoder_set_frame_duration(BPGEncoderContext *s, int frame_ticks)
+{
+    if (frame_ticks >= 1 && frame_ticks <= 65535) {
+        s->frame_ticks = frame_ticks;
+        return 0;
+    } else {
+        return -1;
+    }
+}
+
+void bpg_dyn_buf_init(BPGDynBuf *s)
+{
+    s->buf = NULL;
+    s->size = 0;
+    s->len = 0;
+}
+
+int bpg_dyn_buf_write(void *opaque, const uint8_t *buf, int buf_len)
+{
+    DynBuf *s = opaque;
+    if (dyn_buf_resize(s, s->len + buf_len) < 0)
+        return -1;
+    memcpy(s->buf + s->len, buf, buf_len);
+    s->len += buf_len;
+    return buf_len;
+}
+
+void bpg_dyn_buf_free(BPGDynBuf *s)
+{
+    free(s->buf);
+    bpg_dyn_buf_init(s);
+}
+
+/* encode a reduced version of 'img' as a nested BPG image and add it
+   to the extension data. 'img' is not modified. */
+static int bpg_encoder_add_thumbnail(BPGEncoderContext *s, Image *img)
+{
+    BPGEncoderParameters p_s, *p = &p_s;
+    BPGEncoderContext *s1;
+    BPGMetaData *md;
+    Image *img1;
+    DynBuf dbuf;
+    int w, h, size, ret;
+
+    size = s->params.thumbnail_size;
+    if (img->w <= size && img->h <= size)
+        return 0;
+    if (img->w >= img->h) {
+        w = size;
+        h = ((int64_t)img->h * size + (img->w >> 1)) / img->w;
+    } else {
+        h = size;
+        w = ((int64_t)img->w * size + (img->h >> 1)) / img->h;
+    }
+    if (w < 1)
+        w = 1;
+    if (h < 1)
+        h = 1;
+    img1 = image_downscale(img, w, h);
+    if (!img1)
+        return BPG_ENC_ERR_NOMEM;
+
+    *p = s->params;
+    p->animated = 0;
+    p->thumbnail_size = 0;
+    s1 = bpg_encoder_open(p);
+    if (!s1) {
+        image_free(img1);
+        return BPG_ENC_ERR_NOMEM;
+    }
+    bpg_dyn_buf_init(&dbuf);
+    ret = bpg_encoder_encode(s1, img1, bpg_dyn_buf_write, &dbuf);
+    bpg_encoder_close(s1);
+    image_free(img1);
+    if (ret < 0) {
+        bpg_dyn_buf_free(&dbuf);
+        return ret;
+    }
+
+    md = bpg_md_alloc(BPG_EXTENSION_TAG_THUMBNAIL);
+    md->buf = dbuf.buf;
+    md->buf_len = dbuf.len;
+    md->next = s->first_md;
+    s->first_md = md;
+    return 0;
+}
+
+int bpg_encoder_encode(BPGEncoderContext *s, Image *img,
+                       BPGEncoderWriteFunc *write_func,
+                       void *opaque)
+{
+    const BPGEncoderParameters *p = &s->params;
+    Image *img_alpha;
+    HEVCEncodeParams ep_s, *ep = &ep_s;
+    HEVCEncodeJob job, alpha_job;
+    uint8_t *extension_buf;
+    uint16_t *tab;
+    int extension_buf_len;
+    int cb_size, width, height, ret;
+
+    if (p->animated && !img) {
+        return bpg_encoder_encode_trailer(s, write_func, opaque);
+    }
+
+    /* the thumbnail is computed from the first frame before any
+       conversion */
+    if (s->frame_count == 0 && p->thumbnail_size > 0) {
+        ret = bpg_encoder_add_thumbnail(s, img);
+        if (ret < 0)
+            return ret;
+    }
+
+    /* extract the alpha plane */
+    if (img->has_alpha) {
+        int c_idx;
+
+        img_alpha = mallocz(sizeof(Image));
+        if (!img_alpha)
+            return BPG_ENC_ERR_NOMEM;
+        if (img->format == BPG_FORMAT_GRAY)
+            c_idx = 1;
+        else
+            c_idx = 3;
+
+        img_alpha->w = img->w;
+        img_alpha->h = img->h;
+        img_alpha->format = BPG_FORMAT_GRAY;
+        img_alpha->has_alpha = 0;
+        img_alpha->color_space = BPG_CS_YCbCr;
+        img_alpha->bit_depth = img->bit_depth;
+        img_alpha->pixel_shift = img->pixel_shift;
+        img_alpha->padded = img->padded;
+        img_alpha->data[0] = img->data[c_idx];
+        img_alpha->linesize[0] = img->linesize[c_idx];
+        
+        img->data[c_idx] = NULL;
+        img->has_alpha = 0;
+    } else {
+        img_alpha = NULL;
+    }
+
+    if (img->format == BPG_FORMAT_444 && img->color_space != BPG_CS_RGB) {
+        if (p->preferred_chroma_format == BPG_FORMAT_420 ||
+            p->preferred_chroma_format == BPG_FORMAT_420_VIDEO) {
+            int c_h_phase = (p->preferred_chroma_format == BPG_FORMAT_420);
+            if (image_ycc444_to_ycc420(img, c_h_phase) != 0)
+                goto error_convert;
+        } else if (p->preferred_chroma_format == BPG_FORMAT_422 ||
+                   p->preferred_chroma_format == BPG_FORMAT_422_VIDEO) {
+            int c_h_phase = (p->preferred_chroma_format == BPG_FORMAT_422);
+            if (image_ycc444_to_ycc422(img, c_h_phase) != 0)  {
+            error_convert:
+                ret = BPG_ENC_ERR_CONVERT;
+                goto fail;
+            }
+        }
+    }
+
+    cb_size = CB_SIZE;
+    width = img->w;
+    height = img->h;
+    image_pad(img, cb_size);
+    if (img_alpha)
+        image_pad(img_alpha, cb_size);
+
+    /* convert to the allocated pixel width to 8 bit if needed by the
+       HEVC encoder */
+    if (img->bit_depth == 8) {
+        image_convert16to8(img);
+        if (img_alpha)
+            image_convert16to8(img_alpha);
+    }
+        
+    if (s->frame_count == 0) {
+        memset(ep, 0, sizeof(*ep));
+        ep->qp = p->qp;
+        ep->width = img->w;
+        ep->height = img->h;
+        ep->chroma_format = img->format;
+        ep->color_space = img->color_space;
+        ep->bit_depth = img->bit_depth;
+        ep->intra_only = !p->animated;
+        ep->lossless = p->lossless;
+        ep->sei_decoded_picture_hash = p->sei_decoded_picture_hash;
+        ep->compress_level = p->compress_level;
+        ep->verbose = p->verbose;
+        ep->frame_rate = p->frame_delay_den;
+        ep->limited_range = p->limited_range;
+        ep->threads = p->threads;
+        ep->frame_threads = p->frame_threads;
+        ep->wpp = p->wpp;
+        /* HEVC tiles must be at least 256 x 64 luma samples */
+        ep->tile_cols = min_int(p->tile_cols, max_int(img->w / 256, 1));
+        ep->tile_rows = min_int(p->tile_rows, max_int(img->h / 64, 1));
+
+        ep->session = s->session;
+        if (p->tile_split && s->encoder->vvc) {
+            fprintf(stderr, "Tile splitting requires an HEVC encoder\n");
+            ret = BPG_ENC_ERR_PARAM;
+            goto fail;
+        }
+        s->tile_split = ((p->tile_split || s->encoder->stitch_tiles) &&
+                         !p->animated && !s->session &&
+                         (ep->tile_cols > 1 || ep->tile_rows > 1));
+        if (s->tile_split && ep->wpp > 0)
+            fprintf(stderr, "WPP cannot be used with stitched tiles, disabled.\n");
+        if (!s->tile_split &&
+            (uint64_t)width * height * 2 > MAX_ENCODER_PLANE_SIZE) {
+            ret = BPG_ENC_ERR_TOO_LARGE;
+            goto fail;
+        }
+
+        ret = BPG_ENC_ERR_ENCODER;
+        if (s->tile_split) {
+            /* the encoders are opened for each tile */
+            s->enc_ep = *ep;
+        } else if (bpg_encoder_open_hevc(s, &s->enc_ctx, &s->enc_ep,
+                                         ep) < 0) {
+            goto fail;
+        }
+
+        if (img_alpha) {
+            if (p->alpha_qp < 0)
+                ep->qp = p->qp;
+            else
+                ep->qp = p->alpha_qp;
+            ep->chroma_format = 0;
+            
+            if (s->tile_split) {
+                s->alpha_ep = *ep;
+            } else if (bpg_encoder_open_hevc(s, &s->alpha_enc_ctx,
+                                             &s->alpha_ep, ep) < 0) {
+                goto fail;
+            }
+        } else if (s->alpha_enc_ctx) {
+            /* alpha encoder of the previous image (session mode) */
+            uint8_t *buf;
+            bpg_encoder_close_hevc(s, s->alpha_enc_ctx, &buf);
+            free(buf);
+            s->alpha_enc_ctx = NULL;
+        }
+
+        /* prepare the extension data */
+        if (p->animated) {
+            BPGMetaData *md;
+            uint8_t buf[15], *q;
+
+            md = bpg_md_alloc(BPG_EXTENSION_TAG_ANIM_CONTROL);
+            q = buf;
+            put_ue(&q, p->loop_count);
+            put_ue(&q, p->frame_delay_num);
+            put_ue(&q, p->frame_delay_den);
+            md->buf_len = q - buf;
+            md->buf = malloc(md->buf_len);
+            memcpy(md->buf, buf, md->buf_len);
+            md->next = s->first_md;
+            s->first_md = md;
+        }
+
+        extension_buf = NULL;
+        extension_buf_len = 0;
+        if (s->first_md) {
+            BPGMetaData *md1;
+            int max_len;
+            uint8_t *q;
+            
+            max_len = 0;
+            for(md1 = s->first_md; md1 != NULL; md1 = md1->next) {
+                max_len += md1->buf_len + 5 * 2;
+            }
+            extension_buf = malloc(max_len);
+            if (!extension_buf) {
+                ret = BPG_ENC_ERR_NOMEM;
+                goto fail;
+            }
+            q = extension_buf;
+            for(md1 = s->first_md; md1 != NULL; md1 = md1->next) {
+                put_ue(&q, md1->tag);
+                put_ue(&q, md1->buf_len);
+                memcpy(q, md1->buf, md1->buf_len);
+                q += md1->buf_len;
+            }
+            extension_buf_len = q - extension_buf;
+            
+            bpg_md_free(s->first_md);
+            s->first_md = NULL;
+        }
+    
+        {
+            uint8_t img_header[128], *q;
+            int v, has_alpha, has_extension, alpha2_flag, alpha1_flag, format;
+            
+            has_alpha = (img_alpha != NULL);
+            has_extension = (extension_buf_len > 0);
+            
+            
+            if (has_alpha) {
+                if (img->has_w_plane) {
+                    alpha1_flag = 0;
+                    alpha2_flag = 1;
+                } else {
+                    alpha1_flag = 1;
+                    alpha2_flag = img->premultiplied_alpha;
+                }
+            } else {
+                alpha1_flag = 0;
+                alpha2_flag = 0;
+            }
+            
+            q = img_header;
+            *q++ = (IMAGE_HEADER_MAGIC >> 24) & 0xff;
+            *q++ = (IMAGE_HEADER_MAGIC >> 16) & 0xff;
+            *q++ = (IMAGE_HEADER_MAGIC >> 8) & 0xff;
+            *q++ = (IMAGE_HEADER_MAGIC >> 0) & 0xff;
+
+            if (img->c_h_phase == 0 && img->format == BPG_FORMAT_420)
+                format = BPG_FORMAT_420_VIDEO;
+            else if (img->c_h_phase == 0 && img->format == BPG_FORMAT_422)
+                format = BPG_FORMAT_422_VIDEO;
+            else
+                format = img->format;
+            v = (format << 5) | (alpha1_flag << 4) | (img->bit_depth - 8);
+            *q++ = v;
+            v = (img->color_space << 4) | (has_extension << 3) |
+                (alpha2_flag << 2) | (img->limited_range << 1) |
+                p->animated;
+            *q++ = v;
+            put_ue(&q, width);
+            put_ue(&q, height);
+            
+            put_ue(&q, 0); /* zero length means up to the end of the file */
+            if (has_extension) {
+                put_ue(&q, extension_buf_len); /* extension data length */
+            }
+            
+            ret = BPG_ENC_OK;
+            if (write_func(opaque, img_header, q - img_header) !=
+                q - img_header)
+                ret = BPG_ENC_ERR_WRITE;
+            
+            if (has_extension) {
+                if (ret == BPG_ENC_OK &&
+                    write_func(opaque, extension_buf, extension_buf_len) != extension_buf_len) {
+                    ret = BPG_ENC_ERR_WRITE;
+                }
+                free(extension_buf);
+            }
+            if (ret < 0)
+                goto fail;
+        }
+    }
+
+    /* store the frame duration */
+    if ((s->frame_count + 1) > s->frame_duration_tab_size) {
+        int size;
+        size = (s->frame_duration_tab_size * 3) / 2;
+        if (size < (s->frame_count + 1))
+            size = (s->frame_count + 1);
+        tab = realloc(s->frame_duration_tab,
+                      sizeof(s->frame_duration_tab[0]) * size);
+        if (!tab) {
+            ret = BPG_ENC_ERR_NOMEM;
+            goto fail;
+        }
+        s->frame_duration_tab = tab;
+        s->frame_duration_tab_size = size;
+    }
+    s->frame_duration_tab[s->frame_count] = s->frame_ticks;
+
+    hevc_job_init(&job, s, s->enc_ctx, img);
+    hevc_job_init(&alpha_job, s, s->alpha_enc_ctx, img_alpha);
+    if (s->tile_split) {
+        ret = bpg_encoder_encode_tiles(s, img, img_alpha, &job, &alpha_job);
+    } else {
+        hevc_jobs_exec(&job, img_alpha ? &alpha_job : NULL);
+        ret = BPG_ENC_OK;
+        if (job.ret < 0 || alpha_job.ret < 0)
+            ret = BPG_ENC_ERR_ENCODER;
+    }
+    if (ret < 0) {
+        free(job.buf);
+        free(alpha_job.buf);
+        goto fail;
+    }
+    if (img_alpha)
+        image_free(img_alpha);
+    
+    s->frame_count++;
+
+    if (s->session || s->tile_split) {
+        /* the bitstreams are complete */
+        ret = bpg_encoder_write_hevc(s, job.buf, job.ret,
+                                     alpha_job.buf, alpha_job.ret,
+                                     write_func, opaque);
+        /* in session mode, the encoders stay open for the next image */
+        s->frame_count = 0;
+        return ret;
+    }
+
+    if (!p->animated)
+        return bpg_encoder_encode_trailer(s, write_func, opaque);
+
+    return BPG_ENC_OK;
+ fail:
+    if (img_alpha)
+        image_free(img_alpha);
+    return ret;
+}
+
+/* the HEVC encoders which are still open (error or unterminated
+   animation) are closed and their output is discarded */
+void bpg_encoder_close(BPGEncoderContext *s)
+{
+    uint8_t *buf;
+
+    if (s->enc_ctx) {
+        bpg_encoder_close_hevc(s, s->enc_ctx, &buf);
+        free(buf);
+    }
+    if (s->alpha_enc_ctx) {
+        bpg_encoder_close_hevc(s, s->alpha_enc_ctx, &buf);
+        free(buf);
+    }
+    free(s->frame_duration_tab);
+    bpg_md_free(s->first_md);
+    free(s);
+}
@@ -0,0 +1,266 @@
+/*
+ * BPG encoder library
+ * 
+ * Copyright (c) 2014 Fabrice Bellard
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#ifndef _LIBBPGENC_H
+#define _LIBBPGENC_H
+
+#include <stdio.h>
+#include "bpgenc.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* error codes returned by the encoder functions */
+typedef enum {
+    BPG_ENC_OK = 0,
+    BPG_ENC_ERR_NOMEM = -1, /* memory allocation failed */
+    BPG_ENC_ERR_PARAM = -2, /* invalid parameters */
+    BPG_ENC_ERR_TOO_LARGE = -3, /* image too large */
+    BPG_ENC_ERR_CONVERT = -4, /* unsupported image conversion */
+    BPG_ENC_ERR_ENCODER = -5, /* error from the HEVC encoder */
+    BPG_ENC_ERR_BITSTREAM = -6, /* unsupported HEVC bitstream */
+    BPG_ENC_ERR_WRITE = -7, /* the write function failed */
+} BPGEncoderErrorEnum;
+
+/* Note: HM (jctvc) and VTM (jvetvvc) use process-global state, so
+   only one of their encodes runs at a time. The concurrent encodes
+   (color and alpha layers, ladder renditions, split tiles) are only
+   parallel with x265, SVT and vvenc. */
+typedef enum {
+#if defined(USE_X265)
+    HEVC_ENCODER_X265,
+#endif
+#if defined(USE_SVT)
+    HEVC_ENCODER_SVT,
+#endif
+#if defined(USE_JCTVC)
+    HEVC_ENCODER_JCTVC,
+#endif
+#if defined(USE_JVETVVC)
+    HEVC_ENCODER_JVETVVC,
+#endif
+#if defined(USE_JVETVVENC)
+    HEVC_ENCODER_JVETVVENC,
+#endif
+    HEVC_ENCODER_COUNT,
+} HEVCEncoderEnum;
+
+extern const char *hevc_encoder_name[HEVC_ENCODER_COUNT];
+
+#define DEFAULT_QP 29
+#define DEFAULT_BIT_DEPTH 8
+
+#ifdef RExt__HIGH_BIT_DEPTH_SUPPORT
+#define BIT_DEPTH_MAX 14
+#else
+#define BIT_DEPTH_MAX 12
+#endif
+#define DEFAULT_COMPRESS_LEVEL 8
+
+typedef struct BPGMetaData {
+    uint32_t tag;
+    uint8_t *buf;
+    int buf_len;
+    struct BPGMetaData *next;
+} BPGMetaData;
+
+BPGMetaData *bpg_md_alloc(uint32_t tag);
+void bpg_md_free(BPGMetaData *md);
+BPGMetaData *bpg_md_dup(const BPGMetaData *md);
+
+typedef struct BPGEncoderParameters {
+    int qp; /* 0 ... 51 */
+    int alpha_qp; /* -1 ... 51. -1 means same as qp */
+    int lossless; /* true if lossless compression (qp and alpha_qp are
+                     ignored) */
+    BPGImageFormatEnum preferred_chroma_format;
+    BPGColorSpaceEnum preferred_color_space;
+    int sei_decoded_picture_hash; /* 0, 1 */
+    int compress_level; /* 1 ... 9 */
+    int verbose;
+    int bit_depth;
+    int limited_range;
+    HEVCEncoderEnum encoder_type;
+    int animated; /* 0 ... 1: if true, encode as animated image */
+    uint16_t loop_count; /* animations: number of loops. 0=infinite */
+    /* animations: the frame delay is a multiple of
+       frame_delay_num/frame_delay_den seconds */
+    uint16_t frame_delay_num;
+    uint16_t frame_delay_den;
+    int thumbnail_size; /* 0 = no thumbnail, otherwise maximum width
+                           and height of the embedded thumbnail */
+    /* threading of the HEVC encoder. 0 means the encoder default */
+    int threads; /* number of threads */
+    int frame_threads; /* number of frames encoded concurrently */
+    int wpp; /* -1 = encoder default, 0 = off, 1 = wavefront parallel
+                processing */
+    int tile_cols, tile_rows; /* 0 = no tiles, otherwise uniform tile
+                                 grid. The tiles can be decoded in
+                                 parallel. With encoders without tile
+                                 support, tile_split is implied for
+                                 still images. */
+    int tile_split; /* 0-1: still images with tiles: each tile is
+                       encoded by a separate encoder instance and the
+                       tiles are stitched into a single picture. At
+                       most 'threads' tiles (or the number of CPUs if
+                       0) are encoded concurrently and the remaining
+                       threads are shared by their encoders. It also allows images whose
+                       planes exceed 2 GB. The tile edges are
+                       multiples of 64 (so the grid is not exactly
+                       uniform), the grid is reduced to the tile
+                       count allowed by the HEVC level of the picture
+                       and WPP is disabled. The decoded
+                       picture hash SEI is not supported. Only
+                       available with the HEVC encoders (not VTM and
+                       vvenc). */
+} BPGEncoderParameters;
+
+typedef struct BPGEncoderContext BPGEncoderContext;
+
+/* return 'buf_len' if OK */
+typedef int BPGEncoderWriteFunc(void *opaque, const uint8_t *buf, int buf_len);
+
+BPGEncoderParameters *bpg_encoder_param_alloc(void);
+void bpg_encoder_param_free(BPGEncoderParameters *p);
+/* return NULL if error */
+BPGEncoderContext *bpg_encoder_open(BPGEncoderParameters *p);
+/* 'md' is freed by the encoder */
+void bpg_encoder_set_extension_data(BPGEncoderContext *s, BPGMetaData *md);
+int bpg_encoder_set_frame_duration(BPGEncoderContext *s, int frame_ticks);
+/* Session mode (still images only): each bpg_encoder_encode() call
+   produces a complete BPG image and the HEVC encoders stay open, so
+   that the next image with the same size, format and parameters
+   reuses them. Only images of identical (CB padded) size reuse the
+   encoders: the BPG decoder derives the HEVC picture size from the
+   image size, so the pictures cannot be padded to a common size
+   class. Only x265 supports sessions: return -1 with the other HEVC
+   encoders (HM, VTM, vvenc) and for animations. */
+int bpg_encoder_set_session(BPGEncoderContext *s, int enable);
+/* Encode 'img' and give the output to 'write_func'. Warning: currently
+   'img' is modified. When encoding animations, img = NULL indicates
+   the end of the stream. Return BPG_ENC_OK or an error code. After an
+   error, the context can only be closed. */
+int bpg_encoder_encode(BPGEncoderContext *s, Image *img,
+                       BPGEncoderWriteFunc *write_func, void *opaque);
+void bpg_encoder_close(BPGEncoderContext *s);
+const char *bpg_encoder_get_error_string(int err);
+
+/* growable memory buffer usable as output of bpg_encoder_encode() */
+typedef struct {
+    uint8_t *buf;
+    int size;
+    int len;
+} BPGDynBuf;
+
+void bpg_dyn_buf_init(BPGDynBuf *s);
+/* BPGEncoderWriteFunc appending to the BPGDynBuf 'opaque' */
+int bpg_dyn_buf_write(void *opaque, const uint8_t *buf, int buf_len);
+void bpg_dyn_buf_free(BPGDynBuf *s);
+
+/* images */
+
+Image *image_alloc(int w, int h, BPGImageFormatEnum format, int has_alpha,
+                   BPGColorSpaceEnum color_space, int bit_depth);
+void image_free(Image *img);
+Image *image_dup(Image *img);
+Image *image_downscale(Image *img, int w, int h);
+Image *image_resize(Image *img, int w, int h);
+
+typedef struct {
+    int w, h; /* size given by -resize, 0 to keep the aspect ratio */
+    int max_size; /* maximum width and height (0 = no limit) */
+} ResizeParams;
+
+typedef struct {
+    int w, h; /* 0 if unknown */
+    BPGImageFormatEnum format; /* gray, 4:2:0, 4:2:2 or 4:4:4 */
+    uint8_t c_h_phase; /* chroma position, see Image */
+    int bit_depth; /* samples of more than 8 bits are 16 bit little
+                      endian words */
+    uint8_t y4m; /* true if each frame has a Y4M header */
+    int frame_rate_num, frame_rate_den; /* 0 if unknown */
+} YUVParams;
+
+/* Memory input. The images are converted as by load_image(). 'rp'
+   can be NULL.
+
+   bpg_image_from_rgb() reads 'h' rows of 'w' interleaved samples
+   separated by 'linesize' bytes. 'c_count' is 1 (gray), 2 (gray and
+   alpha), 3 (RGB) or 4 (RGBA). 8 bit samples are bytes, 16 bit
+   samples are native endian 16 bit words. If 'premultiplied_alpha'
+   is true, the color is already premultiplied by the alpha.
+
+   bpg_image_from_yuv() reads the planes 'data[]' whose geometry is
+   given by 'yp'. Samples of more than 8 bits are native endian 16 bit
+   words. The rows are directly copied when no conversion is
+   needed.
+
+   Return BPG_ENC_OK or an error code. */
+int bpg_image_from_rgb(Image **pimg, const uint8_t *data, int linesize,
+                       int w, int h, int c_count, int in_bit_depth,
+                       BPGColorSpaceEnum color_space, int bit_depth,
+                       int limited_range, int premultiplied_alpha,
+                       int chroma_format, const ResizeParams *rp);
+int bpg_image_from_yuv(Image **pimg, const uint8_t * const data[3],
+                       const int linesize[3], const YUVParams *yp,
+                       BPGColorSpaceEnum color_space, int bit_depth,
+                       int limited_range, int chroma_format,
+                       const ResizeParams *rp);
+
+/* file input */
+
+Image *load_image(BPGMetaData **pmd, const char *infilename,
+                  BPGColorSpaceEnum color_space, int bit_depth,
+                  int limited_range, int premultiplied_alpha,
+                  int chroma_format, const ResizeParams *rp,
+                  const YUVParams *raw_params);
+FILE *yuv_open(YUVParams *yp, const char *filename);
+void yuv_close(FILE *f);
+Image *read_yuv(FILE *f, const YUVParams *yp, BPGColorSpaceEnum color_space,
+                int out_bit_depth, int limited_range, int chroma_format,
+                const ResizeParams *rp);
+
+/* threads */
+
+/* Set the number of threads used to convert the images (1 = no
+   thread). Must not be called while images are converted. */
+void bpg_encoder_set_ingest_threads(int n_threads);
+
+typedef struct ThreadPool ThreadPool;
+
+/* A job executes func(opaque, i) for 0 <= i < n. */
+typedef void ThreadFunc(void *opaque, int idx);
+
+/* return NULL if no thread could be created */
+ThreadPool *thread_pool_new(int n_threads);
+void thread_pool_free(ThreadPool *tp);
+/* execute a job and wait for its end. If 'tp' is NULL, it is executed
+   in the calling thread. */
+void thread_pool_run(ThreadPool *tp, ThreadFunc *func, void *opaque, int n);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _LIBBPGENC_H */
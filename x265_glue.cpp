@@ -149,6 +149,30 @@ static HEVCEncoderContext *x265_open(const HEVCEncodeParams *params)
     p->rc.qp = params->qp;
     p->bLossless = params->lossless;
 
+    if (params->threads > 0) {
+        char buf[16];
+        snprintf(buf, sizeof(buf), "%d", params->threads);
+        s->api->param_parse(p, "pools", buf);
+    }
+    if (params->frame_threads > 0)
+        p->frameNumThreads = params->frame_threads;
+    if (params->wpp >= 0)
+        p->bEnableWavefront = params->wpp;
+    /* Note: x265 does not support tiles. libbpgenc stitches separately
+       encoded tiles for still images. */
+    if (params->tile_cols > 1 || params->tile_rows > 1)
+        fprintf(stderr, "x265 does not support tiles, ignored.\n");
+
+    if (params->session && params->intra_only) {
+        /* each picture must be output as soon as it is given */
+        p->totalFrames = 0;
+        p->bOpenGOP = 0;
+        p->lookaheadDepth = 0;
+        p->scenecutThreshold = 0;
+        p->rc.cuTree = 0;
+        p->frameNumThreads = 1;
+    }
+
     s->enc = s->api->encoder_open(p);
 
     s->pic = s->api->picture_alloc();
@@ -177,14 +201,10 @@ static void add_nal(HEVCEncoderContext *s, const uint8_t *data, int data_len)
     s->buf_len += data_len;
 }
 
-static int x265_encode(HEVCEncoderContext *s, Image *img)
+static void x265_set_picture(HEVCEncoderContext *s, Image *img)
 {
-    int c_count, i, ret;
-    x265_picture *pic;
-    uint32_t nal_count;
-    x265_nal *p_nal;
-    
-    pic = s->pic;
+    x265_picture *pic = s->pic;
+    int c_count, i;
 
     if (img->format == BPG_FORMAT_GRAY)
         c_count = 1;
@@ -195,8 +215,17 @@ static int x265_encode(HEVCEncoderContext *s, Image *img)
         pic->stride[i] = img->linesize[i];
     }
     pic->bitDepth = img->bit_depth;
+}
+
+static int x265_encode(HEVCEncoderContext *s, Image *img)
+{
+    int i, ret;
+    uint32_t nal_count;
+    x265_nal *p_nal;
+    
+    x265_set_picture(s, img);
 
-    ret = s->api->encoder_encode(s->enc, &p_nal, &nal_count, pic, NULL);
+    ret = s->api->encoder_encode(s->enc, &p_nal, &nal_count, s->pic, NULL);
     if (ret > 0) {
         for(i = 0; i < nal_count; i++) {
             add_nal(s, p_nal[i].payload, p_nal[i].sizeBytes);
@@ -205,6 +234,34 @@ static int x265_encode(HEVCEncoderContext *s, Image *img)
     return 0;
 }
 
+/* session mode: the picture is forced to IDR and bRepeatHeaders
+   gives the parameter sets before it */
+static int x265_encode_idr(HEVCEncoderContext *s, Image *img, uint8_t **pbuf)
+{
+    int buf_len, ret, i;
+    uint32_t nal_count;
+    x265_nal *p_nal;
+
+    x265_set_picture(s, img);
+    s->pic->sliceType = X265_TYPE_IDR;
+    ret = s->api->encoder_encode(s->enc, &p_nal, &nal_count, s->pic, NULL);
+    s->pic->sliceType = X265_TYPE_AUTO;
+    if (ret <= 0) {
+        *pbuf = NULL;
+        return -1;
+    }
+    for(i = 0; i < nal_count; i++) {
+        add_nal(s, p_nal[i].payload, p_nal[i].sizeBytes);
+    }
+
+    *pbuf = s->buf;
+    buf_len = s->buf_len;
+    s->buf = NULL;
+    s->buf_len = 0;
+    s->buf_size = 0;
+    return buf_len;
+}
+
 static int x265_close(HEVCEncoderContext *s, uint8_t **pbuf)
 {
     int buf_len, ret, i;
@@ -238,4 +295,6 @@ HEVCEncoder x265_hevc_encoder = {
   .open = x265_open,
   .encode = x265_encode,
   .close = x265_close,
+  .encode_picture = x265_encode_idr,
+  .stitch_tiles = 1,
 };